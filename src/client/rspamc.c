@@ -62,9 +62,13 @@ static gboolean compressed = FALSE;
 static gboolean profile = FALSE;
 static gboolean skip_images = FALSE;
 static gboolean skip_attachments = FALSE;
+static gboolean keepalive = TRUE;
+static gboolean binary = FALSE;
 static gchar *key = NULL;
 static gchar *user_agent = "rspamc";
 static GList *children;
+/* Idle persistent connections indexed by server name */
+static GHashTable *idle_conns;
 
 #define ADD_CLIENT_HEADER(o, n, v) do { \
     struct rspamd_http_client_header *nh; \
@@ -154,6 +158,10 @@ static GOptionEntry entries[] =
 	   "Skip attachments when learning/unlearning fuzzy", NULL },
 	{ "user-agent", 'U', 0, G_OPTION_ARG_STRING, &user_agent,
 	   "Use specific User-Agent instead of \"rspamc\"", NULL },
+	{ "no-keepalive", '\0', G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &keepalive,
+	   "Do not reuse connections for several requests", NULL },
+	{ "binary", '\0', 0, G_OPTION_ARG_NONE, &binary,
+	   "Request compact binary results from rspamd", NULL },
 	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
 };
 
@@ -1168,6 +1176,8 @@ rspamc_stat_output (FILE *out, ucl_object_t *obj)
 		ucl_object_toint (ucl_object_lookup (obj, "shared_chunks_allocated")));
 	rspamd_printf_gstring (out_str, "Chunks freed: %L\n",
 		ucl_object_toint (ucl_object_lookup (obj, "chunks_freed")));
+	rspamd_printf_gstring (out_str, "Chunks recycled: %L\n",
+		ucl_object_toint (ucl_object_lookup (obj, "chunks_recycled")));
 	rspamd_printf_gstring (out_str, "Oversized chunks: %L\n",
 		ucl_object_toint (ucl_object_lookup (obj, "chunks_oversized")));
 	/* Fuzzy */
@@ -1470,6 +1480,54 @@ rspamc_client_execute_cmd (struct rspamc_command *cmd, ucl_object_t *result,
 	g_strfreev (eargv);
 }
 
+static GQueue *
+rspamc_idle_queue (const gchar *name)
+{
+	GQueue *q;
+
+	if (idle_conns == NULL) {
+		idle_conns = g_hash_table_new_full (g_str_hash, g_str_equal,
+				g_free, NULL);
+	}
+
+	q = g_hash_table_lookup (idle_conns, name);
+
+	if (q == NULL) {
+		q = g_queue_new ();
+		g_hash_table_insert (idle_conns, g_strdup (name), q);
+	}
+
+	return q;
+}
+
+static void
+rspamc_destroy_idle (void)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	GQueue *q;
+	struct rspamd_client_connection *conn;
+
+	if (idle_conns == NULL) {
+		return;
+	}
+
+	g_hash_table_iter_init (&it, idle_conns);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		q = v;
+
+		while ((conn = g_queue_pop_head (q)) != NULL) {
+			rspamd_client_destroy (conn);
+		}
+
+		g_queue_free (q);
+	}
+
+	g_hash_table_unref (idle_conns);
+	idle_conns = NULL;
+}
+
 static void
 rspamc_client_cb (struct rspamd_client_connection *conn,
 		struct rspamd_http_message *msg,
@@ -1557,7 +1615,14 @@ rspamc_client_cb (struct rspamd_client_connection *conn,
 		fflush (out);
 	}
 
-	rspamd_client_destroy (conn);
+	if (err == NULL && rspamd_client_is_alive (conn)) {
+		/* Keep connection for the next request */
+		g_queue_push_tail (rspamc_idle_queue (name), conn);
+	}
+	else {
+		rspamd_client_destroy (conn);
+	}
+
 	g_free (cbdata->filename);
 	g_slice_free1 (sizeof (struct rspamc_callback_data), cbdata);
 }
@@ -1567,7 +1632,7 @@ rspamc_process_input (struct event_base *ev_base, struct rspamc_command *cmd,
 	FILE *in, const gchar *name, GQueue *attrs)
 {
 	struct rspamd_client_connection *conn;
-	gchar *hostbuf = NULL, *p;
+	gchar *hostbuf = NULL, *srv_name, *p;
 	guint16 port;
 	GError *err = NULL;
 	struct rspamc_callback_data *cbdata;
@@ -1607,7 +1672,29 @@ rspamc_process_input (struct event_base *ev_base, struct rspamc_command *cmd,
 		}
 	}
 
-	conn = rspamd_client_init (ev_base, hostbuf, port, timeout, key);
+	if (port != 0) {
+		srv_name = g_strdup_printf ("%s:%d", hostbuf, (gint)port);
+	}
+	else {
+		srv_name = g_strdup (hostbuf);
+	}
+
+	conn = NULL;
+
+	if (idle_conns != NULL) {
+		conn = g_queue_pop_head (rspamc_idle_queue (srv_name));
+	}
+
+	if (conn == NULL) {
+		conn = rspamd_client_init (ev_base, hostbuf, port, timeout, key);
+
+		if (conn != NULL) {
+			rspamd_client_set_keepalive (conn, keepalive);
+			rspamd_client_set_binary (conn, binary);
+		}
+	}
+
+	g_free (srv_name);
 
 	if (conn != NULL) {
 		cbdata = g_slice_alloc (sizeof (struct rspamc_callback_data));
@@ -1904,6 +1991,7 @@ main (gint argc, gchar **argv, gchar **env)
 	}
 
 	event_base_loop (ev_base, 0);
+	rspamc_destroy_idle ();
 
 	g_queue_free_full (kwattrs, g_free);
 
@@ -17,6 +17,7 @@
 #include "libutil/util.h"
 #include "libutil/http.h"
 #include "libutil/http_private.h"
+#include "libserver/protocol_binary.h"
 #include "unix-std.h"
 #include "contrib/zstd/zstd.h"
 #include "contrib/zstd/zdict.h"
@@ -30,7 +31,23 @@
 struct rspamd_client_request;
 
 /*
- * Since rspamd uses untagged HTTP we can pass a single message per socket
+ * Symbols table learned from binary replies
+ */
+struct rspamd_client_symtab {
+	guint64 cksum;
+	GPtrArray *symbols;
+};
+
+/*
+ * Tables are shared by all connections and are kept until exit, as replies
+ * that omit a table refer to the one whose checksum has been sent in request
+ */
+static GHashTable *client_symtabs = NULL;
+static struct rspamd_client_symtab *client_last_symtab = NULL;
+
+/*
+ * Since rspamd uses untagged HTTP we can pass a single message per socket at
+ * a time, however, persistent connections could be reused for the next message
  */
 struct rspamd_client_connection {
 	gint fd;
@@ -41,6 +58,11 @@ struct rspamd_client_connection {
 	struct timeval timeout;
 	struct rspamd_http_connection *http_conn;
 	gboolean req_sent;
+	gboolean keepalive;
+	gboolean alive;
+	gboolean binary;
+	/* Symbols table known to server for the current request */
+	struct rspamd_client_symtab *symtab;
 	gdouble start_time;
 	gdouble send_time;
 	struct rspamd_client_request *req;
@@ -53,6 +75,10 @@ struct rspamd_client_request {
 	GString *input;
 	rspamd_client_callback cb;
 	gpointer ud;
+	/* Compression dictionary, server might use it for reply as well */
+	void *dict;
+	gsize dict_len;
+	guint dict_id;
 };
 
 #define RCLIENT_ERROR rspamd_client_error_quark ()
@@ -72,6 +98,9 @@ rspamd_client_request_free (struct rspamd_client_request *req)
 		if (req->input) {
 			g_string_free (req->input, TRUE);
 		}
+		if (req->dict) {
+			munmap (req->dict, req->dict_len);
+		}
 
 		g_slice_free1 (sizeof (*req), req);
 	}
@@ -94,11 +123,361 @@ rspamd_client_error_handler (struct rspamd_http_connection *conn, GError *err)
 	struct rspamd_client_connection *c;
 
 	c = req->conn;
+	c->alive = FALSE;
 	req->cb (c, NULL, c->server_name->str, NULL,
 			req->input, req->ud,
 			c->start_time, c->send_time, err);
 }
 
+static void
+rspamd_client_symtab_free (gpointer p)
+{
+	struct rspamd_client_symtab *symtab = p;
+
+	g_ptr_array_free (symtab->symbols, TRUE);
+	g_slice_free1 (sizeof (*symtab), symtab);
+}
+
+/*
+ * Takes ownership of `symbols` and returns the shared table with this checksum
+ */
+static struct rspamd_client_symtab *
+rspamd_client_symtab_learn (guint64 cksum, GPtrArray *symbols)
+{
+	struct rspamd_client_symtab *symtab;
+
+	if (client_symtabs == NULL) {
+		client_symtabs = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+				NULL, rspamd_client_symtab_free);
+	}
+
+	symtab = g_hash_table_lookup (client_symtabs, &cksum);
+
+	if (symtab == NULL) {
+		symtab = g_slice_alloc (sizeof (*symtab));
+		symtab->cksum = cksum;
+		symtab->symbols = symbols;
+		g_hash_table_insert (client_symtabs, &symtab->cksum, symtab);
+	}
+	else {
+		/* Another connection has already learned the same table */
+		g_ptr_array_free (symbols, TRUE);
+	}
+
+	client_last_symtab = symtab;
+
+	return symtab;
+}
+
+static gboolean
+rspamd_client_binary_read (const guchar **p, const guchar *end, gpointer dst,
+		gsize len)
+{
+	if (end - *p < (gssize)len) {
+		return FALSE;
+	}
+
+	memcpy (dst, *p, len);
+	*p += len;
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_client_binary_u16 (const guchar **p, const guchar *end, guint16 *val)
+{
+	if (!rspamd_client_binary_read (p, end, val, sizeof (*val))) {
+		return FALSE;
+	}
+
+	*val = GUINT16_FROM_LE (*val);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_client_binary_u32 (const guchar **p, const guchar *end, guint32 *val)
+{
+	if (!rspamd_client_binary_read (p, end, val, sizeof (*val))) {
+		return FALSE;
+	}
+
+	*val = GUINT32_FROM_LE (*val);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_client_binary_u64 (const guchar **p, const guchar *end, guint64 *val)
+{
+	if (!rspamd_client_binary_read (p, end, val, sizeof (*val))) {
+		return FALSE;
+	}
+
+	*val = GUINT64_FROM_LE (*val);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_client_binary_double (const guchar **p, const guchar *end, gdouble *val)
+{
+	guint64 bits;
+
+	if (!rspamd_client_binary_u64 (p, end, &bits)) {
+		return FALSE;
+	}
+
+	memcpy (val, &bits, sizeof (*val));
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_client_binary_string (const guchar **p, const guchar *end,
+		const gchar **str, gsize *len)
+{
+	guint16 slen;
+
+	if (!rspamd_client_binary_u16 (p, end, &slen) || end - *p < slen) {
+		return FALSE;
+	}
+
+	*str = (const gchar *)*p;
+	*len = slen;
+	*p += slen;
+
+	return TRUE;
+}
+
+static ucl_object_t *
+rspamd_client_binary_json (const guchar *data, gsize len)
+{
+	struct ucl_parser *parser;
+	ucl_object_t *obj = NULL;
+
+	parser = ucl_parser_new (0);
+
+	if (ucl_parser_add_chunk (parser, data, len)) {
+		obj = ucl_parser_get_object (parser);
+	}
+
+	ucl_parser_free (parser);
+
+	return obj;
+}
+
+/*
+ * Converts compact binary reply to the same object as `checkv2` returns
+ */
+static ucl_object_t *
+rspamd_client_parse_binary (struct rspamd_client_connection *c,
+		const guchar *p, gsize len, GError **err)
+{
+	const guchar *end = p + len;
+	ucl_object_t *top, *symbols, *sym, *opts, *elt;
+	const gchar *str;
+	gsize slen;
+	GPtrArray *syms;
+	guint8 version, flags, type;
+	guint16 nopts;
+	guint32 nsyms, id, seclen, i, j;
+	guint64 cksum;
+	gdouble score, tm;
+
+	if (len < sizeof (RSPAMD_PROTOCOL_BINARY_MAGIC) - 1 ||
+			memcmp (p, RSPAMD_PROTOCOL_BINARY_MAGIC,
+					sizeof (RSPAMD_PROTOCOL_BINARY_MAGIC) - 1) != 0) {
+		g_set_error (err, RCLIENT_ERROR, 500, "Invalid binary reply magic");
+
+		return NULL;
+	}
+
+	p += sizeof (RSPAMD_PROTOCOL_BINARY_MAGIC) - 1;
+
+	if (!rspamd_client_binary_read (&p, end, &version, sizeof (version)) ||
+			!rspamd_client_binary_read (&p, end, &flags, sizeof (flags))) {
+		goto truncated;
+	}
+
+	if (version != RSPAMD_PROTOCOL_BINARY_VERSION) {
+		g_set_error (err, RCLIENT_ERROR, 500,
+				"Unsupported binary reply version: %d", (gint)version);
+
+		return NULL;
+	}
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top,
+			ucl_object_frombool (flags & RSPAMD_PROTOCOL_BINARY_FLAG_SKIPPED),
+			"is_skipped", 0, false);
+
+	if (!rspamd_client_binary_string (&p, end, &str, &slen)) {
+		goto err;
+	}
+
+	elt = ucl_object_fromlstring (str, slen);
+
+	if (!rspamd_client_binary_double (&p, end, &score)) {
+		ucl_object_unref (elt);
+		goto err;
+	}
+
+	ucl_object_insert_key (top, ucl_object_fromdouble (score),
+			"score", 0, false);
+
+	if (!rspamd_client_binary_double (&p, end, &score)) {
+		ucl_object_unref (elt);
+		goto err;
+	}
+
+	ucl_object_insert_key (top, ucl_object_fromdouble (score),
+			"required_score", 0, false);
+	ucl_object_insert_key (top, elt, "action", 0, false);
+
+	if (flags & RSPAMD_PROTOCOL_BINARY_FLAG_SYMTAB) {
+		if (!rspamd_client_binary_u64 (&p, end, &cksum) ||
+				!rspamd_client_binary_u32 (&p, end, &nsyms)) {
+			goto err;
+		}
+
+		syms = g_ptr_array_new_full (MIN (nsyms, len), g_free);
+
+		for (i = 0; i < nsyms; i ++) {
+			if (!rspamd_client_binary_string (&p, end, &str, &slen)) {
+				g_ptr_array_free (syms, TRUE);
+				goto err;
+			}
+
+			g_ptr_array_add (syms, g_strndup (str, slen));
+		}
+
+		c->symtab = rspamd_client_symtab_learn (cksum, syms);
+	}
+
+	if (!rspamd_client_binary_u32 (&p, end, &nsyms)) {
+		goto err;
+	}
+
+	symbols = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top, symbols, "symbols", 0, false);
+
+	for (i = 0; i < nsyms; i ++) {
+		if (!rspamd_client_binary_u32 (&p, end, &id)) {
+			goto err;
+		}
+
+		if (id == RSPAMD_PROTOCOL_BINARY_NO_ID) {
+			if (!rspamd_client_binary_string (&p, end, &str, &slen)) {
+				goto err;
+			}
+		}
+		else if (c->symtab != NULL && id < c->symtab->symbols->len) {
+			str = g_ptr_array_index (c->symtab->symbols, id);
+			slen = strlen (str);
+		}
+		else {
+			g_set_error (err, RCLIENT_ERROR, 500,
+					"Unknown symbol id in binary reply: %ud", id);
+			ucl_object_unref (top);
+
+			return NULL;
+		}
+
+		sym = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (symbols, sym, str, slen, true);
+		ucl_object_insert_key (sym, ucl_object_fromlstring (str, slen),
+				"name", 0, false);
+
+		if (!rspamd_client_binary_double (&p, end, &score) ||
+				!rspamd_client_binary_u16 (&p, end, &nopts)) {
+			goto err;
+		}
+
+		ucl_object_insert_key (sym, ucl_object_fromdouble (score),
+				"score", 0, false);
+
+		if (nopts > 0) {
+			opts = ucl_object_typed_new (UCL_ARRAY);
+			ucl_object_insert_key (sym, opts, "options", 0, false);
+
+			for (j = 0; j < nopts; j ++) {
+				if (!rspamd_client_binary_string (&p, end, &str, &slen)) {
+					goto err;
+				}
+
+				ucl_array_append (opts, ucl_object_fromlstring (str, slen));
+			}
+		}
+	}
+
+	while (p < end) {
+		if (!rspamd_client_binary_read (&p, end, &type, sizeof (type)) ||
+				!rspamd_client_binary_u32 (&p, end, &seclen) ||
+				end - p < seclen) {
+			goto err;
+		}
+
+		switch (type) {
+		case RSPAMD_PROTOCOL_BINARY_SUBJECT:
+			ucl_object_insert_key (top,
+					ucl_object_fromlstring ((const gchar *)p, seclen),
+					"subject", 0, false);
+			break;
+		case RSPAMD_PROTOCOL_BINARY_MESSAGE_ID:
+			ucl_object_insert_key (top,
+					ucl_object_fromlstring ((const gchar *)p, seclen),
+					"message-id", 0, false);
+			break;
+		case RSPAMD_PROTOCOL_BINARY_DKIM_SIGNATURE:
+			ucl_object_insert_key (top,
+					ucl_object_fromlstring ((const gchar *)p, seclen),
+					"dkim-signature", 0, false);
+			break;
+		case RSPAMD_PROTOCOL_BINARY_MILTER:
+			elt = rspamd_client_binary_json (p, seclen);
+
+			if (elt) {
+				ucl_object_insert_key (top, elt, "milter", 0, false);
+			}
+			break;
+		case RSPAMD_PROTOCOL_BINARY_MESSAGES:
+			elt = rspamd_client_binary_json (p, seclen);
+
+			if (elt) {
+				ucl_object_insert_key (top, elt, "messages", 0, false);
+			}
+			break;
+		case RSPAMD_PROTOCOL_BINARY_TIME:
+			if (seclen >= sizeof (gdouble) * 2) {
+				const guchar *t = p;
+
+				rspamd_client_binary_double (&t, p + seclen, &tm);
+				ucl_object_insert_key (top, ucl_object_fromdouble (tm),
+						"time_real", 0, false);
+				rspamd_client_binary_double (&t, p + seclen, &tm);
+				ucl_object_insert_key (top, ucl_object_fromdouble (tm),
+						"time_virtual", 0, false);
+			}
+			break;
+		default:
+			/* Skip unknown sections for compatibility with newer servers */
+			break;
+		}
+
+		p += seclen;
+	}
+
+	return top;
+
+err:
+	ucl_object_unref (top);
+truncated:
+	g_set_error (err, RCLIENT_ERROR, 500, "Truncated binary reply");
+
+	return NULL;
+}
+
 static gint
 rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
@@ -107,8 +486,12 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 		(struct rspamd_client_request *)conn->ud;
 	struct rspamd_client_connection *c;
 	struct ucl_parser *parser;
+	ucl_object_t *obj;
 	GError *err;
 	const rspamd_ftok_t *tok;
+	const guchar *body;
+	guchar *out = NULL;
+	gsize bodylen;
 
 	c = req->conn;
 
@@ -124,6 +507,9 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 		return 0;
 	}
 	else {
+		/* Server agrees to process more requests on this connection */
+		c->alive = c->keepalive && (msg->flags & RSPAMD_HTTP_FLAG_KEEP_ALIVE);
+
 		if (rspamd_http_message_get_body (msg, NULL) == NULL || msg->code != 200) {
 			err = g_error_new (RCLIENT_ERROR, msg->code, "HTTP error: %d, %.*s",
 					msg->code,
@@ -135,6 +521,8 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 			return 0;
 		}
 
+		body = (const guchar *)msg->body_buf.begin;
+		bodylen = msg->body_buf.len;
 		tok = rspamd_http_message_find_header (msg, "compression");
 
 		if (tok) {
@@ -148,11 +536,37 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 				ZSTD_DStream *zstream;
 				ZSTD_inBuffer zin;
 				ZSTD_outBuffer zout;
-				guchar *out;
 				gsize outlen, r;
 
+				tok = rspamd_http_message_find_header (msg, "dictionary");
+
+				if (tok != NULL) {
+					gulong dict_id;
+
+					if (req->dict == NULL ||
+							!rspamd_strtoul (tok->begin, tok->len, &dict_id) ||
+							dict_id != req->dict_id) {
+						err = g_error_new (RCLIENT_ERROR, 500,
+								"Unknown dictionary: %.*s",
+								(gint)tok->len, tok->begin);
+						req->cb (c, msg, c->server_name->str, NULL,
+								req->input, req->ud, c->start_time,
+								c->send_time, err);
+						g_error_free (err);
+
+						return 0;
+					}
+				}
+
 				zstream = ZSTD_createDStream ();
-				ZSTD_initDStream (zstream);
+
+				if (tok != NULL) {
+					ZSTD_initDStream_usingDict (zstream, req->dict,
+							req->dict_len);
+				}
+				else {
+					ZSTD_initDStream (zstream);
+				}
 
 				zin.pos = 0;
 				zin.src = msg->body_buf.begin;
@@ -179,7 +593,7 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 								c->send_time, err);
 						g_error_free (err);
 						ZSTD_freeDStream (zstream);
-						g_free (out);
+						g_free (zout.dst);
 
 						return 0;
 					}
@@ -192,21 +606,9 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 				}
 
 				ZSTD_freeDStream (zstream);
-
-				parser = ucl_parser_new (0);
-				if (!ucl_parser_add_chunk (parser, zout.dst, zout.pos)) {
-					err = g_error_new (RCLIENT_ERROR, msg->code, "Cannot parse UCL: %s",
-							ucl_parser_get_error (parser));
-					ucl_parser_free (parser);
-					req->cb (c, msg, c->server_name->str, NULL, req->input,
-							req->ud, c->start_time, c->send_time, err);
-					g_error_free (err);
-					g_free (zout.dst);
-
-					return 0;
-				}
-
-				g_free (zout.dst);
+				out = zout.dst;
+				body = out;
+				bodylen = zout.pos;
 			}
 			else {
 				err = g_error_new (RCLIENT_ERROR, 500,
@@ -218,23 +620,46 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 				return 0;
 			}
 		}
+
+		tok = rspamd_http_message_find_header (msg,
+				RSPAMD_PROTOCOL_REPLY_FORMAT_HEADER);
+
+		if (tok && tok->len == 6 &&
+				g_ascii_strncasecmp (tok->begin, "binary", 6) == 0) {
+			err = NULL;
+			obj = rspamd_client_parse_binary (c, body, bodylen, &err);
+
+			if (obj == NULL) {
+				req->cb (c, msg, c->server_name->str, NULL,
+						req->input, req->ud, c->start_time, c->send_time, err);
+				g_error_free (err);
+				g_free (out);
+
+				return 0;
+			}
+		}
 		else {
 			parser = ucl_parser_new (0);
-			if (!ucl_parser_add_chunk (parser, msg->body_buf.begin, msg->body_buf.len)) {
+
+			if (!ucl_parser_add_chunk (parser, body, bodylen)) {
 				err = g_error_new (RCLIENT_ERROR, msg->code, "Cannot parse UCL: %s",
 						ucl_parser_get_error (parser));
 				ucl_parser_free (parser);
 				req->cb (c, msg, c->server_name->str, NULL,
 						req->input, req->ud, c->start_time, c->send_time, err);
 				g_error_free (err);
+				g_free (out);
 
 				return 0;
 			}
+
+			obj = ucl_parser_get_object (parser);
+			ucl_parser_free (parser);
 		}
 
-		req->cb (c, msg, c->server_name->str, ucl_parser_get_object (
-				parser), req->input, req->ud, c->start_time, c->send_time, NULL);
-		ucl_parser_free (parser);
+		g_free (out);
+		req->cb (c, msg, c->server_name->str, obj, req->input, req->ud,
+				c->start_time, c->send_time, NULL);
 	}
 
 	return 0;
@@ -310,6 +735,19 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 	void *dict = NULL;
 	ZSTD_CCtx *zctx;
 
+	if (conn->req != NULL) {
+		/* Previous request on a persistent connection */
+		rspamd_client_request_free (conn->req);
+	}
+
+	if (conn->req_sent) {
+		rspamd_http_connection_reset (conn->http_conn);
+		conn->req_sent = FALSE;
+		conn->send_time = 0;
+	}
+
+	conn->alive = FALSE;
+
 	req = g_slice_alloc0 (sizeof (struct rspamd_client_request));
 	req->conn = conn;
 	req->cb = cb;
@@ -320,6 +758,10 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 		req->msg->peer_key = rspamd_pubkey_ref (conn->key);
 	}
 
+	if (conn->keepalive) {
+		req->msg->flags |= RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+	}
+
 	if (in != NULL) {
 		/* Read input stream */
 		input = g_string_sized_new (BUFSIZ);
@@ -366,7 +808,7 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 					return FALSE;
 				}
 
-				dict_id = ZDICT_getDictID (comp_dictionary, dict_len);
+				dict_id = ZDICT_getDictID (dict, dict_len);
 
 				if (dict_id == 0) {
 					g_set_error (err, RCLIENT_ERROR, errno,
@@ -388,12 +830,15 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 					dict, dict_len,
 					1);
 
-			munmap (dict, dict_len);
+			/* Kept to decompress reply */
+			req->dict = dict;
+			req->dict_len = dict_len;
+			req->dict_id = dict_id;
 
 			if (ZSTD_isError (body->len)) {
 				g_set_error (err, RCLIENT_ERROR, ferror (
 						in), "compression error");
-				g_slice_free1 (sizeof (struct rspamd_client_request), req);
+				rspamd_client_request_free (req);
 				g_string_free (input, TRUE);
 				rspamd_fstring_free (body);
 				ZSTD_freeCCtx (zctx);
@@ -420,14 +865,37 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 		cur = g_list_next (cur);
 	}
 
+	if (conn->binary) {
+		rspamd_http_message_add_header (req->msg,
+				RSPAMD_PROTOCOL_REPLY_FORMAT_HEADER, "binary");
+
+		/* Table might be learned by another connection to the same server */
+		conn->symtab = client_last_symtab;
+
+		if (conn->symtab) {
+			gchar cksum_str[32];
+
+			rspamd_snprintf (cksum_str, sizeof (cksum_str), "%uL",
+					conn->symtab->cksum);
+			rspamd_http_message_add_header (req->msg,
+					RSPAMD_PROTOCOL_SYMBOLS_CKSUM_HEADER, cksum_str);
+		}
+	}
+
 	if (compressed) {
-		rspamd_http_message_add_header (req->msg, "Compression", "zstd");
+		if (in != NULL) {
+			rspamd_http_message_add_header (req->msg, "Compression", "zstd");
+		}
+
+		rspamd_http_message_add_header (req->msg, "Accept-Compression", "zstd");
 
 		if (dict_id != 0) {
 			gchar dict_str[32];
 
 			rspamd_snprintf (dict_str, sizeof (dict_str), "%ud", dict_id);
 			rspamd_http_message_add_header (req->msg, "Dictionary", dict_str);
+			rspamd_http_message_add_header (req->msg, "Accept-Dictionary",
+					dict_str);
 		}
 	}
 
@@ -450,6 +918,26 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 	return TRUE;
 }
 
+void
+rspamd_client_set_keepalive (struct rspamd_client_connection *conn,
+		gboolean keepalive)
+{
+	conn->keepalive = keepalive;
+}
+
+void
+rspamd_client_set_binary (struct rspamd_client_connection *conn,
+		gboolean binary)
+{
+	conn->binary = binary;
+}
+
+gboolean
+rspamd_client_is_alive (struct rspamd_client_connection *conn)
+{
+	return conn->alive;
+}
+
 void
 rspamd_client_destroy (struct rspamd_client_connection *conn)
 {
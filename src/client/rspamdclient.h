@@ -83,6 +83,32 @@ gboolean rspamd_client_command (
 	const gchar *comp_dictionary,
 	GError **err);
 
+/**
+ * Ask server to keep connection open after a command, so it could be reused
+ * for the next command
+ * @param conn
+ * @param keepalive
+ */
+void rspamd_client_set_keepalive (struct rspamd_client_connection *conn,
+		gboolean keepalive);
+
+/**
+ * Ask server to reply with compact binary results instead of JSON. Replies are
+ * still passed to callbacks as UCL objects
+ * @param conn
+ * @param binary
+ */
+void rspamd_client_set_binary (struct rspamd_client_connection *conn,
+		gboolean binary);
+
+/**
+ * Returns TRUE if the last command has been finished and server allows to
+ * send more commands over this connection
+ * @param conn
+ * @return
+ */
+gboolean rspamd_client_is_alive (struct rspamd_client_connection *conn);
+
 /**
  * Destroy a connection to rspamd
  * @param conn
@@ -28,6 +28,7 @@
 #include "fuzzy_wire.h"
 #include "unix-std.h"
 #include "utlist.h"
+#include "libutil/mempool_vars_internal.h"
 #include <math.h>
 
 /* 60 seconds for worker's IO */
@@ -1355,80 +1356,79 @@ rspamd_controller_handle_legacy_history (
 		struct rspamd_http_connection_entry *conn_ent,
 		struct rspamd_http_message *msg)
 {
-	struct roll_history_row *row, *copied_rows;
-	guint i, rows_proc, row_num;
+	struct roll_history_row r, *row = &r;
+	struct roll_history_iter it;
 	struct tm *tm;
 	gchar timebuf[32];
 	ucl_object_t *top, *obj;
 
 	top = ucl_object_typed_new (UCL_ARRAY);
 
-	/* Set lock on history */
-	copied_rows = g_slice_alloc (sizeof (*copied_rows) * ctx->srv->history->nrows);
-	memcpy (copied_rows, ctx->srv->history->rows,
-			sizeof (*copied_rows) * ctx->srv->history->nrows);
+	/* Rows are copied one by one, incomplete ones are skipped by iterator */
+	rspamd_roll_history_iter_init (ctx->srv->history, &it);
 
-	/* Go through all rows */
-	row_num = ctx->srv->history->cur_row;
+	while (rspamd_roll_history_iter_next (&it, row)) {
+		tm = localtime (&row->tv.tv_sec);
+		strftime (timebuf, sizeof (timebuf) - 1, "%Y-%m-%d %H:%M:%S", tm);
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj, ucl_object_fromstring (
+				timebuf),		  "time", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (
+				row->tv.tv_sec), "unix_time", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromstring (
+				row->message_id), "id",	  0, false);
+		ucl_object_insert_key (obj, ucl_object_fromstring (row->from_addr),
+				"ip", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromstring (rspamd_action_to_str (
+						row->action)), "action", 0, false);
 
-	for (i = 0, rows_proc = 0; i < ctx->srv->history->nrows; i++, row_num++) {
-		if (row_num == ctx->srv->history->nrows) {
-			row_num = 0;
+		if (!isnan (row->score)) {
+			ucl_object_insert_key (obj, ucl_object_fromdouble (
+					row->score),		  "score",			0, false);
 		}
-		row = &copied_rows[row_num];
-		/* Get only completed rows */
-		if (row->completed) {
-			tm = localtime (&row->tv.tv_sec);
-			strftime (timebuf, sizeof (timebuf) - 1, "%Y-%m-%d %H:%M:%S", tm);
-			obj = ucl_object_typed_new (UCL_OBJECT);
-			ucl_object_insert_key (obj, ucl_object_fromstring (
-					timebuf),		  "time", 0, false);
-			ucl_object_insert_key (obj, ucl_object_fromint (
-					row->tv.tv_sec), "unix_time", 0, false);
-			ucl_object_insert_key (obj, ucl_object_fromstring (
-					row->message_id), "id",	  0, false);
-			ucl_object_insert_key (obj, ucl_object_fromstring (row->from_addr),
-					"ip", 0, false);
+		else {
 			ucl_object_insert_key (obj,
-					ucl_object_fromstring (rspamd_action_to_str (
-							row->action)), "action", 0, false);
-
-			if (!isnan (row->score)) {
-				ucl_object_insert_key (obj, ucl_object_fromdouble (
-						row->score),		  "score",			0, false);
-			}
-			else {
-				ucl_object_insert_key (obj,
-						ucl_object_fromdouble (0.0), "score", 0, false);
-			}
+					ucl_object_fromdouble (0.0), "score", 0, false);
+		}
 
-			if (!isnan (row->required_score)) {
-				ucl_object_insert_key (obj,
-						ucl_object_fromdouble (
-								row->required_score), "required_score", 0, false);
-			}
-			else {
-				ucl_object_insert_key (obj,
-						ucl_object_fromdouble (0.0), "required_score", 0, false);
-			}
+		if (!isnan (row->required_score)) {
+			ucl_object_insert_key (obj,
+					ucl_object_fromdouble (
+							row->required_score), "required_score", 0, false);
+		}
+		else {
+			ucl_object_insert_key (obj,
+					ucl_object_fromdouble (0.0), "required_score", 0, false);
+		}
 
+		ucl_object_insert_key (obj, ucl_object_fromstring (
+				row->symbols),		  "symbols",		0, false);
+		ucl_object_insert_key (obj,	   ucl_object_fromint (
+				row->len),			  "size",			0, false);
+		ucl_object_insert_key (obj,	   ucl_object_fromdouble (
+				row->scan_time),	  "scan_time",		0, false);
+		if (row->user[0] != '\0') {
 			ucl_object_insert_key (obj, ucl_object_fromstring (
-					row->symbols),		  "symbols",		0, false);
-			ucl_object_insert_key (obj,	   ucl_object_fromint (
-					row->len),			  "size",			0, false);
-			ucl_object_insert_key (obj,	   ucl_object_fromdouble (
-					row->scan_time),	  "scan_time",		0, false);
-			if (row->user[0] != '\0') {
-				ucl_object_insert_key (obj, ucl_object_fromstring (
-						row->user), "user", 0, false);
-			}
-			if (row->from_addr[0] != '\0') {
-				ucl_object_insert_key (obj, ucl_object_fromstring (
-						row->from_addr), "from", 0, false);
-			}
-			ucl_array_append (top, obj);
-			rows_proc++;
+					row->user), "user", 0, false);
+		}
+		if (row->from_addr[0] != '\0') {
+			ucl_object_insert_key (obj, ucl_object_fromstring (
+					row->from_addr), "from", 0, false);
+		}
+		if (row->from_envelope[0] != '\0') {
+			ucl_object_insert_key (obj, ucl_object_fromstring (
+					row->from_envelope), "sender_smtp", 0, false);
+		}
+		if (row->rcpt_envelope[0] != '\0') {
+			ucl_object_insert_key (obj, ucl_object_fromstring (
+					row->rcpt_envelope), "rcpt_smtp", 0, false);
 		}
+		ucl_object_insert_key (obj, ucl_object_fromdouble (
+				row->virtual_time), "virtual_time", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (
+				row->nsymbols), "nsymbols", 0, false);
+		ucl_array_append (top, obj);
 	}
 
 	rspamd_controller_send_ucl (conn_ent, top);
@@ -1645,8 +1645,6 @@ rspamd_controller_handle_history_reset (struct rspamd_http_connection_entry *con
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 	struct rspamd_controller_worker_ctx *ctx;
-	struct roll_history_row *row;
-	guint start_row, i, t;
 	lua_State *L;
 
 	ctx = session->ctx;
@@ -1657,26 +1655,7 @@ rspamd_controller_handle_history_reset (struct rspamd_http_connection_entry *con
 	}
 
 	if (!ctx->srv->history->disabled) {
-		/* Clean from start to the current row */
-		start_row = g_atomic_int_get (&ctx->srv->history->cur_row);
-
-		for (i = 0; i < start_row; i ++) {
-			t = g_atomic_int_get (&ctx->srv->history->cur_row);
-
-			/* We somehow come to the race condition */
-			if (i >= t) {
-				break;
-			}
-
-			row = &ctx->srv->history->rows[i];
-			memset (row, 0, sizeof (*row));
-		}
-
-		start_row = g_atomic_int_get (&ctx->srv->history->cur_row);
-		/* Optimistically set all bytes to zero (might cause race) */
-		memset (ctx->srv->history->rows,
-				0,
-				sizeof (*row) * (ctx->srv->history->nrows - start_row));
+		rspamd_roll_history_reset (ctx->srv->history);
 
 		msg_info_session ("<%s> reset history",
 				rspamd_inet_address_to_string (session->from_addr));
@@ -2508,7 +2487,8 @@ rspamd_controller_stat_fin_task (void *ud)
 		ucl_object_insert_key (top, cbdata->stat, "statfiles", 0, false);
 	}
 
-	fuzzy_elts = rspamd_mempool_get_variable (cbdata->task->task_pool, "fuzzy_stat");
+	fuzzy_elts = rspamd_mempool_get_variable_idx (cbdata->task->task_pool,
+			RSPAMD_MEMPOOL_VAR_FUZZY_STAT);
 
 	if (fuzzy_elts) {
 		ar = ucl_object_typed_new (UCL_OBJECT);
@@ -2626,6 +2606,8 @@ rspamd_controller_handle_stat_common (
 	ucl_object_insert_key (top,
 		ucl_object_fromint (stat->control_connections_count),
 		"control_connections", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->tasks_shed), "tasks_shed", 0, false);
 
 	ucl_object_insert_key (top,
 		ucl_object_fromint (mem_st.pools_allocated), "pools_allocated", 0,
@@ -2643,6 +2625,8 @@ rspamd_controller_handle_stat_common (
 		"shared_chunks_allocated", 0, false);
 	ucl_object_insert_key (top,
 		ucl_object_fromint (mem_st.chunks_freed), "chunks_freed", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (mem_st.chunks_recycled), "chunks_recycled", 0, false);
 	ucl_object_insert_key (top,
 		ucl_object_fromint (
 			mem_st.oversized_chunks), "chunks_oversized", 0, false);
@@ -2652,6 +2636,7 @@ rspamd_controller_handle_stat_common (
 		session->ctx->srv->stat->messages_learned = 0;
 		session->ctx->srv->stat->connections_count = 0;
 		session->ctx->srv->stat->control_connections_count = 0;
+		session->ctx->srv->stat->tasks_shed = 0;
 		rspamd_mempool_stat_reset ();
 	}
 
@@ -41,6 +41,16 @@
 #define DEFAULT_KEYPAIR_CACHE_SIZE 512
 #define DEFAULT_MASTER_TIMEOUT 10.0
 #define DEFAULT_UPDATES_MAXFAIL 3
+#define DEFAULT_MIRROR_BACKLOG (64 * 1024 * 1024)
+#define DEFAULT_MIRROR_CHUNK (1024 * 1024)
+#define MAX_MIRROR_BACKOFF 600.0
+#define DEFAULT_HOT_CACHE_SIZE 32768
+#define DEFAULT_HOT_CACHE_TTL 10.0
+#define DEFAULT_HOT_CACHE_NEGATIVE_TTL 2.0
+#define MAX_HOT_CACHE_TTL 60.0
+#define MAX_HOT_CACHE_SIZE (1u << 24)
+/* Number of slots checked for a digest in the hot cache */
+#define HOT_CACHE_PROBES 8
 #define COOKIE_SIZE 128
 
 static const gchar *local_db_name = "local";
@@ -103,6 +113,8 @@ struct fuzzy_global_stat {
 	guint64 fuzzy_hashes_found[RSPAMD_FUZZY_EPOCH_MAX];
 	/**< amount of hashes found by epoch				*/
 	guint64 invalid_requests;
+	guint64 cache_hits;
+	/**< amount of checks replied from the hot cache	*/
 };
 
 struct fuzzy_key_stat {
@@ -114,10 +126,63 @@ struct fuzzy_key_stat {
 	rspamd_lru_hash_t *last_ips;
 };
 
+struct fuzzy_slave_connection;
+struct rspamd_fuzzy_storage_ctx;
+
+struct fuzzy_hot_cache_elt {
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+	struct rspamd_fuzzy_reply rep;
+	gdouble expire;
+	/* Negative elements are valid for a single generation only */
+	guint32 gen;
+	/* Generation of updates committed by any worker */
+	guint shared_gen;
+	gboolean shingle;
+	gboolean used;
+};
+
+/*
+ * Cache of recent check replies, both positive and negative, in front of
+ * the backend. It uses open addressing with a bounded number of probes, so
+ * the element that expires first in the probes window is evicted when
+ * the window is full.
+ * Updates are committed by the first worker only, so it bumps the shared
+ * generation after each transaction and other workers drop all their replies
+ * cached before it. Expiration of digests in the backend is not tracked, so
+ * positive replies could outlive it for at most MAX_HOT_CACHE_TTL.
+ */
+struct fuzzy_hot_cache {
+	struct fuzzy_hot_cache_elt *elts;
+	guint mask;
+	guint32 neg_gen;
+	volatile guint *shared_gen;
+};
+
 struct rspamd_fuzzy_mirror {
 	gchar *name;
 	struct upstream_list *u;
 	struct rspamd_cryptobox_pubkey *key;
+	struct rspamd_fuzzy_storage_ctx *ctx;
+	/* Persistent connection to the slave */
+	struct fuzzy_slave_connection *conn;
+	/* Last revision confirmed by the slave */
+	guint32 acked_rev;
+	/* Last revision sent in the current chunk */
+	guint32 sent_rev;
+	/* Only one chunk can be in flight for each mirror */
+	gboolean in_flight;
+	/* Mirror keeps refusing our revisions, it needs cold sync */
+	gboolean stopped;
+	/* Delay before the next retry, grows exponentially on failures */
+	gdouble backoff;
+	struct event flush_ev;
+};
+
+/* Single committed transaction stored in the replication journal */
+struct fuzzy_mirror_batch {
+	guint32 rev;
+	/* Sequence of <uint32_le> length + command elements */
+	rspamd_fstring_t *data;
 };
 
 static const guint64 rspamd_fuzzy_storage_magic = 0x291a3253eb1b3ea5ULL;
@@ -142,6 +207,15 @@ struct rspamd_fuzzy_storage_ctx {
 	struct timeval master_io_tv;
 	gdouble master_timeout;
 	GPtrArray *mirrors;
+	/*
+	 * Recent transactions to be replicated to mirrors, the journal is kept in
+	 * memory only, so revisions that are older than its head (e.g. after
+	 * restart of the master) are lost for lagging mirrors
+	 */
+	GQueue *mirror_journal;
+	gsize mirror_journal_size;
+	gsize mirror_backlog;
+	gsize mirror_chunk;
 	const ucl_object_t *update_map;
 	const ucl_object_t *masters_map;
 	GHashTable *master_flags;
@@ -162,6 +236,12 @@ struct rspamd_fuzzy_storage_ctx {
 	struct rspamd_keypair_cache *keypair_cache;
 	rspamd_lru_hash_t *errors_ips;
 	struct rspamd_fuzzy_backend *backend;
+	struct fuzzy_hot_cache *hot_cache;
+	/* Allocated in shared memory, bumped on each committed update */
+	volatile guint *hot_cache_gen;
+	guint hot_cache_size;
+	gdouble hot_cache_ttl;
+	gdouble hot_cache_negative_ttl;
 	GQueue *updates_pending;
 	guint updates_failed;
 	guint updates_maxfail;
@@ -169,7 +249,7 @@ struct rspamd_fuzzy_storage_ctx {
 	struct rspamd_worker *worker;
 	struct rspamd_http_connection_router *collection_rt;
 	const ucl_object_t *skip_map;
-	GHashTable *skip_hashes;
+	struct rspamd_hash_map_helper *skip_hashes;
 	guchar cookie[COOKIE_SIZE];
 };
 
@@ -225,12 +305,179 @@ struct fuzzy_master_update_session {
 	const gchar *src;
 	gchar *psrc;
 	rspamd_inet_addr_t *addr;
+	/* Revisions received from the master and not applied yet */
+	GQueue *updates;
+	/* Last revision applied from the master */
+	guint32 cur_rev;
+	/* Version of the source in the local backend */
+	guint32 db_rev;
+	/* Newest revision that the master cannot replay (update_v2 only) */
+	guint32 journal_base;
+	guint nops;
 	gboolean replied;
+	gboolean multi;
+	gboolean keepalive;
+	gboolean processing;
+	gboolean applying;
+	gboolean terminated;
+	gboolean failed;
 	gint sock;
 };
 
+struct fuzzy_master_update {
+	guint32 rev;
+	guint ncmds;
+	GList *cmds;
+};
+
 static void rspamd_fuzzy_write_reply (struct fuzzy_session *session);
 
+static struct fuzzy_hot_cache *
+fuzzy_hot_cache_new (guint size, volatile guint *shared_gen)
+{
+	struct fuzzy_hot_cache *cache;
+	guint nelts = HOT_CACHE_PROBES;
+
+	if (size > MAX_HOT_CACHE_SIZE) {
+		msg_warn ("hot cache size %ud is too large, limit it to %ud",
+				size, MAX_HOT_CACHE_SIZE);
+		size = MAX_HOT_CACHE_SIZE;
+	}
+
+	while (nelts < size) {
+		nelts <<= 1;
+	}
+
+	cache = g_malloc0 (sizeof (*cache));
+	cache->elts = g_malloc0_n (nelts, sizeof (*cache->elts));
+	cache->mask = nelts - 1;
+	cache->shared_gen = shared_gen;
+
+	return cache;
+}
+
+static void
+fuzzy_hot_cache_destroy (struct fuzzy_hot_cache *cache)
+{
+	if (cache) {
+		g_free (cache->elts);
+		g_free (cache);
+	}
+}
+
+static void
+fuzzy_hot_cache_clear (struct fuzzy_hot_cache *cache)
+{
+	memset (cache->elts, 0, sizeof (*cache->elts) * (cache->mask + 1));
+}
+
+static inline guint
+fuzzy_hot_cache_idx (struct fuzzy_hot_cache *cache, const guchar *digest)
+{
+	guint64 h;
+
+	/* Digests are cryptographic hashes, so their bytes are uniform */
+	memcpy (&h, digest, sizeof (h));
+
+	return h & cache->mask;
+}
+
+static const struct rspamd_fuzzy_reply *
+fuzzy_hot_cache_lookup (struct fuzzy_hot_cache *cache,
+		const struct rspamd_fuzzy_cmd *cmd, gboolean shingle, gdouble now)
+{
+	struct fuzzy_hot_cache_elt *elt;
+	guint i, idx;
+
+	idx = fuzzy_hot_cache_idx (cache, cmd->digest);
+
+	for (i = 0; i < HOT_CACHE_PROBES; i ++) {
+		elt = &cache->elts[(idx + i) & cache->mask];
+
+		if (elt->used && elt->shingle == shingle &&
+				memcmp (elt->digest, cmd->digest, sizeof (elt->digest)) == 0) {
+			if (elt->expire < now ||
+					elt->shared_gen != g_atomic_int_get (cache->shared_gen) ||
+					(elt->rep.prob <= 0.5 && elt->gen != cache->neg_gen)) {
+				elt->used = FALSE;
+
+				return NULL;
+			}
+
+			return &elt->rep;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+fuzzy_hot_cache_insert (struct fuzzy_hot_cache *cache,
+		const struct rspamd_fuzzy_cmd *cmd, gboolean shingle,
+		const struct rspamd_fuzzy_reply *rep, gdouble expire)
+{
+	struct fuzzy_hot_cache_elt *elt, *sel = NULL;
+	guint i, idx;
+
+	idx = fuzzy_hot_cache_idx (cache, cmd->digest);
+
+	for (i = 0; i < HOT_CACHE_PROBES; i ++) {
+		elt = &cache->elts[(idx + i) & cache->mask];
+
+		if (!elt->used) {
+			sel = elt;
+			break;
+		}
+		else if (elt->shingle == shingle &&
+				memcmp (elt->digest, cmd->digest, sizeof (elt->digest)) == 0) {
+			sel = elt;
+			break;
+		}
+		else if (sel == NULL || elt->expire < sel->expire) {
+			/* Evict the element that expires first */
+			sel = elt;
+		}
+	}
+
+	memcpy (sel->digest, cmd->digest, sizeof (sel->digest));
+	memcpy (&sel->rep, rep, sizeof (sel->rep));
+	sel->expire = expire;
+	sel->gen = cache->neg_gen;
+	sel->shared_gen = g_atomic_int_get (cache->shared_gen);
+	sel->shingle = shingle;
+	sel->used = TRUE;
+}
+
+/*
+ * Removes replies that could be changed by the specified update: the
+ * digest itself and all negative replies, as they could be matched
+ * by shingles of a new digest now
+ */
+static void
+fuzzy_hot_cache_invalidate (struct fuzzy_hot_cache *cache,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	struct fuzzy_hot_cache_elt *elt;
+	guint i, idx;
+
+	if (cache == NULL) {
+		return;
+	}
+
+	idx = fuzzy_hot_cache_idx (cache, cmd->digest);
+
+	for (i = 0; i < HOT_CACHE_PROBES; i ++) {
+		elt = &cache->elts[(idx + i) & cache->mask];
+
+		if (elt->used &&
+				memcmp (elt->digest, cmd->digest, sizeof (elt->digest)) == 0) {
+			elt->used = FALSE;
+		}
+	}
+
+	cache->neg_gen ++;
+}
+
 static gboolean
 rspamd_fuzzy_check_client (struct fuzzy_session *session)
 {
@@ -284,6 +531,8 @@ struct fuzzy_slave_connection {
 	gint sock;
 };
 
+static void rspamd_fuzzy_mirror_flush (struct rspamd_fuzzy_mirror *m);
+
 static void
 fuzzy_mirror_close_connection (struct fuzzy_slave_connection *conn)
 {
@@ -299,112 +548,131 @@ fuzzy_mirror_close_connection (struct fuzzy_slave_connection *conn)
 	}
 }
 
-struct rspamd_fuzzy_updates_cbdata {
-	struct rspamd_fuzzy_storage_ctx *ctx;
-	struct rspamd_http_message *msg;
-	struct fuzzy_slave_connection *conn;
-	struct rspamd_fuzzy_mirror *m;
-};
+static void
+fuzzy_mirror_batch_free (struct fuzzy_mirror_batch *batch)
+{
+	rspamd_fstring_free (batch->data);
+	g_slice_free1 (sizeof (*batch), batch);
+}
 
 static void
-fuzzy_mirror_updates_version_cb (guint64 rev64, void *ud)
+fuzzy_mirror_journal_free (GQueue *journal)
 {
-	struct rspamd_fuzzy_updates_cbdata *cbdata = ud;
 	GList *cur;
-	struct fuzzy_peer_cmd *io_cmd;
-	guint32 rev32 = rev64, len;
-	const gchar *p;
-	rspamd_fstring_t *reply;
-	struct fuzzy_slave_connection *conn;
-	struct rspamd_fuzzy_storage_ctx *ctx;
-	struct rspamd_http_message *msg;
-	struct rspamd_fuzzy_mirror *m;
+
+	for (cur = journal->head; cur != NULL; cur = g_list_next (cur)) {
+		fuzzy_mirror_batch_free (cur->data);
+	}
+
+	g_queue_free (journal);
+}
+
+/*
+ * Returns the newest revision that is not in the journal, so it cannot be
+ * replayed to mirrors anymore
+ */
+static guint32
+fuzzy_mirror_journal_base (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	struct fuzzy_mirror_batch *head;
+
+	head = g_queue_peek_head (ctx->mirror_journal);
+
+	return head ? head->rev - 1 : 0;
+}
+
+static void
+fuzzy_mirror_flush_cb (gint fd, short what, gpointer ud)
+{
+	struct rspamd_fuzzy_mirror *m = ud;
+
+	rspamd_fuzzy_mirror_flush (m);
+}
+
+/*
+ * Schedules sending of the next chunk to a mirror outside of the current
+ * callstack (e.g. HTTP handlers)
+ */
+static void
+fuzzy_mirror_schedule_flush (struct rspamd_fuzzy_mirror *m, gdouble delay)
+{
 	struct timeval tv;
 
-	conn = cbdata->conn;
-	ctx = cbdata->ctx;
-	msg = cbdata->msg;
-	m = cbdata->m;
-	g_slice_free1 (sizeof (*cbdata), cbdata);
-	rev32 = GUINT32_TO_LE (rev32);
-	len = sizeof (guint32) * 2; /* revision + last chunk */
+	if (delay > 0 && m->ctx->worker->wanna_die) {
+		/* Do not delay termination for retries */
+		return;
+	}
 
-	for (cur = ctx->updates_pending->head; cur != NULL; cur = g_list_next (cur)) {
-		io_cmd = cur->data;
+	if (event_get_base (&m->flush_ev) == NULL) {
+		evtimer_set (&m->flush_ev, fuzzy_mirror_flush_cb, m);
+		event_base_set (m->ctx->ev_base, &m->flush_ev);
+	}
 
-		if (io_cmd->is_shingle) {
-			len += sizeof (guint32) + sizeof (guint32) +
-					sizeof (struct rspamd_fuzzy_shingle_cmd);
-		}
-		else {
-			len += sizeof (guint32) + sizeof (guint32) +
-					sizeof (struct rspamd_fuzzy_cmd);
-		}
+	if (!evtimer_pending (&m->flush_ev, NULL)) {
+		double_to_tv (delay, &tv);
+		evtimer_add (&m->flush_ev, &tv);
+	}
+}
+
+/*
+ * Schedules retry to a failed mirror, delay is doubled on each subsequent
+ * failure up to MAX_MIRROR_BACKOFF and reset when mirror acks a chunk
+ */
+static void
+fuzzy_mirror_retry (struct rspamd_fuzzy_mirror *m)
+{
+	if (m->backoff == 0) {
+		m->backoff = m->ctx->master_timeout;
+	}
+	else {
+		m->backoff = MIN (m->backoff * 2, MAX_MIRROR_BACKOFF);
 	}
 
-	reply = rspamd_fstring_sized_new (len);
-	reply = rspamd_fstring_append (reply, (const char *)&rev32,
-			sizeof (rev32));
+	fuzzy_mirror_schedule_flush (m, rspamd_time_jitter (m->backoff,
+			m->backoff / 4.0));
+}
 
-	for (cur = ctx->updates_pending->head; cur != NULL; cur = g_list_next (cur)) {
-		io_cmd = cur->data;
+static void
+fuzzy_mirror_detach (struct rspamd_fuzzy_mirror *m, gboolean failed)
+{
+	struct fuzzy_slave_connection *conn = m->conn;
 
-		if (io_cmd->is_shingle) {
-			len = sizeof (guint32) +
-					sizeof (struct rspamd_fuzzy_shingle_cmd);
-		}
-		else {
-			len = sizeof (guint32) +
-					sizeof (struct rspamd_fuzzy_cmd);
+	m->conn = NULL;
+	m->in_flight = FALSE;
+
+	if (conn) {
+		if (failed) {
+			rspamd_upstream_fail (conn->up);
 		}
 
-		p = (const char *)io_cmd;
-		len = GUINT32_TO_LE (len);
-		reply = rspamd_fstring_append (reply, (const char *)&len, sizeof (len));
-		reply = rspamd_fstring_append (reply, p, len);
+		fuzzy_mirror_close_connection (conn);
 	}
-
-	/* Last chunk */
-	len = 0;
-	reply = rspamd_fstring_append (reply, (const char *)&len, sizeof (len));
-	rspamd_http_message_set_body_from_fstring_steal (msg, reply);
-	double_to_tv (ctx->sync_timeout, &tv);
-	rspamd_http_connection_write_message (conn->http_conn,
-			msg, NULL, NULL, conn,
-			conn->sock,
-			&tv, ctx->ev_base);
-	msg_info ("send update request to %s", m->name);
 }
 
 static void
-fuzzy_mirror_updates_to_http (struct rspamd_fuzzy_mirror *m,
-		struct fuzzy_slave_connection *conn,
-		struct rspamd_fuzzy_storage_ctx *ctx,
-		struct rspamd_http_message *msg)
+fuzzy_mirror_fail (struct rspamd_fuzzy_mirror *m)
 {
+	fuzzy_mirror_detach (m, TRUE);
 
-	struct rspamd_fuzzy_updates_cbdata *cbdata;
-
-	cbdata = g_slice_alloc (sizeof (*cbdata));
-	cbdata->ctx = ctx;
-	cbdata->msg = msg;
-	cbdata->conn = conn;
-	cbdata->m = m;
-	rspamd_fuzzy_backend_version (ctx->backend, local_db_name,
-			fuzzy_mirror_updates_version_cb, cbdata);
+	if (!m->stopped) {
+		/* Journal is still here, so we can resume from the last acked revision */
+		fuzzy_mirror_retry (m);
+	}
 }
 
 static void
 fuzzy_mirror_error_handler (struct rspamd_http_connection *conn, GError *err)
 {
 	struct fuzzy_slave_connection *bk_conn = conn->ud;
+	struct rspamd_fuzzy_mirror *m = bk_conn->mirror;
+
 	msg_info ("abnormally closing connection from backend: %s:%s, "
 			"error: %e",
-			bk_conn->mirror->name,
+			m->name,
 			rspamd_inet_address_to_string (rspamd_upstream_addr (bk_conn->up)),
 			err);
 
-	fuzzy_mirror_close_connection (bk_conn);
+	fuzzy_mirror_fail (m);
 }
 
 static gint
@@ -412,19 +680,79 @@ fuzzy_mirror_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
 {
 	struct fuzzy_slave_connection *bk_conn = conn->ud;
+	struct rspamd_fuzzy_mirror *m = bk_conn->mirror;
+	const rspamd_ftok_t *hdr;
+	gulong slave_rev;
 
-	msg_info ("finished mirror connection to %s", bk_conn->mirror->name);
-	fuzzy_mirror_close_connection (bk_conn);
+	hdr = rspamd_http_message_find_header (msg, "Revision");
+
+	if (hdr == NULL || !rspamd_strtoul (hdr->begin, hdr->len, &slave_rev)) {
+		hdr = NULL;
+	}
+
+	if (msg->code == 409) {
+		/*
+		 * Slave has another revision than we have assumed (e.g. it has been
+		 * restored from backup), so we resume from its revision. If it does
+		 * not help, we stop replication to this mirror as retries won't
+		 * change anything
+		 */
+		if (hdr && slave_rev != m->acked_rev) {
+			msg_warn ("mirror %s has a revision gap: its revision is %ud, "
+					"resume from it", m->name, (guint32)slave_rev);
+			m->acked_rev = slave_rev;
+			/* Slave closes connection after errors */
+			fuzzy_mirror_detach (m, FALSE);
+			fuzzy_mirror_schedule_flush (m, 0.0);
+		}
+		else {
+			msg_err ("mirror %s has a revision gap that cannot be replayed: "
+					"its revision is %ud, stop replication to it, "
+					"cold sync is required", m->name,
+					hdr ? (guint32)slave_rev : m->acked_rev);
+			m->stopped = TRUE;
+			fuzzy_mirror_fail (m);
+		}
+
+		return 0;
+	}
+	else if (msg->code != 200) {
+		if (hdr) {
+			/* Resume from the revision the slave has actually committed */
+			m->acked_rev = slave_rev;
+		}
+
+		msg_err ("mirror %s refused update: %d, its revision is %ud",
+				m->name, msg->code, m->acked_rev);
+		fuzzy_mirror_fail (m);
+
+		return 0;
+	}
+
+	m->acked_rev = m->sent_rev;
+	m->backoff = 0;
+
+	if (hdr) {
+		/* Slave might already have some of our updates */
+		if (slave_rev > m->acked_rev) {
+			m->acked_rev = slave_rev;
+		}
+	}
+
+	msg_debug ("mirror %s acked revision %ud", m->name, m->acked_rev);
+	rspamd_upstream_ok (bk_conn->up);
+	m->in_flight = FALSE;
+	/* Connection is kept open for the next chunks */
+	fuzzy_mirror_schedule_flush (m, 0.0);
 
 	return 0;
 }
 
-static void
-rspamd_fuzzy_send_update_mirror (struct rspamd_fuzzy_storage_ctx *ctx,
+static struct fuzzy_slave_connection *
+fuzzy_mirror_connect (struct rspamd_fuzzy_storage_ctx *ctx,
 		struct rspamd_fuzzy_mirror *m)
 {
 	struct fuzzy_slave_connection *conn;
-	struct rspamd_http_message *msg;
 
 	conn = g_slice_alloc0 (sizeof (*conn));
 	conn->up = rspamd_upstream_get (m->u,
@@ -432,8 +760,9 @@ rspamd_fuzzy_send_update_mirror (struct rspamd_fuzzy_storage_ctx *ctx,
 	conn->mirror = m;
 
 	if (conn->up == NULL) {
+		g_slice_free1 (sizeof (*conn), conn);
 		msg_err ("cannot select upstream for %s", m->name);
-		return;
+		return NULL;
 	}
 
 	conn->sock = rspamd_inet_address_connect (
@@ -443,12 +772,10 @@ rspamd_fuzzy_send_update_mirror (struct rspamd_fuzzy_storage_ctx *ctx,
 	if (conn->sock == -1) {
 		msg_err ("cannot connect upstream for %s", m->name);
 		rspamd_upstream_fail (conn->up);
-		return;
+		g_slice_free1 (sizeof (*conn), conn);
+		return NULL;
 	}
 
-	msg = rspamd_http_new_message (HTTP_REQUEST);
-	rspamd_printf_fstring (&msg->url, "/update_v1/%s", m->name);
-
 	conn->http_conn = rspamd_http_connection_new (NULL,
 			fuzzy_mirror_error_handler,
 			fuzzy_mirror_finish_handler,
@@ -459,13 +786,204 @@ rspamd_fuzzy_send_update_mirror (struct rspamd_fuzzy_storage_ctx *ctx,
 
 	rspamd_http_connection_set_key (conn->http_conn,
 			ctx->sync_keypair);
+
+	return conn;
+}
+
+/*
+ * Sends the next chunk of the journal that has not been acked by a mirror.
+ *
+ * Message format:
+ * <uint32_le> - revision
+ * <uint32_le> - size of the next element
+ * <data> - command data
+ * ...
+ * <0> - end of revision
+ * ... - next revisions
+ */
+static void
+rspamd_fuzzy_mirror_flush (struct rspamd_fuzzy_mirror *m)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = m->ctx;
+	struct fuzzy_mirror_batch *batch;
+	struct rspamd_http_message *msg;
+	rspamd_fstring_t *reply;
+	GList *cur, *first = NULL;
+	guint32 rev32, len, nrevs = 0;
+	gsize total = 0;
+	struct timeval tv;
+	gchar revbuf[32];
+
+	if (m->in_flight || m->stopped || ctx->mirror_journal == NULL) {
+		/* Backpressure: wait for the slave to ack the previous chunk */
+		return;
+	}
+
+	for (cur = ctx->mirror_journal->head; cur != NULL; cur = g_list_next (cur)) {
+		batch = cur->data;
+
+		if (batch->rev > m->acked_rev) {
+			first = cur;
+			break;
+		}
+	}
+
+	if (first == NULL) {
+		return;
+	}
+
+	batch = first->data;
+
+	if (m->acked_rev != 0 && batch->rev > m->acked_rev + 1) {
+		msg_warn ("mirror %s is lagging behind the journal: acked revision "
+				"%ud, oldest journal revision %ud, revisions in between are "
+				"lost for it", m->name, m->acked_rev, batch->rev);
+	}
+
+	for (cur = first; cur != NULL; cur = g_list_next (cur)) {
+		batch = cur->data;
+
+		if (nrevs > 0 && total + batch->data->len > ctx->mirror_chunk) {
+			break;
+		}
+
+		total += batch->data->len + sizeof (guint32) * 2;
+		nrevs ++;
+	}
+
+	if (m->conn == NULL) {
+		m->conn = fuzzy_mirror_connect (ctx, m);
+
+		if (m->conn == NULL) {
+			fuzzy_mirror_retry (m);
+			return;
+		}
+	}
+
+	reply = rspamd_fstring_sized_new (total);
+
+	for (cur = first; cur != NULL && nrevs > 0; cur = g_list_next (cur), nrevs --) {
+		batch = cur->data;
+		rev32 = GUINT32_TO_LE (batch->rev);
+		reply = rspamd_fstring_append (reply, (const char *)&rev32,
+				sizeof (rev32));
+		reply = rspamd_fstring_append (reply, batch->data->str,
+				batch->data->len);
+		/* End of revision */
+		len = 0;
+		reply = rspamd_fstring_append (reply, (const char *)&len, sizeof (len));
+		m->sent_rev = batch->rev;
+	}
+
+	msg = rspamd_http_new_message (HTTP_REQUEST);
+	rspamd_printf_fstring (&msg->url, "/update_v2/%s", m->name);
 	msg->peer_key = rspamd_pubkey_ref (m->key);
-	fuzzy_mirror_updates_to_http (m, conn, ctx, msg);
+	rspamd_http_message_set_body_from_fstring_steal (msg, reply);
+	/* Slave applies revisions older than the journal with a gap */
+	rspamd_snprintf (revbuf, sizeof (revbuf), "%ud",
+			fuzzy_mirror_journal_base (ctx));
+	rspamd_http_message_add_header (msg, "Journal-Base", revbuf);
+	double_to_tv (ctx->sync_timeout, &tv);
+	rspamd_http_connection_reset (m->conn->http_conn);
+	m->in_flight = TRUE;
+	rspamd_http_connection_write_message (m->conn->http_conn,
+			msg, NULL, NULL, m->conn,
+			m->conn->sock,
+			&tv, ctx->ev_base);
+	msg_info ("send update request to %s, revisions up to %ud",
+			m->name, m->sent_rev);
+}
+
+struct rspamd_fuzzy_journal_cbdata {
+	struct rspamd_fuzzy_storage_ctx *ctx;
+	struct fuzzy_mirror_batch *batch;
+};
+
+static void
+fuzzy_mirror_journal_version_cb (guint64 rev64, void *ud)
+{
+	struct rspamd_fuzzy_journal_cbdata *cbdata = ud;
+	struct rspamd_fuzzy_storage_ctx *ctx = cbdata->ctx;
+	struct fuzzy_mirror_batch *batch = cbdata->batch, *tail;
+	struct rspamd_fuzzy_mirror *m;
+	guint i;
+
+	g_slice_free1 (sizeof (*cbdata), cbdata);
+	batch->rev = rev64;
+	tail = g_queue_peek_tail (ctx->mirror_journal);
+
+	if (tail && tail->rev >= batch->rev) {
+		msg_err ("cannot add revision %ud to the journal, as the last "
+				"revision is %ud", batch->rev, tail->rev);
+		fuzzy_mirror_batch_free (batch);
+
+		return;
+	}
+
+	g_queue_push_tail (ctx->mirror_journal, batch);
+	ctx->mirror_journal_size += batch->data->len;
+
+	/* Drop the oldest revisions, lagging slaves would require cold sync */
+	while (ctx->mirror_journal_size > ctx->mirror_backlog &&
+			g_queue_get_length (ctx->mirror_journal) > 1) {
+		tail = g_queue_pop_head (ctx->mirror_journal);
+		ctx->mirror_journal_size -= tail->data->len;
+		fuzzy_mirror_batch_free (tail);
+	}
+
+	for (i = 0; i < ctx->mirrors->len; i ++) {
+		m = g_ptr_array_index (ctx->mirrors, i);
+		rspamd_fuzzy_mirror_flush (m);
+	}
+}
+
+/*
+ * Stores pending updates in the replication journal, they are sent
+ * to mirrors once the revision of the transaction is known
+ */
+static void
+rspamd_fuzzy_mirror_journal_append (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	struct rspamd_fuzzy_journal_cbdata *cbdata;
+	struct fuzzy_mirror_batch *batch;
+	struct fuzzy_peer_cmd *io_cmd;
+	GList *cur;
+	guint32 len;
+
+	batch = g_slice_alloc0 (sizeof (*batch));
+	batch->data = rspamd_fstring_new ();
+
+	for (cur = ctx->updates_pending->head; cur != NULL; cur = g_list_next (cur)) {
+		io_cmd = cur->data;
+
+		if (io_cmd->is_shingle) {
+			len = sizeof (guint32) +
+					sizeof (struct rspamd_fuzzy_shingle_cmd);
+		}
+		else {
+			len = sizeof (guint32) +
+					sizeof (struct rspamd_fuzzy_cmd);
+		}
+
+		len = GUINT32_TO_LE (len);
+		batch->data = rspamd_fstring_append (batch->data, (const char *)&len,
+				sizeof (len));
+		batch->data = rspamd_fstring_append (batch->data,
+				(const char *)io_cmd, GUINT32_FROM_LE (len));
+	}
+
+	cbdata = g_slice_alloc (sizeof (*cbdata));
+	cbdata->ctx = ctx;
+	cbdata->batch = batch;
+	rspamd_fuzzy_backend_version (ctx->backend, local_db_name,
+			fuzzy_mirror_journal_version_cb, cbdata);
 }
 
 struct rspamd_updates_cbdata {
 	struct rspamd_fuzzy_storage_ctx *ctx;
 	gchar *source;
+	void (*fin) (gboolean success, gpointer ud);
+	gpointer fin_ud;
 };
 
 static void
@@ -498,8 +1016,6 @@ static void
 rspamd_fuzzy_updates_cb (gboolean success, void *ud)
 {
 	struct rspamd_updates_cbdata *cbdata = ud;
-	struct rspamd_fuzzy_mirror *m;
-	guint i;
 	struct rspamd_fuzzy_storage_ctx *ctx;
 	const gchar *source;
 	GList *cur;
@@ -508,15 +1024,17 @@ rspamd_fuzzy_updates_cb (gboolean success, void *ud)
 	ctx = cbdata->ctx;
 	source = cbdata->source;
 
+	if (ctx->hot_cache_gen) {
+		/* Drop replies cached by all workers before this transaction */
+		g_atomic_int_inc (ctx->hot_cache_gen);
+	}
+
 	if (success) {
 		rspamd_fuzzy_backend_count (ctx->backend, fuzzy_count_callback, ctx);
 
-		if (g_queue_get_length (ctx->updates_pending) > 0) {
-			for (i = 0; i < ctx->mirrors->len; i ++) {
-				m = g_ptr_array_index (ctx->mirrors, i);
-
-				rspamd_fuzzy_send_update_mirror (ctx, m);
-			}
+		if (ctx->mirrors->len > 0 &&
+				g_queue_get_length (ctx->updates_pending) > 0) {
+			rspamd_fuzzy_mirror_journal_append (ctx);
 		}
 
 		/* Clear updates */
@@ -568,25 +1086,48 @@ rspamd_fuzzy_updates_cb (gboolean success, void *ud)
 		event_base_loopexit (ctx->ev_base, &tv);
 	}
 
+	if (cbdata->fin) {
+		cbdata->fin (success, cbdata->fin_ud);
+	}
+
 	g_free (cbdata->source);
 	g_slice_free1 (sizeof (*cbdata), cbdata);
 }
 
-static void
+static gboolean
 rspamd_fuzzy_process_updates_queue (struct rspamd_fuzzy_storage_ctx *ctx,
-		const gchar *source, gboolean forced)
+		const gchar *source, guint64 rev, gboolean forced,
+		void (*fin) (gboolean success, gpointer ud), gpointer fin_ud)
 {
 
 	struct rspamd_updates_cbdata *cbdata;
+	struct fuzzy_peer_cmd *io_cmd;
+	GList *cur;
 
 	if (ctx->updates_pending &&
 			(forced || g_queue_get_length (ctx->updates_pending) > 0)) {
+		if (ctx->hot_cache) {
+			for (cur = ctx->updates_pending->head; cur != NULL;
+					cur = g_list_next (cur)) {
+				io_cmd = cur->data;
+				fuzzy_hot_cache_invalidate (ctx->hot_cache,
+						io_cmd->is_shingle ?
+						&io_cmd->cmd.shingle.basic : &io_cmd->cmd.normal);
+			}
+		}
+
 		cbdata = g_slice_alloc (sizeof (*cbdata));
 		cbdata->ctx = ctx;
 		cbdata->source = g_strdup (source);
+		cbdata->fin = fin;
+		cbdata->fin_ud = fin_ud;
 		rspamd_fuzzy_backend_process_updates (ctx->backend, ctx->updates_pending,
-				source, rspamd_fuzzy_updates_cb, cbdata);
+				source, rev, rspamd_fuzzy_updates_cb, cbdata);
+
+		return TRUE;
 	}
+
+	return FALSE;
 }
 
 static void
@@ -773,6 +1314,13 @@ rspamd_fuzzy_check_callback (struct rspamd_fuzzy_reply *result, void *ud)
 		break;
 	}
 
+	if (session->ctx->hot_cache && cmd) {
+		fuzzy_hot_cache_insert (session->ctx->hot_cache, cmd, is_shingle,
+				result, rspamd_get_calendar_ticks () +
+				(result->prob > 0.5 ? session->ctx->hot_cache_ttl :
+						session->ctx->hot_cache_negative_ttl));
+	}
+
 	rspamd_fuzzy_make_reply (cmd, result, session, encrypted, is_shingle);
 	REF_RELEASE (session);
 }
@@ -786,6 +1334,7 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 	struct fuzzy_peer_cmd *up_cmd;
 	struct fuzzy_peer_request *up_req;
 	struct fuzzy_key_stat *ip_stat = NULL;
+	const struct rspamd_fuzzy_reply *cached;
 	gchar hexbuf[rspamd_cryptobox_HASHBYTES * 2 + 1];
 	rspamd_inet_addr_t *naddr;
 	gpointer ptr;
@@ -852,6 +1401,13 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 			result.flag = 0;
 			rspamd_fuzzy_make_reply (cmd, &result, session, encrypted, is_shingle);
 		}
+		else if (session->ctx->hot_cache &&
+				(cached = fuzzy_hot_cache_lookup (session->ctx->hot_cache,
+						cmd, is_shingle, rspamd_get_calendar_ticks ())) != NULL) {
+			memcpy (&result, cached, sizeof (result));
+			session->ctx->stat.cache_hits ++;
+			rspamd_fuzzy_make_reply (cmd, &result, session, encrypted, is_shingle);
+		}
 		else {
 			REF_RETAIN (session);
 			rspamd_fuzzy_backend_check (session->ctx->backend, cmd,
@@ -880,7 +1436,7 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 					hexbuf, sizeof (hexbuf) - 1);
 				hexbuf[sizeof (hexbuf) - 1] = '\0';
 
-				if (g_hash_table_lookup (session->ctx->skip_hashes, hexbuf)) {
+				if (rspamd_match_hash_map (session->ctx->skip_hashes, hexbuf)) {
 					result.value = 401;
 					result.prob = 0.0;
 
@@ -888,6 +1444,9 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 				}
 			}
 
+			/* Do not reply from cache for this digest in this worker */
+			fuzzy_hot_cache_invalidate (session->ctx->hot_cache, cmd);
+
 			if (session->worker->index == 0 || session->ctx->peer_fd == -1) {
 				/* Just add to the queue */
 				up_cmd = g_slice_alloc0 (sizeof (*up_cmd));
@@ -1104,21 +1663,33 @@ rspamd_fuzzy_cmd_from_wire (guchar *buf, guint buflen, struct fuzzy_session *s)
 }
 
 static void
-rspamd_fuzzy_mirror_process_update (struct fuzzy_master_update_session *session,
-		struct rspamd_http_message *msg, guint our_rev)
+rspamd_fuzzy_master_update_free (struct fuzzy_master_update *up)
+{
+	GList *cur;
+
+	for (cur = up->cmds; cur != NULL; cur = g_list_next (cur)) {
+		g_slice_free1 (sizeof (struct fuzzy_peer_cmd), cur->data);
+	}
+
+	g_list_free (up->cmds);
+	g_slice_free1 (sizeof (*up), up);
+}
+
+static gboolean
+rspamd_fuzzy_mirror_parse_update (struct fuzzy_master_update_session *session,
+		struct rspamd_http_message *msg)
 {
 	const guchar *p;
 	gsize remain;
-	gint32 revision;
-	guint32 len = 0, cnt = 0;
+	guint32 len = 0, revision;
 	struct fuzzy_peer_cmd cmd, *pcmd;
+	struct fuzzy_master_update *up = NULL;
 	enum {
-		read_len = 0,
+		read_rev = 0,
+		read_len,
 		read_data,
 		finish_processing
-	} state = read_len;
-	GList *updates = NULL, *cur;
-	gpointer flag_ptr;
+	} state = read_rev;
 
 	/*
 	 * Message format:
@@ -1127,37 +1698,31 @@ rspamd_fuzzy_mirror_process_update (struct fuzzy_master_update_session *session,
 	 * <data> - command data
 	 * ...
 	 * <0> - end of data
-	 * ... - ignored
+	 * ... - next revisions for update_v2, ignored for update_v1
 	 */
 	p = rspamd_http_message_get_body (msg, &remain);
 
-	if (p && remain >= sizeof (gint32) * 2) {
-		memcpy (&revision, p, sizeof (gint32));
-		revision = GINT32_TO_LE (revision);
-
-		if (revision <= our_rev) {
-			msg_err_fuzzy_update ("remote revision: %d is older than ours: %d, "
-					"refusing update",
-					revision, our_rev);
-
-			return;
-		}
-		else if (revision - our_rev > 1) {
-			msg_warn_fuzzy_update ("remote revision: %d is newer more than one revision "
-					"than ours: %d, cold sync is recommended",
-								revision, our_rev);
-		}
-
-		remain -= sizeof (gint32);
-		p += sizeof (gint32);
-	}
-	else {
+	if (p == NULL || remain < sizeof (guint32) * 2) {
 		msg_err_fuzzy_update ("short update message, not processing");
-		goto err;
+		return FALSE;
 	}
 
 	while (remain > 0) {
 		switch (state) {
+		case read_rev:
+			if (remain < sizeof (guint32) * 2) {
+				msg_err_fuzzy_update ("short update message while reading "
+						"revision, not processing");
+				goto err;
+			}
+
+			memcpy (&revision, p, sizeof (guint32));
+			up = g_slice_alloc0 (sizeof (*up));
+			up->rev = GUINT32_FROM_LE (revision);
+			remain -= sizeof (guint32);
+			p += sizeof (guint32);
+			state = read_len;
+			break;
 		case read_len:
 			if (remain < sizeof (guint32)) {
 				msg_err_fuzzy_update ("short update message while reading "
@@ -1171,8 +1736,11 @@ rspamd_fuzzy_mirror_process_update (struct fuzzy_master_update_session *session,
 			p += sizeof (guint32);
 
 			if (len == 0) {
-				remain = 0;
-				state = finish_processing;
+				/* Commands are applied in the order of the master */
+				up->cmds = g_list_reverse (up->cmds);
+				g_queue_push_tail (session->updates, up);
+				up = NULL;
+				state = session->multi ? read_rev : finish_processing;
 			}
 			else {
 				state = read_data;
@@ -1183,7 +1751,7 @@ rspamd_fuzzy_mirror_process_update (struct fuzzy_master_update_session *session,
 				msg_err_fuzzy_update ("short update message while reading data, "
 						"not processing"
 						" (%zd is available, %d is required)", remain, len);
-				return;
+				goto err;
 			}
 
 			if (len < sizeof (struct rspamd_fuzzy_cmd) + sizeof (guint32) ||
@@ -1206,13 +1774,13 @@ rspamd_fuzzy_mirror_process_update (struct fuzzy_master_update_session *session,
 
 			pcmd = g_slice_alloc (sizeof (cmd));
 			memcpy (pcmd, &cmd, len);
-			updates = g_list_prepend (updates, pcmd);
+			up->cmds = g_list_prepend (up->cmds, pcmd);
+			up->ncmds ++;
 
 			p += len;
 			remain -= len;
 			len = 0;
 			state = read_len;
-			cnt ++;
 			break;
 		case finish_processing:
 			/* Do nothing */
@@ -1221,49 +1789,182 @@ rspamd_fuzzy_mirror_process_update (struct fuzzy_master_update_session *session,
 		}
 	}
 
-	/* Insert elements to the updates from head */
-	for (cur = updates; cur != NULL; cur = g_list_next (cur)) {
-		pcmd = cur->data;
+	if (up != NULL || g_queue_get_length (session->updates) == 0) {
+		msg_err_fuzzy_update ("unterminated update message, not processing");
+		goto err;
+	}
+
+	return TRUE;
+
+err:
+	if (up) {
+		rspamd_fuzzy_master_update_free (up);
+	}
+
+	while ((up = g_queue_pop_head (session->updates)) != NULL) {
+		rspamd_fuzzy_master_update_free (up);
+	}
+
+	return FALSE;
+}
+
+static void rspamd_fuzzy_mirror_apply_updates (
+		struct fuzzy_master_update_session *session);
+static void rspamd_fuzzy_mirror_session_destroy (
+		struct fuzzy_master_update_session *session);
+static void rspamd_fuzzy_mirror_send_reply (
+		struct fuzzy_master_update_session *session,
+		guint code, const gchar *str);
+
+static void
+rspamd_fuzzy_mirror_update_fin (gboolean success, gpointer ud)
+{
+	struct fuzzy_master_update_session *session = ud;
+
+	session->processing = FALSE;
+
+	if (success) {
+		/* Version of the source is set to the revision of the master */
+		session->db_rev = session->cur_rev;
+	}
+	else {
+		/* Master should resend this revision and all the following ones */
+		session->failed = TRUE;
+	}
+
+	if (session->applying) {
+		/* Synchronous backend, updates loop continues */
+		return;
+	}
+
+	if (session->terminated) {
+		rspamd_fuzzy_mirror_session_destroy (session);
+	}
+	else {
+		rspamd_fuzzy_mirror_apply_updates (session);
+	}
+}
+
+static void
+rspamd_fuzzy_mirror_drop_updates (struct fuzzy_master_update_session *session)
+{
+	struct fuzzy_master_update *up;
+
+	while ((up = g_queue_pop_head (session->updates)) != NULL) {
+		rspamd_fuzzy_master_update_free (up);
+	}
+}
+
+/*
+ * Applies received revisions one by one, so every revision of the master
+ * results in a single transaction (and version bump) in the local backend.
+ * Processing stops on the first failed transaction or on a gap in revisions,
+ * the reply carries the local revision so the master could resume from it
+ */
+static void
+rspamd_fuzzy_mirror_apply_updates (struct fuzzy_master_update_session *session)
+{
+	struct fuzzy_master_update *up;
+	struct fuzzy_peer_cmd *pcmd;
+	GList *cur;
+	gpointer flag_ptr;
+
+	if (session->failed) {
+		msg_err_fuzzy_update ("cannot apply revision %d from the master %s, "
+				"local revision: %d",
+				session->cur_rev,
+				rspamd_inet_address_to_string (session->addr),
+				session->db_rev);
+		rspamd_fuzzy_mirror_drop_updates (session);
+		rspamd_fuzzy_mirror_send_reply (session, 500, "Update failed");
+
+		return;
+	}
+
+	while ((up = g_queue_pop_head (session->updates)) != NULL) {
+		if (up->rev <= session->cur_rev) {
+			/* Already applied, e.g. when master resumes replication */
+			msg_debug_fuzzy_update ("remote revision: %d is not newer than "
+					"ours: %d, skip it", up->rev, session->cur_rev);
+			rspamd_fuzzy_master_update_free (up);
+			continue;
+		}
+		else if (up->rev - session->cur_rev > 1) {
+			if (session->multi && up->rev > session->journal_base + 1) {
+				/* Master still has the missing revisions, ask it to resend */
+				msg_err_fuzzy_update ("remote revision: %d is newer more than "
+						"one revision than ours: %d, master can resend "
+						"revisions since %d",
+						up->rev, session->cur_rev, session->journal_base + 1);
+				rspamd_fuzzy_master_update_free (up);
+				rspamd_fuzzy_mirror_drop_updates (session);
+				rspamd_fuzzy_mirror_send_reply (session, 409, "Revision gap");
 
-		if (pcmd->is_shingle) {
-			if ((flag_ptr = g_hash_table_lookup (session->ctx->master_flags,
-					GUINT_TO_POINTER (pcmd->cmd.shingle.basic.flag))) != NULL) {
-				pcmd->cmd.shingle.basic.flag = GPOINTER_TO_UINT (flag_ptr);
+				return;
 			}
+
+			/* Missing revisions are lost, e.g. master has been restarted */
+			msg_warn_fuzzy_update ("remote revision: %d is newer more than one "
+					"revision than ours: %d, apply it with a gap",
+					up->rev, session->cur_rev);
 		}
-		else {
-			if ((flag_ptr = g_hash_table_lookup (session->ctx->master_flags,
-					GUINT_TO_POINTER (pcmd->cmd.normal.flag))) != NULL) {
-				pcmd->cmd.normal.flag = GPOINTER_TO_UINT (flag_ptr);
+
+		/* Insert elements to the updates from head */
+		for (cur = g_list_last (up->cmds); cur != NULL; cur = g_list_previous (cur)) {
+			pcmd = cur->data;
+
+			if (pcmd->is_shingle) {
+				if ((flag_ptr = g_hash_table_lookup (session->ctx->master_flags,
+						GUINT_TO_POINTER (pcmd->cmd.shingle.basic.flag))) != NULL) {
+					pcmd->cmd.shingle.basic.flag = GPOINTER_TO_UINT (flag_ptr);
+				}
+			}
+			else {
+				if ((flag_ptr = g_hash_table_lookup (session->ctx->master_flags,
+						GUINT_TO_POINTER (pcmd->cmd.normal.flag))) != NULL) {
+					pcmd->cmd.normal.flag = GPOINTER_TO_UINT (flag_ptr);
+				}
 			}
+
+			g_queue_push_head (session->ctx->updates_pending, pcmd);
+			cur->data = NULL;
 		}
 
+		g_list_free (up->cmds);
+		up->cmds = NULL;
+		session->cur_rev = up->rev;
+		session->nops += up->ncmds;
+		rspamd_fuzzy_master_update_free (up);
+
+		session->processing = TRUE;
+		session->applying = TRUE;
+		rspamd_fuzzy_process_updates_queue (session->ctx, session->src,
+				session->cur_rev, TRUE,
+				rspamd_fuzzy_mirror_update_fin, session);
+		session->applying = FALSE;
 
-		g_queue_push_head (session->ctx->updates_pending, cur->data);
-		cur->data = NULL;
+		if (session->processing) {
+			/* Continue when backend finishes transaction */
+			return;
+		}
+		else if (session->terminated) {
+			rspamd_fuzzy_mirror_session_destroy (session);
+			return;
+		}
+		else if (session->failed) {
+			rspamd_fuzzy_mirror_apply_updates (session);
+			return;
+		}
 	}
 
-	rspamd_fuzzy_process_updates_queue (session->ctx, session->src, TRUE);
 	msg_info_fuzzy_update ("processed updates from the master %s, "
 			"%ud operations processed,"
 			" revision: %d (local revision: %d)",
 			rspamd_inet_address_to_string (session->addr),
-			cnt, revision, our_rev);
-
-err:
-	if (updates) {
-		/* We still need to clear queue */
-		for (cur = updates; cur != NULL; cur = g_list_next (cur)) {
-			if (cur->data) {
-				g_slice_free1 (sizeof (cmd), cur->data);
-			}
-		}
-
-		g_list_free (updates);
-	}
+			session->nops, session->cur_rev, session->db_rev);
+	rspamd_fuzzy_mirror_send_reply (session, 200, "OK");
 }
 
-
 static void
 fuzzy_session_destroy (gpointer d)
 {
@@ -1278,7 +1979,20 @@ fuzzy_session_destroy (gpointer d)
 static void
 rspamd_fuzzy_mirror_session_destroy (struct fuzzy_master_update_session *session)
 {
+	struct fuzzy_master_update *up;
+
 	if (session) {
+		if (session->processing) {
+			/* Wait for the backend to finish */
+			session->terminated = TRUE;
+			return;
+		}
+
+		while ((up = g_queue_pop_head (session->updates)) != NULL) {
+			rspamd_fuzzy_master_update_free (up);
+		}
+
+		g_queue_free (session->updates);
 		rspamd_http_connection_reset (session->conn);
 		rspamd_http_connection_unref (session->conn);
 		rspamd_inet_address_free (session->addr);
@@ -1307,12 +2021,21 @@ rspamd_fuzzy_mirror_send_reply (struct fuzzy_master_update_session *session,
 		guint code, const gchar *str)
 {
 	struct rspamd_http_message *msg;
+	gchar revbuf[32];
 
 	msg = rspamd_http_new_message (HTTP_RESPONSE);
 	msg->url = rspamd_fstring_new_init (str, strlen (str));
 	msg->code = code;
 	session->replied = TRUE;
 
+	if (code == 200 || code == 409 || code == 500) {
+		/* Allows master to resume replication from our revision */
+		rspamd_snprintf (revbuf, sizeof (revbuf), "%ud", session->db_rev);
+		rspamd_http_message_add_header (msg, "Revision", revbuf);
+	}
+
+	session->keepalive = code == 200 && session->multi;
+
 	rspamd_http_connection_reset (session->conn);
 	rspamd_http_connection_write_message (session->conn, msg, NULL, "text/plain",
 			session, session->sock, &session->ctx->master_io_tv,
@@ -1324,8 +2047,17 @@ rspamd_fuzzy_update_version_callback (guint64 version, void *ud)
 {
 	struct fuzzy_master_update_session *session = ud;
 
-	rspamd_fuzzy_mirror_process_update (session, session->msg, version);
-	rspamd_fuzzy_mirror_send_reply (session, 200, "OK");
+	session->cur_rev = version;
+	session->db_rev = version;
+	session->nops = 0;
+	session->failed = FALSE;
+
+	if (!rspamd_fuzzy_mirror_parse_update (session, session->msg)) {
+		rspamd_fuzzy_mirror_send_reply (session, 400, "Bad update");
+		return;
+	}
+
+	rspamd_fuzzy_mirror_apply_updates (session);
 }
 
 static gint
@@ -1334,13 +2066,35 @@ rspamd_fuzzy_mirror_finish_handler (struct rspamd_http_connection *conn,
 {
 	struct fuzzy_master_update_session *session = conn->ud;
 	const struct rspamd_cryptobox_pubkey *rk;
+	const rspamd_ftok_t *hdr;
 	const gchar *err_str = NULL;
 	gchar *psrc;
 	const gchar *src = NULL;
 	gsize remain;
+	gulong base;
 
 	if (session->replied) {
-		rspamd_fuzzy_mirror_session_destroy (session);
+		if (session->keepalive) {
+			/* Wait for the next chunk from the master */
+			if (session->psrc) {
+				g_free (session->psrc);
+				session->psrc = NULL;
+			}
+
+			session->src = NULL;
+			session->msg = NULL;
+			session->replied = FALSE;
+			session->keepalive = FALSE;
+			rspamd_http_connection_reset (conn);
+			rspamd_http_connection_read_message (conn,
+					session,
+					session->sock,
+					&session->ctx->master_io_tv,
+					session->ctx->ev_base);
+		}
+		else {
+			rspamd_fuzzy_mirror_session_destroy (session);
+		}
 
 		return 0;
 	}
@@ -1377,6 +2131,17 @@ rspamd_fuzzy_mirror_finish_handler (struct rspamd_http_connection *conn,
 			goto end;
 		}
 
+		/* update_v2 messages can contain many revisions */
+		session->multi = msg->url->len > sizeof ("/update_v2/") - 1 &&
+				memcmp (msg->url->str, "/update_v2/",
+						sizeof ("/update_v2/") - 1) == 0;
+		session->journal_base = 0;
+		hdr = rspamd_http_message_find_header (msg, "Journal-Base");
+
+		if (hdr && rspamd_strtoul (hdr->begin, hdr->len, &base)) {
+			session->journal_base = base;
+		}
+
 		/* Detect source from url: /update_v1/<source>, so we look for the last '/' */
 		remain = msg->url->len;
 		psrc = rspamd_fstringdup (msg->url);
@@ -1769,6 +2534,7 @@ accept_fuzzy_mirror_socket (gint fd, short what, void *arg)
 	session->conn = http_conn;
 	session->addr = addr;
 	session->sock = nfd;
+	session->updates = g_queue_new ();
 
 	rspamd_http_connection_read_message (http_conn,
 			session,
@@ -1860,7 +2626,8 @@ rspamd_fuzzy_storage_periodic_callback (void *ud)
 	struct rspamd_fuzzy_storage_ctx *ctx = ud;
 
 	if (g_queue_get_length (ctx->updates_pending) > 0) {
-		rspamd_fuzzy_process_updates_queue (ctx, local_db_name, FALSE);
+		rspamd_fuzzy_process_updates_queue (ctx, local_db_name, 0, FALSE,
+				NULL, NULL);
 
 		return TRUE;
 	}
@@ -1881,7 +2648,8 @@ rspamd_fuzzy_storage_sync (struct rspamd_main *rspamd_main,
 	rep.reply.fuzzy_sync.status = 0;
 
 	if (ctx->backend && worker->index == 0) {
-		rspamd_fuzzy_process_updates_queue (ctx, local_db_name, FALSE);
+		rspamd_fuzzy_process_updates_queue (ctx, local_db_name, 0, FALSE,
+				NULL, NULL);
 		rspamd_fuzzy_backend_start_update (ctx->backend, ctx->sync_timeout,
 				rspamd_fuzzy_storage_periodic_callback, ctx);
 	}
@@ -1912,6 +2680,10 @@ rspamd_fuzzy_storage_reload (struct rspamd_main *rspamd_main,
 		rspamd_fuzzy_backend_close (ctx->backend);
 	}
 
+	if (ctx->hot_cache) {
+		fuzzy_hot_cache_clear (ctx->hot_cache);
+	}
+
 	memset (&rep, 0, sizeof (rep));
 	rep.type = RSPAMD_CONTROL_RELOAD;
 
@@ -2028,6 +2800,11 @@ rspamd_fuzzy_stat_to_ucl (struct rspamd_fuzzy_storage_ctx *ctx, gboolean ip_stat
 			"invalid_requests",
 			0,
 			false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromint (ctx->stat.cache_hits),
+			"cache_hits",
+			0,
+			false);
 
 	if (ctx->errors_ips && ip_stat) {
 		ip_hash = rspamd_lru_hash_get_htable (ctx->errors_ips);
@@ -2200,6 +2977,7 @@ fuzzy_storage_parse_mirror (rspamd_mempool_t *pool,
 
 	up = g_slice_alloc0 (sizeof (*up));
 	up->name = g_strdup (ucl_object_tostring (elt));
+	up->ctx = ctx;
 
 	elt = ucl_object_lookup (obj, "key");
 	if (elt != NULL) {
@@ -2396,6 +3174,17 @@ init_fuzzy (struct rspamd_config *cfg)
 	ctx->mirrors = g_ptr_array_new ();
 	rspamd_mempool_add_destructor (cfg->cfg_pool,
 			(rspamd_mempool_destruct_t)rspamd_ptr_array_free_hard, ctx->mirrors);
+	ctx->mirror_journal = g_queue_new ();
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+			(rspamd_mempool_destruct_t)fuzzy_mirror_journal_free,
+			ctx->mirror_journal);
+	ctx->hot_cache_size = DEFAULT_HOT_CACHE_SIZE;
+	ctx->hot_cache_gen = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+			sizeof (*ctx->hot_cache_gen));
+	ctx->hot_cache_ttl = DEFAULT_HOT_CACHE_TTL;
+	ctx->hot_cache_negative_ttl = DEFAULT_HOT_CACHE_NEGATIVE_TTL;
+	ctx->mirror_backlog = DEFAULT_MIRROR_BACKLOG;
+	ctx->mirror_chunk = DEFAULT_MIRROR_CHUNK;
 	ctx->updates_maxfail = DEFAULT_UPDATES_MAXFAIL;
 	ctx->collection_id_file = RSPAMD_DBDIR "/fuzzy_collection.id";
 
@@ -2565,6 +3354,54 @@ init_fuzzy (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, updates_maxfail),
 			RSPAMD_CL_FLAG_UINT,
 			"Maximum number of updates to be failed before discarding");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"hot_cache_size",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, hot_cache_size),
+			RSPAMD_CL_FLAG_UINT,
+			"Number of recent check replies cached in each worker (0 to disable), "
+			"default: " G_STRINGIFY (DEFAULT_HOT_CACHE_SIZE));
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"hot_cache_ttl",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, hot_cache_ttl),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Lifetime of cached positive replies (at most "
+			G_STRINGIFY (MAX_HOT_CACHE_TTL) " seconds), default: "
+			G_STRINGIFY (DEFAULT_HOT_CACHE_TTL) " seconds");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"hot_cache_negative_ttl",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+					hot_cache_negative_ttl),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Lifetime of cached negative replies, default: "
+			G_STRINGIFY (DEFAULT_HOT_CACHE_NEGATIVE_TTL) " seconds");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"mirror_backlog",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, mirror_backlog),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Size of recent updates kept in memory to resume replication to "
+			"lagging mirrors, older revisions (e.g. after restart) are lost "
+			"for mirrors that are behind it, default: 64Mb");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"mirror_chunk_size",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, mirror_chunk),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Maximum size of a single update message sent to mirrors, "
+			"default: 1Mb");
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"collection_only",
@@ -2742,6 +3579,20 @@ start_fuzzy (struct rspamd_worker *worker)
 
 		rspamd_fuzzy_backend_count (ctx->backend, fuzzy_count_callback, ctx);
 
+		if (ctx->hot_cache_size > 0) {
+			if (ctx->hot_cache_ttl > MAX_HOT_CACHE_TTL) {
+				msg_warn ("hot cache ttl %.1f is too large, limit it to %.1f",
+						ctx->hot_cache_ttl, MAX_HOT_CACHE_TTL);
+				ctx->hot_cache_ttl = MAX_HOT_CACHE_TTL;
+			}
+
+			if (ctx->hot_cache_negative_ttl > MAX_HOT_CACHE_TTL) {
+				ctx->hot_cache_negative_ttl = MAX_HOT_CACHE_TTL;
+			}
+
+			ctx->hot_cache = fuzzy_hot_cache_new (ctx->hot_cache_size,
+					ctx->hot_cache_gen);
+		}
 
 		if (worker->index == 0) {
 			ctx->updates_pending = g_queue_new ();
@@ -2882,7 +3733,8 @@ start_fuzzy (struct rspamd_worker *worker)
 
 	if (worker->index == 0 && g_queue_get_length (ctx->updates_pending) > 0) {
 		if (!ctx->collection_mode) {
-			rspamd_fuzzy_process_updates_queue (ctx, local_db_name, FALSE);
+			rspamd_fuzzy_process_updates_queue (ctx, local_db_name, 0, FALSE,
+					NULL, NULL);
 			event_base_loop (ctx->ev_base, 0);
 		}
 	}
@@ -2929,6 +3781,7 @@ start_fuzzy (struct rspamd_worker *worker)
 		rspamd_keypair_cache_destroy (ctx->keypair_cache);
 	}
 
+	fuzzy_hot_cache_destroy (ctx->hot_cache);
 	REF_RELEASE (ctx->cfg);
 
 	exit (EXIT_SUCCESS);
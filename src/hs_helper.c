@@ -19,6 +19,7 @@
 #include "libserver/cfg_rcl.h"
 #include "libserver/worker_util.h"
 #include "libserver/rspamd_control.h"
+#include "libutil/map.h"
 #include "unix-std.h"
 
 #ifdef HAVE_GLOB_H
@@ -39,6 +40,9 @@ worker_t hs_helper_worker = {
 
 static const gdouble default_max_time = 1.0;
 static const gdouble default_recompile_time = 60.0;
+static const gdouble default_map_check_time = 1.0;
+/* Temporary files of regexp maps databases left for a day are removed */
+static const time_t default_map_tmp_ttl = 86400;
 static const guint64 rspamd_hs_helper_magic = 0x22d310157a2288a0ULL;
 
 /*
@@ -58,6 +62,10 @@ struct hs_helper_ctx {
 	gdouble max_time;
 	gdouble recompile_time;
 	struct event recompile_timer;
+	/* Regexp maps requests are stored in hs_cache_dir of the config */
+	const gchar *map_dir;
+	gdouble map_check_time;
+	struct event map_timer;
 };
 
 static gpointer
@@ -74,6 +82,7 @@ init_hs_helper (struct rspamd_config *cfg)
 	ctx->hs_dir = NULL;
 	ctx->max_time = default_max_time;
 	ctx->recompile_time = default_recompile_time;
+	ctx->map_check_time = default_map_check_time;
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -99,6 +108,14 @@ init_hs_helper (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct hs_helper_ctx, recompile_time),
 			RSPAMD_CL_FLAG_TIME_FLOAT,
 			"Time between recompilation checks");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"map_check",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct hs_helper_ctx, map_check_time),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Time between checks for regexp maps to compile");
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"timeout",
@@ -111,6 +128,154 @@ init_hs_helper (struct rspamd_config *cfg)
 	return ctx;
 }
 
+/*
+ * Removes files matching pattern in dir that are older than max_age seconds,
+ * used for temporary files left by interrupted writers
+ */
+static gboolean
+rspamd_hs_helper_cleanup_files (const gchar *dir, const gchar *pattern,
+		time_t max_age)
+{
+	glob_t globbuf;
+	struct stat st;
+	gchar path[PATH_MAX];
+	time_t now;
+	guint i;
+	gint rc;
+	gboolean ret = TRUE;
+
+	memset (&globbuf, 0, sizeof (globbuf));
+	rspamd_snprintf (path, sizeof (path), "%s%c%s", dir, G_DIR_SEPARATOR,
+			pattern);
+	now = time (NULL);
+
+	if ((rc = glob (path, 0, NULL, &globbuf)) == 0) {
+		for (i = 0; i < globbuf.gl_pathc; i++) {
+			if (stat (globbuf.gl_pathv[i], &st) == -1 ||
+					st.st_mtime + max_age > now) {
+				continue;
+			}
+
+			if (unlink (globbuf.gl_pathv[i]) == -1) {
+				msg_err ("cannot unlink %s: %s", globbuf.gl_pathv[i],
+						strerror (errno));
+				ret = FALSE;
+			}
+		}
+	}
+	else if (rc != GLOB_NOMATCH) {
+		msg_err ("glob %s failed: %s", path, strerror (errno));
+		ret = FALSE;
+	}
+
+	globfree (&globbuf);
+
+	return ret;
+}
+
+struct rspamd_hs_helper_map_db {
+	gchar *path;
+	time_t mtime;
+};
+
+static void
+rspamd_hs_helper_map_db_free (gpointer p)
+{
+	struct rspamd_hs_helper_map_db *db = p;
+
+	g_free (db->path);
+	g_free (db);
+}
+
+static gboolean
+rspamd_hs_helper_unlink (const gchar *path)
+{
+	if (unlink (path) == -1) {
+		msg_err ("cannot unlink %s: %s", path, strerror (errno));
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Removes databases of regexp maps that are no longer used: databases of
+ * maps that are not defined in the config and all but the latest database
+ * of each map, as a map is changed by replacing its database
+ */
+static gboolean
+rspamd_hs_helper_cleanup_maps (struct hs_helper_ctx *ctx, gboolean forced)
+{
+	struct rspamd_hs_helper_map_db *db;
+	GHashTable *latest;
+	glob_t globbuf;
+	struct stat st;
+	gchar path[PATH_MAX], *tag;
+	const gchar *base, *dash;
+	guint i;
+	gint rc;
+	gboolean ret = TRUE;
+
+	memset (&globbuf, 0, sizeof (globbuf));
+	rspamd_snprintf (path, sizeof (path), "%s%c%s", ctx->map_dir,
+			G_DIR_SEPARATOR, "*.hsmc");
+	latest = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			g_free, rspamd_hs_helper_map_db_free);
+
+	if ((rc = glob (path, 0, NULL, &globbuf)) == 0) {
+		for (i = 0; i < globbuf.gl_pathc; i++) {
+			if (forced || !rspamd_regexp_map_is_valid_hyperscan_file (
+					ctx->cfg, globbuf.gl_pathv[i])) {
+				if (!rspamd_hs_helper_unlink (globbuf.gl_pathv[i])) {
+					ret = FALSE;
+				}
+
+				continue;
+			}
+
+			if (stat (globbuf.gl_pathv[i], &st) == -1) {
+				continue;
+			}
+
+			base = strrchr (globbuf.gl_pathv[i], G_DIR_SEPARATOR);
+			base = base ? base + 1 : globbuf.gl_pathv[i];
+			dash = strchr (base, '-');
+			tag = g_strndup (base, dash - base);
+			db = g_hash_table_lookup (latest, tag);
+
+			if (db == NULL || db->mtime < st.st_mtime) {
+				if (db != NULL && !rspamd_hs_helper_unlink (db->path)) {
+					ret = FALSE;
+				}
+
+				db = g_malloc (sizeof (*db));
+				db->path = g_strdup (globbuf.gl_pathv[i]);
+				db->mtime = st.st_mtime;
+				g_hash_table_replace (latest, tag, db);
+			}
+			else {
+				/* Databases written at the same second are both kept */
+				if (db->mtime > st.st_mtime &&
+						!rspamd_hs_helper_unlink (globbuf.gl_pathv[i])) {
+					ret = FALSE;
+				}
+
+				g_free (tag);
+			}
+		}
+	}
+	else if (rc != GLOB_NOMATCH) {
+		msg_err ("glob %s failed: %s", path, strerror (errno));
+		ret = FALSE;
+	}
+
+	globfree (&globbuf);
+	g_hash_table_unref (latest);
+
+	return ret;
+}
+
 /**
  * Clean
  */
@@ -175,6 +340,21 @@ rspamd_hs_helper_cleanup_dir (struct hs_helper_ctx *ctx, gboolean forced)
 	globfree (&globbuf);
 	g_free (pattern);
 
+	/* Databases of regexp maps */
+	if (!rspamd_hs_helper_cleanup_maps (ctx, forced)) {
+		ret = FALSE;
+	}
+
+	if (!rspamd_hs_helper_cleanup_files (ctx->map_dir, "*.hsmc.tmp",
+			default_map_tmp_ttl)) {
+		ret = FALSE;
+	}
+
+	if (!rspamd_hs_helper_cleanup_files (ctx->map_dir, "*.hsmr.tmp",
+			default_map_tmp_ttl)) {
+		ret = FALSE;
+	}
+
 	return ret;
 }
 
@@ -231,6 +411,63 @@ rspamd_rs_compile (struct hs_helper_ctx *ctx, struct rspamd_worker *worker,
 	return TRUE;
 }
 
+/*
+ * Compiles regexp maps requested by workers, so they could load databases
+ * instead of compiling the same maps in each process
+ */
+static void
+rspamd_hs_helper_compile_maps (struct hs_helper_ctx *ctx,
+		struct rspamd_worker *worker)
+{
+	static struct rspamd_srv_command srv_cmd;
+	glob_t globbuf;
+	gchar pattern[PATH_MAX];
+	GError *err = NULL;
+	guint i, ncompiled = 0;
+	gint rc;
+
+	memset (&globbuf, 0, sizeof (globbuf));
+	rspamd_snprintf (pattern, sizeof (pattern), "%s%c%s", ctx->map_dir,
+			G_DIR_SEPARATOR, "*.hsmr");
+
+	if ((rc = glob (pattern, 0, NULL, &globbuf)) == 0) {
+		for (i = 0; i < globbuf.gl_pathc; i++) {
+			if (rspamd_regexp_map_compile_hyperscan (globbuf.gl_pathv[i],
+					&err)) {
+				msg_info ("compiled regexp map %s", globbuf.gl_pathv[i]);
+				ncompiled ++;
+			}
+			else {
+				msg_err ("failed to compile regexp map: %e", err);
+				g_error_free (err);
+				err = NULL;
+			}
+
+			/* Workers use pcre for maps that cannot be compiled */
+			if (unlink (globbuf.gl_pathv[i]) == -1) {
+				msg_err ("cannot unlink %s: %s", globbuf.gl_pathv[i],
+						strerror (errno));
+			}
+		}
+	}
+	else if (rc != GLOB_NOMATCH) {
+		msg_err ("glob %s failed: %s", pattern, strerror (errno));
+	}
+
+	globfree (&globbuf);
+
+	if (ncompiled > 0) {
+		memset (&srv_cmd, 0, sizeof (srv_cmd));
+		srv_cmd.type = RSPAMD_SRV_HYPERSCAN_LOADED;
+		rspamd_strlcpy (srv_cmd.cmd.hs_loaded.cache_dir, ctx->hs_dir,
+				sizeof (srv_cmd.cmd.hs_loaded.cache_dir));
+		srv_cmd.cmd.hs_loaded.forced = FALSE;
+
+		rspamd_srv_send_command (worker, ctx->ev_base, &srv_cmd, -1,
+				NULL, NULL);
+	}
+}
+
 static gboolean
 rspamd_hs_helper_reload (struct rspamd_main *rspamd_main,
 		struct rspamd_worker *worker, gint fd,
@@ -273,6 +510,20 @@ rspamd_hs_helper_timer (gint fd, short what, gpointer ud)
 	event_add (&ctx->recompile_timer, &tv);
 }
 
+static void
+rspamd_hs_helper_map_timer (gint fd, short what, gpointer ud)
+{
+	struct rspamd_worker *worker = ud;
+	struct hs_helper_ctx *ctx;
+	struct timeval tv;
+
+	ctx = worker->ctx;
+	event_del (&ctx->map_timer);
+	rspamd_hs_helper_compile_maps (ctx, worker);
+	double_to_tv (ctx->map_check_time, &tv);
+	event_add (&ctx->map_timer, &tv);
+}
+
 static void
 start_hs_helper (struct rspamd_worker *worker)
 {
@@ -289,6 +540,13 @@ start_hs_helper (struct rspamd_worker *worker)
 		ctx->hs_dir = RSPAMD_DBDIR "/";
 	}
 
+	if (ctx->cfg->hs_cache_dir) {
+		ctx->map_dir = ctx->cfg->hs_cache_dir;
+	}
+	else {
+		ctx->map_dir = RSPAMD_DBDIR "/";
+	}
+
 	ctx->ev_base = rspamd_prepare_worker (worker,
 			"hs_helper",
 			NULL);
@@ -307,6 +565,12 @@ start_hs_helper (struct rspamd_worker *worker)
 	tim = rspamd_time_jitter (ctx->recompile_time, 0);
 	double_to_tv (tim, &tv);
 	event_add (&ctx->recompile_timer, &tv);
+
+	event_set (&ctx->map_timer, -1, EV_TIMEOUT, rspamd_hs_helper_map_timer,
+			worker);
+	event_base_set (ctx->ev_base, &ctx->map_timer);
+	double_to_tv (ctx->map_check_time, &tv);
+	event_add (&ctx->map_timer, &tv);
 	event_base_loop (ctx->ev_base, 0);
 	rspamd_worker_block_signals ();
 
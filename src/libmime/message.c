@@ -24,7 +24,7 @@
 #include "smtp_parsers.h"
 #include "mime_parser.h"
 #include "mime_encoding.h"
-#include "libserver/mempool_vars_internal.h"
+#include "libutil/mempool_vars_internal.h"
 
 #ifdef WITH_SNOWBALL
 #include "libstemmer.h"
@@ -306,27 +306,27 @@ rspamd_extract_words (struct rspamd_task *task,
 	if (part->normalized_words && part->normalized_words->len) {
 		gdouble *avg_len_p, *short_len_p;
 
-		avg_len_p = rspamd_mempool_get_variable (task->task_pool,
-				RSPAMD_MEMPOOL_AVG_WORDS_LEN);
+		avg_len_p = rspamd_mempool_get_variable_idx (task->task_pool,
+				RSPAMD_MEMPOOL_VAR_AVG_WORDS_LEN);
 
 		if (avg_len_p == NULL) {
 			avg_len_p = rspamd_mempool_alloc (task->task_pool, sizeof (double));
 			*avg_len_p = total_len;
-			rspamd_mempool_set_variable (task->task_pool,
-					RSPAMD_MEMPOOL_AVG_WORDS_LEN, avg_len_p, NULL);
+			rspamd_mempool_set_variable_idx (task->task_pool,
+					RSPAMD_MEMPOOL_VAR_AVG_WORDS_LEN, avg_len_p, NULL);
 		}
 		else {
 			*avg_len_p += total_len;
 		}
 
-		short_len_p = rspamd_mempool_get_variable (task->task_pool,
-				RSPAMD_MEMPOOL_SHORT_WORDS_CNT);
+		short_len_p = rspamd_mempool_get_variable_idx (task->task_pool,
+				RSPAMD_MEMPOOL_VAR_SHORT_WORDS_CNT);
 
 		if (short_len_p == NULL) {
 			short_len_p = rspamd_mempool_alloc (task->task_pool, sizeof (double));
 			*short_len_p = short_len;
-			rspamd_mempool_set_variable (task->task_pool,
-					RSPAMD_MEMPOOL_SHORT_WORDS_CNT, avg_len_p, NULL);
+			rspamd_mempool_set_variable_idx (task->task_pool,
+					RSPAMD_MEMPOOL_VAR_SHORT_WORDS_CNT, avg_len_p, NULL);
 		}
 		else {
 			*short_len_p += short_len;
@@ -1039,8 +1039,8 @@ rspamd_message_parse (struct rspamd_task *task)
 			trecv->real_ip = rspamd_mempool_strdup (task->task_pool,
 					rspamd_inet_address_to_string (task->from_addr));
 			trecv->from_ip = trecv->real_ip;
-			trecv->by_hostname = rspamd_mempool_get_variable (task->task_pool,
-					RSPAMD_MEMPOOL_MTA_NAME);
+			trecv->by_hostname = rspamd_mempool_get_variable_idx (task->task_pool,
+					RSPAMD_MEMPOOL_VAR_MTA_NAME);
 			trecv->addr = rspamd_inet_address_copy (task->from_addr);
 			rspamd_mempool_add_destructor (task->task_pool,
 					(rspamd_mempool_destruct_t)rspamd_inet_address_free,
@@ -1131,8 +1131,8 @@ rspamd_message_parse (struct rspamd_task *task)
 						pdiff = rspamd_mempool_alloc (task->task_pool,
 								sizeof (gdouble));
 						*pdiff = diff;
-						rspamd_mempool_set_variable (task->task_pool,
-								"parts_distance",
+						rspamd_mempool_set_variable_idx (task->task_pool,
+								RSPAMD_MEMPOOL_VAR_PARTS_DISTANCE,
 								pdiff,
 								NULL);
 						ptw = rspamd_mempool_alloc (task->task_pool,
@@ -1171,15 +1171,15 @@ rspamd_message_parse (struct rspamd_task *task)
 	}
 
 	if (total_words > 0) {
-		var = rspamd_mempool_get_variable (task->task_pool,
-				RSPAMD_MEMPOOL_AVG_WORDS_LEN);
+		var = rspamd_mempool_get_variable_idx (task->task_pool,
+				RSPAMD_MEMPOOL_VAR_AVG_WORDS_LEN);
 
 		if (var) {
 			*var /= (double)total_words;
 		}
 
-		var = rspamd_mempool_get_variable (task->task_pool,
-				RSPAMD_MEMPOOL_SHORT_WORDS_CNT);
+		var = rspamd_mempool_get_variable_idx (task->task_pool,
+				RSPAMD_MEMPOOL_VAR_SHORT_WORDS_CNT);
 
 		if (var) {
 			*var /= (double)total_words;
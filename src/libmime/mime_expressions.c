@@ -22,6 +22,7 @@
 #include "html.h"
 #include "lua/lua_common.h"
 #include "utlist.h"
+#include "libutil/mempool_vars_internal.h"
 
 gboolean rspamd_compare_encoding (struct rspamd_task *task,
 	GArray * args,
@@ -1085,8 +1086,8 @@ rspamd_parts_distance (struct rspamd_task * task, GArray * args, void *unused)
 	}
 
 	if ((pdiff =
-		rspamd_mempool_get_variable (task->task_pool,
-		"parts_distance")) != NULL) {
+		rspamd_mempool_get_variable_idx (task->task_pool,
+		RSPAMD_MEMPOOL_VAR_PARTS_DISTANCE)) != NULL) {
 		diff = (1.0 - (*pdiff)) * 100.0;
 
 		if (diff != -1) {
@@ -29,6 +29,7 @@
 #include "libutil/radix.h"
 #include "monitored.h"
 #include "redis_pool.h"
+#include "libutil/http_pool.h"
 
 #define DEFAULT_BIND_PORT 11333
 #define DEFAULT_CONTROL_PORT 11334
@@ -325,6 +326,7 @@ struct rspamd_config {
 	gchar *log_file;                                /**< path to logfile in case of file logging			*/
 	gboolean log_buffered;                          /**< whether logging is buffered						*/
 	guint32 log_buf_size;                           /**< length of log buffer								*/
+	guint32 log_async_size;                         /**< size of shared buffer for async logging			*/
 	const ucl_object_t *debug_ip_map;               /**< turn on debugging for specified ip addresses       */
 	gboolean log_urls;                              /**< whether we should log URLs                         */
 	GList *debug_symbols;                           /**< symbols to debug									*/
@@ -409,6 +411,8 @@ struct rspamd_config {
 	guint upstream_max_errors;						/**< upstream max errors before shutting off			*/
 	gdouble upstream_error_time;					/**< rate of upstream errors							*/
 	gdouble upstream_revive_time;					/**< revive timeout for upstreams						*/
+	guint upstream_keepalive_max;					/**< idle keep-alive connections per upstream address	*/
+	gdouble upstream_keepalive_timeout;				/**< time to keep idle keep-alive connections			*/
 	struct upstream_ctx *ups_ctx;					/**< upstream context									*/
 	struct rspamd_dns_resolver *dns_resolver;		/**< dns resolver if loaded								*/
 
@@ -428,6 +432,7 @@ struct rspamd_config {
 	struct rspamd_external_libs_ctx *libs_ctx;		/**< context for external libraries						*/
 	struct rspamd_monitored_ctx *monitored_ctx;		/**< context for monitored resources					*/
 	struct rspamd_redis_pool *redis_pool;			/**< redis connectiosn pool								*/
+	struct rspamd_http_pool *http_pool;				/**< http client connections pool						*/
 
 	struct rspamd_re_cache *re_cache;				/**< static regexp cache								*/
 
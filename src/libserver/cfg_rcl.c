@@ -1771,6 +1771,13 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, log_buf_size),
 			RSPAMD_CL_FLAG_INT_32,
 			"Size of log buffer in bytes (for file logging)");
+	rspamd_rcl_add_default_handler (sub,
+			"async_buffer",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, log_async_size),
+			RSPAMD_CL_FLAG_INT_32,
+			"Size of shared buffer used by workers to pass log lines to the "
+			"main process for writing (for file logging, disabled by default)");
 	rspamd_rcl_add_default_handler (sub,
 			"log_urls",
 			rspamd_rcl_parse_struct_boolean,
@@ -2309,6 +2316,19 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, upstream_revive_time),
 			RSPAMD_CL_FLAG_TIME_FLOAT,
 			"Time before attempting to recover upstream after an error");
+	rspamd_rcl_add_default_handler (ssub,
+			"keepalive_max",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, upstream_keepalive_max),
+			RSPAMD_CL_FLAG_UINT,
+			"Maximum number of idle keep-alive HTTP connections per upstream "
+			"address, 0 disables reusing of connections");
+	rspamd_rcl_add_default_handler (ssub,
+			"keepalive_timeout",
+			rspamd_rcl_parse_struct_time,
+			G_STRUCT_OFFSET (struct rspamd_config, upstream_keepalive_timeout),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Time to keep idle keep-alive HTTP connections");
 
 	/**
 	 * Metric section
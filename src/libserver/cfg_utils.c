@@ -183,6 +183,9 @@ rspamd_config_new (void)
 #ifdef WITH_HIREDIS
 	cfg->redis_pool = rspamd_redis_pool_init ();
 #endif
+	cfg->http_pool = rspamd_http_pool_init ();
+	cfg->upstream_keepalive_max = RSPAMD_HTTP_POOL_DEFAULT_MAX_IDLE;
+	cfg->upstream_keepalive_timeout = RSPAMD_HTTP_POOL_DEFAULT_IDLE_TIMEOUT;
 	cfg->default_max_shots = DEFAULT_MAX_SHOTS;
 	cfg->max_sessions_cache = DEFAULT_MAX_SESSIONS;
 
@@ -222,6 +225,7 @@ rspamd_config_free (struct rspamd_config *cfg)
 		rspamd_redis_pool_destroy (cfg->redis_pool);
 	}
 #endif
+	rspamd_http_pool_destroy (cfg->http_pool);
 	ucl_object_unref (cfg->rcl_obj);
 	ucl_object_unref (cfg->config_comments);
 	ucl_object_unref (cfg->doc_strings);
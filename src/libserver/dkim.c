@@ -20,7 +20,7 @@
 #include "dns.h"
 #include "utlist.h"
 #include "unix-std.h"
-#include "mempool_vars_internal.h"
+#include "libutil/mempool_vars_internal.h"
 
 #include <openssl/evp.h>
 #include <openssl/rsa.h>
@@ -19,6 +19,7 @@
 #include "fuzzy_backend_sqlite.h"
 #include "fuzzy_backend_redis.h"
 #include "cfg_file.h"
+#include "cryptobox.h"
 
 #define DEFAULT_EXPIRE 172800L
 
@@ -34,7 +35,7 @@ static void rspamd_fuzzy_backend_check_sqlite (struct rspamd_fuzzy_backend *bk,
 		rspamd_fuzzy_check_cb cb, void *ud,
 		void *subr_ud);
 static void rspamd_fuzzy_backend_update_sqlite (struct rspamd_fuzzy_backend *bk,
-		GQueue *updates, const gchar *src,
+		GQueue *updates, const gchar *src, guint64 rev,
 		rspamd_fuzzy_update_cb cb, void *ud,
 		void *subr_ud);
 static void rspamd_fuzzy_backend_count_sqlite (struct rspamd_fuzzy_backend *bk,
@@ -60,7 +61,7 @@ struct rspamd_fuzzy_backend_subr {
 			rspamd_fuzzy_check_cb cb, void *ud,
 			void *subr_ud);
 	void (*update) (struct rspamd_fuzzy_backend *bk,
-			GQueue *updates, const gchar *src,
+			GQueue *updates, const gchar *src, guint64 rev,
 			rspamd_fuzzy_update_cb cb, void *ud,
 			void *subr_ud);
 	void (*count) (struct rspamd_fuzzy_backend *bk,
@@ -104,6 +105,7 @@ struct rspamd_fuzzy_backend {
 	enum rspamd_fuzzy_backend_type type;
 	gdouble expire;
 	gdouble sync;
+	gboolean lsh;
 	struct event_base *ev_base;
 	rspamd_fuzzy_periodic_cb periodic_cb;
 	void *periodic_ud;
@@ -146,7 +148,7 @@ rspamd_fuzzy_backend_check_sqlite (struct rspamd_fuzzy_backend *bk,
 	struct rspamd_fuzzy_backend_sqlite *sq = subr_ud;
 	struct rspamd_fuzzy_reply rep;
 
-	rep = rspamd_fuzzy_backend_sqlite_check (sq, cmd, bk->expire);
+	rep = rspamd_fuzzy_backend_sqlite_check (sq, cmd, bk->expire, bk->lsh);
 
 	if (cb) {
 		cb (&rep, ud);
@@ -155,7 +157,7 @@ rspamd_fuzzy_backend_check_sqlite (struct rspamd_fuzzy_backend *bk,
 
 static void
 rspamd_fuzzy_backend_update_sqlite (struct rspamd_fuzzy_backend *bk,
-		GQueue *updates, const gchar *src,
+		GQueue *updates, const gchar *src, guint64 rev,
 		rspamd_fuzzy_update_cb cb, void *ud,
 		void *subr_ud)
 {
@@ -194,7 +196,7 @@ rspamd_fuzzy_backend_update_sqlite (struct rspamd_fuzzy_backend *bk,
 		}
 
 		if (rspamd_fuzzy_backend_sqlite_finish_update (sq, src,
-				nupdates > 0)) {
+				nupdates > 0, rev)) {
 			success = TRUE;
 		}
 	}
@@ -272,6 +274,11 @@ rspamd_fuzzy_backend_create (struct event_base *ev_base,
 	enum rspamd_fuzzy_backend_type type = RSPAMD_FUZZY_BACKEND_SQLITE;
 	const ucl_object_t *elt;
 	gdouble expire = DEFAULT_EXPIRE;
+	/*
+	 * Band index is not built for redis databases filled before it was
+	 * introduced, so it is disabled unless explicitly enabled
+	 */
+	gboolean lsh = FALSE;
 
 	if (config != NULL) {
 		elt = ucl_object_lookup (config, "backend");
@@ -296,11 +303,18 @@ rspamd_fuzzy_backend_create (struct event_base *ev_base,
 		if (elt != NULL) {
 			expire = ucl_object_todouble (elt);
 		}
+
+		elt = ucl_object_lookup (config, "lsh");
+
+		if (elt != NULL && ucl_object_type (elt) == UCL_BOOLEAN) {
+			lsh = ucl_object_toboolean (elt);
+		}
 	}
 
 	bk = g_slice_alloc0 (sizeof (*bk));
 	bk->ev_base = ev_base;
 	bk->expire = expire;
+	bk->lsh = lsh;
 	bk->type = type;
 	bk->subr = &fuzzy_subrs[type];
 
@@ -326,14 +340,14 @@ rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *bk,
 
 void
 rspamd_fuzzy_backend_process_updates (struct rspamd_fuzzy_backend *bk,
-		GQueue *updates, const gchar *src, rspamd_fuzzy_update_cb cb,
-		void *ud)
+		GQueue *updates, const gchar *src, guint64 rev,
+		rspamd_fuzzy_update_cb cb, void *ud)
 {
 	g_assert (bk != NULL);
 	g_assert (updates != NULL);
 
 	if (updates) {
-		bk->subr->update (bk, updates, src, cb, ud, bk->subr_ud);
+		bk->subr->update (bk, updates, src, rev, cb, ud, bk->subr_ud);
 	}
 	else if (cb) {
 		cb (TRUE, ud);
@@ -462,3 +476,21 @@ rspamd_fuzzy_backend_get_expire (struct rspamd_fuzzy_backend *backend)
 {
 	return backend->expire;
 }
+
+gboolean
+rspamd_fuzzy_backend_use_lsh (struct rspamd_fuzzy_backend *backend)
+{
+	return backend->lsh;
+}
+
+guint64
+rspamd_fuzzy_lsh_band_hash (const struct rspamd_shingle *sgl, guint band)
+{
+	g_assert (band < RSPAMD_FUZZY_LSH_BANDS);
+
+	/* Band hashes are stored persistently, so use a machine independent hash */
+	return rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+			&sgl->hashes[band * RSPAMD_FUZZY_LSH_ROWS],
+			sizeof (guint64) * RSPAMD_FUZZY_LSH_ROWS,
+			band);
+}
@@ -32,6 +32,15 @@ typedef void (*rspamd_fuzzy_version_cb) (guint64 rev, void *ud);
 typedef void (*rspamd_fuzzy_count_cb) (guint64 count, void *ud);
 typedef gboolean (*rspamd_fuzzy_periodic_cb) (void *ud);
 
+/*
+ * Banded LSH index: shingles are split into RSPAMD_FUZZY_LSH_BANDS groups of
+ * RSPAMD_FUZZY_LSH_ROWS consecutive hashes, and each group is indexed by a
+ * single hash. Two documents sharing any whole band become candidates that
+ * are verified by comparing all shingles.
+ */
+#define RSPAMD_FUZZY_LSH_BANDS 16
+#define RSPAMD_FUZZY_LSH_ROWS (RSPAMD_SHINGLE_SIZE / RSPAMD_FUZZY_LSH_BANDS)
+
 /**
  * Open fuzzy backend
  * @param ev_base
@@ -60,10 +69,11 @@ void rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *bk,
  * @param bk
  * @param updates queue of struct fuzzy_peer_cmd
  * @param src
+ * @param rev new revision of the source or 0 to increment it
  */
 void rspamd_fuzzy_backend_process_updates (struct rspamd_fuzzy_backend *bk,
-		GQueue *updates, const gchar *src, rspamd_fuzzy_update_cb cb,
-		void *ud);
+		GQueue *updates, const gchar *src, guint64 rev,
+		rspamd_fuzzy_update_cb cb, void *ud);
 
 /**
  * Gets number of hashes from the backend
@@ -104,6 +114,22 @@ void rspamd_fuzzy_backend_start_update (struct rspamd_fuzzy_backend *backend,
 struct event_base* rspamd_fuzzy_backend_event_base (struct rspamd_fuzzy_backend *backend);
 gdouble rspamd_fuzzy_backend_get_expire (struct rspamd_fuzzy_backend *backend);
 
+/**
+ * Returns TRUE if backend should use LSH index to find fuzzy candidates
+ * @param backend
+ * @return
+ */
+gboolean rspamd_fuzzy_backend_use_lsh (struct rspamd_fuzzy_backend *backend);
+
+/**
+ * Returns stable hash of the specific LSH band of shingles
+ * @param sgl shingles
+ * @param band band number (less than RSPAMD_FUZZY_LSH_BANDS)
+ * @return
+ */
+guint64 rspamd_fuzzy_lsh_band_hash (const struct rspamd_shingle *sgl,
+		guint band);
+
 /**
  * Closes backend
  * @param backend
@@ -24,10 +24,56 @@
 #include "upstream.h"
 #include "contrib/hiredis/hiredis.h"
 #include "contrib/hiredis/async.h"
+#include <openssl/sha.h>
 
 #define REDIS_DEFAULT_PORT 6379
 #define REDIS_DEFAULT_OBJECT "fuzzy"
 #define REDIS_DEFAULT_TIMEOUT 2.0
+#define REDIS_DEFAULT_PIPELINED 16
+
+/*
+ * Resolves digest and fuzzy candidates in a single round trip
+ * KEYS[1]: digest key
+ * KEYS[2..]: LSH bands or shingles keys
+ * ARGV[1]: prefix
+ * ARGV[2]: number of shingles covered by a single key
+ * ARGV[3]: shingles of the request (optional, used to verify candidates)
+ * Returns {value, flag, matched shingles} or nil, where matched shingles is
+ * -1 for a direct match
+ *
+ * Candidates keys are built from the prefix, so in Redis Cluster all fuzzy
+ * keys must share one slot, see `hash_tag` option
+ */
+static const gchar fuzzy_check_script[] = ""
+		"local function matched(s, q)"
+		"  local n = 0"
+		"  for i = 0, #q / 8 - 1 do"
+		"    if string.sub(s, i * 8 + 1, i * 8 + 8) =="
+		"        string.sub(q, i * 8 + 1, i * 8 + 8) then n = n + 1 end"
+		"  end"
+		"  return n "
+		"end "
+		"local v = redis.call('HMGET', KEYS[1], 'V', 'F') "
+		"if v[1] and v[2] then return {v[1], v[2], -1} end "
+		"if #KEYS == 1 then return nil end "
+		"local cnt = {} "
+		"for _, c in ipairs(redis.call('MGET', unpack(KEYS, 2))) do"
+		"  if c then cnt[c] = (cnt[c] or 0) + 1 end "
+		"end "
+		"local q = ARGV[3] "
+		"local best, best_n = nil, 0 "
+		"for c, n in pairs(cnt) do"
+		"  n = n * tonumber(ARGV[2])"
+		"  if q or n > best_n then"
+		"    local h = redis.call('HMGET', ARGV[1] .. c, 'V', 'F', 'S')"
+		"    if h[1] and h[2] then"
+		"      if q and h[3] and #h[3] == #q then n = matched(h[3], q) end"
+		"      if n > best_n then best = h; best_n = n end"
+		"    end"
+		"  end "
+		"end "
+		"if not best then return nil end "
+		"return {best[1], best[2], best_n}";
 
 #define msg_err_redis_session(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         "fuzzy_redis", session->backend->id, \
@@ -53,8 +99,11 @@ struct rspamd_fuzzy_backend_redis {
 	const gchar *password;
 	const gchar *dbname;
 	gchar *id;
+	gchar *check_script_sha;
 	struct rspamd_redis_pool *pool;
 	gdouble timeout;
+	guint max_pipelined;
+	gboolean use_scripts;
 	ref_entry_t ref;
 };
 
@@ -66,6 +115,10 @@ struct rspamd_fuzzy_redis_session {
 	struct event_base *ev_base;
 	float prob;
 	gboolean shingles_checked;
+	gboolean lsh;
+	gboolean shared;
+	gboolean orphaned;
+	gboolean script_loaded;
 
 	enum {
 		RSPAMD_FUZZY_REDIS_COMMAND_COUNT,
@@ -177,6 +230,18 @@ rspamd_fuzzy_backend_redis_try_ucl (struct rspamd_fuzzy_backend_redis *backend,
 		backend->redis_object = ucl_object_tostring (elt);
 	}
 
+	elt = ucl_object_lookup (obj, "hash_tag");
+	if (elt && ucl_object_toboolean (elt) &&
+			strchr (backend->redis_object, '{') == NULL) {
+		gchar *tagged;
+
+		/* Keep all fuzzy keys in a single Redis Cluster slot */
+		tagged = g_strdup_printf ("{%s}", backend->redis_object);
+		rspamd_mempool_add_destructor (cfg->cfg_pool,
+				(rspamd_mempool_destruct_t)g_free, tagged);
+		backend->redis_object = tagged;
+	}
+
 	elt = ucl_object_lookup (obj, "timeout");
 	if (elt) {
 		backend->timeout = ucl_object_todouble (elt);
@@ -206,6 +271,16 @@ rspamd_fuzzy_backend_redis_try_ucl (struct rspamd_fuzzy_backend_redis *backend,
 		backend->dbname = NULL;
 	}
 
+	elt = ucl_object_lookup (obj, "scripts");
+	if (elt && ucl_object_type (elt) == UCL_BOOLEAN) {
+		backend->use_scripts = ucl_object_toboolean (elt);
+	}
+
+	elt = ucl_object_lookup (obj, "max_pipelined");
+	if (elt && ucl_object_type (elt) == UCL_INT) {
+		backend->max_pipelined = MAX (ucl_object_toint (elt), 1);
+	}
+
 	return TRUE;
 }
 
@@ -223,6 +298,10 @@ rspamd_fuzzy_backend_redis_dtor (struct rspamd_fuzzy_backend_redis *backend)
 		g_free (backend->id);
 	}
 
+	if (backend->check_script_sha) {
+		g_free (backend->check_script_sha);
+	}
+
 	g_slice_free1 (sizeof (*backend), backend);
 }
 
@@ -234,12 +313,15 @@ rspamd_fuzzy_backend_init_redis (struct rspamd_fuzzy_backend *bk,
 	const ucl_object_t *elt;
 	gboolean ret = FALSE;
 	guchar id_hash[rspamd_cryptobox_HASHBYTES];
+	guchar script_sha[SHA_DIGEST_LENGTH];
 	rspamd_cryptobox_hash_state_t st;
 
 	backend = g_slice_alloc0 (sizeof (*backend));
 
 	backend->timeout = REDIS_DEFAULT_TIMEOUT;
 	backend->redis_object = REDIS_DEFAULT_OBJECT;
+	backend->use_scripts = TRUE;
+	backend->max_pipelined = REDIS_DEFAULT_PIPELINED;
 
 	ret = rspamd_fuzzy_backend_redis_try_ucl (backend, obj, cfg);
 
@@ -288,6 +370,12 @@ rspamd_fuzzy_backend_init_redis (struct rspamd_fuzzy_backend *bk,
 	rspamd_cryptobox_hash_final (&st, id_hash);
 	backend->id = rspamd_encode_base32 (id_hash, sizeof (id_hash));
 
+	/* Redis identifies cached scripts by their sha1 */
+	SHA1 ((const guchar *)fuzzy_check_script, sizeof (fuzzy_check_script) - 1,
+			script_sha);
+	backend->check_script_sha = rspamd_encode_hex (script_sha,
+			sizeof (script_sha));
+
 	return backend;
 }
 
@@ -296,11 +384,35 @@ rspamd_fuzzy_redis_timeout (gint fd, short what, gpointer priv)
 {
 	struct rspamd_fuzzy_redis_session *session = priv;
 	redisAsyncContext *ac;
+	struct rspamd_fuzzy_reply rep;
 	static char errstr[128];
 
 	if (session->ctx) {
 		ac = session->ctx;
 		session->ctx = NULL;
+
+		if (session->shared) {
+			/*
+			 * Connection is shared with other sessions, so we cannot terminate
+			 * it: reply to the caller now and ignore reply from redis
+			 * when it arrives
+			 */
+			session->orphaned = TRUE;
+
+			if (session->callback.cb_check) {
+				memset (&rep, 0, sizeof (rep));
+				session->callback.cb_check (&rep, session->cbdata);
+			}
+
+			msg_err_redis_session ("timeout waiting for redis reply");
+			rspamd_upstream_fail (session->up);
+			/* Session might be freed after this call */
+			rspamd_redis_pool_release_connection (session->backend->pool,
+					ac, TRUE);
+
+			return;
+		}
+
 		ac->err = REDIS_ERR_IO;
 		/* Should be safe as in hiredis it is char[128] */
 		rspamd_snprintf (errstr, sizeof (errstr), "%s", strerror (ETIMEDOUT));
@@ -341,6 +453,12 @@ rspamd_fuzzy_redis_shingles_callback (redisAsyncContext *c, gpointer r,
 	struct _rspamd_fuzzy_shingles_helper *shingles, *prev = NULL, *sel = NULL;
 	guint i, found = 0, max_found = 0, cur_found = 0;
 
+	if (session->orphaned) {
+		/* Session has been timed out, so reply is not needed */
+		rspamd_fuzzy_redis_session_dtor (session, FALSE);
+		return;
+	}
+
 	event_del (&session->timeout);
 	memset (&rep, 0, sizeof (rep));
 
@@ -465,6 +583,184 @@ rspamd_fuzzy_redis_shingles_callback (redisAsyncContext *c, gpointer r,
 	rspamd_fuzzy_redis_session_dtor (session, FALSE);
 }
 
+static void
+rspamd_fuzzy_redis_lsh_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_fuzzy_redis_session *session = priv;
+	redisReply *reply = r, *cur, *sel = NULL;
+	struct rspamd_fuzzy_reply rep;
+	struct timeval tv;
+	GString *key;
+	guint i, j, found, max_found = 0;
+
+	if (session->orphaned) {
+		/* Session has been timed out, so reply is not needed */
+		rspamd_fuzzy_redis_session_dtor (session, FALSE);
+		return;
+	}
+
+	event_del (&session->timeout);
+	memset (&rep, 0, sizeof (rep));
+
+	if (c->err == 0) {
+		rspamd_upstream_ok (session->up);
+
+		if (reply->type == REDIS_REPLY_ARRAY &&
+				reply->elements == RSPAMD_FUZZY_LSH_BANDS) {
+			/* Select the candidate that has the most bands matched */
+			for (i = 0; i < RSPAMD_FUZZY_LSH_BANDS; i ++) {
+				cur = reply->element[i];
+
+				if (cur->type != REDIS_REPLY_STRING) {
+					continue;
+				}
+
+				found = 0;
+
+				for (j = i; j < RSPAMD_FUZZY_LSH_BANDS; j ++) {
+					if (reply->element[j]->type == REDIS_REPLY_STRING &&
+							reply->element[j]->len == cur->len &&
+							memcmp (reply->element[j]->str, cur->str,
+									cur->len) == 0) {
+						found ++;
+					}
+				}
+
+				if (found > max_found) {
+					max_found = found;
+					sel = cur;
+				}
+			}
+
+			if (sel != NULL) {
+				/*
+				 * Lower bound of similarity if candidate has no shingles stored,
+				 * otherwise it is refined when we get the candidate itself
+				 */
+				session->prob = ((float)max_found * RSPAMD_FUZZY_LSH_ROWS) /
+						RSPAMD_SHINGLE_SIZE;
+
+				/* Prepare new check command */
+				rspamd_fuzzy_redis_session_free_args (session);
+				session->nargs = 5;
+				session->argv = g_malloc (sizeof (gchar *) * session->nargs);
+				session->argv_lens = g_malloc (sizeof (gsize) * session->nargs);
+
+				key = g_string_new (session->backend->redis_object);
+				g_string_append_len (key, sel->str, sel->len);
+				session->argv[0] = g_strdup ("HMGET");
+				session->argv_lens[0] = 5;
+				session->argv[1] = key->str;
+				session->argv_lens[1] = key->len;
+				session->argv[2] = g_strdup ("V");
+				session->argv_lens[2] = 1;
+				session->argv[3] = g_strdup ("F");
+				session->argv_lens[3] = 1;
+				session->argv[4] = g_strdup ("S");
+				session->argv_lens[4] = 1;
+				g_string_free (key, FALSE); /* Do not free underlying array */
+
+				g_assert (session->ctx != NULL);
+				if (redisAsyncCommandArgv (session->ctx,
+						rspamd_fuzzy_redis_check_callback,
+						session, session->nargs,
+						(const gchar **)session->argv,
+						session->argv_lens) != REDIS_OK) {
+
+					if (session->callback.cb_check) {
+						memset (&rep, 0, sizeof (rep));
+						session->callback.cb_check (&rep, session->cbdata);
+					}
+
+					rspamd_fuzzy_redis_session_dtor (session, TRUE);
+				}
+				else {
+					/* Add timeout */
+					event_set (&session->timeout, -1, EV_TIMEOUT,
+							rspamd_fuzzy_redis_timeout,
+							session);
+					event_base_set (session->ev_base, &session->timeout);
+					double_to_tv (session->backend->timeout, &tv);
+					event_add (&session->timeout, &tv);
+				}
+
+				return;
+			}
+		}
+
+		if (session->callback.cb_check) {
+			session->callback.cb_check (&rep, session->cbdata);
+		}
+	}
+	else {
+		if (session->callback.cb_check) {
+			session->callback.cb_check (&rep, session->cbdata);
+		}
+
+		if (c->errstr) {
+			msg_err_redis_session ("error getting lsh bands: %s", c->errstr);
+		}
+
+		rspamd_upstream_fail (session->up);
+	}
+
+	rspamd_fuzzy_redis_session_dtor (session, FALSE);
+}
+
+static void
+rspamd_fuzzy_backend_check_lsh (struct rspamd_fuzzy_redis_session *session)
+{
+	struct timeval tv;
+	struct rspamd_fuzzy_reply rep;
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	GString *key;
+	guint i;
+
+	rspamd_fuzzy_redis_session_free_args (session);
+	session->nargs = RSPAMD_FUZZY_LSH_BANDS + 1;
+	session->argv = g_malloc (sizeof (gchar *) * session->nargs);
+	session->argv_lens = g_malloc (sizeof (gsize) * session->nargs);
+	shcmd = (const struct rspamd_fuzzy_shingle_cmd *)session->cmd;
+
+	session->argv[0] = g_strdup ("MGET");
+	session->argv_lens[0] = 4;
+
+	for (i = 0; i < RSPAMD_FUZZY_LSH_BANDS; i ++) {
+		key = g_string_new (session->backend->redis_object);
+		rspamd_printf_gstring (key, "_l_%d_%uL", i,
+				rspamd_fuzzy_lsh_band_hash (&shcmd->sgl, i));
+		session->argv[i + 1] = key->str;
+		session->argv_lens[i + 1] = key->len;
+		g_string_free (key, FALSE); /* Do not free underlying array */
+	}
+
+	session->shingles_checked = TRUE;
+
+	g_assert (session->ctx != NULL);
+
+	if (redisAsyncCommandArgv (session->ctx, rspamd_fuzzy_redis_lsh_callback,
+			session, session->nargs,
+			(const gchar **)session->argv, session->argv_lens) != REDIS_OK) {
+		msg_err ("cannot execute redis command: %s", session->ctx->errstr);
+
+		if (session->callback.cb_check) {
+			memset (&rep, 0, sizeof (rep));
+			session->callback.cb_check (&rep, session->cbdata);
+		}
+
+		rspamd_fuzzy_redis_session_dtor (session, TRUE);
+	}
+	else {
+		/* Add timeout */
+		event_set (&session->timeout, -1, EV_TIMEOUT, rspamd_fuzzy_redis_timeout,
+				session);
+		event_base_set (session->ev_base, &session->timeout);
+		double_to_tv (session->backend->timeout, &tv);
+		event_add (&session->timeout, &tv);
+	}
+}
+
 static void
 rspamd_fuzzy_backend_check_shingles (struct rspamd_fuzzy_redis_session *session)
 {
@@ -525,16 +821,36 @@ rspamd_fuzzy_redis_check_callback (redisAsyncContext *c, gpointer r,
 	struct rspamd_fuzzy_redis_session *session = priv;
 	redisReply *reply = r, *cur;
 	struct rspamd_fuzzy_reply rep;
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct rspamd_shingle sgl;
 	gulong value;
 	guint found_elts = 0;
 
+	if (session->orphaned) {
+		/* Session has been timed out, so reply is not needed */
+		rspamd_fuzzy_redis_session_dtor (session, FALSE);
+		return;
+	}
+
 	event_del (&session->timeout);
 	memset (&rep, 0, sizeof (rep));
 
 	if (c->err == 0) {
 		rspamd_upstream_ok (session->up);
 
-		if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 2) {
+		if (reply->type == REDIS_REPLY_ARRAY && reply->elements >= 2) {
+			if (reply->elements > 2) {
+				/* LSH candidate: verify it using all stored shingles */
+				cur = reply->element[2];
+
+				if (cur->type == REDIS_REPLY_STRING &&
+						cur->len == sizeof (sgl)) {
+					shcmd = (const struct rspamd_fuzzy_shingle_cmd *)session->cmd;
+					memcpy (&sgl, cur->str, sizeof (sgl));
+					session->prob = rspamd_shingles_compare (&sgl, &shcmd->sgl);
+				}
+			}
+
 			cur = reply->element[0];
 
 			if (cur->type == REDIS_REPLY_STRING) {
@@ -551,15 +867,24 @@ rspamd_fuzzy_redis_check_callback (redisAsyncContext *c, gpointer r,
 				found_elts ++;
 			}
 
-			if (found_elts == 2) {
+			if (found_elts == 2 && session->prob > 0.5) {
 				rep.prob = session->prob;
 			}
+			else {
+				/* Not found or LSH candidate is not similar enough */
+				memset (&rep, 0, sizeof (rep));
+			}
 		}
 
 		if (found_elts != 2) {
 			if (session->cmd->shingles_count > 0 && !session->shingles_checked) {
 				/* We also need to check all shingles here */
-				rspamd_fuzzy_backend_check_shingles (session);
+				if (session->lsh) {
+					rspamd_fuzzy_backend_check_lsh (session);
+				}
+				else {
+					rspamd_fuzzy_backend_check_shingles (session);
+				}
 				/* Do not free session */
 				return;
 			}
@@ -590,6 +915,189 @@ rspamd_fuzzy_redis_check_callback (redisAsyncContext *c, gpointer r,
 	rspamd_fuzzy_redis_session_dtor (session, FALSE);
 }
 
+static void
+rspamd_fuzzy_redis_script_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_fuzzy_redis_session *session = priv;
+	redisReply *reply = r, *cur;
+	struct rspamd_fuzzy_reply rep;
+	struct timeval tv;
+	gint64 matched;
+
+	if (session->orphaned) {
+		/* Session has been timed out, so reply is not needed */
+		rspamd_fuzzy_redis_session_dtor (session, FALSE);
+		return;
+	}
+
+	event_del (&session->timeout);
+	memset (&rep, 0, sizeof (rep));
+
+	if (c->err == 0) {
+		rspamd_upstream_ok (session->up);
+
+		if (reply->type == REDIS_REPLY_ERROR && !session->script_loaded &&
+				strncmp (reply->str, "NOSCRIPT", sizeof ("NOSCRIPT") - 1) == 0) {
+			/* Script is not cached by redis yet, so we need to send it */
+			session->script_loaded = TRUE;
+			g_free (session->argv[0]);
+			session->argv[0] = g_strdup ("EVAL");
+			session->argv_lens[0] = sizeof ("EVAL") - 1;
+			g_free (session->argv[1]);
+			session->argv[1] = g_strdup (fuzzy_check_script);
+			session->argv_lens[1] = sizeof (fuzzy_check_script) - 1;
+
+			if (redisAsyncCommandArgv (session->ctx,
+					rspamd_fuzzy_redis_script_callback,
+					session, session->nargs,
+					(const gchar **)session->argv,
+					session->argv_lens) != REDIS_OK) {
+
+				if (session->callback.cb_check) {
+					session->callback.cb_check (&rep, session->cbdata);
+				}
+
+				rspamd_fuzzy_redis_session_dtor (session, TRUE);
+			}
+			else {
+				/* Add timeout */
+				event_set (&session->timeout, -1, EV_TIMEOUT,
+						rspamd_fuzzy_redis_timeout,
+						session);
+				event_base_set (session->ev_base, &session->timeout);
+				double_to_tv (session->backend->timeout, &tv);
+				event_add (&session->timeout, &tv);
+			}
+
+			return;
+		}
+		else if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 3) {
+			cur = reply->element[2];
+			matched = cur->type == REDIS_REPLY_INTEGER ? cur->integer : 0;
+
+			if (matched < 0) {
+				/* Direct match */
+				rep.prob = 1.0;
+			}
+			else {
+				rep.prob = ((float)matched) / RSPAMD_SHINGLE_SIZE;
+			}
+
+			if (rep.prob > 0.5 &&
+					reply->element[0]->type == REDIS_REPLY_STRING &&
+					reply->element[1]->type == REDIS_REPLY_STRING) {
+				rep.value = strtoul (reply->element[0]->str, NULL, 10);
+				rep.flag = strtoul (reply->element[1]->str, NULL, 10);
+			}
+			else {
+				memset (&rep, 0, sizeof (rep));
+			}
+		}
+		else if (reply->type == REDIS_REPLY_ERROR) {
+			msg_err_redis_session ("error running check script: %s",
+					reply->str);
+		}
+
+		if (session->callback.cb_check) {
+			session->callback.cb_check (&rep, session->cbdata);
+		}
+	}
+	else {
+		if (session->callback.cb_check) {
+			session->callback.cb_check (&rep, session->cbdata);
+		}
+
+		if (c->errstr) {
+			msg_err_redis_session ("error checking hashes: %s", c->errstr);
+		}
+
+		rspamd_upstream_fail (session->up);
+	}
+
+	rspamd_fuzzy_redis_session_dtor (session, FALSE);
+}
+
+/*
+ * Prepares arguments to check digest and all fuzzy candidates using
+ * the check script
+ */
+static void
+rspamd_fuzzy_redis_check_script_args (struct rspamd_fuzzy_redis_session *session)
+{
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	GString *key;
+	guint i, nkeys = 1, cur_shift;
+
+	if (session->cmd->shingles_count > 0) {
+		nkeys += session->lsh ? RSPAMD_FUZZY_LSH_BANDS : RSPAMD_SHINGLE_SIZE;
+	}
+
+	/* EVALSHA <sha> <numkeys> <keys> <prefix> <weight> [<shingles>] */
+	session->nargs = 3 + nkeys + 2;
+
+	if (session->cmd->shingles_count > 0 && session->lsh) {
+		session->nargs ++;
+	}
+
+	session->argv = g_malloc (sizeof (gchar *) * session->nargs);
+	session->argv_lens = g_malloc (sizeof (gsize) * session->nargs);
+	shcmd = (const struct rspamd_fuzzy_shingle_cmd *)session->cmd;
+
+	session->argv[0] = g_strdup ("EVALSHA");
+	session->argv_lens[0] = sizeof ("EVALSHA") - 1;
+	session->argv[1] = g_strdup (session->backend->check_script_sha);
+	session->argv_lens[1] = strlen (session->argv[1]);
+	session->argv[2] = g_strdup_printf ("%u", nkeys);
+	session->argv_lens[2] = strlen (session->argv[2]);
+
+	key = g_string_new (session->backend->redis_object);
+	g_string_append_len (key, session->cmd->digest,
+			sizeof (session->cmd->digest));
+	session->argv[3] = key->str;
+	session->argv_lens[3] = key->len;
+	g_string_free (key, FALSE); /* Do not free underlying array */
+	cur_shift = 4;
+
+	if (session->cmd->shingles_count > 0) {
+		if (session->lsh) {
+			for (i = 0; i < RSPAMD_FUZZY_LSH_BANDS; i ++) {
+				key = g_string_new (session->backend->redis_object);
+				rspamd_printf_gstring (key, "_l_%d_%uL", i,
+						rspamd_fuzzy_lsh_band_hash (&shcmd->sgl, i));
+				session->argv[cur_shift] = key->str;
+				session->argv_lens[cur_shift++] = key->len;
+				g_string_free (key, FALSE);
+			}
+		}
+		else {
+			for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+				key = g_string_new (session->backend->redis_object);
+				rspamd_printf_gstring (key, "_%d_%uL", i, shcmd->sgl.hashes[i]);
+				session->argv[cur_shift] = key->str;
+				session->argv_lens[cur_shift++] = key->len;
+				g_string_free (key, FALSE);
+			}
+		}
+	}
+
+	session->argv[cur_shift] = g_strdup (session->backend->redis_object);
+	session->argv_lens[cur_shift] = strlen (session->argv[cur_shift]);
+	cur_shift ++;
+	session->argv[cur_shift] = g_strdup_printf ("%d",
+			session->lsh ? RSPAMD_FUZZY_LSH_ROWS : 1);
+	session->argv_lens[cur_shift] = strlen (session->argv[cur_shift]);
+	cur_shift ++;
+
+	if (session->cmd->shingles_count > 0 && session->lsh) {
+		session->argv[cur_shift] = g_malloc (sizeof (shcmd->sgl));
+		memcpy (session->argv[cur_shift], &shcmd->sgl, sizeof (shcmd->sgl));
+		session->argv_lens[cur_shift++] = sizeof (shcmd->sgl);
+	}
+
+	g_assert (cur_shift == session->nargs);
+}
+
 void
 rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
 		const struct rspamd_fuzzy_cmd *cmd,
@@ -602,6 +1110,7 @@ rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
 	struct timeval tv;
 	rspamd_inet_addr_t *addr;
 	struct rspamd_fuzzy_reply rep;
+	redisCallbackFn *check_cb;
 	GString *key;
 
 	g_assert (backend != NULL);
@@ -615,24 +1124,33 @@ rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
 	session->command = RSPAMD_FUZZY_REDIS_COMMAND_CHECK;
 	session->cmd = cmd;
 	session->prob = 1.0;
+	session->lsh = rspamd_fuzzy_backend_use_lsh (bk);
 	session->ev_base = rspamd_fuzzy_backend_event_base (bk);
 
-	/* First of all check digest */
-	session->nargs = 4;
-	session->argv = g_malloc (sizeof (gchar *) * session->nargs);
-	session->argv_lens = g_malloc (sizeof (gsize) * session->nargs);
+	if (backend->use_scripts) {
+		/* Check digest and all fuzzy candidates at once */
+		rspamd_fuzzy_redis_check_script_args (session);
+		check_cb = rspamd_fuzzy_redis_script_callback;
+	}
+	else {
+		/* First of all check digest */
+		session->nargs = 4;
+		session->argv = g_malloc (sizeof (gchar *) * session->nargs);
+		session->argv_lens = g_malloc (sizeof (gsize) * session->nargs);
 
-	key = g_string_new (backend->redis_object);
-	g_string_append_len (key, cmd->digest, sizeof (cmd->digest));
-	session->argv[0] = g_strdup ("HMGET");
-	session->argv_lens[0] = 5;
-	session->argv[1] = key->str;
-	session->argv_lens[1] = key->len;
-	session->argv[2] = g_strdup ("V");
-	session->argv_lens[2] = 1;
-	session->argv[3] = g_strdup ("F");
-	session->argv_lens[3] = 1;
-	g_string_free (key, FALSE); /* Do not free underlying array */
+		key = g_string_new (backend->redis_object);
+		g_string_append_len (key, cmd->digest, sizeof (cmd->digest));
+		session->argv[0] = g_strdup ("HMGET");
+		session->argv_lens[0] = 5;
+		session->argv[1] = key->str;
+		session->argv_lens[1] = key->len;
+		session->argv[2] = g_strdup ("V");
+		session->argv_lens[2] = 1;
+		session->argv[3] = g_strdup ("F");
+		session->argv_lens[3] = 1;
+		g_string_free (key, FALSE); /* Do not free underlying array */
+		check_cb = rspamd_fuzzy_redis_check_callback;
+	}
 
 	up = rspamd_upstream_get (backend->read_servers,
 			RSPAMD_UPSTREAM_ROUND_ROBIN,
@@ -642,10 +1160,22 @@ rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
 	session->up = up;
 	addr = rspamd_upstream_addr (up);
 	g_assert (addr != NULL);
-	session->ctx = rspamd_redis_pool_connect (backend->pool,
-			backend->dbname, backend->password,
-			rspamd_inet_address_to_string (addr),
-			rspamd_inet_address_get_port (addr));
+
+	if (backend->max_pipelined > 1) {
+		/* Checks from many sessions are pipelined over the same connection */
+		session->ctx = rspamd_redis_pool_connect_shared (backend->pool,
+				backend->dbname, backend->password,
+				rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr),
+				backend->max_pipelined);
+		session->shared = TRUE;
+	}
+	else {
+		session->ctx = rspamd_redis_pool_connect (backend->pool,
+				backend->dbname, backend->password,
+				rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr));
+	}
 
 	if (session->ctx == NULL) {
 		rspamd_fuzzy_redis_session_dtor (session, TRUE);
@@ -656,7 +1186,7 @@ rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
 		}
 	}
 	else {
-		if (redisAsyncCommandArgv (session->ctx, rspamd_fuzzy_redis_check_callback,
+		if (redisAsyncCommandArgv (session->ctx, check_cb,
 				session, session->nargs,
 				(const gchar **)session->argv, session->argv_lens) != REDIS_OK) {
 			rspamd_fuzzy_redis_session_dtor (session, TRUE);
@@ -1147,6 +1677,69 @@ rspamd_fuzzy_update_append_command (struct rspamd_fuzzy_backend *bk,
 					return FALSE;
 				}
 			}
+
+			/*
+			 * For LSH index we store all shingles with the digest:
+			 * HSET <key> S <shingles>
+			 * and emit a command per band:
+			 * SETEX <prefix>_l_<band>_<value> <expire> <digest>
+			 */
+			key = g_string_sized_new (klen);
+			g_string_append (key, session->backend->redis_object);
+			g_string_append_len (key, cmd->digest, sizeof (cmd->digest));
+			session->argv[cur_shift] = g_strdup ("HSET");
+			session->argv_lens[cur_shift++] = sizeof ("HSET") - 1;
+			session->argv[cur_shift] = key->str;
+			session->argv_lens[cur_shift++] = key->len;
+			session->argv[cur_shift] = g_strdup ("S");
+			session->argv_lens[cur_shift++] = sizeof ("S") - 1;
+			session->argv[cur_shift] = g_malloc (sizeof (io_cmd->cmd.shingle.sgl));
+			memcpy (session->argv[cur_shift], &io_cmd->cmd.shingle.sgl,
+					sizeof (io_cmd->cmd.shingle.sgl));
+			session->argv_lens[cur_shift++] = sizeof (io_cmd->cmd.shingle.sgl);
+			g_string_free (key, FALSE);
+
+			if (redisAsyncCommandArgv (session->ctx, NULL, NULL,
+					4,
+					(const gchar **)&session->argv[cur_shift - 4],
+					&session->argv_lens[cur_shift - 4]) != REDIS_OK) {
+
+				return FALSE;
+			}
+
+			for (i = 0; i < RSPAMD_FUZZY_LSH_BANDS; i ++) {
+				guchar *hval;
+
+				key = g_string_sized_new (klen);
+				rspamd_printf_gstring (key, "%s_l_%d_%uL",
+						session->backend->redis_object,
+						i,
+						rspamd_fuzzy_lsh_band_hash (&io_cmd->cmd.shingle.sgl, i));
+				value = g_string_sized_new (30);
+				rspamd_printf_gstring (value, "%d",
+						(gint)rspamd_fuzzy_backend_get_expire (bk));
+				hval = g_malloc (sizeof (io_cmd->cmd.shingle.basic.digest));
+				memcpy (hval, io_cmd->cmd.shingle.basic.digest,
+						sizeof (io_cmd->cmd.shingle.basic.digest));
+				session->argv[cur_shift] = g_strdup ("SETEX");
+				session->argv_lens[cur_shift++] = sizeof ("SETEX") - 1;
+				session->argv[cur_shift] = key->str;
+				session->argv_lens[cur_shift++] = key->len;
+				session->argv[cur_shift] = value->str;
+				session->argv_lens[cur_shift++] = value->len;
+				session->argv[cur_shift] = hval;
+				session->argv_lens[cur_shift++] = sizeof (io_cmd->cmd.shingle.basic.digest);
+				g_string_free (key, FALSE);
+				g_string_free (value, FALSE);
+
+				if (redisAsyncCommandArgv (session->ctx, NULL, NULL,
+						4,
+						(const gchar **)&session->argv[cur_shift - 4],
+						&session->argv_lens[cur_shift - 4]) != REDIS_OK) {
+
+					return FALSE;
+				}
+			}
 		}
 		else if (cmd->cmd == FUZZY_DEL) {
 			klen = strlen (session->backend->redis_object) +
@@ -1172,6 +1765,27 @@ rspamd_fuzzy_update_append_command (struct rspamd_fuzzy_backend *bk,
 					return FALSE;
 				}
 			}
+
+			for (i = 0; i < RSPAMD_FUZZY_LSH_BANDS; i ++) {
+				key = g_string_sized_new (klen);
+				rspamd_printf_gstring (key, "%s_l_%d_%uL",
+						session->backend->redis_object,
+						i,
+						rspamd_fuzzy_lsh_band_hash (&io_cmd->cmd.shingle.sgl, i));
+				session->argv[cur_shift] = g_strdup ("DEL");
+				session->argv_lens[cur_shift++] = sizeof ("DEL") - 1;
+				session->argv[cur_shift] = key->str;
+				session->argv_lens[cur_shift++] = key->len;
+				g_string_free (key, FALSE);
+
+				if (redisAsyncCommandArgv (session->ctx, NULL, NULL,
+						2,
+						(const gchar **)&session->argv[cur_shift - 2],
+						&session->argv_lens[cur_shift - 2]) != REDIS_OK) {
+
+					return FALSE;
+				}
+			}
 		}
 		else {
 			g_assert_not_reached ();
@@ -1223,7 +1837,7 @@ rspamd_fuzzy_redis_update_callback (redisAsyncContext *c, gpointer r,
 
 void
 rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
-		GQueue *updates, const gchar *src,
+		GQueue *updates, const gchar *src, guint64 rev,
 		rspamd_fuzzy_update_cb cb, void *ud,
 		void *subr_ud)
 {
@@ -1236,7 +1850,7 @@ rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
 	GString *key;
 	struct fuzzy_peer_cmd *io_cmd;
 	struct rspamd_fuzzy_cmd *cmd;
-	guint nargs, ncommands, cur_shift;
+	guint nargs, ncommands, cur_shift, src_nargs;
 
 	g_assert (backend != NULL);
 
@@ -1255,17 +1869,21 @@ rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
 	 *
 	 * For each command with shingles we additionally emit 32 commands:
 	 * SETEX <prefix>_<number>_<value> <expire> <digest>
+	 * and LSH index commands:
+	 * HSET <key> S <shingles>
+	 * SETEX <prefix>_l_<band>_<value> <expire> <digest> (for each band)
 	 *
 	 * For each delete command we emit:
 	 * DEL <key>
 	 *
 	 * For each delete command with shingles we emit also 32 commands:
 	 * DEL <prefix>_<number>_<value>
+	 * DEL <prefix>_l_<band>_<value> (for each band)
 	 * DECR <prefix||fuzzy_count>
 	 */
 
-	ncommands = 3; /* For MULTI + EXEC + INCR <src> */
-	nargs = 4;
+	ncommands = 3; /* For MULTI + EXEC + INCR <src> or SET <src> <rev> */
+	nargs = rev != 0 ? 5 : 4;
 
 	for (cur = updates->head; cur != NULL; cur = g_list_next (cur)) {
 		io_cmd = cur->data;
@@ -1282,8 +1900,8 @@ rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
 			nargs += 13;
 
 			if (io_cmd->is_shingle) {
-				ncommands += RSPAMD_SHINGLE_SIZE;
-				nargs += RSPAMD_SHINGLE_SIZE * 4;
+				ncommands += RSPAMD_SHINGLE_SIZE + RSPAMD_FUZZY_LSH_BANDS + 1;
+				nargs += RSPAMD_SHINGLE_SIZE * 4 + RSPAMD_FUZZY_LSH_BANDS * 4 + 4;
 			}
 
 		}
@@ -1292,8 +1910,8 @@ rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
 			nargs += 4;
 
 			if (io_cmd->is_shingle) {
-				ncommands += RSPAMD_SHINGLE_SIZE;
-				nargs += RSPAMD_SHINGLE_SIZE * 2;
+				ncommands += RSPAMD_SHINGLE_SIZE + RSPAMD_FUZZY_LSH_BANDS;
+				nargs += RSPAMD_SHINGLE_SIZE * 2 + RSPAMD_FUZZY_LSH_BANDS * 2;
 			}
 		}
 	}
@@ -1366,19 +1984,35 @@ rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
 			}
 		}
 
-		/* Now INCR command for the source */
+		/* Now INCR or SET command for the source */
 		key = g_string_new (backend->redis_object);
 		g_string_append (key, src);
-		session->argv[cur_shift] = g_strdup ("INCR");
-		session->argv_lens[cur_shift ++] = 4;
-		session->argv[cur_shift] = key->str;
-		session->argv_lens[cur_shift ++] = key->len;
+
+		if (rev != 0) {
+			session->argv[cur_shift] = g_strdup ("SET");
+			session->argv_lens[cur_shift ++] = 3;
+			session->argv[cur_shift] = key->str;
+			session->argv_lens[cur_shift ++] = key->len;
+			session->argv[cur_shift] = g_strdup_printf ("%" G_GUINT64_FORMAT,
+					rev);
+			session->argv_lens[cur_shift] = strlen (session->argv[cur_shift]);
+			cur_shift ++;
+			src_nargs = 3;
+		}
+		else {
+			session->argv[cur_shift] = g_strdup ("INCR");
+			session->argv_lens[cur_shift ++] = 4;
+			session->argv[cur_shift] = key->str;
+			session->argv_lens[cur_shift ++] = key->len;
+			src_nargs = 2;
+		}
+
 		g_string_free (key, FALSE);
 
 		if (redisAsyncCommandArgv (session->ctx, NULL, NULL,
-				2,
-				(const gchar **)&session->argv[cur_shift - 2],
-				&session->argv_lens[cur_shift - 2]) != REDIS_OK) {
+				src_nargs,
+				(const gchar **)&session->argv[cur_shift - src_nargs],
+				&session->argv_lens[cur_shift - src_nargs]) != REDIS_OK) {
 
 			if (cb) {
 				cb (FALSE, ud);
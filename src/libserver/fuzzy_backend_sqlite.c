@@ -68,10 +68,17 @@ static const char *create_tables_sql =
 		"	name TEXT UNIQUE,"
 		"	version INTEGER,"
 		"	last INTEGER);"
+		"CREATE TABLE IF NOT EXISTS lsh("
+		"	value INTEGER NOT NULL,"
+		"	band INTEGER NOT NULL,"
+		"	digest_id INTEGER REFERENCES digests(id) ON DELETE CASCADE "
+		"	ON UPDATE CASCADE);"
 		"CREATE UNIQUE INDEX IF NOT EXISTS d ON digests(digest);"
 		"CREATE INDEX IF NOT EXISTS t ON digests(time);"
 		"CREATE INDEX IF NOT EXISTS dgst_id ON shingles(digest_id);"
 		"CREATE UNIQUE INDEX IF NOT EXISTS s ON shingles(value, number);"
+		"CREATE INDEX IF NOT EXISTS lsh_id ON lsh(digest_id);"
+		"CREATE UNIQUE INDEX IF NOT EXISTS l ON lsh(value, band);"
 		"COMMIT;";
 #if 0
 static const char *create_index_sql =
@@ -101,6 +108,9 @@ enum rspamd_fuzzy_statement_idx {
 	RSPAMD_FUZZY_BACKEND_ADD_SOURCE,
 	RSPAMD_FUZZY_BACKEND_VERSION,
 	RSPAMD_FUZZY_BACKEND_SET_VERSION,
+	RSPAMD_FUZZY_BACKEND_INSERT_LSH,
+	RSPAMD_FUZZY_BACKEND_CHECK_LSH,
+	RSPAMD_FUZZY_BACKEND_GET_SHINGLES_BY_ID,
 	RSPAMD_FUZZY_BACKEND_MAX
 };
 static struct rspamd_fuzzy_stmts {
@@ -241,6 +251,28 @@ static struct rspamd_fuzzy_stmts {
 		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_INSERT_LSH,
+		.sql = "INSERT OR REPLACE INTO lsh(value, band, digest_id) "
+				"VALUES (?1, ?2, ?3);",
+		.args = "III",
+		.stmt = NULL,
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_CHECK_LSH,
+		.sql = "SELECT digest_id FROM lsh WHERE value=?1 AND band=?2",
+		.args = "IS",
+		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_GET_SHINGLES_BY_ID,
+		.sql = "SELECT value, number FROM shingles WHERE digest_id=?1",
+		.args = "I",
+		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
 };
 
 static GQuark
@@ -431,7 +463,7 @@ rspamd_fuzzy_backend_sqlite_open_db (const gchar *path, GError **err)
 	bk->expired = 0;
 	bk->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "fuzzy_backend");
 	bk->db = rspamd_sqlite3_open_or_create (bk->pool, bk->path,
-			create_tables_sql, 1, err);
+			create_tables_sql, 2, err);
 
 	if (bk->db == NULL) {
 		rspamd_fuzzy_backend_sqlite_close (bk);
@@ -455,6 +487,131 @@ rspamd_fuzzy_backend_sqlite_open_db (const gchar *path, GError **err)
 	return bk;
 }
 
+static gboolean
+rspamd_fuzzy_backend_sqlite_table_empty (struct rspamd_fuzzy_backend_sqlite *backend,
+		const gchar *sql)
+{
+	sqlite3_stmt *stmt;
+	gboolean ret = TRUE;
+
+	if (sqlite3_prepare_v2 (backend->db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		msg_warn_fuzzy_backend ("cannot prepare sql `%s`: %s", sql,
+				sqlite3_errmsg (backend->db));
+
+		return TRUE;
+	}
+
+	if (sqlite3_step (stmt) == SQLITE_ROW) {
+		ret = FALSE;
+	}
+
+	sqlite3_finalize (stmt);
+
+	return ret;
+}
+
+static void
+rspamd_fuzzy_backend_sqlite_lsh_flush (struct rspamd_fuzzy_backend_sqlite *backend,
+		const struct rspamd_shingle *sgl, guint32 mask, gint64 id)
+{
+	guint i;
+	guint32 band_mask;
+
+	for (i = 0; i < RSPAMD_FUZZY_LSH_BANDS; i ++) {
+		band_mask = ((1ULL << RSPAMD_FUZZY_LSH_ROWS) - 1) <<
+				(i * RSPAMD_FUZZY_LSH_ROWS);
+
+		/* Shingles might be overwritten by other digests */
+		if ((mask & band_mask) == band_mask) {
+			rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
+					RSPAMD_FUZZY_BACKEND_INSERT_LSH,
+					rspamd_fuzzy_lsh_band_hash (sgl, i), (gint64)i, id);
+		}
+	}
+}
+
+/*
+ * Databases created before LSH index was introduced have shingles but no
+ * bands, so we need to build the index from the existing shingles once
+ */
+static void
+rspamd_fuzzy_backend_sqlite_build_lsh (struct rspamd_fuzzy_backend_sqlite *backend)
+{
+	static const gchar all_shingles[] = "SELECT digest_id, number, value "
+			"FROM shingles ORDER BY digest_id;";
+	sqlite3_stmt *stmt;
+	struct rspamd_shingle sgl;
+	gint64 cur_id = -1, id, number;
+	guint32 mask = 0;
+	guint ndigests = 0;
+
+	if (!rspamd_fuzzy_backend_sqlite_table_empty (backend,
+			"SELECT 1 FROM lsh LIMIT 1;") ||
+			rspamd_fuzzy_backend_sqlite_table_empty (backend,
+			"SELECT 1 FROM shingles LIMIT 1;")) {
+		return;
+	}
+
+	if (rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
+			RSPAMD_FUZZY_BACKEND_TRANSACTION_START) != SQLITE_OK) {
+		msg_warn_fuzzy_backend ("cannot start transaction to build lsh index: %s",
+				sqlite3_errmsg (backend->db));
+
+		return;
+	}
+
+	if (sqlite3_prepare_v2 (backend->db, all_shingles, -1, &stmt,
+			NULL) != SQLITE_OK) {
+		msg_warn_fuzzy_backend ("cannot build lsh index: %s",
+				sqlite3_errmsg (backend->db));
+		rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
+				RSPAMD_FUZZY_BACKEND_TRANSACTION_ROLLBACK);
+
+		return;
+	}
+
+	memset (&sgl, 0, sizeof (sgl));
+
+	while (sqlite3_step (stmt) == SQLITE_ROW) {
+		id = sqlite3_column_int64 (stmt, 0);
+		number = sqlite3_column_int64 (stmt, 1);
+
+		if (id != cur_id) {
+			if (cur_id != -1) {
+				rspamd_fuzzy_backend_sqlite_lsh_flush (backend, &sgl, mask,
+						cur_id);
+				ndigests ++;
+			}
+
+			cur_id = id;
+			mask = 0;
+		}
+
+		if (number >= 0 && number < RSPAMD_SHINGLE_SIZE) {
+			sgl.hashes[number] = sqlite3_column_int64 (stmt, 2);
+			mask |= 1U << number;
+		}
+	}
+
+	if (cur_id != -1) {
+		rspamd_fuzzy_backend_sqlite_lsh_flush (backend, &sgl, mask, cur_id);
+		ndigests ++;
+	}
+
+	sqlite3_finalize (stmt);
+
+	if (rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
+			RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT) != SQLITE_OK) {
+		msg_warn_fuzzy_backend ("cannot commit lsh index: %s",
+				sqlite3_errmsg (backend->db));
+		rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
+				RSPAMD_FUZZY_BACKEND_TRANSACTION_ROLLBACK);
+	}
+	else {
+		msg_info_fuzzy_backend ("built lsh index for %ud digests", ndigests);
+	}
+}
+
 struct rspamd_fuzzy_backend_sqlite *
 rspamd_fuzzy_backend_sqlite_open (const gchar *path,
 		gboolean vacuum,
@@ -480,6 +637,7 @@ rspamd_fuzzy_backend_sqlite_open (const gchar *path,
 	}
 
 	rspamd_fuzzy_backend_sqlite_cleanup_stmt (backend, RSPAMD_FUZZY_BACKEND_COUNT);
+	rspamd_fuzzy_backend_sqlite_build_lsh (backend);
 
 	return backend;
 }
@@ -492,16 +650,156 @@ rspamd_fuzzy_backend_sqlite_int64_cmp (const void *a, const void *b)
 	return (ia - ib);
 }
 
+/*
+ * Looks up every shingle separately and selects the most frequent digest
+ */
+static gint64
+rspamd_fuzzy_backend_sqlite_shingles_select (
+		struct rspamd_fuzzy_backend_sqlite *backend,
+		const struct rspamd_fuzzy_shingle_cmd *shcmd,
+		gint64 *matched)
+{
+	gint64 shingle_values[RSPAMD_SHINGLE_SIZE], i, sel_id, cur_id,
+		cur_cnt, max_cnt;
+	int rc;
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, FALSE,
+				RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE,
+				shcmd->sgl.hashes[i], i);
+		if (rc == SQLITE_OK) {
+			shingle_values[i] = sqlite3_column_int64 (
+					prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE].stmt,
+					0);
+		}
+		else {
+			shingle_values[i] = -1;
+		}
+		msg_debug_fuzzy_backend ("looking for shingle %L -> %L: %d", i,
+				shcmd->sgl.hashes[i], rc);
+	}
+
+	rspamd_fuzzy_backend_sqlite_cleanup_stmt (backend,
+			RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE);
+
+	qsort (shingle_values, RSPAMD_SHINGLE_SIZE, sizeof (gint64),
+			rspamd_fuzzy_backend_sqlite_int64_cmp);
+	sel_id = -1;
+	cur_id = -1;
+	cur_cnt = 0;
+	max_cnt = 0;
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		if (shingle_values[i] == -1) {
+			continue;
+		}
+
+		/* We have some value here, so we need to check it */
+		if (shingle_values[i] == cur_id) {
+			cur_cnt ++;
+		}
+		else {
+			cur_id = shingle_values[i];
+			if (cur_cnt >= max_cnt) {
+				max_cnt = cur_cnt;
+				sel_id = cur_id;
+			}
+			cur_cnt = 0;
+		}
+	}
+
+	if (cur_cnt > max_cnt) {
+		max_cnt = cur_cnt;
+	}
+
+	*matched = max_cnt;
+
+	return sel_id;
+}
+
+/*
+ * Looks up LSH bands to get candidates and verifies them by comparing all
+ * stored shingles of each candidate
+ */
+static gint64
+rspamd_fuzzy_backend_sqlite_lsh_select (
+		struct rspamd_fuzzy_backend_sqlite *backend,
+		const struct rspamd_fuzzy_shingle_cmd *shcmd,
+		gint64 *matched)
+{
+	gint64 candidates[RSPAMD_FUZZY_LSH_BANDS], sel_id = -1, cur_id, number,
+		cnt;
+	guint64 value;
+	guint ncandidates = 0, i, j;
+	sqlite3_stmt *stmt;
+	int rc;
+
+	*matched = 0;
+
+	for (i = 0; i < RSPAMD_FUZZY_LSH_BANDS; i ++) {
+		rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, FALSE,
+				RSPAMD_FUZZY_BACKEND_CHECK_LSH,
+				rspamd_fuzzy_lsh_band_hash (&shcmd->sgl, i), (gint)i);
+
+		if (rc == SQLITE_OK) {
+			cur_id = sqlite3_column_int64 (
+					prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK_LSH].stmt, 0);
+
+			for (j = 0; j < ncandidates; j ++) {
+				if (candidates[j] == cur_id) {
+					break;
+				}
+			}
+
+			if (j == ncandidates) {
+				candidates[ncandidates ++] = cur_id;
+			}
+		}
+	}
+
+	rspamd_fuzzy_backend_sqlite_cleanup_stmt (backend,
+			RSPAMD_FUZZY_BACKEND_CHECK_LSH);
+	msg_debug_fuzzy_backend ("found %ud lsh candidates", ncandidates);
+
+	for (i = 0; i < ncandidates; i ++) {
+		rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, FALSE,
+				RSPAMD_FUZZY_BACKEND_GET_SHINGLES_BY_ID, candidates[i]);
+		stmt = prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_SHINGLES_BY_ID].stmt;
+		cnt = 0;
+
+		while (rc == SQLITE_OK) {
+			value = sqlite3_column_int64 (stmt, 0);
+			number = sqlite3_column_int64 (stmt, 1);
+
+			if (number >= 0 && number < RSPAMD_SHINGLE_SIZE &&
+					shcmd->sgl.hashes[number] == value) {
+				cnt ++;
+			}
+
+			rc = sqlite3_step (stmt) == SQLITE_ROW ? SQLITE_OK : SQLITE_DONE;
+		}
+
+		rspamd_fuzzy_backend_sqlite_cleanup_stmt (backend,
+				RSPAMD_FUZZY_BACKEND_GET_SHINGLES_BY_ID);
+
+		if (cnt > *matched) {
+			*matched = cnt;
+			sel_id = candidates[i];
+		}
+	}
+
+	return sel_id;
+}
+
 struct rspamd_fuzzy_reply
 rspamd_fuzzy_backend_sqlite_check (struct rspamd_fuzzy_backend_sqlite *backend,
-		const struct rspamd_fuzzy_cmd *cmd, gint64 expire)
+		const struct rspamd_fuzzy_cmd *cmd, gint64 expire, gboolean use_lsh)
 {
 	struct rspamd_fuzzy_reply rep = {0, 0, 0, 0.0};
 	const struct rspamd_fuzzy_shingle_cmd *shcmd;
 	int rc;
 	gint64 timestamp;
-	gint64 shingle_values[RSPAMD_SHINGLE_SIZE], i, sel_id, cur_id,
-		cur_cnt, max_cnt;
+	gint64 sel_id, max_cnt;
 
 	if (backend == NULL) {
 		return rep;
@@ -535,53 +833,13 @@ rspamd_fuzzy_backend_sqlite_check (struct rspamd_fuzzy_backend_sqlite *backend,
 		rspamd_fuzzy_backend_sqlite_cleanup_stmt (backend, RSPAMD_FUZZY_BACKEND_CHECK);
 		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
 
-		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-			rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, FALSE,
-					RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE,
-					shcmd->sgl.hashes[i], i);
-			if (rc == SQLITE_OK) {
-				shingle_values[i] = sqlite3_column_int64 (
-						prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE].stmt,
-						0);
-			}
-			else {
-				shingle_values[i] = -1;
-			}
-			msg_debug_fuzzy_backend ("looking for shingle %L -> %L: %d", i,
-					shcmd->sgl.hashes[i], rc);
+		if (use_lsh) {
+			sel_id = rspamd_fuzzy_backend_sqlite_lsh_select (backend, shcmd,
+					&max_cnt);
 		}
-
-		rspamd_fuzzy_backend_sqlite_cleanup_stmt (backend,
-				RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE);
-
-		qsort (shingle_values, RSPAMD_SHINGLE_SIZE, sizeof (gint64),
-				rspamd_fuzzy_backend_sqlite_int64_cmp);
-		sel_id = -1;
-		cur_id = -1;
-		cur_cnt = 0;
-		max_cnt = 0;
-
-		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-			if (shingle_values[i] == -1) {
-				continue;
-			}
-
-			/* We have some value here, so we need to check it */
-			if (shingle_values[i] == cur_id) {
-				cur_cnt ++;
-			}
-			else {
-				cur_id = shingle_values[i];
-				if (cur_cnt >= max_cnt) {
-					max_cnt = cur_cnt;
-					sel_id = cur_id;
-				}
-				cur_cnt = 0;
-			}
-		}
-
-		if (cur_cnt > max_cnt) {
-			max_cnt = cur_cnt;
+		else {
+			sel_id = rspamd_fuzzy_backend_sqlite_shingles_select (backend, shcmd,
+					&max_cnt);
 		}
 
 		if (sel_id != -1) {
@@ -735,6 +993,19 @@ rspamd_fuzzy_backend_sqlite_add (struct rspamd_fuzzy_backend_sqlite *backend,
 								id, sqlite3_errmsg (backend->db));
 					}
 				}
+
+				for (i = 0; i < RSPAMD_FUZZY_LSH_BANDS; i++) {
+					rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
+							RSPAMD_FUZZY_BACKEND_INSERT_LSH,
+							rspamd_fuzzy_lsh_band_hash (&shcmd->sgl, i),
+							(gint64)i, id);
+
+					if (rc != SQLITE_OK) {
+						msg_warn_fuzzy_backend ("cannot add lsh band %d -> "
+								"%L: %s", i,
+								id, sqlite3_errmsg (backend->db));
+					}
+				}
 			}
 		}
 		else {
@@ -753,14 +1024,20 @@ rspamd_fuzzy_backend_sqlite_add (struct rspamd_fuzzy_backend_sqlite *backend,
 
 gboolean
 rspamd_fuzzy_backend_sqlite_finish_update (struct rspamd_fuzzy_backend_sqlite *backend,
-		const gchar *source, gboolean version_bump)
+		const gchar *source, gboolean version_bump, guint64 rev)
 {
-	gint rc = SQLITE_OK, wal_frames, wal_checkpointed, ver;
+	gint rc = SQLITE_OK, wal_frames, wal_checkpointed;
+	gint64 ver;
 
 	/* Get and update version */
 	if (version_bump) {
-		ver = rspamd_fuzzy_backend_sqlite_version (backend, source);
-		++ver;
+		if (rev != 0) {
+			ver = rev;
+		}
+		else {
+			ver = rspamd_fuzzy_backend_sqlite_version (backend, source);
+			++ver;
+		}
 
 		rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
 				RSPAMD_FUZZY_BACKEND_SET_VERSION,
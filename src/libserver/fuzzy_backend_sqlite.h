@@ -36,12 +36,14 @@ struct rspamd_fuzzy_backend_sqlite *rspamd_fuzzy_backend_sqlite_open (const gcha
  * Check specified fuzzy in the backend
  * @param backend
  * @param cmd
+ * @param use_lsh use LSH index to find fuzzy candidates
  * @return reply with probability and weight
  */
 struct rspamd_fuzzy_reply rspamd_fuzzy_backend_sqlite_check (
 		struct rspamd_fuzzy_backend_sqlite *backend,
 		const struct rspamd_fuzzy_cmd *cmd,
-		gint64 expire);
+		gint64 expire,
+		gboolean use_lsh);
 
 /**
  * Prepare storage for updates (by starting transaction)
@@ -69,10 +71,11 @@ gboolean rspamd_fuzzy_backend_sqlite_del (
 		const struct rspamd_fuzzy_cmd *cmd);
 
 /**
- * Commit updates to storage
+ * Commit updates to storage, if `rev` is not zero then the version of the
+ * source is set to it instead of being incremented
  */
 gboolean rspamd_fuzzy_backend_sqlite_finish_update (struct rspamd_fuzzy_backend_sqlite *backend,
-		const gchar *source, gboolean version_bump);
+		const gchar *source, gboolean version_bump, guint64 rev);
 
 /**
  * Sync storage
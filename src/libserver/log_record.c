@@ -0,0 +1,495 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamd.h"
+#include "log_record.h"
+#include "libmime/email_addr.h"
+#include "libutil/mempool_vars_internal.h"
+
+#define HDR_LEN (sizeof (RSPAMD_LOG_RECORD_MAGIC) - 1 + 2 + sizeof (guint16))
+#define FIELD_HDR_LEN (2 + sizeof (guint32))
+/* Space left for the scalar fields that might follow a list */
+#define RECORD_RESERVE 512
+/*
+ * Record size up to which each list might grow, so a long recipients list
+ * still leaves space for symbols
+ */
+#define RECORD_RCPT_LIMIT (RSPAMD_LOG_RECORD_BUF_SIZE / 4)
+#define RECORD_SYMBOLS_LIMIT (RSPAMD_LOG_RECORD_BUF_SIZE / 4 * 3)
+#define RECORD_URLS_LIMIT RSPAMD_LOG_RECORD_BUF_SIZE
+
+struct rspamd_log_record_writer {
+	GByteArray *buf;
+	guint16 nfields;
+	guint8 flags;
+};
+
+/*
+ * Checks if a list item of `need` bytes could be added so the record does
+ * not grow beyond `limit`, marks record as truncated otherwise
+ */
+static gboolean
+rspamd_log_record_fits (struct rspamd_log_record_writer *wr, gsize need,
+		gsize limit)
+{
+	if (wr->buf->len + need + RECORD_RESERVE > limit) {
+		wr->flags |= RSPAMD_LOG_RECORD_FLAG_TRUNCATED;
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gsize
+rspamd_log_record_field_start (struct rspamd_log_record_writer *wr,
+		enum rspamd_log_record_tag tag, enum rspamd_log_record_type type)
+{
+	guint8 hdr[2];
+	guint32 len = 0;
+	gsize off;
+
+	hdr[0] = tag;
+	hdr[1] = type;
+	g_byte_array_append (wr->buf, hdr, sizeof (hdr));
+	off = wr->buf->len;
+	g_byte_array_append (wr->buf, (const guint8 *)&len, sizeof (len));
+
+	return off;
+}
+
+static void
+rspamd_log_record_field_end (struct rspamd_log_record_writer *wr, gsize off)
+{
+	guint32 len;
+
+	len = wr->buf->len - off - sizeof (len);
+	memcpy (wr->buf->data + off, &len, sizeof (len));
+	wr->nfields ++;
+}
+
+static void
+rspamd_log_record_append_str (GByteArray *buf, const gchar *str, gsize len)
+{
+	guint16 slen;
+
+	slen = MIN (len, RSPAMD_LOG_RECORD_MAX_STR);
+	g_byte_array_append (buf, (const guint8 *)&slen, sizeof (slen));
+	g_byte_array_append (buf, (const guint8 *)str, slen);
+}
+
+static void
+rspamd_log_record_add_string (struct rspamd_log_record_writer *wr,
+		enum rspamd_log_record_tag tag, const gchar *str)
+{
+	gsize off;
+
+	if (str == NULL) {
+		return;
+	}
+
+	off = rspamd_log_record_field_start (wr, tag, RSPAMD_LOG_RECORD_STRING);
+	g_byte_array_append (wr->buf, (const guint8 *)str,
+			MIN (strlen (str), RSPAMD_LOG_RECORD_MAX_STR));
+	rspamd_log_record_field_end (wr, off);
+}
+
+static void
+rspamd_log_record_add_double (struct rspamd_log_record_writer *wr,
+		enum rspamd_log_record_tag tag, gdouble val)
+{
+	gsize off;
+
+	off = rspamd_log_record_field_start (wr, tag, RSPAMD_LOG_RECORD_DOUBLE);
+	g_byte_array_append (wr->buf, (const guint8 *)&val, sizeof (val));
+	rspamd_log_record_field_end (wr, off);
+}
+
+static void
+rspamd_log_record_add_uint (struct rspamd_log_record_writer *wr,
+		enum rspamd_log_record_tag tag, guint64 val)
+{
+	gsize off;
+
+	off = rspamd_log_record_field_start (wr, tag, RSPAMD_LOG_RECORD_UINT);
+	g_byte_array_append (wr->buf, (const guint8 *)&val, sizeof (val));
+	rspamd_log_record_field_end (wr, off);
+}
+
+GByteArray *
+rspamd_log_record_from_task (struct rspamd_task *task)
+{
+	struct rspamd_log_record_writer wr;
+	struct rspamd_metric_result *mres = task->result;
+	struct rspamd_symbol_result *sym;
+	struct rspamd_email_address *addr;
+	struct rspamd_url *url;
+	GHashTableIter it;
+	gpointer k, v;
+	guint32 *sid, cnt, i;
+	gsize off, cnt_off, len;
+	guint8 hdr[HDR_LEN];
+
+	wr.buf = g_byte_array_sized_new (1024);
+	wr.nfields = 0;
+	wr.flags = 0;
+
+	memset (hdr, 0, sizeof (hdr));
+	memcpy (hdr, RSPAMD_LOG_RECORD_MAGIC, sizeof (RSPAMD_LOG_RECORD_MAGIC) - 1);
+	hdr[sizeof (RSPAMD_LOG_RECORD_MAGIC) - 1] = RSPAMD_LOG_RECORD_VERSION;
+	g_byte_array_append (wr.buf, hdr, sizeof (hdr));
+
+	rspamd_log_record_add_double (&wr, RSPAMD_LOG_RECORD_TIME,
+			tv_to_double (&task->tv));
+	rspamd_log_record_add_string (&wr, RSPAMD_LOG_RECORD_MESSAGE_ID,
+			task->message_id);
+
+	if (task->from_addr) {
+		rspamd_log_record_add_string (&wr, RSPAMD_LOG_RECORD_IP,
+				rspamd_inet_address_to_string (task->from_addr));
+	}
+
+	rspamd_log_record_add_string (&wr, RSPAMD_LOG_RECORD_USER, task->user);
+
+	if (task->from_envelope && task->from_envelope->addr_len > 0) {
+		off = rspamd_log_record_field_start (&wr, RSPAMD_LOG_RECORD_FROM,
+				RSPAMD_LOG_RECORD_STRING);
+		g_byte_array_append (wr.buf,
+				(const guint8 *)task->from_envelope->addr,
+				MIN (task->from_envelope->addr_len, RSPAMD_LOG_RECORD_MAX_STR));
+		rspamd_log_record_field_end (&wr, off);
+	}
+
+	if (task->rcpt_envelope && task->rcpt_envelope->len > 0) {
+		off = rspamd_log_record_field_start (&wr, RSPAMD_LOG_RECORD_RCPT,
+				RSPAMD_LOG_RECORD_STRING_LIST);
+		cnt = 0;
+		cnt_off = wr.buf->len;
+		g_byte_array_append (wr.buf, (const guint8 *)&cnt, sizeof (cnt));
+
+		for (i = 0; i < task->rcpt_envelope->len; i ++) {
+			addr = g_ptr_array_index (task->rcpt_envelope, i);
+
+			if (!rspamd_log_record_fits (&wr, sizeof (guint16) +
+					MIN (addr->addr_len, RSPAMD_LOG_RECORD_MAX_STR),
+					RECORD_RCPT_LIMIT)) {
+				break;
+			}
+
+			rspamd_log_record_append_str (wr.buf, addr->addr, addr->addr_len);
+			cnt ++;
+		}
+
+		memcpy (wr.buf->data + cnt_off, &cnt, sizeof (cnt));
+		rspamd_log_record_field_end (&wr, off);
+	}
+
+	if (mres) {
+		rspamd_log_record_add_string (&wr, RSPAMD_LOG_RECORD_ACTION,
+				rspamd_action_to_str (mres->action));
+		rspamd_log_record_add_double (&wr, RSPAMD_LOG_RECORD_SCORE,
+				mres->score);
+		rspamd_log_record_add_double (&wr, RSPAMD_LOG_RECORD_REQUIRED_SCORE,
+				rspamd_task_get_required_score (task, mres));
+
+		off = rspamd_log_record_field_start (&wr,
+				RSPAMD_LOG_RECORD_SYMBOLS_LIST, RSPAMD_LOG_RECORD_SYMBOLS);
+		cnt = 0;
+		cnt_off = wr.buf->len;
+		g_byte_array_append (wr.buf, (const guint8 *)&cnt, sizeof (cnt));
+		g_hash_table_iter_init (&it, mres->symbols);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			sym = v;
+			len = strlen (sym->name);
+
+			if (!rspamd_log_record_fits (&wr, sizeof (guint16) +
+					MIN (len, RSPAMD_LOG_RECORD_MAX_STR) +
+					sizeof (sym->score), RECORD_SYMBOLS_LIMIT)) {
+				break;
+			}
+
+			rspamd_log_record_append_str (wr.buf, sym->name, len);
+			g_byte_array_append (wr.buf, (const guint8 *)&sym->score,
+					sizeof (sym->score));
+			cnt ++;
+		}
+
+		memcpy (wr.buf->data + cnt_off, &cnt, sizeof (cnt));
+		rspamd_log_record_field_end (&wr, off);
+	}
+
+	rspamd_log_record_add_uint (&wr, RSPAMD_LOG_RECORD_SIZE, task->msg.len);
+	rspamd_log_record_add_double (&wr, RSPAMD_LOG_RECORD_SCAN_TIME,
+			task->time_real_finish - task->time_real);
+	rspamd_log_record_add_double (&wr, RSPAMD_LOG_RECORD_VIRTUAL_TIME,
+			task->time_virtual_finish - task->time_virtual);
+
+	sid = rspamd_mempool_get_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_SETTINGS_HASH);
+
+	if (sid) {
+		rspamd_log_record_add_uint (&wr, RSPAMD_LOG_RECORD_SETTINGS_ID, *sid);
+	}
+
+	if (task->urls && g_hash_table_size (task->urls) > 0) {
+		off = rspamd_log_record_field_start (&wr, RSPAMD_LOG_RECORD_URLS,
+				RSPAMD_LOG_RECORD_STRING_LIST);
+		cnt = 0;
+		cnt_off = wr.buf->len;
+		g_byte_array_append (wr.buf, (const guint8 *)&cnt, sizeof (cnt));
+		g_hash_table_iter_init (&it, task->urls);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			url = k;
+
+			if (cnt >= RSPAMD_LOG_RECORD_MAX_URLS) {
+				wr.flags |= RSPAMD_LOG_RECORD_FLAG_TRUNCATED;
+				break;
+			}
+
+			if (!rspamd_log_record_fits (&wr, sizeof (guint16) +
+					MIN (url->urllen, RSPAMD_LOG_RECORD_MAX_STR),
+					RECORD_URLS_LIMIT)) {
+				break;
+			}
+
+			rspamd_log_record_append_str (wr.buf, url->string, url->urllen);
+			cnt ++;
+		}
+
+		memcpy (wr.buf->data + cnt_off, &cnt, sizeof (cnt));
+		rspamd_log_record_field_end (&wr, off);
+	}
+
+	wr.buf->data[sizeof (RSPAMD_LOG_RECORD_MAGIC)] = wr.flags;
+	memcpy (wr.buf->data + HDR_LEN - sizeof (wr.nfields), &wr.nfields,
+			sizeof (wr.nfields));
+
+	return wr.buf;
+}
+
+void
+rspamd_log_record_init (struct rspamd_log_record *rec)
+{
+	memset (rec, 0, sizeof (*rec));
+	rec->rcpts = g_array_new (FALSE, FALSE, sizeof (rspamd_ftok_t));
+	rec->urls = g_array_new (FALSE, FALSE, sizeof (rspamd_ftok_t));
+	rec->symbols = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamd_log_record_symbol));
+}
+
+void
+rspamd_log_record_destroy (struct rspamd_log_record *rec)
+{
+	g_array_free (rec->rcpts, TRUE);
+	g_array_free (rec->urls, TRUE);
+	g_array_free (rec->symbols, TRUE);
+}
+
+static gboolean
+rspamd_log_record_read_str (const guchar **pp, const guchar *end,
+		rspamd_ftok_t *tok)
+{
+	guint16 slen;
+
+	if (end - *pp < (gssize)sizeof (slen)) {
+		return FALSE;
+	}
+
+	memcpy (&slen, *pp, sizeof (slen));
+	*pp += sizeof (slen);
+
+	if (end - *pp < slen) {
+		return FALSE;
+	}
+
+	tok->begin = (const gchar *)*pp;
+	tok->len = slen;
+	*pp += slen;
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_log_record_parse_list (const guchar *p, const guchar *end,
+		GArray *ar, gboolean with_scores)
+{
+	struct rspamd_log_record_symbol sym;
+	guint32 cnt, i;
+
+	if (end - p < (gssize)sizeof (cnt)) {
+		return FALSE;
+	}
+
+	memcpy (&cnt, p, sizeof (cnt));
+	p += sizeof (cnt);
+
+	for (i = 0; i < cnt; i ++) {
+		if (!rspamd_log_record_read_str (&p, end, &sym.name)) {
+			return FALSE;
+		}
+
+		if (with_scores) {
+			if (end - p < (gssize)sizeof (sym.score)) {
+				return FALSE;
+			}
+
+			memcpy (&sym.score, p, sizeof (sym.score));
+			p += sizeof (sym.score);
+			g_array_append_val (ar, sym);
+		}
+		else {
+			g_array_append_val (ar, sym.name);
+		}
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_log_record_parse (struct rspamd_log_record *rec,
+		const guchar *data, gsize len)
+{
+	const guchar *p = data, *end = data + len;
+	guint16 nfields, i;
+	guint32 flen;
+	guint8 tag, type;
+	rspamd_ftok_t *tok;
+	gdouble *dval;
+	guint64 *uval;
+
+	g_array_set_size (rec->rcpts, 0);
+	g_array_set_size (rec->urls, 0);
+	g_array_set_size (rec->symbols, 0);
+	rec->ts = rec->score = rec->required_score = 0;
+	rec->scan_time = rec->virtual_time = 0;
+	rec->size = rec->settings_id = 0;
+	memset (&rec->message_id, 0, sizeof (rec->message_id));
+	memset (&rec->ip, 0, sizeof (rec->ip));
+	memset (&rec->user, 0, sizeof (rec->user));
+	memset (&rec->from, 0, sizeof (rec->from));
+	memset (&rec->action, 0, sizeof (rec->action));
+
+	if (len < HDR_LEN || memcmp (p, RSPAMD_LOG_RECORD_MAGIC,
+			sizeof (RSPAMD_LOG_RECORD_MAGIC) - 1) != 0) {
+		return FALSE;
+	}
+
+	rec->version = p[sizeof (RSPAMD_LOG_RECORD_MAGIC) - 1];
+	rec->flags = p[sizeof (RSPAMD_LOG_RECORD_MAGIC)];
+	memcpy (&nfields, p + HDR_LEN - sizeof (nfields), sizeof (nfields));
+	p += HDR_LEN;
+
+	for (i = 0; i < nfields; i ++) {
+		if (end - p < (gssize)FIELD_HDR_LEN) {
+			return FALSE;
+		}
+
+		tag = p[0];
+		type = p[1];
+		memcpy (&flen, p + 2, sizeof (flen));
+		p += FIELD_HDR_LEN;
+
+		if (end - p < (gssize)flen) {
+			return FALSE;
+		}
+
+		tok = NULL;
+		dval = NULL;
+		uval = NULL;
+
+		switch (tag) {
+		case RSPAMD_LOG_RECORD_MESSAGE_ID:
+			tok = &rec->message_id;
+			break;
+		case RSPAMD_LOG_RECORD_IP:
+			tok = &rec->ip;
+			break;
+		case RSPAMD_LOG_RECORD_USER:
+			tok = &rec->user;
+			break;
+		case RSPAMD_LOG_RECORD_FROM:
+			tok = &rec->from;
+			break;
+		case RSPAMD_LOG_RECORD_ACTION:
+			tok = &rec->action;
+			break;
+		case RSPAMD_LOG_RECORD_TIME:
+			dval = &rec->ts;
+			break;
+		case RSPAMD_LOG_RECORD_SCORE:
+			dval = &rec->score;
+			break;
+		case RSPAMD_LOG_RECORD_REQUIRED_SCORE:
+			dval = &rec->required_score;
+			break;
+		case RSPAMD_LOG_RECORD_SCAN_TIME:
+			dval = &rec->scan_time;
+			break;
+		case RSPAMD_LOG_RECORD_VIRTUAL_TIME:
+			dval = &rec->virtual_time;
+			break;
+		case RSPAMD_LOG_RECORD_SIZE:
+			uval = &rec->size;
+			break;
+		case RSPAMD_LOG_RECORD_SETTINGS_ID:
+			uval = &rec->settings_id;
+			break;
+		case RSPAMD_LOG_RECORD_RCPT:
+			if (type == RSPAMD_LOG_RECORD_STRING_LIST &&
+					!rspamd_log_record_parse_list (p, p + flen, rec->rcpts,
+							FALSE)) {
+				return FALSE;
+			}
+			break;
+		case RSPAMD_LOG_RECORD_URLS:
+			if (type == RSPAMD_LOG_RECORD_STRING_LIST &&
+					!rspamd_log_record_parse_list (p, p + flen, rec->urls,
+							FALSE)) {
+				return FALSE;
+			}
+			break;
+		case RSPAMD_LOG_RECORD_SYMBOLS_LIST:
+			if (type == RSPAMD_LOG_RECORD_SYMBOLS &&
+					!rspamd_log_record_parse_list (p, p + flen, rec->symbols,
+							TRUE)) {
+				return FALSE;
+			}
+			break;
+		default:
+			/* Unknown field */
+			break;
+		}
+
+		if (tok && type == RSPAMD_LOG_RECORD_STRING) {
+			tok->begin = (const gchar *)p;
+			tok->len = flen;
+		}
+		else if (dval && type == RSPAMD_LOG_RECORD_DOUBLE &&
+				flen == sizeof (*dval)) {
+			memcpy (dval, p, sizeof (*dval));
+		}
+		else if (uval && type == RSPAMD_LOG_RECORD_UINT &&
+				flen == sizeof (*uval)) {
+			memcpy (uval, p, sizeof (*uval));
+		}
+
+		p += flen;
+	}
+
+	return TRUE;
+}
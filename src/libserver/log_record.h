@@ -0,0 +1,130 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_LOG_RECORD_H
+#define RSPAMD_LOG_RECORD_H
+
+#include "config.h"
+#include "fstring.h"
+
+/*
+ * Binary task record sent by scanners to log pipes of type
+ * RSPAMD_LOG_PIPE_RECORDS, one record per packet. Integers and doubles are in
+ * host byte order as records never leave the host, `str` is a string
+ * prefixed by u16 length.
+ *
+ * record: magic[4] version:u8 flags:u8 nfields:u16 field[nfields]
+ * field:  tag:u8 type:u8 len:u32 data[len]
+ *
+ * Each field carries its type, so readers skip fields with unknown tags or
+ * unexpected types and new fields could be added without changing version.
+ */
+
+#define RSPAMD_LOG_RECORD_MAGIC "RSLR"
+#define RSPAMD_LOG_RECORD_VERSION 1
+/* Limits that keep a record within a single packet */
+#define RSPAMD_LOG_RECORD_MAX_URLS 64
+#define RSPAMD_LOG_RECORD_MAX_STR 1024
+/* Size of buffer enough to read any record, records never exceed it */
+#define RSPAMD_LOG_RECORD_BUF_SIZE (128 * 1024)
+/* Some items of recipients, symbols or URLs lists have been omitted */
+#define RSPAMD_LOG_RECORD_FLAG_TRUNCATED (1u << 0)
+
+enum rspamd_log_record_type {
+	RSPAMD_LOG_RECORD_STRING = 1,	/* raw bytes */
+	RSPAMD_LOG_RECORD_DOUBLE,		/* f64 */
+	RSPAMD_LOG_RECORD_UINT,			/* u64 */
+	RSPAMD_LOG_RECORD_STRING_LIST,	/* count:u32 str[count] */
+	RSPAMD_LOG_RECORD_SYMBOLS,		/* count:u32 (name:str score:f64)[count] */
+};
+
+enum rspamd_log_record_tag {
+	RSPAMD_LOG_RECORD_TIME = 1,
+	RSPAMD_LOG_RECORD_MESSAGE_ID,
+	RSPAMD_LOG_RECORD_IP,
+	RSPAMD_LOG_RECORD_USER,
+	RSPAMD_LOG_RECORD_FROM,
+	RSPAMD_LOG_RECORD_RCPT,
+	RSPAMD_LOG_RECORD_ACTION,
+	RSPAMD_LOG_RECORD_SCORE,
+	RSPAMD_LOG_RECORD_REQUIRED_SCORE,
+	RSPAMD_LOG_RECORD_SIZE,
+	RSPAMD_LOG_RECORD_SCAN_TIME,
+	RSPAMD_LOG_RECORD_VIRTUAL_TIME,
+	RSPAMD_LOG_RECORD_SETTINGS_ID,
+	RSPAMD_LOG_RECORD_SYMBOLS_LIST,
+	RSPAMD_LOG_RECORD_URLS,
+};
+
+struct rspamd_log_record_symbol {
+	rspamd_ftok_t name;
+	gdouble score;
+};
+
+/*
+ * Parsed record, strings point to the parsed buffer
+ */
+struct rspamd_log_record {
+	guint version;
+	guint flags;
+	gdouble ts;
+	gdouble score;
+	gdouble required_score;
+	gdouble scan_time;
+	gdouble virtual_time;
+	guint64 size;
+	guint64 settings_id;
+	rspamd_ftok_t message_id;
+	rspamd_ftok_t ip;
+	rspamd_ftok_t user;
+	rspamd_ftok_t from;
+	rspamd_ftok_t action;
+	GArray *rcpts;		/* rspamd_ftok_t */
+	GArray *urls;		/* rspamd_ftok_t */
+	GArray *symbols;	/* struct rspamd_log_record_symbol */
+};
+
+struct rspamd_task;
+
+/**
+ * Serialize task to a binary record
+ * @param task task object
+ * @return new byte array
+ */
+GByteArray *rspamd_log_record_from_task (struct rspamd_task *task);
+
+/**
+ * Init record structure, it could be reused for many records
+ * @param rec record
+ */
+void rspamd_log_record_init (struct rspamd_log_record *rec);
+
+/**
+ * Parse binary record
+ * @param rec initialized record
+ * @param data input
+ * @param len length of input
+ * @return TRUE if a record has been parsed
+ */
+gboolean rspamd_log_record_parse (struct rspamd_log_record *rec,
+		const guchar *data, gsize len);
+
+/**
+ * Free arrays of record structure
+ * @param rec record
+ */
+void rspamd_log_record_destroy (struct rspamd_log_record *rec);
+
+#endif
@@ -112,7 +112,8 @@ rspamd_milter_session_reset (struct rspamd_milter_session *session,
 
 	if (how & RSPAMD_MILTER_RESET_COMMON) {
 		if (session->message) {
-			session->message->len = 0;
+			rspamd_http_message_unref (session->message);
+			session->message = NULL;
 		}
 
 		if (session->rcpts) {
@@ -176,10 +177,6 @@ rspamd_milter_session_dtor (struct rspamd_milter_session *session)
 			rspamd_fstring_free (priv->parser.buf);
 		}
 
-		if (session->message) {
-			rspamd_fstring_free (session->message);
-		}
-
 		if (session->helo) {
 			rspamd_fstring_free (session->helo);
 		}
@@ -260,6 +257,42 @@ rspamd_milter_plan_io (struct rspamd_milter_session *session,
 	(var) = ntohs (var); \
 } while (0)
 
+/*
+ * Message is assembled directly in a shared memory segment, so the proxy can
+ * pass it to a scanner without copying
+ */
+static gboolean
+rspamd_milter_message_append (struct rspamd_milter_session *session,
+		struct rspamd_milter_private *priv,
+		const gchar *data, gsize len)
+{
+	GError *err;
+
+	if (session->message == NULL) {
+		session->message = rspamd_http_new_message (HTTP_REQUEST);
+		session->message->flags |= RSPAMD_HTTP_FLAG_SHMEM;
+
+		if (!rspamd_http_message_set_body (session->message, NULL,
+				RSPAMD_MILTER_MESSAGE_CHUNK)) {
+			goto err;
+		}
+	}
+
+	if (len > 0 && !rspamd_http_message_append_body (session->message,
+			data, len)) {
+		goto err;
+	}
+
+	return TRUE;
+
+err:
+	err = g_error_new (rspamd_milter_quark (), errno, "cannot store "
+			"message: %s", strerror (errno));
+	rspamd_milter_on_protocol_error (session, priv, err);
+
+	return FALSE;
+}
+
 static gboolean
 rspamd_milter_process_command (struct rspamd_milter_session *session,
 		struct rspamd_milter_private *priv)
@@ -281,14 +314,11 @@ rspamd_milter_process_command (struct rspamd_milter_session *session,
 		rspamd_milter_session_reset (session, RSPAMD_MILTER_RESET_ABORT);
 		break;
 	case RSPAMD_MILTER_CMD_BODY:
-		if (!session->message) {
-			session->message = rspamd_fstring_sized_new (
-					RSPAMD_MILTER_MESSAGE_CHUNK);
-		}
-
 		msg_debug_milter ("got body chunk: %d bytes", (int)cmdlen);
-		session->message = rspamd_fstring_append (session->message,
-				pos, cmdlen);
+
+		if (!rspamd_milter_message_append (session, priv, pos, cmdlen)) {
+			return FALSE;
+		}
 		break;
 	case RSPAMD_MILTER_CMD_CONNECT:
 		msg_debug_milter ("got connect command");
@@ -547,9 +577,16 @@ rspamd_milter_process_command (struct rspamd_milter_session *session,
 							GINT_TO_POINTER (num));
 				}
 
-				rspamd_printf_fstring (&session->message, "%*s: %*s\r\n",
-						(int)(zero - pos), pos,
-						(int)(end - zero - 2), zero + 1);
+				if (!rspamd_milter_message_append (session, priv,
+							pos, zero - pos) ||
+						!rspamd_milter_message_append (session, priv,
+							": ", 2) ||
+						!rspamd_milter_message_append (session, priv,
+							zero + 1, end - zero - 2) ||
+						!rspamd_milter_message_append (session, priv,
+							"\r\n", 2)) {
+					return FALSE;
+				}
 			}
 			else {
 				err = g_error_new (rspamd_milter_quark (), EINVAL, "invalid "
@@ -600,14 +637,15 @@ rspamd_milter_process_command (struct rspamd_milter_session *session,
 		break;
 	case RSPAMD_MILTER_CMD_EOH:
 		msg_debug_milter ("got eoh command");
+		/*
+		 * Headers are not processed here: MTA does not wait for replies to
+		 * header commands, and the scanner gets the message as a single
+		 * shared segment when the body is complete
+		 */
 
-		if (!session->message) {
-			session->message = rspamd_fstring_sized_new (
-					RSPAMD_MILTER_MESSAGE_CHUNK);
+		if (!rspamd_milter_message_append (session, priv, "\r\n", 2)) {
+			return FALSE;
 		}
-
-		session->message = rspamd_fstring_append (session->message,
-				"\r\n", 2);
 		break;
 	case RSPAMD_MILTER_CMD_OPTNEG:
 		if (cmdlen != sizeof (guint32) * 3) {
@@ -700,9 +738,8 @@ rspamd_milter_process_command (struct rspamd_milter_session *session,
 		}
 		break;
 	case RSPAMD_MILTER_CMD_DATA:
-		if (!session->message) {
-			session->message = rspamd_fstring_sized_new (
-					RSPAMD_MILTER_MESSAGE_CHUNK);
+		if (!rspamd_milter_message_append (session, priv, NULL, 0)) {
+			return FALSE;
 		}
 		msg_debug_milter ("got data command");
 		/* We do not need reply as specified */
@@ -1305,15 +1342,17 @@ rspamd_milter_to_http (struct rspamd_milter_session *session)
 
 	g_assert (session != NULL);
 
-	msg = rspamd_http_new_message (HTTP_REQUEST);
-
-	msg->url = rspamd_fstring_assign (msg->url, "/" MSG_CMD_CHECK_V2,
-			sizeof ("/" MSG_CMD_CHECK_V2) - 1);
-
 	if (session->message) {
-		rspamd_http_message_set_body_from_fstring_steal (msg, session->message);
+		/* Body is already in place */
+		msg = session->message;
 		session->message = NULL;
 	}
+	else {
+		msg = rspamd_http_new_message (HTTP_REQUEST);
+	}
+
+	msg->url = rspamd_fstring_assign (msg->url, "/" MSG_CMD_CHECK_V2,
+			sizeof ("/" MSG_CMD_CHECK_V2) - 1);
 
 	if (session->hostname && session->hostname->len > 0) {
 		rspamd_http_message_add_header_fstr (msg, HOSTNAME_HEADER,
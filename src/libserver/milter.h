@@ -48,7 +48,8 @@ struct rspamd_milter_session {
 	GPtrArray *rcpts;
 	rspamd_fstring_t *helo;
 	rspamd_fstring_t *hostname;
-	rspamd_fstring_t *message;
+	/* Message being received, its body is stored in shared memory */
+	struct rspamd_http_message *message;
 	void *priv;
 	ref_entry_t ref;
 };
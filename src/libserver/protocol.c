@@ -23,7 +23,9 @@
 #include "lua/lua_common.h"
 #include "unix-std.h"
 #include "protocol_internal.h"
-#include "libserver/mempool_vars_internal.h"
+#include "protocol_binary.h"
+#include "libutil/mempool_vars_internal.h"
+#include "log_record.h"
 #include <math.h>
 
 static GQuark
@@ -311,7 +313,19 @@ rspamd_protocol_handle_headers (struct rspamd_task *task,
 					debug_task ("read rcpt header, value: %V", hv);
 				}
 				else {
-					debug_task ("wrong header: %V", hn);
+					IF_HEADER (RSPAMD_PROTOCOL_REPLY_FORMAT_HEADER) {
+						srch.begin = "binary";
+						srch.len = 6;
+
+						debug_task ("read reply format header, value: %V", hv);
+
+						if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
+							task->reply_format = RSPAMD_TASK_REPLY_BINARY;
+						}
+					}
+					else {
+						debug_task ("wrong header: %V", hn);
+					}
 				}
 				break;
 			case 'i':
@@ -361,8 +375,8 @@ rspamd_protocol_handle_headers (struct rspamd_task *task,
 							hv_tok->begin, hv_tok->len, 0xdeadbabe);
 					hp = rspamd_mempool_alloc (task->task_pool, sizeof (*hp));
 					memcpy (hp, &h, sizeof (*hp));
-					rspamd_mempool_set_variable (task->task_pool,
-							RSPAMD_MEMPOOL_SETTINGS_HASH,
+					rspamd_mempool_set_variable_idx (task->task_pool,
+							RSPAMD_MEMPOOL_VAR_SETTINGS_HASH,
 							hp, NULL);
 				}
 				break;
@@ -429,16 +443,16 @@ rspamd_protocol_handle_headers (struct rspamd_task *task,
 				IF_HEADER (MTA_TAG_HEADER) {
 					gchar *mta_tag;
 					mta_tag = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
-					rspamd_mempool_set_variable (task->task_pool,
-							RSPAMD_MEMPOOL_MTA_TAG,
+					rspamd_mempool_set_variable_idx (task->task_pool,
+							RSPAMD_MEMPOOL_VAR_MTA_TAG,
 							mta_tag, NULL);
 					debug_task ("read MTA-Tag header, value: %s", mta_tag);
 				}
 				IF_HEADER (MTA_NAME_HEADER) {
 					gchar *mta_name;
 					mta_name = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
-					rspamd_mempool_set_variable (task->task_pool,
-							RSPAMD_MEMPOOL_MTA_NAME,
+					rspamd_mempool_set_variable_idx (task->task_pool,
+							RSPAMD_MEMPOOL_VAR_MTA_NAME,
 							mta_name, NULL);
 					debug_task ("read MTA-Name header, value: %s", mta_name);
 				}
@@ -646,6 +660,32 @@ rspamd_protocol_extended_url (struct rspamd_task *task,
 	return obj;
 }
 
+static void
+rspamd_protocol_log_url (struct rspamd_task *task,
+		const gchar *encoded, gsize enclen)
+{
+	const gchar *user_field = "unknown";
+	gboolean has_user = FALSE;
+	guint len = 0;
+
+	if (task->user) {
+		user_field = task->user;
+		len = strlen (task->user);
+		has_user = TRUE;
+	}
+	else if (task->from_envelope) {
+		user_field = task->from_envelope->addr;
+		len = task->from_envelope->addr_len;
+	}
+
+	msg_info_task_encrypted ("<%s> %s: %*s; ip: %s; URL: %*s",
+		task->message_id,
+		has_user ? "user" : "from",
+		len, user_field,
+		rspamd_inet_address_to_string (task->from_addr),
+		(gint)enclen, encoded);
+}
+
 /*
  * Callback for writing urls
  */
@@ -656,9 +696,7 @@ urls_protocol_cb (gpointer key, gpointer value, gpointer ud)
 	struct rspamd_url *url = value;
 	ucl_object_t *obj;
 	struct rspamd_task *task = cb->task;
-	const gchar *user_field = "unknown", *encoded;
-	gboolean has_user = FALSE;
-	guint len = 0;
+	const gchar *encoded;
 	gsize enclen;
 
 	encoded = rspamd_url_encode (url, &enclen, task->task_pool);
@@ -673,22 +711,7 @@ urls_protocol_cb (gpointer key, gpointer value, gpointer ud)
 	ucl_array_append (cb->top, obj);
 
 	if (cb->task->cfg->log_urls) {
-		if (task->user) {
-			user_field = task->user;
-			len = strlen (task->user);
-			has_user = TRUE;
-		}
-		else if (task->from_envelope) {
-			user_field = task->from_envelope->addr;
-			len = task->from_envelope->addr_len;
-		}
-
-		msg_info_task_encrypted ("<%s> %s: %*s; ip: %s; URL: %*s",
-			task->message_id,
-			has_user ? "user" : "from",
-			len, user_field,
-			rspamd_inet_address_to_string (task->from_addr),
-			(gint)enclen, encoded);
+		rspamd_protocol_log_url (task, encoded, enclen);
 	}
 }
 
@@ -1050,7 +1073,8 @@ rspamd_protocol_output_profiling (struct rspamd_task *task,
 	gdouble val;
 
 	prof = ucl_object_typed_new (UCL_OBJECT);
-	tbl = rspamd_mempool_get_variable (task->task_pool, "profile");
+	tbl = rspamd_mempool_get_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_PROFILE);
 
 	if (tbl) {
 		g_hash_table_iter_init (&it, tbl);
@@ -1086,10 +1110,10 @@ rspamd_protocol_write_ucl (struct rspamd_task *task,
 	GString *dkim_sig;
 	const ucl_object_t *milter_reply;
 	struct rspamd_saved_protocol_reply *cached;
-	static const gchar *varname = RSPAMD_MEMPOOL_CACHED_REPLY;
 
 	/* Check for cached reply */
-	cached = rspamd_mempool_get_variable (task->task_pool, varname);
+	cached = rspamd_mempool_get_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_CACHED_REPLY);
 
 	if (cached) {
 		top = cached->obj;
@@ -1107,7 +1131,8 @@ rspamd_protocol_write_ucl (struct rspamd_task *task,
 		cached = rspamd_mempool_alloc (task->task_pool, sizeof (*cached));
 		cached->obj = top;
 		cached->flags = flags;
-		rspamd_mempool_set_variable (task->task_pool, varname,
+		rspamd_mempool_set_variable_idx (task->task_pool,
+				RSPAMD_MEMPOOL_VAR_CACHED_REPLY,
 				cached, rspamd_protocol_cached_dtor);
 
 		/* We also set scan time here */
@@ -1172,8 +1197,8 @@ rspamd_protocol_write_ucl (struct rspamd_task *task,
 	}
 
 	if (flags & RSPAMD_PROTOCOL_DKIM) {
-		dkim_sig = rspamd_mempool_get_variable (task->task_pool,
-				RSPAMD_MEMPOOL_DKIM_SIGNATURE);
+		dkim_sig = rspamd_mempool_get_variable_idx (task->task_pool,
+				RSPAMD_MEMPOOL_VAR_DKIM_SIGNATURE);
 
 		if (dkim_sig) {
 			GString *folded_header;
@@ -1210,8 +1235,8 @@ rspamd_protocol_write_ucl (struct rspamd_task *task,
 	}
 
 	if (flags & RSPAMD_PROTOCOL_RMILTER) {
-		milter_reply = rspamd_mempool_get_variable (task->task_pool,
-				RSPAMD_MEMPOOL_MILTER_REPLY);
+		milter_reply = rspamd_mempool_get_variable_idx (task->task_pool,
+				RSPAMD_MEMPOOL_VAR_MILTER_REPLY);
 
 		if (milter_reply) {
 			if (task->cmd == CMD_CHECK_V2) {
@@ -1228,6 +1253,770 @@ rspamd_protocol_write_ucl (struct rspamd_task *task,
 	return top;
 }
 
+/*
+ * Streaming JSON output: emits the same reply as `rspamd_protocol_write_ucl`
+ * followed by compact JSON emitting, but without building an UCL tree
+ */
+
+/*
+ * Characters escaped by libucl JSON emitter: control characters except NUL
+ * and vertical tab, DEL, quote and backslash. Other bytes, including
+ * non-ASCII ones, are copied as is.
+ */
+static inline gboolean
+rspamd_protocol_json_unsafe (guchar c)
+{
+	return (c > 0 && c < 0x20 && c != '\v') || c == 0x7f ||
+			c == '"' || c == '\\';
+}
+
+static void
+rspamd_protocol_json_string (rspamd_fstring_t **out,
+		const gchar *str, gsize len)
+{
+	const gchar *p = str, *c = str, *end = str + len, *esc;
+
+	*out = rspamd_fstring_append_chars (*out, '"', 1);
+
+	while (p < end) {
+		if (!rspamd_protocol_json_unsafe (*p)) {
+			p ++;
+			continue;
+		}
+
+		switch (*p) {
+		case '\n':
+			esc = "\\n";
+			break;
+		case '\r':
+			esc = "\\r";
+			break;
+		case '\b':
+			esc = "\\b";
+			break;
+		case '\t':
+			esc = "\\t";
+			break;
+		case '\f':
+			esc = "\\f";
+			break;
+		case '\\':
+			esc = "\\\\";
+			break;
+		case '"':
+			esc = "\\\"";
+			break;
+		default:
+			esc = "\\uFFFD";
+			break;
+		}
+
+		if (p > c) {
+			*out = rspamd_fstring_append (*out, c, p - c);
+		}
+
+		*out = rspamd_fstring_append (*out, esc, strlen (esc));
+		c = ++p;
+	}
+
+	if (p > c) {
+		*out = rspamd_fstring_append (*out, c, p - c);
+	}
+
+	*out = rspamd_fstring_append_chars (*out, '"', 1);
+}
+
+static void
+rspamd_protocol_json_key (rspamd_fstring_t **out, const gchar *key,
+		gboolean *first)
+{
+	if (!*first) {
+		*out = rspamd_fstring_append_chars (*out, ',', 1);
+	}
+
+	*first = FALSE;
+	rspamd_protocol_json_string (out, key, strlen (key));
+	*out = rspamd_fstring_append_chars (*out, ':', 1);
+}
+
+static void
+rspamd_protocol_json_double (rspamd_fstring_t **out, gdouble val)
+{
+	const gdouble delta = 0.0000001;
+
+	/* Keep the same format as UCL emitter uses */
+	if (val == (gdouble)((gint)val)) {
+		rspamd_printf_fstring (out, "%.1f", val);
+	}
+	else if (fabs (val - (gdouble)(gint)val) < delta) {
+		rspamd_printf_fstring (out, "%.*g", DBL_DIG, val);
+	}
+	else {
+		rspamd_printf_fstring (out, "%f", val);
+	}
+}
+
+static void
+rspamd_protocol_json_bool (rspamd_fstring_t **out, gboolean val)
+{
+	if (val) {
+		*out = rspamd_fstring_append (*out, "true", 4);
+	}
+	else {
+		*out = rspamd_fstring_append (*out, "false", 5);
+	}
+}
+
+static void
+rspamd_protocol_json_extended_url (struct rspamd_task *task,
+		struct rspamd_url *url,
+		const gchar *encoded, gsize enclen,
+		rspamd_fstring_t **out)
+{
+	gboolean first = TRUE;
+
+	*out = rspamd_fstring_append_chars (*out, '{', 1);
+	rspamd_protocol_json_key (out, "url", &first);
+	rspamd_protocol_json_string (out, encoded, enclen);
+
+	if (url->surbllen > 0) {
+		rspamd_protocol_json_key (out, "surbl", &first);
+		rspamd_protocol_json_string (out, url->surbl, url->surbllen);
+	}
+	if (url->hostlen > 0) {
+		rspamd_protocol_json_key (out, "host", &first);
+		rspamd_protocol_json_string (out, url->host, url->hostlen);
+	}
+
+	rspamd_protocol_json_key (out, "phished", &first);
+	rspamd_protocol_json_bool (out, url->flags & RSPAMD_URL_FLAG_PHISHED);
+	rspamd_protocol_json_key (out, "redirected", &first);
+	rspamd_protocol_json_bool (out, url->flags & RSPAMD_URL_FLAG_REDIRECTED);
+
+	if (url->phished_url) {
+		encoded = rspamd_url_encode (url->phished_url, &enclen, task->task_pool);
+		rspamd_protocol_json_key (out, "orig_url", &first);
+		rspamd_protocol_json_extended_url (task, url->phished_url, encoded,
+				enclen, out);
+	}
+
+	*out = rspamd_fstring_append_chars (*out, '}', 1);
+}
+
+static void
+rspamd_protocol_json_urls (struct rspamd_task *task, rspamd_fstring_t **out)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_url *url;
+	const gchar *encoded;
+	gsize enclen;
+	gboolean first = TRUE;
+
+	*out = rspamd_fstring_append_chars (*out, '[', 1);
+	g_hash_table_iter_init (&it, task->urls);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		url = v;
+		encoded = rspamd_url_encode (url, &enclen, task->task_pool);
+
+		if (!first) {
+			*out = rspamd_fstring_append_chars (*out, ',', 1);
+		}
+
+		first = FALSE;
+
+		if (!(task->flags & RSPAMD_TASK_FLAG_EXT_URLS)) {
+			rspamd_protocol_json_string (out, encoded, enclen);
+		}
+		else {
+			rspamd_protocol_json_extended_url (task, url, encoded, enclen, out);
+		}
+
+		if (task->cfg->log_urls) {
+			rspamd_protocol_log_url (task, encoded, enclen);
+		}
+	}
+
+	*out = rspamd_fstring_append_chars (*out, ']', 1);
+}
+
+static void
+rspamd_protocol_json_emails (struct rspamd_task *task, rspamd_fstring_t **out)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_url *url;
+	gboolean first = TRUE;
+
+	*out = rspamd_fstring_append_chars (*out, '[', 1);
+	g_hash_table_iter_init (&it, task->emails);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		url = v;
+
+		if (url->userlen > 0 && url->hostlen > 0 &&
+				url->host == url->user + url->userlen + 1) {
+			if (!first) {
+				*out = rspamd_fstring_append_chars (*out, ',', 1);
+			}
+
+			first = FALSE;
+			rspamd_protocol_json_string (out, url->user,
+					url->userlen + url->hostlen + 1);
+		}
+	}
+
+	*out = rspamd_fstring_append_chars (*out, ']', 1);
+}
+
+static void
+rspamd_protocol_json_symbol (struct rspamd_task *task,
+		struct rspamd_symbol_result *sym, rspamd_fstring_t **out)
+{
+	struct rspamd_symbol_option *opt;
+	gboolean first = TRUE, first_opt = TRUE;
+
+	*out = rspamd_fstring_append_chars (*out, '{', 1);
+	rspamd_protocol_json_key (out, "name", &first);
+	rspamd_protocol_json_string (out, sym->name, strlen (sym->name));
+	rspamd_protocol_json_key (out, "score", &first);
+	rspamd_protocol_json_double (out, sym->score);
+
+	if (task->cmd == CMD_CHECK_V2) {
+		rspamd_protocol_json_key (out, "metric_score", &first);
+		rspamd_protocol_json_double (out, sym->sym ? sym->sym->score : 0.0);
+	}
+
+	if (sym->sym != NULL && sym->sym->description) {
+		rspamd_protocol_json_key (out, "description", &first);
+		rspamd_protocol_json_string (out, sym->sym->description,
+				strlen (sym->sym->description));
+	}
+
+	if (sym->options != NULL) {
+		rspamd_protocol_json_key (out, "options", &first);
+		*out = rspamd_fstring_append_chars (*out, '[', 1);
+
+		DL_FOREACH (sym->opts_head, opt) {
+			if (!first_opt) {
+				*out = rspamd_fstring_append_chars (*out, ',', 1);
+			}
+
+			first_opt = FALSE;
+			rspamd_protocol_json_string (out, opt->option,
+					strlen (opt->option));
+		}
+
+		*out = rspamd_fstring_append_chars (*out, ']', 1);
+	}
+
+	*out = rspamd_fstring_append_chars (*out, '}', 1);
+}
+
+static void
+rspamd_protocol_json_metric (struct rspamd_task *task,
+		struct rspamd_metric_result *mres, rspamd_fstring_t **out,
+		gboolean *top_first)
+{
+	GHashTableIter hiter;
+	enum rspamd_metric_action action;
+	gpointer h, v;
+	const gchar *subject;
+	gboolean first = TRUE, *pfirst;
+
+	if (mres->action == METRIC_ACTION_MAX) {
+		mres->action = rspamd_check_action_metric (task, mres);
+	}
+
+	action = mres->action;
+
+	if (task->cmd != CMD_CHECK_V2) {
+		rspamd_protocol_json_key (out, DEFAULT_METRIC, top_first);
+		*out = rspamd_fstring_append_chars (*out, '{', 1);
+		pfirst = &first;
+		rspamd_protocol_json_key (out, "is_spam", pfirst);
+		rspamd_protocol_json_bool (out, action < METRIC_ACTION_GREYLIST);
+	}
+	else {
+		pfirst = top_first;
+	}
+
+	rspamd_protocol_json_key (out, "is_skipped", pfirst);
+	rspamd_protocol_json_bool (out, RSPAMD_TASK_IS_SKIPPED (task));
+	rspamd_protocol_json_key (out, "score", pfirst);
+	rspamd_protocol_json_double (out, isnan (mres->score) ? 0.0 : mres->score);
+	rspamd_protocol_json_key (out, "required_score", pfirst);
+	rspamd_protocol_json_double (out,
+			rspamd_task_get_required_score (task, mres));
+	rspamd_protocol_json_key (out, "action", pfirst);
+	rspamd_protocol_json_string (out, rspamd_action_to_str (action),
+			strlen (rspamd_action_to_str (action)));
+
+	if (action == METRIC_ACTION_REWRITE_SUBJECT) {
+		subject = make_rewritten_subject (mres->metric, task);
+
+		if (subject) {
+			rspamd_protocol_json_key (out, "subject", pfirst);
+			rspamd_protocol_json_string (out, subject, strlen (subject));
+		}
+	}
+
+	if (task->cmd == CMD_CHECK_V2) {
+		rspamd_protocol_json_key (out, "symbols", top_first);
+		*out = rspamd_fstring_append_chars (*out, '{', 1);
+		first = TRUE;
+	}
+
+	g_hash_table_iter_init (&hiter, mres->symbols);
+
+	while (g_hash_table_iter_next (&hiter, &h, &v)) {
+		rspamd_protocol_json_key (out, h, &first);
+		rspamd_protocol_json_symbol (task, v, out);
+	}
+
+	*out = rspamd_fstring_append_chars (*out, '}', 1);
+}
+
+/*
+ * Writes scan reply as compact JSON directly to the output buffer
+ */
+static void
+rspamd_protocol_write_json (struct rspamd_task *task,
+		enum rspamd_protocol_flags flags, rspamd_fstring_t **out)
+{
+	GString *dkim_sig;
+	const ucl_object_t *milter_reply;
+	gboolean first = TRUE;
+
+	*out = rspamd_fstring_append_chars (*out, '{', 1);
+
+	if (flags & RSPAMD_PROTOCOL_METRICS) {
+		rspamd_protocol_json_metric (task, task->result, out, &first);
+	}
+
+	if (flags & RSPAMD_PROTOCOL_MESSAGES) {
+		rspamd_protocol_json_key (out, "messages", &first);
+
+		if (G_UNLIKELY (task->cfg->compat_messages)) {
+			const ucl_object_t *cur;
+			ucl_object_iter_t iter = NULL;
+			gboolean first_msg = TRUE;
+
+			*out = rspamd_fstring_append_chars (*out, '[', 1);
+
+			while ((cur = ucl_object_iterate (task->messages, &iter, true)) != NULL) {
+				if (cur->type == UCL_STRING) {
+					if (!first_msg) {
+						*out = rspamd_fstring_append_chars (*out, ',', 1);
+					}
+
+					first_msg = FALSE;
+					rspamd_protocol_json_string (out, cur->value.sv, cur->len);
+				}
+			}
+
+			*out = rspamd_fstring_append_chars (*out, ']', 1);
+		}
+		else {
+			rspamd_ucl_emit_fstring (task->messages, UCL_EMIT_JSON_COMPACT, out);
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_URLS) {
+		if (task->cfg->log_urls || (task->flags & RSPAMD_TASK_FLAG_EXT_URLS)) {
+			if (g_hash_table_size (task->urls) > 0) {
+				rspamd_protocol_json_key (out, "urls", &first);
+				rspamd_protocol_json_urls (task, out);
+			}
+			if (g_hash_table_size (task->emails) > 0) {
+				rspamd_protocol_json_key (out, "emails", &first);
+				rspamd_protocol_json_emails (task, out);
+			}
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_EXTRA) {
+		if (G_UNLIKELY (RSPAMD_TASK_IS_PROFILING (task))) {
+			GHashTable *tbl;
+			GHashTableIter it;
+			gpointer k, v;
+			gboolean first_prof = TRUE;
+
+			rspamd_protocol_json_key (out, "profile", &first);
+			*out = rspamd_fstring_append_chars (*out, '{', 1);
+			tbl = rspamd_mempool_get_variable_idx (task->task_pool,
+					RSPAMD_MEMPOOL_VAR_PROFILE);
+
+			if (tbl) {
+				g_hash_table_iter_init (&it, tbl);
+
+				while (g_hash_table_iter_next (&it, &k, &v)) {
+					rspamd_protocol_json_key (out, k, &first_prof);
+					rspamd_protocol_json_double (out, *(gdouble *)v);
+				}
+			}
+
+			*out = rspamd_fstring_append_chars (*out, '}', 1);
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_BASIC) {
+		if (task->message_id) {
+			rspamd_protocol_json_key (out, "message-id", &first);
+			rspamd_protocol_json_string (out, task->message_id,
+					strlen (task->message_id));
+		}
+
+		rspamd_protocol_json_key (out, "time_real", &first);
+		rspamd_protocol_json_double (out,
+				task->time_real_finish - task->time_real);
+		rspamd_protocol_json_key (out, "time_virtual", &first);
+		rspamd_protocol_json_double (out,
+				task->time_virtual_finish - task->time_virtual);
+	}
+
+	if (flags & RSPAMD_PROTOCOL_DKIM) {
+		dkim_sig = rspamd_mempool_get_variable_idx (task->task_pool,
+				RSPAMD_MEMPOOL_VAR_DKIM_SIGNATURE);
+
+		if (dkim_sig) {
+			GString *folded_header;
+
+			/* See comments about folding in `rspamd_protocol_write_ucl` */
+			if (task->flags & RSPAMD_TASK_FLAG_MILTER) {
+				folded_header = rspamd_header_value_fold ("DKIM-Signature",
+						dkim_sig->str, 80, RSPAMD_TASK_NEWLINES_LF);
+			}
+			else {
+				folded_header = rspamd_header_value_fold ("DKIM-Signature",
+						dkim_sig->str, 80, task->nlines_type);
+			}
+
+			rspamd_protocol_json_key (out, "dkim-signature", &first);
+			rspamd_protocol_json_string (out, folded_header->str,
+					folded_header->len);
+			g_string_free (folded_header, TRUE);
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_RMILTER) {
+		milter_reply = rspamd_mempool_get_variable_idx (task->task_pool,
+				RSPAMD_MEMPOOL_VAR_MILTER_REPLY);
+
+		if (milter_reply) {
+			rspamd_protocol_json_key (out,
+					task->cmd == CMD_CHECK_V2 ? "milter" : "rmilter", &first);
+			rspamd_ucl_emit_fstring (milter_reply, UCL_EMIT_JSON_COMPACT, out);
+		}
+	}
+
+	*out = rspamd_fstring_append_chars (*out, '}', 1);
+}
+
+static void
+rspamd_protocol_binary_u16 (rspamd_fstring_t **out, guint16 val)
+{
+	val = GUINT16_TO_LE (val);
+	*out = rspamd_fstring_append (*out, (const gchar *)&val, sizeof (val));
+}
+
+static void
+rspamd_protocol_binary_u32 (rspamd_fstring_t **out, guint32 val)
+{
+	val = GUINT32_TO_LE (val);
+	*out = rspamd_fstring_append (*out, (const gchar *)&val, sizeof (val));
+}
+
+static void
+rspamd_protocol_binary_u64 (rspamd_fstring_t **out, guint64 val)
+{
+	val = GUINT64_TO_LE (val);
+	*out = rspamd_fstring_append (*out, (const gchar *)&val, sizeof (val));
+}
+
+static void
+rspamd_protocol_binary_double (rspamd_fstring_t **out, gdouble val)
+{
+	guint64 bits;
+
+	memcpy (&bits, &val, sizeof (bits));
+	rspamd_protocol_binary_u64 (out, bits);
+}
+
+static void
+rspamd_protocol_binary_string (rspamd_fstring_t **out, const gchar *str,
+		gsize len)
+{
+	len = MIN (len, G_MAXUINT16);
+	rspamd_protocol_binary_u16 (out, len);
+	*out = rspamd_fstring_append (*out, str, len);
+}
+
+/*
+ * Starts a section with unknown length, returns offset of its data
+ */
+static gsize
+rspamd_protocol_binary_section_start (rspamd_fstring_t **out, guint8 type)
+{
+	*out = rspamd_fstring_append_chars (*out, type, 1);
+	rspamd_protocol_binary_u32 (out, 0);
+
+	return (*out)->len;
+}
+
+static void
+rspamd_protocol_binary_section_end (rspamd_fstring_t *out, gsize start)
+{
+	guint32 len;
+
+	len = GUINT32_TO_LE (out->len - start);
+	memcpy (out->str + start - sizeof (len), &len, sizeof (len));
+}
+
+static void
+rspamd_protocol_binary_section (rspamd_fstring_t **out, guint8 type,
+		const gchar *data, gsize len)
+{
+	*out = rspamd_fstring_append_chars (*out, type, 1);
+	rspamd_protocol_binary_u32 (out, len);
+	*out = rspamd_fstring_append (*out, data, len);
+}
+
+static void
+rspamd_protocol_binary_symbol (struct rspamd_task *task,
+		struct rspamd_symbol_result *sym, rspamd_fstring_t **out)
+{
+	struct rspamd_symbol_option *opt;
+	guint nopts = 0;
+	gint id;
+
+	id = rspamd_symbols_cache_find_symbol (task->cfg->cache, sym->name);
+
+	if (id >= 0) {
+		rspamd_protocol_binary_u32 (out, id);
+	}
+	else {
+		rspamd_protocol_binary_u32 (out, RSPAMD_PROTOCOL_BINARY_NO_ID);
+		rspamd_protocol_binary_string (out, sym->name, strlen (sym->name));
+	}
+
+	rspamd_protocol_binary_double (out, sym->score);
+
+	/* Count options that are actually written */
+	DL_FOREACH (sym->opts_head, opt) {
+		if (nopts == G_MAXUINT16) {
+			break;
+		}
+
+		nopts ++;
+	}
+
+	rspamd_protocol_binary_u16 (out, nopts);
+
+	DL_FOREACH (sym->opts_head, opt) {
+		if (nopts-- == 0) {
+			break;
+		}
+
+		rspamd_protocol_binary_string (out, opt->option,
+				strlen (opt->option));
+	}
+}
+
+/*
+ * Writes scan reply in compact binary format described in protocol_binary.h
+ */
+static void
+rspamd_protocol_write_binary (struct rspamd_task *task,
+		enum rspamd_protocol_flags flags, rspamd_fstring_t **out)
+{
+	struct rspamd_metric_result *mres = task->result;
+	struct symbols_cache *cache = task->cfg->cache;
+	GHashTableIter hiter;
+	gpointer h, v;
+	rspamd_ftok_t *cksum_tok, srch;
+	const gchar *str;
+	GString *dkim_sig;
+	const ucl_object_t *milter_reply;
+	gchar cksum_buf[32];
+	guint8 bflags = 0;
+	guint i, nsyms;
+	gsize start;
+
+	if (mres->action == METRIC_ACTION_MAX) {
+		mres->action = rspamd_check_action_metric (task, mres);
+	}
+
+	if (RSPAMD_TASK_IS_SKIPPED (task)) {
+		bflags |= RSPAMD_PROTOCOL_BINARY_FLAG_SKIPPED;
+	}
+
+	/* Send symbols table unless client already knows the same one */
+	srch.len = rspamd_snprintf (cksum_buf, sizeof (cksum_buf), "%uL",
+			rspamd_symbols_cache_get_cksum (cache));
+	srch.begin = cksum_buf;
+	cksum_tok = rspamd_task_get_request_header (task,
+			RSPAMD_PROTOCOL_SYMBOLS_CKSUM_HEADER);
+
+	if (cksum_tok == NULL || rspamd_ftok_cmp (cksum_tok, &srch) != 0) {
+		bflags |= RSPAMD_PROTOCOL_BINARY_FLAG_SYMTAB;
+	}
+
+	*out = rspamd_fstring_append (*out, RSPAMD_PROTOCOL_BINARY_MAGIC,
+			sizeof (RSPAMD_PROTOCOL_BINARY_MAGIC) - 1);
+	*out = rspamd_fstring_append_chars (*out, RSPAMD_PROTOCOL_BINARY_VERSION, 1);
+	*out = rspamd_fstring_append_chars (*out, bflags, 1);
+	str = rspamd_action_to_str (mres->action);
+	rspamd_protocol_binary_string (out, str, strlen (str));
+	rspamd_protocol_binary_double (out, isnan (mres->score) ? 0.0 : mres->score);
+	rspamd_protocol_binary_double (out,
+			rspamd_task_get_required_score (task, mres));
+
+	if (bflags & RSPAMD_PROTOCOL_BINARY_FLAG_SYMTAB) {
+		nsyms = rspamd_symbols_cache_symbols_count (cache);
+		rspamd_protocol_binary_u64 (out, rspamd_symbols_cache_get_cksum (cache));
+		rspamd_protocol_binary_u32 (out, nsyms);
+
+		for (i = 0; i < nsyms; i ++) {
+			str = rspamd_symbols_cache_symbol_by_id (cache, i);
+			rspamd_protocol_binary_string (out, str, str ? strlen (str) : 0);
+		}
+	}
+
+	rspamd_protocol_binary_u32 (out, g_hash_table_size (mres->symbols));
+	g_hash_table_iter_init (&hiter, mres->symbols);
+
+	while (g_hash_table_iter_next (&hiter, &h, &v)) {
+		rspamd_protocol_binary_symbol (task, v, out);
+	}
+
+	if (mres->action == METRIC_ACTION_REWRITE_SUBJECT) {
+		str = make_rewritten_subject (mres->metric, task);
+
+		if (str) {
+			rspamd_protocol_binary_section (out, RSPAMD_PROTOCOL_BINARY_SUBJECT,
+					str, strlen (str));
+		}
+	}
+
+	if ((flags & RSPAMD_PROTOCOL_URLS) && task->cfg->log_urls) {
+		/* Urls are not sent in binary reply but we still need to log them */
+		struct rspamd_url *url;
+		gsize enclen;
+
+		g_hash_table_iter_init (&hiter, task->urls);
+
+		while (g_hash_table_iter_next (&hiter, &h, &v)) {
+			url = v;
+			str = rspamd_url_encode (url, &enclen, task->task_pool);
+			rspamd_protocol_log_url (task, str, enclen);
+		}
+	}
+
+	if ((flags & RSPAMD_PROTOCOL_MESSAGES) && task->messages->len > 0) {
+		start = rspamd_protocol_binary_section_start (out,
+				RSPAMD_PROTOCOL_BINARY_MESSAGES);
+		rspamd_ucl_emit_fstring (task->messages, UCL_EMIT_JSON_COMPACT, out);
+		rspamd_protocol_binary_section_end (*out, start);
+	}
+
+	if (flags & RSPAMD_PROTOCOL_BASIC) {
+		if (task->message_id) {
+			rspamd_protocol_binary_section (out,
+					RSPAMD_PROTOCOL_BINARY_MESSAGE_ID,
+					task->message_id, strlen (task->message_id));
+		}
+
+		start = rspamd_protocol_binary_section_start (out,
+				RSPAMD_PROTOCOL_BINARY_TIME);
+		rspamd_protocol_binary_double (out,
+				task->time_real_finish - task->time_real);
+		rspamd_protocol_binary_double (out,
+				task->time_virtual_finish - task->time_virtual);
+		rspamd_protocol_binary_section_end (*out, start);
+	}
+
+	if (flags & RSPAMD_PROTOCOL_DKIM) {
+		dkim_sig = rspamd_mempool_get_variable_idx (task->task_pool,
+				RSPAMD_MEMPOOL_VAR_DKIM_SIGNATURE);
+
+		if (dkim_sig) {
+			GString *folded_header;
+
+			/* See comments about folding in `rspamd_protocol_write_ucl` */
+			if (task->flags & RSPAMD_TASK_FLAG_MILTER) {
+				folded_header = rspamd_header_value_fold ("DKIM-Signature",
+						dkim_sig->str, 80, RSPAMD_TASK_NEWLINES_LF);
+			}
+			else {
+				folded_header = rspamd_header_value_fold ("DKIM-Signature",
+						dkim_sig->str, 80, task->nlines_type);
+			}
+
+			rspamd_protocol_binary_section (out,
+					RSPAMD_PROTOCOL_BINARY_DKIM_SIGNATURE,
+					folded_header->str, folded_header->len);
+			g_string_free (folded_header, TRUE);
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_RMILTER) {
+		milter_reply = rspamd_mempool_get_variable_idx (task->task_pool,
+				RSPAMD_MEMPOOL_VAR_MILTER_REPLY);
+
+		if (milter_reply) {
+			start = rspamd_protocol_binary_section_start (out,
+					RSPAMD_PROTOCOL_BINARY_MILTER);
+			rspamd_ucl_emit_fstring (milter_reply, UCL_EMIT_JSON_COMPACT, out);
+			rspamd_protocol_binary_section_end (*out, start);
+		}
+	}
+}
+
+/*
+ * Checks if reply should be compressed and selects a dictionary for it
+ */
+static gboolean
+rspamd_protocol_want_compression (struct rspamd_task *task,
+		struct zstd_dictionary **pdict)
+{
+	struct rspamd_external_libs_ctx *ctx = task->cfg->libs_ctx;
+	rspamd_ftok_t *tok, srch;
+	gulong dict_id;
+
+	*pdict = NULL;
+
+	if (ctx->out_zstream == NULL) {
+		return FALSE;
+	}
+
+	tok = rspamd_task_get_request_header (task, ACCEPT_COMPRESSION_HEADER);
+	srch.begin = "zstd";
+	srch.len = 4;
+
+	if (tok && rspamd_ftok_casecmp (tok, &srch) == 0) {
+		/* Output dictionary is used only if client knows it */
+		tok = rspamd_task_get_request_header (task, ACCEPT_DICTIONARY_HEADER);
+
+		if (tok && ctx->out_dict &&
+				rspamd_strtoul (tok->begin, tok->len, &dict_id) &&
+				dict_id == ctx->out_dict->id) {
+			*pdict = ctx->out_dict;
+		}
+
+		return TRUE;
+	}
+
+	if (task->flags & RSPAMD_TASK_FLAG_COMPRESSED) {
+		*pdict = ctx->out_dict;
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
 void
 rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 		struct rspamd_task *task, ucl_object_t **pobj)
@@ -1238,7 +2027,9 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 	gpointer h, v;
 	ucl_object_t *top = NULL;
 	rspamd_fstring_t *reply;
+	struct zstd_dictionary *dict;
 	gint action, flags = RSPAMD_PROTOCOL_DEFAULT;
+	gboolean stream_json, binary;
 
 	/* Write custom headers */
 	g_hash_table_iter_init (&hiter, task->reply_headers);
@@ -1252,10 +2043,32 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 		flags |= RSPAMD_PROTOCOL_URLS;
 	}
 
-	top = rspamd_protocol_write_ucl (task, flags);
-
-	if (pobj) {
-		*pobj = top;
+	/*
+	 * If nobody needs UCL reply (and it has not been built before), then
+	 * JSON is written directly without an intermediate tree
+	 */
+	stream_json = pobj == NULL && msg->method < HTTP_SYMBOLS &&
+			!RSPAMD_TASK_IS_SPAMC (task) &&
+			rspamd_mempool_get_variable_idx (task->task_pool,
+					RSPAMD_MEMPOOL_VAR_CACHED_REPLY) == NULL;
+	/*
+	 * Binary reply is encoded from the metric result, so it is used even if
+	 * UCL reply has been built for other consumers
+	 */
+	binary = task->reply_format == RSPAMD_TASK_REPLY_BINARY &&
+			msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task);
+
+	if (!stream_json) {
+		top = rspamd_protocol_write_ucl (task, flags);
+
+		if (pobj) {
+			*pobj = top;
+		}
+	}
+	else {
+		/* We also set scan time here */
+		task->time_real_finish = rspamd_get_ticks ();
+		task->time_virtual_finish = rspamd_get_virtual_ticks ();
 	}
 
 	if (!(task->flags & RSPAMD_TASK_FLAG_NO_LOG)) {
@@ -1279,73 +2092,63 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 				restat->bytes_scanned);
 	}
 
-	reply = rspamd_fstring_sized_new (1000);
-
-	if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task)) {
-		rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT, &reply);
+	if (binary) {
+		reply = rspamd_fstring_sized_new (256 +
+				g_hash_table_size (task->result->symbols) * 32);
+		rspamd_protocol_write_binary (task, flags, &reply);
+		rspamd_http_message_add_header (msg,
+				RSPAMD_PROTOCOL_REPLY_FORMAT_HEADER, "binary");
+	}
+	else if (stream_json) {
+		/* Preallocate enough space for typical symbols entries */
+		reply = rspamd_fstring_sized_new (512 +
+				g_hash_table_size (task->result->symbols) * 96);
+		rspamd_protocol_write_json (task, flags, &reply);
 	}
 	else {
-		if (RSPAMD_TASK_IS_SPAMC (task)) {
-			rspamd_ucl_tospamc_output (top, &reply);
+		reply = rspamd_fstring_sized_new (1000);
+
+		if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task)) {
+			rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT, &reply);
 		}
 		else {
-			rspamd_ucl_torspamc_output (top, &reply);
+			if (RSPAMD_TASK_IS_SPAMC (task)) {
+				rspamd_ucl_tospamc_output (top, &reply);
+			}
+			else {
+				rspamd_ucl_torspamc_output (top, &reply);
+			}
 		}
 	}
 
-	if ((task->flags & RSPAMD_TASK_FLAG_COMPRESSED) &&
-			rspamd_libs_reset_compression (task->cfg->libs_ctx)) {
+	if (rspamd_protocol_want_compression (task, &dict) &&
+			rspamd_zstd_init_compression (task->cfg->libs_ctx->out_zstream,
+					dict)) {
 		/* We can compress output */
-		ZSTD_inBuffer zin;
-		ZSTD_outBuffer zout;
-		ZSTD_CStream *zstream;
 		rspamd_fstring_t *compressed_reply;
-		gsize r;
-
-		zstream = task->cfg->libs_ctx->out_zstream;
-		compressed_reply = rspamd_fstring_sized_new (ZSTD_compressBound (reply->len));
-		zin.pos = 0;
-		zin.src = reply->str;
-		zin.size = reply->len;
-		zout.pos = 0;
-		zout.dst = compressed_reply->str;
-		zout.size = compressed_reply->allocated;
-
-		while (zin.pos < zin.size) {
-			r = ZSTD_compressStream (zstream, &zout, &zin);
-
-			if (ZSTD_isError (r)) {
-				msg_err_task ("cannot compress: %s", ZSTD_getErrorName (r));
-				rspamd_fstring_free (compressed_reply);
-				rspamd_http_message_set_body_from_fstring_steal (msg, reply);
-
-				goto end;
-			}
-		}
+		const gchar *err = NULL;
 
-		r = ZSTD_endStream (zstream, &zout);
+		compressed_reply = rspamd_zstd_compress (
+				task->cfg->libs_ctx->out_zstream,
+				reply->str, reply->len, &err);
 
-		if (ZSTD_isError (r)) {
-			msg_err_task ("cannot finalize compress: %s", ZSTD_getErrorName (r));
-			rspamd_fstring_free (compressed_reply);
+		if (compressed_reply == NULL) {
+			msg_err_task ("cannot compress: %s", err);
 			rspamd_http_message_set_body_from_fstring_steal (msg, reply);
 
 			goto end;
 		}
 
 		msg_info_task ("writing compressed results: %z bytes before "
-				"%z bytes after", zin.pos, zout.pos);
-		compressed_reply->len = zout.pos;
+				"%z bytes after", reply->len, compressed_reply->len);
 		rspamd_fstring_free (reply);
 		rspamd_http_message_set_body_from_fstring_steal (msg, compressed_reply);
 		rspamd_http_message_add_header (msg, "Compression", "zstd");
 
-		if (task->cfg->libs_ctx->out_dict &&
-				task->cfg->libs_ctx->out_dict->id != 0) {
+		if (dict && dict->id != 0) {
 			gchar dict_str[32];
 
-			rspamd_snprintf (dict_str, sizeof (dict_str), "%ud",
-					task->cfg->libs_ctx->out_dict->id);
+			rspamd_snprintf (dict_str, sizeof (dict_str), "%ud", dict->id);
 			rspamd_http_message_add_header (msg, "Dictionary", dict_str);
 		}
 	}
@@ -1409,6 +2212,7 @@ rspamd_protocol_write_log_pipe (struct rspamd_task *task)
 	GArray *extra;
 	struct rspamd_protocol_log_symbol_result er;
 	struct rspamd_task **ptask;
+	GByteArray *rec;
 
 	/* Get extra results from lua plugins */
 	extra = g_array_new (FALSE, FALSE, sizeof (er));
@@ -1553,8 +2357,8 @@ rspamd_protocol_write_log_pipe (struct rspamd_task *task)
 					ls = g_slice_alloc (sz);
 
 					/* Handle settings id */
-					sid = rspamd_mempool_get_variable (task->task_pool,
-							"settings_hash");
+					sid = rspamd_mempool_get_variable_idx (task->task_pool,
+							RSPAMD_MEMPOOL_VAR_SETTINGS_HASH);
 
 					if (sid) {
 						ls->settings_id = *sid;
@@ -1605,6 +2409,16 @@ rspamd_protocol_write_log_pipe (struct rspamd_task *task)
 
 				g_slice_free1 (sz, ls);
 				break;
+			case RSPAMD_LOG_PIPE_RECORDS:
+				rec = rspamd_log_record_from_task (task);
+
+				if (write (lp->fd, rec->data, rec->len) == -1) {
+					msg_info_task ("cannot write to log pipe: %s",
+							strerror (errno));
+				}
+
+				g_byte_array_free (rec, TRUE);
+				break;
 			default:
 				msg_err_task ("unknown log format %d", lp->type);
 				break;
@@ -1635,6 +2449,9 @@ rspamd_protocol_write_reply (struct rspamd_task *task)
 	if (RSPAMD_TASK_IS_SPAMC (task)) {
 		msg->flags |= RSPAMD_HTTP_FLAG_SPAMC;
 	}
+	if (task->flags & RSPAMD_TASK_FLAG_KEEPALIVE) {
+		msg->flags |= RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+	}
 
 	msg->date = time (NULL);
 
@@ -1669,6 +2486,12 @@ rspamd_protocol_write_reply (struct rspamd_task *task)
 		case CMD_CHECK_V2:
 			rspamd_protocol_http_reply (msg, task, NULL);
 			rspamd_protocol_write_log_pipe (task);
+
+			if (task->reply_format == RSPAMD_TASK_REPLY_BINARY &&
+					rspamd_http_message_find_header (msg,
+							RSPAMD_PROTOCOL_REPLY_FORMAT_HEADER)) {
+				ctype = "application/octet-stream";
+			}
 			break;
 		case CMD_PING:
 			rspamd_http_message_set_body (msg, "pong" CRLF, 6);
@@ -0,0 +1,63 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_PROTOCOL_BINARY_H
+#define RSPAMD_PROTOCOL_BINARY_H
+
+/*
+ * Compact binary scan reply. Client asks for it by `Reply-Format: binary`
+ * header and server marks such a reply with the same header. All integers and
+ * doubles are little endian, `str` is a string prefixed by u16 length.
+ *
+ * reply:   magic[4] version:u8 flags:u8 action:str score:f64
+ *          required_score:f64 [symtab] nsymbols:u32 symbol[nsymbols] section*
+ * symtab:  cksum:u64 nnames:u32 name:str[nnames]
+ * symbol:  id:u32 [name:str] score:f64 nopts:u16 option:str[nopts]
+ * section: type:u8 len:u32 data[len]
+ *
+ * Symbols are identified by their ids in the symbols cache. Client passes the
+ * checksum of the symbols table it knows in `Symbols-Checksum` header, and
+ * if it differs from the server's one then a reply includes the whole table
+ * (id is an index in it) marked by RSPAMD_PROTOCOL_BINARY_FLAG_SYMTAB.
+ * Symbols without an id (e.g. virtual symbols inserted from lua) are written
+ * with RSPAMD_PROTOCOL_BINARY_NO_ID followed by their name.
+ *
+ * Urls, emails, profiling data and symbols descriptions are not included.
+ */
+
+#define RSPAMD_PROTOCOL_BINARY_MAGIC "RSPB"
+#define RSPAMD_PROTOCOL_BINARY_VERSION 1
+#define RSPAMD_PROTOCOL_BINARY_NO_ID 0xffffffffU
+
+#define RSPAMD_PROTOCOL_REPLY_FORMAT_HEADER "Reply-Format"
+#define RSPAMD_PROTOCOL_SYMBOLS_CKSUM_HEADER "Symbols-Checksum"
+
+enum rspamd_protocol_binary_flags {
+	RSPAMD_PROTOCOL_BINARY_FLAG_SKIPPED = 1 << 0,
+	RSPAMD_PROTOCOL_BINARY_FLAG_SYMTAB = 1 << 1,
+};
+
+enum rspamd_protocol_binary_section {
+	RSPAMD_PROTOCOL_BINARY_SUBJECT = 1,
+	RSPAMD_PROTOCOL_BINARY_MESSAGE_ID,
+	RSPAMD_PROTOCOL_BINARY_DKIM_SIGNATURE,
+	/* Milter reply and messages are passed as compact JSON */
+	RSPAMD_PROTOCOL_BINARY_MILTER,
+	RSPAMD_PROTOCOL_BINARY_MESSAGES,
+	/* Real and virtual scan time as two doubles */
+	RSPAMD_PROTOCOL_BINARY_TIME,
+};
+
+#endif
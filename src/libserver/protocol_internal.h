@@ -78,6 +78,8 @@
 #define PROFILE_HEADER "Profile"
 #define TLS_CIPHER_HEADER "TLS-Cipher"
 #define TLS_VERSION_HEADER "TLS-Version"
+#define ACCEPT_COMPRESSION_HEADER "Accept-Compression"
+#define ACCEPT_DICTIONARY_HEADER "Accept-Dictionary"
 #define MTA_NAME_HEADER "MTA-Name"
 #define MILTER_HEADER "Milter"
 
@@ -32,6 +32,9 @@ struct rspamd_redis_pool_connection {
 	GList *entry;
 	struct event timeout;
 	gboolean active;
+	gboolean shared;
+	gboolean failed;
+	guint nusers;
 	gchar tag[MEMPOOL_UID_LEN];
 	ref_entry_t ref;
 };
@@ -105,7 +108,7 @@ rspamd_redis_pool_conn_dtor (struct rspamd_redis_pool_connection *conn)
 				redisAsyncContext *ac = conn->ctx;
 
 				conn->ctx = NULL;
-				g_hash_table_remove (conn->elt->pool->elts_by_ctx, conn->ctx);
+				g_hash_table_remove (conn->elt->pool->elts_by_ctx, ac);
 				ac->onDisconnect = NULL;
 				redisAsyncFree (ac);
 			}
@@ -352,6 +355,8 @@ rspamd_redis_pool_connect (struct rspamd_redis_pool *pool,
 			if (conn->ctx->err == REDIS_OK) {
 				event_del (&conn->timeout);
 				conn->active = TRUE;
+				conn->shared = FALSE;
+				conn->failed = FALSE;
 				g_queue_push_tail_link (elt->active, conn_entry);
 				msg_debug_rpool ("reused existing connection to %s:%d", ip, port);
 			}
@@ -384,11 +389,57 @@ rspamd_redis_pool_connect (struct rspamd_redis_pool *pool,
 		return NULL;
 	}
 
+	conn->nusers = 1;
 	REF_RETAIN (conn);
 
 	return conn->ctx;
 }
 
+struct redisAsyncContext*
+rspamd_redis_pool_connect_shared (struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port, guint max_users)
+{
+	guint64 key;
+	struct rspamd_redis_pool_elt *elt;
+	struct rspamd_redis_pool_connection *conn;
+	struct redisAsyncContext *ctx;
+	GList *cur;
+
+	g_assert (pool != NULL);
+	g_assert (ip != NULL);
+
+	key = rspamd_redis_pool_get_key (db, password, ip, port);
+	elt = g_hash_table_lookup (pool->elts_by_key, &key);
+
+	if (elt) {
+		/* Try to join some active shared connection */
+		for (cur = elt->active->head; cur != NULL; cur = g_list_next (cur)) {
+			conn = cur->data;
+
+			if (conn->shared && !conn->failed && conn->nusers < max_users &&
+					conn->ctx && conn->ctx->err == REDIS_OK) {
+				conn->nusers ++;
+				REF_RETAIN (conn);
+				msg_debug_rpool ("pipeline request to existing connection "
+						"to %s:%d, %ud users", ip, port, conn->nusers);
+
+				return conn->ctx;
+			}
+		}
+	}
+
+	ctx = rspamd_redis_pool_connect (pool, db, password, ip, port);
+
+	if (ctx) {
+		conn = g_hash_table_lookup (pool->elts_by_ctx, ctx);
+		g_assert (conn != NULL);
+		conn->shared = TRUE;
+	}
+
+	return ctx;
+}
+
 
 void
 rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
@@ -403,7 +454,25 @@ rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
 	if (conn != NULL) {
 		g_assert (conn->active);
 
-		if (is_fatal || ctx->err != REDIS_OK) {
+		if (conn->nusers > 1) {
+			/*
+			 * Connection is still used by other users, so we cannot close it
+			 * right now: just avoid sharing it any longer on errors
+			 */
+			conn->nusers --;
+
+			if (is_fatal || ctx->err != REDIS_OK) {
+				conn->failed = TRUE;
+			}
+
+			REF_RELEASE (conn);
+
+			return;
+		}
+
+		conn->nusers = 0;
+
+		if (is_fatal || conn->failed || ctx->err != REDIS_OK) {
 			/* We need to terminate connection forcefully */
 			msg_debug_rpool ("closed connection forcefully");
 			REF_RELEASE (conn);
@@ -53,6 +53,24 @@ struct redisAsyncContext* rspamd_redis_pool_connect (
 		const gchar *db, const gchar *password,
 		const char *ip, int port);
 
+/**
+ * Create or reuse a redis connection that could be shared by many concurrent
+ * users: their commands are pipelined over the same connection and replies
+ * are delivered in order. Each call must be paired with
+ * `rspamd_redis_pool_release_connection`
+ * @param pool
+ * @param db
+ * @param password
+ * @param ip
+ * @param port
+ * @param max_users maximum number of concurrent users of a single connection
+ * @return
+ */
+struct redisAsyncContext* rspamd_redis_pool_connect_shared (
+		struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port, guint max_users);
+
 /**
  * Release a connection to the pool
  * @param pool
@@ -17,9 +17,70 @@
 #include "rspamd.h"
 #include "lua/lua_common.h"
 #include "unix-std.h"
+#include "libmime/email_addr.h"
 
 static const gchar rspamd_history_magic_old[] = {'r', 's', 'h', '1'};
 
+/*
+ * Writer claims a row by making its sequence odd, and the release fence
+ * after that keeps the row's data from being stored before the claim.
+ * The final (even) sequence is stored with release semantics after the data,
+ * and readers check it with acquire loads around copying the row.
+ */
+#ifdef HAVE_ATOMIC_BUILTINS
+#define HISTORY_LOAD(p) __atomic_load_n ((p), __ATOMIC_ACQUIRE)
+#define HISTORY_STORE(p, v) __atomic_store_n ((p), (v), __ATOMIC_RELEASE)
+#define HISTORY_FETCH_ADD(p, v) __atomic_fetch_add ((p), (v), __ATOMIC_ACQ_REL)
+#define HISTORY_CAS(p, pexp, v) __atomic_compare_exchange_n ((p), (pexp), (v), \
+		FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define HISTORY_WRITE_FENCE() __atomic_thread_fence (__ATOMIC_RELEASE)
+#define HISTORY_READ_FENCE() __atomic_thread_fence (__ATOMIC_ACQUIRE)
+#define HISTORY_SEQ_BEFORE(a, b) ((gint64)((a) - (b)) < 0)
+#else
+/* Glib atomic operations are full memory barriers */
+#define HISTORY_LOAD(p) \
+	((rspamd_roll_history_seq_t)g_atomic_int_get ((volatile gint *)(p)))
+#define HISTORY_STORE(p, v) g_atomic_int_set ((volatile gint *)(p), (gint)(v))
+#define HISTORY_FETCH_ADD(p, v) rspamd_roll_history_fetch_add ((p), (v))
+#define HISTORY_CAS(p, pexp, v) rspamd_roll_history_cas ((p), (pexp), (v))
+#define HISTORY_WRITE_FENCE() do {} while (0)
+#define HISTORY_READ_FENCE() do {} while (0)
+#define HISTORY_SEQ_BEFORE(a, b) ((gint)((a) - (b)) < 0)
+
+static inline gboolean
+rspamd_roll_history_cas (rspamd_roll_history_seq_t *p,
+		rspamd_roll_history_seq_t *pexp, rspamd_roll_history_seq_t v)
+{
+	if (g_atomic_int_compare_and_exchange ((volatile gint *)p,
+			(gint)*pexp, (gint)v)) {
+		return TRUE;
+	}
+
+	*pexp = HISTORY_LOAD (p);
+
+	return FALSE;
+}
+
+/* g_atomic_int_add does not return the old value in older glib versions */
+static inline rspamd_roll_history_seq_t
+rspamd_roll_history_fetch_add (rspamd_roll_history_seq_t *p,
+		rspamd_roll_history_seq_t v)
+{
+	rspamd_roll_history_seq_t old = HISTORY_LOAD (p);
+
+	while (!rspamd_roll_history_cas (p, &old, old + v));
+
+	return old;
+}
+#endif
+
+/* Row's data excluding its sequence number */
+#define HISTORY_ROW_DATA(row) (((guchar *)(row)) + sizeof ((row)->seq))
+#define HISTORY_ROW_DATA_LEN (sizeof (struct roll_history_row) - \
+		sizeof (rspamd_roll_history_seq_t))
+#define HISTORY_SEQ_BUSY(seq) ((seq) * 2 + 1)
+#define HISTORY_SEQ_DONE(seq) ((seq) * 2 + 2)
+
 /**
  * Returns new roll history
  * @param pool pool for shared memory
@@ -84,6 +145,45 @@ roll_history_symbols_callback (gpointer key, gpointer value, void *user_data)
 	}
 }
 
+static void
+roll_history_copy_email (gchar *dst, gsize dstlen,
+		struct rspamd_email_address *addr)
+{
+	if (addr && addr->addr_len > 0) {
+		rspamd_strlcpy (dst, addr->addr, MIN (dstlen, addr->addr_len + 1));
+	}
+	else {
+		dst[0] = '\0';
+	}
+}
+
+/*
+ * Copies row to the slot reserved for the sequence number `seq`. If the slot
+ * is still being written by some slow writer from the previous cycle, or it
+ * has been already claimed by a newer one, the row is dropped
+ */
+static void
+roll_history_publish (struct roll_history *history,
+		struct roll_history_row *row, rspamd_roll_history_seq_t seq)
+{
+	struct roll_history_row *slot;
+	rspamd_roll_history_seq_t cur;
+
+	slot = &history->rows[seq % history->nrows];
+	cur = HISTORY_LOAD (&slot->seq);
+
+	do {
+		if ((cur & 1) || !HISTORY_SEQ_BEFORE (cur, HISTORY_SEQ_BUSY (seq))) {
+			return;
+		}
+	} while (!HISTORY_CAS (&slot->seq, &cur, HISTORY_SEQ_BUSY (seq)));
+
+	HISTORY_WRITE_FENCE ();
+	memcpy (HISTORY_ROW_DATA (slot), HISTORY_ROW_DATA (row),
+			HISTORY_ROW_DATA_LEN);
+	HISTORY_STORE (&slot->seq, HISTORY_SEQ_DONE (seq));
+}
+
 /**
  * Update roll history with data from task
  * @param history roll history object
@@ -93,8 +193,7 @@ void
 rspamd_roll_history_update (struct roll_history *history,
 	struct rspamd_task *task)
 {
-	guint row_num;
-	struct roll_history_row *row;
+	struct roll_history_row row;
 	struct rspamd_metric_result *metric_res;
 	struct history_metric_callback_data cbdata;
 
@@ -102,59 +201,50 @@ rspamd_roll_history_update (struct roll_history *history,
 		return;
 	}
 
-	/* First of all obtain check and obtain row number */
-	g_atomic_int_compare_and_exchange (&history->cur_row, history->nrows, 0);
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
-	row_num = g_atomic_int_add (&history->cur_row, 1);
-#else
-	row_num = g_atomic_int_exchange_and_add (&history->cur_row, 1);
-#endif
-
-	if (row_num < history->nrows) {
-		row = &history->rows[row_num];
-		g_atomic_int_set (&row->completed, FALSE);
-	}
-	else {
-		/* Race condition */
-		history->cur_row = 0;
-		return;
-	}
+	/* Row is filled locally, so the shared one is busy just for a memcpy */
+	memset (&row, 0, sizeof (row));
 
 	/* Add information from task to roll history */
 	if (task->from_addr) {
-		rspamd_strlcpy (row->from_addr,
+		rspamd_strlcpy (row.from_addr,
 				rspamd_inet_address_to_string (task->from_addr),
-				sizeof (row->from_addr));
+				sizeof (row.from_addr));
 	}
 	else {
-		rspamd_strlcpy (row->from_addr, "unknown", sizeof (row->from_addr));
+		rspamd_strlcpy (row.from_addr, "unknown", sizeof (row.from_addr));
 	}
 
-	memcpy (&row->tv, &task->tv, sizeof (row->tv));
+	memcpy (&row.tv, &task->tv, sizeof (row.tv));
 
 	/* Strings */
-	rspamd_strlcpy (row->message_id, task->message_id,
-		sizeof (row->message_id));
+	rspamd_strlcpy (row.message_id, task->message_id,
+		sizeof (row.message_id));
 	if (task->user) {
-		rspamd_strlcpy (row->user, task->user, sizeof (row->user));
+		rspamd_strlcpy (row.user, task->user, sizeof (row.user));
 	}
-	else {
-		row->user[0] = '\0';
+
+	roll_history_copy_email (row.from_envelope, sizeof (row.from_envelope),
+			task->from_envelope);
+
+	if (task->rcpt_envelope && task->rcpt_envelope->len > 0) {
+		roll_history_copy_email (row.rcpt_envelope,
+				sizeof (row.rcpt_envelope),
+				g_ptr_array_index (task->rcpt_envelope, 0));
 	}
 
 	/* Get default metric */
 	metric_res = task->result;
 
 	if (metric_res == NULL) {
-		row->symbols[0] = '\0';
-		row->action = METRIC_ACTION_NOACTION;
+		row.action = METRIC_ACTION_NOACTION;
 	}
 	else {
-		row->score = metric_res->score;
-		row->action = metric_res->action;
-		row->required_score = rspamd_task_get_required_score (task, metric_res);
-		cbdata.pos = row->symbols;
-		cbdata.remain = sizeof (row->symbols);
+		row.score = metric_res->score;
+		row.action = metric_res->action;
+		row.required_score = rspamd_task_get_required_score (task, metric_res);
+		row.nsymbols = g_hash_table_size (metric_res->symbols);
+		cbdata.pos = row.symbols;
+		cbdata.remain = sizeof (row.symbols);
 		g_hash_table_foreach (metric_res->symbols,
 			roll_history_symbols_callback,
 			&cbdata);
@@ -166,9 +256,83 @@ rspamd_roll_history_update (struct roll_history *history,
 		}
 	}
 
-	row->scan_time = task->time_real_finish - task->time_real;
-	row->len = task->msg.len;
-	g_atomic_int_set (&row->completed, TRUE);
+	row.scan_time = task->time_real_finish - task->time_real;
+	row.virtual_time = task->time_virtual_finish - task->time_virtual;
+	row.len = task->msg.len;
+
+	rspamd_roll_history_add_row (history, &row);
+}
+
+void
+rspamd_roll_history_add_row (struct roll_history *history,
+		struct roll_history_row *row)
+{
+	if (!history->disabled) {
+		roll_history_publish (history, row,
+				HISTORY_FETCH_ADD (&history->head, 1));
+	}
+}
+
+void
+rspamd_roll_history_iter_init (struct roll_history *history,
+		struct roll_history_iter *it)
+{
+	rspamd_roll_history_seq_t reset_seq;
+
+	it->history = history;
+
+	if (history->disabled) {
+		it->cur = it->end = 0;
+
+		return;
+	}
+
+	it->end = HISTORY_LOAD (&history->head);
+	reset_seq = HISTORY_LOAD (&history->reset_seq);
+	it->cur = it->end > history->nrows ? it->end - history->nrows : 0;
+
+	if (HISTORY_SEQ_BEFORE (it->cur, reset_seq)) {
+		it->cur = reset_seq;
+	}
+}
+
+gboolean
+rspamd_roll_history_iter_next (struct roll_history_iter *it,
+		struct roll_history_row *row)
+{
+	struct roll_history_row *slot;
+	rspamd_roll_history_seq_t seq;
+
+	while (HISTORY_SEQ_BEFORE (it->cur, it->end)) {
+		slot = &it->history->rows[it->cur % it->history->nrows];
+		seq = HISTORY_SEQ_DONE (it->cur);
+		it->cur ++;
+
+		if (HISTORY_LOAD (&slot->seq) != seq) {
+			/* Not yet written or already overwritten */
+			continue;
+		}
+
+		memcpy (HISTORY_ROW_DATA (row), HISTORY_ROW_DATA (slot),
+				HISTORY_ROW_DATA_LEN);
+		HISTORY_READ_FENCE ();
+
+		if (HISTORY_LOAD (&slot->seq) == seq) {
+			row->seq = it->cur - 1;
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+void
+rspamd_roll_history_reset (struct roll_history *history)
+{
+	if (!history->disabled) {
+		HISTORY_STORE (&history->reset_seq, HISTORY_LOAD (&history->head));
+	}
 }
 
 /**
@@ -186,8 +350,9 @@ rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
 	ucl_object_t *top;
 	const ucl_object_t *cur, *elt;
 	struct ucl_parser *parser;
-	struct roll_history_row *row;
-	guint n, i;
+	struct roll_history_row row;
+	guint n, i, start = 0;
+	rspamd_roll_history_seq_t seq;
 
 	g_assert (history != NULL);
 	if (history->disabled) {
@@ -248,7 +413,9 @@ rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
 	if (top->len > history->nrows) {
 		msg_warn ("stored history is larger than the current one: %ud (file) vs "
 				"%ud (history)", top->len, history->nrows);
-		n = history->nrows;
+		/* Keep the newest rows */
+		start = top->len - history->nrows;
+		n = top->len;
 	}
 	else if (top->len < history->nrows) {
 		msg_warn (
@@ -261,84 +428,112 @@ rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
 		n = top->len;
 	}
 
-	for (i = 0; i < n; i ++) {
+	/* Workers are not started yet, so nobody writes history concurrently */
+	seq = HISTORY_LOAD (&history->head);
+
+	for (i = start; i < n; i ++) {
 		cur = ucl_array_find_index (top, i);
 
 		if (cur != NULL && ucl_object_type (cur) == UCL_OBJECT) {
-			row = &history->rows[i];
-			memset (row, 0, sizeof (*row));
+			memset (&row, 0, sizeof (row));
 
 			elt = ucl_object_lookup (cur, "time");
 
 			if (elt && ucl_object_type (elt) == UCL_FLOAT) {
-				double_to_tv (ucl_object_todouble (elt), &row->tv);
+				double_to_tv (ucl_object_todouble (elt), &row.tv);
 			}
 
 			elt = ucl_object_lookup (cur, "id");
 
 			if (elt && ucl_object_type (elt) == UCL_STRING) {
-				rspamd_strlcpy (row->message_id, ucl_object_tostring (elt),
-						sizeof (row->message_id));
+				rspamd_strlcpy (row.message_id, ucl_object_tostring (elt),
+						sizeof (row.message_id));
 			}
 
 			elt = ucl_object_lookup (cur, "symbols");
 
 			if (elt && ucl_object_type (elt) == UCL_STRING) {
-				rspamd_strlcpy (row->symbols, ucl_object_tostring (elt),
-						sizeof (row->symbols));
+				rspamd_strlcpy (row.symbols, ucl_object_tostring (elt),
+						sizeof (row.symbols));
 			}
 
 			elt = ucl_object_lookup (cur, "user");
 
 			if (elt && ucl_object_type (elt) == UCL_STRING) {
-				rspamd_strlcpy (row->user, ucl_object_tostring (elt),
-						sizeof (row->user));
+				rspamd_strlcpy (row.user, ucl_object_tostring (elt),
+						sizeof (row.user));
 			}
 
 			elt = ucl_object_lookup (cur, "from");
 
 			if (elt && ucl_object_type (elt) == UCL_STRING) {
-				rspamd_strlcpy (row->from_addr, ucl_object_tostring (elt),
-						sizeof (row->from_addr));
+				rspamd_strlcpy (row.from_addr, ucl_object_tostring (elt),
+						sizeof (row.from_addr));
 			}
 
 			elt = ucl_object_lookup (cur, "len");
 
 			if (elt && ucl_object_type (elt) == UCL_INT) {
-				row->len = ucl_object_toint (elt);
+				row.len = ucl_object_toint (elt);
 			}
 
 			elt = ucl_object_lookup (cur, "scan_time");
 
 			if (elt && ucl_object_type (elt) == UCL_FLOAT) {
-				row->scan_time = ucl_object_todouble (elt);
+				row.scan_time = ucl_object_todouble (elt);
 			}
 
 			elt = ucl_object_lookup (cur, "score");
 
 			if (elt && ucl_object_type (elt) == UCL_FLOAT) {
-				row->score = ucl_object_todouble (elt);
+				row.score = ucl_object_todouble (elt);
 			}
 
 			elt = ucl_object_lookup (cur, "required_score");
 
 			if (elt && ucl_object_type (elt) == UCL_FLOAT) {
-				row->required_score = ucl_object_todouble (elt);
+				row.required_score = ucl_object_todouble (elt);
 			}
 
 			elt = ucl_object_lookup (cur, "action");
 
 			if (elt && ucl_object_type (elt) == UCL_INT) {
-				row->action = ucl_object_toint (elt);
+				row.action = ucl_object_toint (elt);
 			}
 
-			row->completed = TRUE;
+			elt = ucl_object_lookup (cur, "virtual_time");
+
+			if (elt && ucl_object_type (elt) == UCL_FLOAT) {
+				row.virtual_time = ucl_object_todouble (elt);
+			}
+
+			elt = ucl_object_lookup (cur, "nsymbols");
+
+			if (elt && ucl_object_type (elt) == UCL_INT) {
+				row.nsymbols = ucl_object_toint (elt);
+			}
+
+			elt = ucl_object_lookup (cur, "from_envelope");
+
+			if (elt && ucl_object_type (elt) == UCL_STRING) {
+				rspamd_strlcpy (row.from_envelope, ucl_object_tostring (elt),
+						sizeof (row.from_envelope));
+			}
+
+			elt = ucl_object_lookup (cur, "rcpt_envelope");
+
+			if (elt && ucl_object_type (elt) == UCL_STRING) {
+				rspamd_strlcpy (row.rcpt_envelope, ucl_object_tostring (elt),
+						sizeof (row.rcpt_envelope));
+			}
+
+			roll_history_publish (history, &row, seq ++);
 		}
 	}
 
 	ucl_object_unref (top);
 
-	history->cur_row = n;
+	HISTORY_STORE (&history->head, seq);
 
 	return TRUE;
 }
@@ -354,8 +549,8 @@ rspamd_roll_history_save (struct roll_history *history, const gchar *filename)
 {
 	gint fd;
 	ucl_object_t *obj, *elt;
-	guint i;
-	struct roll_history_row *row;
+	struct roll_history_iter it;
+	struct roll_history_row r, *row = &r;
 	struct ucl_emitter_functions *emitter_func;
 
 	g_assert (history != NULL);
@@ -371,13 +566,9 @@ rspamd_roll_history_save (struct roll_history *history, const gchar *filename)
 
 	obj = ucl_object_typed_new (UCL_ARRAY);
 
-	for (i = 0; i < history->nrows; i ++) {
-		row = &history->rows[i];
-
-		if (!row->completed) {
-			continue;
-		}
+	rspamd_roll_history_iter_init (history, &it);
 
+	while (rspamd_roll_history_iter_next (&it, row)) {
 		elt = ucl_object_typed_new (UCL_OBJECT);
 
 		ucl_object_insert_key (elt, ucl_object_fromdouble (
@@ -400,6 +591,14 @@ rspamd_roll_history_save (struct roll_history *history, const gchar *filename)
 				"required_score", 0, false);
 		ucl_object_insert_key (elt, ucl_object_fromint (row->action),
 				"action", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromdouble (row->virtual_time),
+				"virtual_time", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (row->nsymbols),
+				"nsymbols", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromstring (row->from_envelope),
+				"from_envelope", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromstring (row->rcpt_envelope),
+				"rcpt_envelope", 0, false);
 
 		ucl_array_append (obj, elt);
 	}
@@ -22,35 +22,64 @@
 /*
  * Roll history is a special cycled buffer for checked messages, it is designed for writing history messages
  * and displaying them in webui
+ *
+ * Rows are written by all workers without locks: each writer claims a global
+ * sequence number and the row `seq % nrows`. Row's `seq` field is odd while
+ * the row is being written and equals to `2 * seq + 2` once it is complete,
+ * so readers can detect and skip torn or overwritten rows (seqlock).
  */
 
 #define HISTORY_MAX_ID 256
 #define HISTORY_MAX_SYMBOLS 256
 #define HISTORY_MAX_USER 32
 #define HISTORY_MAX_ADDR 32
+#define HISTORY_MAX_EMAIL 64
 
 struct rspamd_task;
 struct rspamd_config;
 
+#ifdef HAVE_ATOMIC_BUILTINS
+typedef guint64 rspamd_roll_history_seq_t;
+#else
+/* Glib atomics operate on integers only, sequence numbers might wrap */
+typedef guint rspamd_roll_history_seq_t;
+#endif
+
 struct roll_history_row {
+	rspamd_roll_history_seq_t seq;
 	struct timeval tv;
 	gchar message_id[HISTORY_MAX_ID];
 	gchar symbols[HISTORY_MAX_SYMBOLS];
 	gchar user[HISTORY_MAX_USER];
 	gchar from_addr[HISTORY_MAX_ADDR];
+	gchar from_envelope[HISTORY_MAX_EMAIL];
+	gchar rcpt_envelope[HISTORY_MAX_EMAIL];
 	gsize len;
 	gdouble scan_time;
+	gdouble virtual_time;
 	gdouble score;
 	gdouble required_score;
 	gint action;
-	guint completed;
+	guint nsymbols;
 };
 
 struct roll_history {
 	struct roll_history_row *rows;
 	gboolean disabled;
 	guint nrows;
-	guint cur_row;
+	/* Sequence number of the next row */
+	rspamd_roll_history_seq_t head;
+	/* Rows with lower sequence numbers are considered as removed */
+	rspamd_roll_history_seq_t reset_seq;
+};
+
+/*
+ * Iterates over history rows from the oldest to the newest ones
+ */
+struct roll_history_iter {
+	struct roll_history *history;
+	rspamd_roll_history_seq_t cur;
+	rspamd_roll_history_seq_t end;
 };
 
 /**
@@ -69,6 +98,38 @@ struct roll_history * rspamd_roll_history_new (rspamd_mempool_t *pool,
 void rspamd_roll_history_update (struct roll_history *history,
 	struct rspamd_task *task);
 
+/**
+ * Append a filled row to the history, its `seq` field is ignored
+ * @param history roll history object
+ * @param row row to copy
+ */
+void rspamd_roll_history_add_row (struct roll_history *history,
+		struct roll_history_row *row);
+
+/**
+ * Start iteration over the rows written so far
+ * @param history roll history object
+ * @param it iterator to init
+ */
+void rspamd_roll_history_iter_init (struct roll_history *history,
+		struct roll_history_iter *it);
+
+/**
+ * Copy the next complete row, rows being written or overwritten concurrently
+ * are skipped
+ * @param it iterator
+ * @param row output row
+ * @return FALSE if there are no more rows
+ */
+gboolean rspamd_roll_history_iter_next (struct roll_history_iter *it,
+		struct roll_history_row *row);
+
+/**
+ * Remove all rows written so far
+ * @param history roll history object
+ */
+void rspamd_roll_history_reset (struct roll_history *history);
+
 /**
  * Load previously saved history from file
  * @param history roll history object
@@ -101,6 +101,13 @@ static const struct rspamd_control_cmd_match {
 				},
 				.type = RSPAMD_CONTROL_FUZZY_SYNC
 		},
+		{
+				.name = {
+						.begin = "/memtrace",
+						.len = sizeof ("/memtrace") - 1
+				},
+				.type = RSPAMD_CONTROL_MEMORY_TRACE
+		},
 };
 
 void
@@ -282,6 +289,25 @@ rspamd_control_write_reply (struct rspamd_control_session *session)
 			ucl_object_insert_key (cur, ucl_object_fromint (
 					elt->reply.reply.fuzzy_sync.status), "status", 0, false);
 			break;
+		case RSPAMD_CONTROL_MEMORY_TRACE:
+			ucl_object_insert_key (cur, ucl_object_fromint (
+					elt->reply.reply.memory_trace.status), "status", 0, false);
+
+			if (elt->attached_fd != -1) {
+				parser = ucl_parser_new (0);
+
+				if (ucl_parser_add_fd (parser, elt->attached_fd)) {
+					ucl_object_insert_key (cur, ucl_parser_get_object (parser),
+							"data", 0, false);
+				}
+				else {
+					ucl_object_insert_key (cur, ucl_object_fromstring (
+							ucl_parser_get_error (parser)), "error", 0, false);
+				}
+
+				ucl_parser_free (parser);
+			}
+			break;
 		default:
 			break;
 		}
@@ -531,6 +557,106 @@ struct rspamd_worker_control_data {
 	} handlers[RSPAMD_CONTROL_MAX];
 };
 
+static void
+rspamd_control_memory_trace_elt (const gchar *name, const gchar *tag,
+		gsize bytes, gsize allocations, gpointer ud)
+{
+	ucl_object_t *ar = ud, *elt;
+
+	elt = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (elt, ucl_object_fromstring (name), "name", 0, false);
+	ucl_object_insert_key (elt, ucl_object_fromstring (tag), "tag", 0, false);
+	ucl_object_insert_key (elt, ucl_object_fromint (bytes), "bytes", 0, false);
+	ucl_object_insert_key (elt, ucl_object_fromint (allocations),
+			"allocations", 0, false);
+	ucl_array_append (ar, elt);
+}
+
+/*
+ * Writes traced allocations to a temporary file and passes it to the main
+ * process along with the reply
+ */
+static void
+rspamd_control_send_memory_trace (gint fd,
+		struct rspamd_worker_control_data *cd)
+{
+	struct rspamd_control_reply rep;
+	ucl_object_t *obj, *ar;
+	struct ucl_emitter_functions *emit_subr;
+	guchar fdspace[CMSG_SPACE(sizeof (int))];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	gint outfd = -1;
+	gchar tmppath[PATH_MAX];
+
+	memset (&rep, 0, sizeof (rep));
+	rep.type = RSPAMD_CONTROL_MEMORY_TRACE;
+
+	rspamd_snprintf (tmppath, sizeof (tmppath), "%s%c%s-XXXXXXXXXX",
+			cd->worker->srv->cfg->temp_dir, G_DIR_SEPARATOR, "memtrace");
+
+	if ((outfd = mkstemp (tmppath)) == -1) {
+		rep.reply.memory_trace.status = errno;
+		msg_info ("cannot make temporary file for memory trace: %s",
+				strerror (errno));
+	}
+	else {
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj,
+				ucl_object_frombool (rspamd_mempool_trace_enabled ()),
+				"enabled", 0, false);
+
+		ar = ucl_object_typed_new (UCL_ARRAY);
+		rspamd_mempool_trace_foreach (FALSE, rspamd_control_memory_trace_elt,
+				ar);
+		ucl_object_insert_key (obj, ar, "locations", 0, false);
+
+		ar = ucl_object_typed_new (UCL_ARRAY);
+		rspamd_mempool_trace_foreach (TRUE, rspamd_control_memory_trace_elt,
+				ar);
+		ucl_object_insert_key (obj, ar, "symbols", 0, false);
+
+		emit_subr = ucl_object_emit_fd_funcs (outfd);
+		ucl_object_emit_full (obj, UCL_EMIT_JSON_COMPACT, emit_subr, NULL);
+		ucl_object_emit_funcs_free (emit_subr);
+		ucl_object_unref (obj);
+		/* Rewind output file */
+		close (outfd);
+		outfd = open (tmppath, O_RDONLY);
+		unlink (tmppath);
+	}
+
+	memset (&msg, 0, sizeof (msg));
+
+	if (outfd != -1) {
+		memset (fdspace, 0, sizeof (fdspace));
+		msg.msg_control = fdspace;
+		msg.msg_controllen = sizeof (fdspace);
+		cmsg = CMSG_FIRSTHDR (&msg);
+
+		if (cmsg) {
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+			memcpy (CMSG_DATA (cmsg), &outfd, sizeof (int));
+		}
+	}
+
+	iov.iov_base = &rep;
+	iov.iov_len = sizeof (rep);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (sendmsg (fd, &msg, 0) == -1) {
+		msg_err ("cannot send memory trace: %s", strerror (errno));
+	}
+
+	if (outfd != -1) {
+		close (outfd);
+	}
+}
+
 static void
 rspamd_control_default_cmd_handler (gint fd,
 		gint attached_fd,
@@ -568,6 +694,15 @@ rspamd_control_default_cmd_handler (gint fd,
 	case RSPAMD_CONTROL_FUZZY_SYNC:
 	case RSPAMD_CONTROL_LOG_PIPE:
 		break;
+	case RSPAMD_CONTROL_MEMORY_TRACE:
+		/* Reply is sent with the attached file */
+		rspamd_control_send_memory_trace (fd, cd);
+
+		if (attached_fd != -1) {
+			close (attached_fd);
+		}
+
+		return;
 	case RSPAMD_CONTROL_RERESOLVE:
 		if (cd->worker->srv->cfg) {
 			REF_RETAIN (cd->worker->srv->cfg);
@@ -33,6 +33,7 @@ enum rspamd_control_type {
 	RSPAMD_CONTROL_FUZZY_STAT,
 	RSPAMD_CONTROL_FUZZY_SYNC,
 	RSPAMD_CONTROL_MONITORED_CHANGE,
+	RSPAMD_CONTROL_MEMORY_TRACE,
 	RSPAMD_CONTROL_MAX
 };
 
@@ -46,6 +47,7 @@ enum rspamd_srv_type {
 
 enum rspamd_log_pipe_type {
 	RSPAMD_LOG_PIPE_SYMBOLS = 0,
+	RSPAMD_LOG_PIPE_RECORDS,
 };
 #define CONTROL_PATHLEN 400
 struct rspamd_control_command {
@@ -81,6 +83,9 @@ struct rspamd_control_command {
 		struct {
 			guint unused;
 		} fuzzy_sync;
+		struct {
+			guint unused;
+		} memory_trace;
 	} cmd;
 };
 
@@ -119,6 +124,9 @@ struct rspamd_control_reply {
 		struct {
 			guint status;
 		} fuzzy_sync;
+		struct {
+			guint status;
+		} memory_trace;
 	} reply;
 };
 
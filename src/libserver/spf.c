@@ -19,7 +19,7 @@
 #include "rspamd.h"
 #include "message.h"
 #include "utlist.h"
-#include "libserver/mempool_vars_internal.h"
+#include "libutil/mempool_vars_internal.h"
 
 #define SPF_VER1_STR "v=spf1"
 #define SPF_VER2_STR "spf2."
@@ -2084,7 +2084,8 @@ rspamd_spf_cache_domain (struct rspamd_task *task)
 	}
 
 	if (cred) {
-		rspamd_mempool_set_variable (task->task_pool, RSPAMD_MEMPOOL_SPF_DOMAIN,
+		rspamd_mempool_set_variable_idx (task->task_pool,
+				RSPAMD_MEMPOOL_VAR_SPF_DOMAIN,
 				cred, NULL);
 	}
 
@@ -2097,8 +2098,8 @@ rspamd_spf_get_domain (struct rspamd_task *task)
 	gchar *domain = NULL;
 	struct rspamd_spf_cred *cred;
 
-	cred = rspamd_mempool_get_variable (task->task_pool,
-			RSPAMD_MEMPOOL_SPF_DOMAIN);
+	cred = rspamd_mempool_get_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_SPF_DOMAIN);
 
 	if (!cred) {
 		cred = rspamd_spf_cache_domain (task);
@@ -2118,8 +2119,8 @@ rspamd_spf_resolve (struct rspamd_task *task, spf_cb_t callback,
 	struct spf_record *rec;
 	struct rspamd_spf_cred *cred;
 
-	cred = rspamd_mempool_get_variable (task->task_pool,
-			RSPAMD_MEMPOOL_SPF_DOMAIN);
+	cred = rspamd_mempool_get_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_SPF_DOMAIN);
 
 	if (!cred) {
 		cred = rspamd_spf_cache_domain (task);
@@ -64,6 +64,7 @@ struct symbols_cache {
 	GHashTable *items_by_symbol;
 	struct symbols_cache_order *items_by_order;
 	GPtrArray *items_by_id;
+	GPtrArray *connfilters;
 	GPtrArray *prefilters;
 	GPtrArray *postfilters;
 	GPtrArray *composites;
@@ -360,7 +361,8 @@ rspamd_symbols_cache_resort (struct symbols_cache *cache)
 		it = g_ptr_array_index (cache->items_by_id, i);
 		total_hits += it->st->total_hits;
 
-		if (!(it->type & (SYMBOL_TYPE_PREFILTER|SYMBOL_TYPE_POSTFILTER|SYMBOL_TYPE_COMPOSITE))) {
+		if (!(it->type & (SYMBOL_TYPE_PREFILTER|SYMBOL_TYPE_POSTFILTER|
+				SYMBOL_TYPE_CONNFILTER|SYMBOL_TYPE_COMPOSITE))) {
 			g_ptr_array_add (ord->d, it);
 		}
 	}
@@ -466,6 +468,7 @@ rspamd_symbols_cache_post_init (struct symbols_cache *cache)
 		}
 	}
 
+	g_ptr_array_sort_with_data (cache->connfilters, prefilters_cmp, cache);
 	g_ptr_array_sort_with_data (cache->prefilters, prefilters_cmp, cache);
 	g_ptr_array_sort_with_data (cache->postfilters, postfilters_cmp, cache);
 }
@@ -783,7 +786,10 @@ rspamd_symbols_cache_add_symbol (struct symbols_cache *cache,
 		g_hash_table_insert (cache->items_by_symbol, item->symbol, item);
 	}
 
-	if (item->type & SYMBOL_TYPE_PREFILTER) {
+	if (item->type & SYMBOL_TYPE_CONNFILTER) {
+		g_ptr_array_add (cache->connfilters, item);
+	}
+	else if (item->type & SYMBOL_TYPE_PREFILTER) {
 		g_ptr_array_add (cache->prefilters, item);
 	}
 	else if (item->type & SYMBOL_TYPE_POSTFILTER) {
@@ -922,6 +928,7 @@ rspamd_symbols_cache_destroy (struct symbols_cache *cache)
 		g_hash_table_destroy (cache->items_by_symbol);
 		rspamd_mempool_delete (cache->static_pool);
 		g_ptr_array_free (cache->items_by_id, TRUE);
+		g_ptr_array_free (cache->connfilters, TRUE);
 		g_ptr_array_free (cache->prefilters, TRUE);
 		g_ptr_array_free (cache->postfilters, TRUE);
 		g_ptr_array_free (cache->composites, TRUE);
@@ -946,6 +953,7 @@ rspamd_symbols_cache_new (struct rspamd_config *cfg)
 	cache->items_by_symbol = g_hash_table_new (rspamd_str_hash,
 			rspamd_str_equal);
 	cache->items_by_id = g_ptr_array_new ();
+	cache->connfilters = g_ptr_array_new ();
 	cache->prefilters = g_ptr_array_new ();
 	cache->postfilters = g_ptr_array_new ();
 	cache->composites = g_ptr_array_new ();
@@ -1231,6 +1239,29 @@ rspamd_symbols_cache_watcher_cb (gpointer sessiond, gpointer ud)
 			remain);
 }
 
+/*
+ * Call symbol's callback attributing pool allocations and Lua heap growth
+ * to this symbol
+ */
+static void
+rspamd_symbols_cache_call_traced (struct rspamd_task *task,
+		struct cache_item *item)
+{
+	lua_State *L = task->cfg->lua_state;
+	const gchar *ctx = item->symbol ? item->symbol : "unnamed";
+	gsize lua_before, lua_after;
+
+	lua_before = lua_gc (L, LUA_GCCOUNT, 0) * 1024 + lua_gc (L, LUA_GCCOUNTB, 0);
+	rspamd_mempool_trace_set_context (ctx);
+	item->func (task, item->user_data);
+	rspamd_mempool_trace_set_context (NULL);
+	lua_after = lua_gc (L, LUA_GCCOUNT, 0) * 1024 + lua_gc (L, LUA_GCCOUNTB, 0);
+
+	if (lua_after > lua_before) {
+		rspamd_mempool_trace_account (ctx, "lua", lua_after - lua_before);
+	}
+}
+
 static gboolean
 rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 		struct symbols_cache *cache,
@@ -1284,7 +1315,14 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 					item);
 			msg_debug_task ("execute %s, %d", item->symbol, item->id);
 			t1 = rspamd_get_ticks ();
-			item->func (task, item->user_data);
+
+			if (G_UNLIKELY (rspamd_mempool_trace_enabled ())) {
+				rspamd_symbols_cache_call_traced (task, item);
+			}
+			else {
+				item->func (task, item->user_data);
+			}
+
 			t2 = rspamd_get_ticks ();
 			diff = (t2 - t1) * 1e6;
 
@@ -1453,7 +1491,8 @@ rspamd_symbols_cache_make_checkpoint (struct rspamd_task *task,
 	guint nitems;
 
 	nitems = cache->items_by_id->len - cache->postfilters->len -
-			cache->prefilters->len - cache->composites->len;
+			cache->prefilters->len - cache->connfilters->len -
+			cache->composites->len;
 
 	if (nitems != cache->items_by_order->d->len) {
 		/*
@@ -1594,6 +1633,10 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 
 	g_assert (cache != NULL);
 
+	if (stage == RSPAMD_TASK_STAGE_ENVELOPE && cache->connfilters->len == 0) {
+		return TRUE;
+	}
+
 	if (task->checkpoint == NULL) {
 		checkpoint = rspamd_symbols_cache_make_checkpoint (task, cache);
 		task->checkpoint = checkpoint;
@@ -1602,6 +1645,38 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 		checkpoint = task->checkpoint;
 	}
 
+	if (stage == RSPAMD_TASK_STAGE_ENVELOPE) {
+		/*
+		 * Connection filters use merely envelope data, so they are started
+		 * before the message is parsed (or even completely received).
+		 * Like prefilters, they are ordered by priority, so settings can be
+		 * applied before the other filters are started
+		 */
+		saved_priority = G_MININT;
+		start_events_pending = rspamd_session_events_pending (task->s);
+
+		for (i = 0; i < (gint)cache->connfilters->len; i ++) {
+			item = g_ptr_array_index (cache->connfilters, i);
+
+			if (!isset (checkpoint->processed_bits, item->id * 2) &&
+					!isset (checkpoint->processed_bits, item->id * 2 + 1)) {
+				if (saved_priority == G_MININT) {
+					saved_priority = item->priority;
+				}
+				else if (item->priority < saved_priority &&
+						rspamd_session_events_pending (task->s) > start_events_pending) {
+					/* Stage is restarted when higher priority filters finish */
+					return TRUE;
+				}
+
+				rspamd_symbols_cache_check_symbol (task, cache, item,
+						checkpoint, &total_microseconds);
+			}
+		}
+
+		return TRUE;
+	}
+
 	if (stage == RSPAMD_TASK_STAGE_POST_FILTERS && checkpoint->pass <
 			RSPAMD_CACHE_PASS_POSTFILTERS) {
 		checkpoint->pass = RSPAMD_CACHE_PASS_POSTFILTERS;
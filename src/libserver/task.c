@@ -25,7 +25,7 @@
 #include "unix-std.h"
 #include "utlist.h"
 #include "contrib/zstd/zstd.h"
-#include "libserver/mempool_vars_internal.h"
+#include "libutil/mempool_vars_internal.h"
 #include <math.h>
 
 /*
@@ -324,6 +324,193 @@ rspamd_task_unmapper (gpointer ud)
 	munmap (m->begin, m->len);
 }
 
+static gboolean
+rspamd_task_map_shmem (struct rspamd_task *task, gint fd, const gchar *fp,
+		const gchar *ft)
+{
+	gulong offset = 0, shmem_size = 0;
+	rspamd_ftok_t *tok;
+	gpointer map;
+	struct stat st;
+	struct rspamd_task_map *m;
+
+	if (fstat (fd, &st) == -1) {
+		g_set_error (&task->err, rspamd_task_quark(), RSPAMD_PROTOCOL_ERROR,
+				"Cannot stat %s segment (%s): %s", ft, fp, strerror (errno));
+		close (fd);
+
+		return FALSE;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (map == MAP_FAILED) {
+		close (fd);
+		g_set_error (&task->err, rspamd_task_quark(), RSPAMD_PROTOCOL_ERROR,
+				"Cannot mmap %s (%s): %s", ft, fp, strerror (errno));
+		return FALSE;
+	}
+
+	close (fd);
+
+	tok = rspamd_task_get_request_header (task, "shm-offset");
+
+	if (tok) {
+		rspamd_strtoul (tok->begin, tok->len, &offset);
+
+		if (offset > (gulong)st.st_size) {
+			msg_err_task ("invalid offset %ul (%ul available) for shm "
+					"segment %s", offset, st.st_size, fp);
+			munmap (map, st.st_size);
+
+			return FALSE;
+		}
+	}
+
+	tok = rspamd_task_get_request_header (task, "shm-length");
+	shmem_size = st.st_size;
+
+
+	if (tok) {
+		rspamd_strtoul (tok->begin, tok->len, &shmem_size);
+
+		if (shmem_size > (gulong)st.st_size) {
+			msg_err_task ("invalid length %ul (%ul available) for %s "
+					"segment %s", shmem_size, st.st_size, ft, fp);
+			munmap (map, st.st_size);
+
+			return FALSE;
+		}
+	}
+
+	task->msg.begin = ((guchar *)map) + offset;
+	task->msg.len = shmem_size;
+	m = rspamd_mempool_alloc (task->task_pool, sizeof (*m));
+	m->begin = map;
+	m->len = st.st_size;
+
+	msg_info_task ("loaded message from shared memory %s (%ul size, %ul offset)",
+			fp, shmem_size, offset);
+
+	rspamd_mempool_add_destructor (task->task_pool, rspamd_task_unmapper, m);
+
+	return TRUE;
+}
+
+struct rspamd_task_zstd_stream {
+	ZSTD_DStream *zstream;
+	rspamd_fstring_t *out;
+	gsize compressed_len;
+};
+
+static gboolean
+rspamd_task_zstd_dictionary (struct rspamd_task *task,
+		struct zstd_dictionary **pdict)
+{
+	rspamd_ftok_t *tok;
+	gulong dict_id;
+
+	tok = rspamd_task_get_request_header (task, "dictionary");
+
+	if (tok == NULL) {
+		*pdict = task->cfg->libs_ctx->in_dict;
+
+		return TRUE;
+	}
+
+	/* We need to use custom dictionary */
+	if (!rspamd_strtoul (tok->begin, tok->len, &dict_id)) {
+		g_set_error (&task->err, rspamd_task_quark(), RSPAMD_PROTOCOL_ERROR,
+				"Non numeric dictionary");
+
+		return FALSE;
+	}
+
+	*pdict = rspamd_libs_zstd_dictionary (task->cfg->libs_ctx, dict_id);
+
+	if (*pdict == NULL) {
+		g_set_error (&task->err, rspamd_task_quark(), RSPAMD_PROTOCOL_ERROR,
+				"Unknown dictionary %ul, undefined locally", dict_id);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_task_zstd_stream_dtor (gpointer p)
+{
+	struct rspamd_task_zstd_stream *zs = p;
+
+	ZSTD_freeDStream (zs->zstream);
+	rspamd_fstring_free (zs->out);
+}
+
+gboolean
+rspamd_task_decompress_chunk (struct rspamd_task *task,
+		const gchar *chunk, gsize len)
+{
+	struct rspamd_task_zstd_stream *zs;
+	struct zstd_dictionary *dict;
+	rspamd_ftok_t *tok, srch;
+	const gchar *err = NULL;
+
+	tok = rspamd_task_get_request_header (task, "compression");
+
+	if (tok == NULL || len == 0) {
+		return TRUE;
+	}
+
+	srch.begin = "zstd";
+	srch.len = 4;
+
+	if (rspamd_ftok_casecmp (tok, &srch) != 0) {
+		/* Reported when message is loaded */
+		return TRUE;
+	}
+
+	zs = rspamd_mempool_get_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_ZSTD_STREAM);
+
+	if (zs == NULL) {
+		if (!rspamd_task_zstd_dictionary (task, &dict)) {
+			return FALSE;
+		}
+
+		zs = rspamd_mempool_alloc0 (task->task_pool, sizeof (*zs));
+		zs->zstream = ZSTD_createDStream ();
+
+		if (zs->zstream == NULL ||
+				!rspamd_zstd_init_decompression (zs->zstream, dict)) {
+			g_set_error (&task->err, rspamd_task_quark(), RSPAMD_PROTOCOL_ERROR,
+					"Cannot decompress, decompressor init failed");
+
+			if (zs->zstream) {
+				ZSTD_freeDStream (zs->zstream);
+			}
+
+			return FALSE;
+		}
+
+		zs->out = rspamd_fstring_sized_new (ZSTD_DStreamOutSize ());
+		rspamd_mempool_set_variable_idx (task->task_pool,
+				RSPAMD_MEMPOOL_VAR_ZSTD_STREAM, zs, rspamd_task_zstd_stream_dtor);
+	}
+
+	zs->compressed_len += len;
+
+	if (!rspamd_zstd_decompress_chunk (zs->zstream, chunk, len, &zs->out,
+			&err)) {
+		g_set_error (&task->err, rspamd_task_quark(), RSPAMD_PROTOCOL_ERROR,
+				"Decompression error: %s", err);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 gboolean
 rspamd_task_load_message (struct rspamd_task *task,
 	struct rspamd_http_message *msg, const gchar *start, gsize len)
@@ -333,11 +520,11 @@ rspamd_task_load_message (struct rspamd_task *task,
 	ucl_object_t *control_obj;
 	gchar filepath[PATH_MAX], *fp;
 	gint fd, flen;
-	gulong offset = 0, shmem_size = 0;
 	rspamd_ftok_t *tok;
 	gpointer map;
 	struct stat st;
 	struct rspamd_task_map *m;
+	struct rspamd_task_zstd_stream *zs;
 	const gchar *ft;
 
 #ifdef HAVE_SANE_SHMEM
@@ -347,7 +534,17 @@ rspamd_task_load_message (struct rspamd_task *task,
 #endif
 
 	if (msg) {
-		rspamd_protocol_handle_headers (task, msg);
+		if (!(task->flags & RSPAMD_TASK_FLAG_WAIT_BODY)) {
+			/* Streamed requests have headers processed with the first chunk */
+			rspamd_protocol_handle_headers (task, msg);
+		}
+
+		tok = rspamd_task_get_request_header (task, "shm-fd");
+
+		if (tok && (fd = rspamd_http_message_steal_fd (msg)) != -1) {
+			/* Segment has been passed over unix socket, no need to open it */
+			return rspamd_task_map_shmem (task, fd, "descriptor", ft);
+		}
 	}
 
 	tok = rspamd_task_get_request_header (task, "shm");
@@ -379,67 +576,7 @@ rspamd_task_load_message (struct rspamd_task *task,
 			return FALSE;
 		}
 
-		if (fstat (fd, &st) == -1) {
-			g_set_error (&task->err, rspamd_task_quark(), RSPAMD_PROTOCOL_ERROR,
-					"Cannot stat %s segment (%s): %s", ft, fp, strerror (errno));
-			close (fd);
-
-			return FALSE;
-		}
-
-		map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
-
-		if (map == MAP_FAILED) {
-			close (fd);
-			g_set_error (&task->err, rspamd_task_quark(), RSPAMD_PROTOCOL_ERROR,
-					"Cannot mmap %s (%s): %s", ft, fp, strerror (errno));
-			return FALSE;
-		}
-
-		close (fd);
-
-		tok = rspamd_task_get_request_header (task, "shm-offset");
-
-		if (tok) {
-			rspamd_strtoul (tok->begin, tok->len, &offset);
-
-			if (offset > (gulong)st.st_size) {
-				msg_err_task ("invalid offset %ul (%ul available) for shm "
-						"segment %s", offset, st.st_size, fp);
-				munmap (map, st.st_size);
-
-				return FALSE;
-			}
-		}
-
-		tok = rspamd_task_get_request_header (task, "shm-length");
-		shmem_size = st.st_size;
-
-
-		if (tok) {
-			rspamd_strtoul (tok->begin, tok->len, &shmem_size);
-
-			if (shmem_size > (gulong)st.st_size) {
-				msg_err_task ("invalid length %ul (%ul available) for %s "
-						"segment %s", shmem_size, st.st_size, ft, fp);
-				munmap (map, st.st_size);
-
-				return FALSE;
-			}
-		}
-
-		task->msg.begin = ((guchar *)map) + offset;
-		task->msg.len = shmem_size;
-		m = rspamd_mempool_alloc (task->task_pool, sizeof (*m));
-		m->begin = map;
-		m->len = st.st_size;
-
-		msg_info_task ("loaded message from shared memory %s (%ul size, %ul offset)",
-				fp, shmem_size, offset);
-
-		rspamd_mempool_add_destructor (task->task_pool, rspamd_task_unmapper, m);
-
-		return TRUE;
+		return rspamd_task_map_shmem (task, fd, fp, ft);
 	}
 
 	tok = rspamd_task_get_request_header (task, "file");
@@ -511,8 +648,20 @@ rspamd_task_load_message (struct rspamd_task *task,
 
 	/* Check compression */
 	tok = rspamd_task_get_request_header (task, "compression");
-
-	if (tok) {
+	zs = rspamd_mempool_get_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_ZSTD_STREAM);
+
+	if (zs) {
+		/* Message has been decompressed while it was received */
+		task->msg.begin = zs->out->str;
+		task->msg.len = zs->out->len;
+		task->flags |= RSPAMD_TASK_FLAG_COMPRESSED;
+
+		msg_info_task ("loaded message from zstd compressed stream; "
+				"compressed: %z; uncompressed: %z",
+				zs->compressed_len, zs->out->len);
+	}
+	else if (tok) {
 		/* Need to uncompress */
 		rspamd_ftok_t t;
 
@@ -520,14 +669,12 @@ rspamd_task_load_message (struct rspamd_task *task,
 		t.len = 4;
 
 		if (rspamd_ftok_casecmp (tok, &t) == 0) {
-			ZSTD_DStream *zstream;
-			ZSTD_inBuffer zin;
-			ZSTD_outBuffer zout;
-			guchar *out;
-			gsize outlen, r;
-			gulong dict_id;
-
-			if (!rspamd_libs_reset_decompression (task->cfg->libs_ctx)) {
+			struct zstd_dictionary *dict;
+			rspamd_fstring_t *out;
+			const gchar *err = NULL;
+			gsize outlen;
+
+			if (task->cfg->libs_ctx->in_zstream == NULL) {
 				g_set_error (&task->err, rspamd_task_quark(),
 						RSPAMD_PROTOCOL_ERROR,
 						"Cannot decompress, decompressor init failed");
@@ -535,73 +682,44 @@ rspamd_task_load_message (struct rspamd_task *task,
 				return FALSE;
 			}
 
-			tok = rspamd_task_get_request_header (task, "dictionary");
-
-			if (tok != NULL) {
-				/* We need to use custom dictionary */
-				if (!rspamd_strtoul (tok->begin, tok->len, &dict_id)) {
-					g_set_error (&task->err, rspamd_task_quark(), RSPAMD_PROTOCOL_ERROR,
-							"Non numeric dictionary");
-
-					return FALSE;
-				}
-
-				if (!task->cfg->libs_ctx->in_dict) {
-					g_set_error (&task->err, rspamd_task_quark(), RSPAMD_PROTOCOL_ERROR,
-							"Unknown dictionary, undefined locally");
-
-					return FALSE;
-				}
-
-				if (task->cfg->libs_ctx->in_dict->id != dict_id) {
-					g_set_error (&task->err, rspamd_task_quark(), RSPAMD_PROTOCOL_ERROR,
-							"Unknown dictionary, invalid dictionary id");
-
-					return FALSE;
-				}
+			if (!rspamd_task_zstd_dictionary (task, &dict)) {
+				return FALSE;
 			}
 
-			zstream = task->cfg->libs_ctx->in_zstream;
+			if (!rspamd_zstd_init_decompression (task->cfg->libs_ctx->in_zstream,
+					dict)) {
+				g_set_error (&task->err, rspamd_task_quark(),
+						RSPAMD_PROTOCOL_ERROR,
+						"Cannot decompress, decompressor init failed");
 
-			zin.pos = 0;
-			zin.src = start;
-			zin.size = len;
+				return FALSE;
+			}
 
 			if ((outlen = ZSTD_getDecompressedSize (start, len)) == 0) {
 				outlen = ZSTD_DStreamOutSize ();
 			}
 
-			out = g_malloc (outlen);
-			zout.dst = out;
-			zout.pos = 0;
-			zout.size = outlen;
-
-			while (zin.pos < zin.size) {
-				r = ZSTD_decompressStream (zstream, &zout, &zin);
-
-				if (ZSTD_isError (r)) {
-					g_set_error (&task->err, rspamd_task_quark(),
-							RSPAMD_PROTOCOL_ERROR,
-							"Decompression error: %s", ZSTD_getErrorName (r));
+			out = rspamd_fstring_sized_new (outlen);
 
-					return FALSE;
-				}
+			if (!rspamd_zstd_decompress_chunk (task->cfg->libs_ctx->in_zstream,
+					start, len, &out, &err)) {
+				g_set_error (&task->err, rspamd_task_quark(),
+						RSPAMD_PROTOCOL_ERROR,
+						"Decompression error: %s", err);
+				rspamd_fstring_free (out);
 
-				if (zout.pos == zout.size) {
-					/* We need to extend output buffer */
-					zout.size = zout.size * 1.5 + 1.0;
-					zout.dst = g_realloc (zout.dst, zout.size);
-				}
+				return FALSE;
 			}
 
-			rspamd_mempool_add_destructor (task->task_pool, g_free, zout.dst);
-			task->msg.begin = zout.dst;
-			task->msg.len = zout.pos;
+			rspamd_mempool_add_destructor (task->task_pool,
+					(rspamd_mempool_destruct_t)rspamd_fstring_free, out);
+			task->msg.begin = out->str;
+			task->msg.len = out->len;
 			task->flags |= RSPAMD_TASK_FLAG_COMPRESSED;
 
 			msg_info_task ("loaded message from zstd compressed stream; "
-					"compressed: %ul; uncompressed: %ul",
-					(gulong)zin.size, (gulong)zout.pos);
+					"compressed: %z; uncompressed: %z",
+					len, out->len);
 
 		}
 		else {
@@ -704,7 +822,20 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 
 	st = rspamd_task_select_processing_stage (task, stages);
 
+	if (st == RSPAMD_TASK_STAGE_READ_MESSAGE &&
+			(task->flags & RSPAMD_TASK_FLAG_WAIT_BODY)) {
+		/* Message is still being received, continue when it is ready */
+		task->flags &= ~RSPAMD_TASK_FLAG_PROCESSING;
+
+		return TRUE;
+	}
+
 	switch (st) {
+	case RSPAMD_TASK_STAGE_ENVELOPE:
+		rspamd_symbols_cache_process_symbols (task, task->cfg->cache,
+				RSPAMD_TASK_STAGE_ENVELOPE);
+		break;
+
 	case RSPAMD_TASK_STAGE_READ_MESSAGE:
 		if (!rspamd_message_parse (task)) {
 			ret = FALSE;
@@ -841,8 +972,8 @@ rspamd_task_cache_principal_recipient (struct rspamd_task *task,
 	rspamd_strlcpy (rcpt_lc, rcpt, len + 1);
 	rspamd_str_lc (rcpt_lc, len);
 
-	rspamd_mempool_set_variable (task->task_pool,
-			RSPAMD_MEMPOOL_PRINCIPAL_RECIPIENT, rcpt_lc, NULL);
+	rspamd_mempool_set_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_PRINCIPAL_RECIPIENT, rcpt_lc, NULL);
 
 	return rcpt_lc;
 }
@@ -853,8 +984,8 @@ rspamd_task_get_principal_recipient (struct rspamd_task *task)
 	const gchar *val;
 	struct rspamd_email_address *addr;
 
-	val = rspamd_mempool_get_variable (task->task_pool,
-			RSPAMD_MEMPOOL_PRINCIPAL_RECIPIENT);
+	val = rspamd_mempool_get_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_PRINCIPAL_RECIPIENT);
 
 	if (val) {
 		return val;
@@ -1508,11 +1639,13 @@ rspamd_task_profile_set (struct rspamd_task *task, const gchar *key,
 		return;
 	}
 
-	tbl = rspamd_mempool_get_variable (task->task_pool, RSPAMD_MEMPOOL_PROFILE);
+	tbl = rspamd_mempool_get_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_PROFILE);
 
 	if (tbl == NULL) {
 		tbl = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
-		rspamd_mempool_set_variable (task->task_pool, RSPAMD_MEMPOOL_PROFILE,
+		rspamd_mempool_set_variable_idx (task->task_pool,
+				RSPAMD_MEMPOOL_VAR_PROFILE,
 				tbl, (rspamd_mempool_destruct_t)g_hash_table_unref);
 	}
 
@@ -1534,7 +1667,8 @@ rspamd_task_profile_get (struct rspamd_task *task, const gchar *key)
 	GHashTable *tbl;
 	gdouble *pval = NULL;
 
-	tbl = rspamd_mempool_get_variable (task->task_pool, RSPAMD_MEMPOOL_PROFILE);
+	tbl = rspamd_mempool_get_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_PROFILE);
 
 	if (tbl != NULL) {
 		pval = g_hash_table_lookup (tbl, key);
@@ -108,6 +108,14 @@ enum rspamd_task_stage {
 #define RSPAMD_TASK_FLAG_GREYLISTED (1 << 26)
 #define RSPAMD_TASK_FLAG_OWN_POOL (1 << 27)
 #define RSPAMD_TASK_FLAG_MILTER (1 << 28)
+#define RSPAMD_TASK_FLAG_OVERLOADED (1 << 29)
+#define RSPAMD_TASK_FLAG_KEEPALIVE (1 << 30)
+#define RSPAMD_TASK_FLAG_WAIT_BODY (1U << 31)
+
+enum rspamd_task_reply_format {
+	RSPAMD_TASK_REPLY_DEFAULT = 0,
+	RSPAMD_TASK_REPLY_BINARY,
+};
 
 #define RSPAMD_TASK_IS_SKIPPED(task) (((task)->flags & RSPAMD_TASK_FLAG_SKIP))
 #define RSPAMD_TASK_IS_JSON(task) (((task)->flags & RSPAMD_TASK_FLAG_JSON))
@@ -129,6 +137,7 @@ struct rspamd_task {
 	enum rspamd_command cmd;						/**< command										*/
 	gint sock;										/**< socket descriptor								*/
 	guint32 flags;									/**< Bit flags										*/
+	enum rspamd_task_reply_format reply_format;		/**< Format of scan reply							*/
 	guint32 dns_requests;							/**< number of DNS requests per this task			*/
 	gulong message_len;								/**< Message length									*/
 	gchar *helo;									/**< helo header value								*/
@@ -226,6 +235,17 @@ void rspamd_task_restore (void *arg);
  */
 gboolean rspamd_task_fin (void *arg);
 
+/**
+ * Decompress a portion of zstd compressed body received in streaming mode.
+ * Does nothing if message is not compressed
+ * @param task
+ * @param chunk
+ * @param len
+ * @return FALSE in case of error
+ */
+gboolean rspamd_task_decompress_chunk (struct rspamd_task *task,
+		const gchar *chunk, gsize len);
+
 /**
  * Load HTTP message with body in `msg` to an rspamd_task
  * @param task
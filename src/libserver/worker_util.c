@@ -283,6 +283,8 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 	rspamd_redis_pool_config (worker->srv->cfg->redis_pool,
 			worker->srv->cfg, ev_base);
 #endif
+	rspamd_http_pool_config (worker->srv->cfg->http_pool,
+			worker->srv->cfg, ev_base);
 
 	/* Accept all sockets */
 	if (accept_handler) {
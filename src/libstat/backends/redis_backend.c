@@ -18,7 +18,7 @@
 #include "stat_internal.h"
 #include "upstream.h"
 #include "lua/lua_common.h"
-#include "libserver/mempool_vars_internal.h"
+#include "libutil/mempool_vars_internal.h"
 
 #ifdef WITH_HIREDIS
 #include "hiredis.h"
@@ -161,7 +161,8 @@ rspamd_redis_expand_object (const gchar *pattern,
 		}
 
 		if (rcpt) {
-			rspamd_mempool_set_variable (task->task_pool, "stat_user",
+			rspamd_mempool_set_variable_idx (task->task_pool,
+					RSPAMD_MEMPOOL_VAR_STAT_USER,
 					(gpointer)rcpt, NULL);
 		}
 	}
@@ -612,8 +613,8 @@ rspamd_redis_store_stat_signature (struct rspamd_task *task,
 	rspamd_fstring_t *out;
 
 	out = rspamd_fstring_sized_new (1024);
-	sig = rspamd_mempool_get_variable (task->task_pool,
-			RSPAMD_MEMPOOL_STAT_SIGNATURE);
+	sig = rspamd_mempool_get_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_STAT_SIGNATURE);
 
 	if (sig == NULL) {
 		msg_err_task ("cannot get bayes signature");
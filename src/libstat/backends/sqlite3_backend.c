@@ -20,6 +20,7 @@
 #include "libstat/stat_internal.h"
 #include "libmime/message.h"
 #include "lua/lua_common.h"
+#include "libutil/mempool_vars_internal.h"
 #include "unix-std.h"
 
 #define SQLITE3_BACKEND_TYPE "sqlite3"
@@ -326,7 +327,8 @@ rspamd_sqlite3_get_user (struct rspamd_stat_sqlite3_db *db,
 
 
 	if (user != NULL) {
-		rspamd_mempool_set_variable (task->task_pool, "stat_user",
+		rspamd_mempool_set_variable_idx (task->task_pool,
+				RSPAMD_MEMPOOL_VAR_STAT_USER,
 				(gpointer)user, NULL);
 
 		rc = rspamd_sqlite3_run_prstmt (task->task_pool, db->sqlite, db->prstmt,
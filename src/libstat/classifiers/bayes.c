@@ -19,6 +19,7 @@
 #include "classifiers.h"
 #include "rspamd.h"
 #include "stat_internal.h"
+#include "libutil/mempool_vars_internal.h"
 #include "math.h"
 
 #define msg_err_bayes(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
@@ -369,7 +370,8 @@ bayes_classify (struct rspamd_classifier * ctx,
 
 	pprob = rspamd_mempool_alloc (task->task_pool, sizeof (*pprob));
 	*pprob = final_prob;
-	rspamd_mempool_set_variable (task->task_pool, "bayes_prob", pprob, NULL);
+	rspamd_mempool_set_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_BAYES_PROB, pprob, NULL);
 
 	if (cl.processed_tokens > 0 && fabs (final_prob - 0.5) > 0.05) {
 		/* Now we can have exactly one HAM and exactly one SPAM statfiles per classifier */
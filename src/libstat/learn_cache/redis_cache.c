@@ -20,6 +20,7 @@
 #include "stat_internal.h"
 #include "cryptobox.h"
 #include "ucl.h"
+#include "libutil/mempool_vars_internal.h"
 #include "hiredis.h"
 #include "adapters/libevent.h"
 
@@ -189,7 +190,8 @@ rspamd_stat_cache_redis_generate_id (struct rspamd_task *task)
 
 	rspamd_cryptobox_hash_init (&st, NULL, 0);
 
-	user = rspamd_mempool_get_variable (task->task_pool, "stat_user");
+	user = rspamd_mempool_get_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_STAT_USER);
 	/* Use dedicated hash space for per users cache */
 	if (user != NULL) {
 		rspamd_cryptobox_hash_update (&st, user, strlen (user));
@@ -205,7 +207,8 @@ rspamd_stat_cache_redis_generate_id (struct rspamd_task *task)
 
 	b32out = rspamd_encode_base32 (out, sizeof (out));
 	g_assert (b32out != NULL);
-	rspamd_mempool_set_variable (task->task_pool, "words_hash", b32out, g_free);
+	rspamd_mempool_set_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_WORDS_HASH, b32out, g_free);
 }
 
 static gboolean
@@ -433,7 +436,8 @@ rspamd_stat_cache_redis_check (struct rspamd_task *task,
 	struct timeval tv;
 	gchar *h;
 
-	h = rspamd_mempool_get_variable (task->task_pool, "words_hash");
+	h = rspamd_mempool_get_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_WORDS_HASH);
 
 	if (h == NULL) {
 		return RSPAMD_LEARN_INGORE;
@@ -464,7 +468,8 @@ rspamd_stat_cache_redis_learn (struct rspamd_task *task,
 	gchar *h;
 	gint flag;
 
-	h = rspamd_mempool_get_variable (task->task_pool, "words_hash");
+	h = rspamd_mempool_get_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_WORDS_HASH);
 	g_assert (h != NULL);
 
 	double_to_tv (rt->ctx->timeout, &tv);
@@ -23,6 +23,7 @@
 #include "fstring.h"
 #include "message.h"
 #include "libutil/sqlite_utils.h"
+#include "libutil/mempool_vars_internal.h"
 
 static const char *create_tables_sql =
 		""
@@ -192,7 +193,8 @@ rspamd_stat_cache_sqlite3_check (struct rspamd_task *task,
 
 		rspamd_cryptobox_hash_init (&st, NULL, 0);
 
-		user = rspamd_mempool_get_variable (task->task_pool, "stat_user");
+		user = rspamd_mempool_get_variable_idx (task->task_pool,
+				RSPAMD_MEMPOOL_VAR_STAT_USER);
 		/* Use dedicated hash space for per users cache */
 		if (user != NULL) {
 			rspamd_cryptobox_hash_update (&st, user, strlen (user));
@@ -215,7 +217,8 @@ rspamd_stat_cache_sqlite3_check (struct rspamd_task *task,
 				RSPAMD_STAT_CACHE_TRANSACTION_COMMIT);
 
 		/* Save hash into variables */
-		rspamd_mempool_set_variable (task->task_pool, "words_hash", out, NULL);
+		rspamd_mempool_set_variable_idx (task->task_pool,
+				RSPAMD_MEMPOOL_VAR_WORDS_HASH, out, NULL);
 
 		if (rc == SQLITE_OK) {
 			/* We have some existing record in the table */
@@ -243,7 +246,8 @@ rspamd_stat_cache_sqlite3_learn (struct rspamd_task *task,
 	guchar *h;
 	gint64 flag;
 
-	h = rspamd_mempool_get_variable (task->task_pool, "words_hash");
+	h = rspamd_mempool_get_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_WORDS_HASH);
 
 	if (h == NULL) {
 		return RSPAMD_LEARN_INGORE;
@@ -21,7 +21,7 @@
 #include "libmime/images.h"
 #include "libserver/html.h"
 #include "lua/lua_common.h"
-#include "libserver/mempool_vars_internal.h"
+#include "libutil/mempool_vars_internal.h"
 #include "utlist.h"
 #include <math.h>
 
@@ -174,8 +174,8 @@ rspamd_stat_tokenize_parts_metadata (struct rspamd_stat_ctx *st_ctx,
 	}
 
 	/* Use headers order */
-	headers_hash = rspamd_mempool_get_variable (task->task_pool,
-			RSPAMD_MEMPOOL_HEADERS_HASH);
+	headers_hash = rspamd_mempool_get_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_HEADERS_HASH);
 
 	if (headers_hash) {
 		elt.begin = (gchar *)headers_hash;
@@ -321,7 +321,8 @@ rspamd_stat_process_tokenize (struct rspamd_stat_ctx *st_ctx,
 	task->tokens = g_ptr_array_sized_new (reserved_len);
 	rspamd_mempool_add_destructor (task->task_pool,
 			rspamd_ptr_array_free_hard, task->tokens);
-	pdiff = rspamd_mempool_get_variable (task->task_pool, "parts_distance");
+	pdiff = rspamd_mempool_get_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_PARTS_DISTANCE);
 
 	for (i = 0; i < task->text_parts->len; i ++) {
 		part = g_ptr_array_index (task->text_parts, i);
@@ -383,7 +384,8 @@ rspamd_stat_process_tokenize (struct rspamd_stat_ctx *st_ctx,
 	 * hash distribution
 	 */
 	b32_hout[32] = '\0';
-	rspamd_mempool_set_variable (task->task_pool, RSPAMD_MEMPOOL_STAT_SIGNATURE,
+	rspamd_mempool_set_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_STAT_SIGNATURE,
 			b32_hout, g_free);
 }
 
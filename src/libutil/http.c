@@ -43,6 +43,8 @@ enum rspamd_http_priv_flags {
 	RSPAMD_HTTP_CONN_FLAG_NEW_HEADER = 1 << 1,
 	RSPAMD_HTTP_CONN_FLAG_RESETED = 1 << 2,
 	RSPAMD_HTTP_CONN_FLAG_TOO_LARGE = 1 << 3,
+	RSPAMD_HTTP_CONN_FLAG_HAS_DATA = 1 << 4,
+	RSPAMD_HTTP_CONN_FLAG_IDLE = 1 << 5,
 };
 
 #define IS_CONN_ENCRYPTED(c) ((c)->flags & RSPAMD_HTTP_CONN_FLAG_ENCRYPTED)
@@ -60,7 +62,15 @@ struct rspamd_http_connection_private {
 	struct event ev;
 	struct timeval tv;
 	struct timeval *ptv;
+	/* Timeout used until the first byte of a message arrives */
+	struct timeval idle_tv;
 	struct rspamd_http_message *msg;
+	/* Data received after the end of the previous message */
+	rspamd_fstring_t *pipelined;
+	/* Descriptor received but not yet attached to a message */
+	gint passed_fd;
+	/* Descriptor to be sent with the first portion of data */
+	gint send_fd;
 	struct iovec *out;
 	guint outlen;
 	enum rspamd_http_priv_flags flags;
@@ -636,9 +646,15 @@ rspamd_http_on_headers_complete (http_parser * parser)
 		}
 
 		msg->code = parser->status_code;
+
+		if (conn->type == RSPAMD_HTTP_CLIENT && http_should_keep_alive (parser)) {
+			/* HEAD replies have no body, so a connection could be reused */
+			msg->flags |= RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+		}
+
 		rspamd_http_connection_ref (conn);
-		ret = conn->finish_handler (conn, msg);
 		conn->finished = TRUE;
+		ret = conn->finish_handler (conn, msg);
 		rspamd_http_connection_unref (conn);
 
 		return ret;
@@ -666,11 +682,20 @@ rspamd_http_on_headers_complete (http_parser * parser)
 	if (parser->flags & F_SPAMC) {
 		msg->flags |= RSPAMD_HTTP_FLAG_SPAMC;
 	}
-
+	else if (http_should_keep_alive (parser) &&
+			(conn->type == RSPAMD_HTTP_CLIENT || parser->method < HTTP_SYMBOLS)) {
+		/* Legacy protocols replies have no length, so we never keep them */
+		msg->flags |= RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+	}
 
 	msg->method = parser->method;
 	msg->code = parser->status_code;
 
+	if (priv->passed_fd != -1 && msg->passed_fd == -1) {
+		msg->passed_fd = priv->passed_fd;
+		priv->passed_fd = -1;
+	}
+
 	return 0;
 }
 
@@ -812,8 +837,8 @@ rspamd_http_on_headers_complete_decrypted (http_parser *parser)
 
 		msg->code = parser->status_code;
 		rspamd_http_connection_ref (conn);
-		ret = conn->finish_handler (conn, msg);
 		conn->finished = TRUE;
+		ret = conn->finish_handler (conn, msg);
 		rspamd_http_connection_unref (conn);
 
 		return ret;
@@ -907,6 +932,7 @@ rspamd_http_on_message_complete (http_parser * parser)
 		(struct rspamd_http_connection *)parser->data;
 	struct rspamd_http_connection_private *priv;
 	int ret = 0;
+	gboolean keepalive;
 	enum rspamd_cryptobox_mode mode;
 
 	if (conn->finished) {
@@ -956,9 +982,21 @@ rspamd_http_on_message_complete (http_parser * parser)
 			event_del (&priv->ev);
 		}
 
+		keepalive = priv->msg->flags & RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+
+		if (keepalive) {
+			/*
+			 * Do not parse further, the rest of data belongs to the next
+			 * (pipelined) message and is saved until the next read; the
+			 * parser is paused before the handler as it can start reading
+			 * of the next message itself
+			 */
+			http_parser_pause (parser, 1);
+		}
+
 		rspamd_http_connection_ref (conn);
-		ret = conn->finish_handler (conn, priv->msg);
 		conn->finished = TRUE;
+		ret = conn->finish_handler (conn, priv->msg);
 		rspamd_http_connection_unref (conn);
 	}
 
@@ -1006,6 +1044,8 @@ rspamd_http_write_helper (struct rspamd_http_connection *conn)
 	GError *err;
 	struct iovec *cur_iov;
 	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	guchar fdspace[CMSG_SPACE (sizeof (gint))];
 
 	priv = conn->priv;
 
@@ -1042,6 +1082,16 @@ rspamd_http_write_helper (struct rspamd_http_connection *conn)
 	flags = MSG_NOSIGNAL;
 #endif
 
+	if (priv->send_fd != -1 && !priv->ssl) {
+		cmsg = (struct cmsghdr *)fdspace;
+		msg.msg_control = fdspace;
+		msg.msg_controllen = sizeof (fdspace);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN (sizeof (gint));
+		memcpy (CMSG_DATA (cmsg), &priv->send_fd, sizeof (gint));
+	}
+
 	if (priv->ssl) {
 		r = rspamd_ssl_writev (priv->ssl, msg.msg_iov, msg.msg_iovlen);
 	}
@@ -1062,6 +1112,8 @@ rspamd_http_write_helper (struct rspamd_http_connection *conn)
 	}
 	else {
 		priv->wr_pos += r;
+		/* Descriptor is passed with the first byte sent */
+		priv->send_fd = -1;
 	}
 
 	if (priv->wr_pos >= priv->wr_total) {
@@ -1098,7 +1150,12 @@ rspamd_http_try_read (gint fd,
 	gssize r;
 	gchar *data;
 	gsize len;
+	gint rfd;
 	struct rspamd_http_message *msg;
+	struct msghdr rmsg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	guchar fdspace[CMSG_SPACE (sizeof (gint))];
 
 	msg = priv->msg;
 
@@ -1121,6 +1178,34 @@ rspamd_http_try_read (gint fd,
 	if (priv->ssl) {
 		r = rspamd_ssl_read (priv->ssl, data, len);
 	}
+	else if (conn->opts & RSPAMD_HTTP_ACCEPT_FD) {
+		memset (&rmsg, 0, sizeof (rmsg));
+		iov.iov_base = data;
+		iov.iov_len = len;
+		rmsg.msg_iov = &iov;
+		rmsg.msg_iovlen = 1;
+		rmsg.msg_control = fdspace;
+		rmsg.msg_controllen = sizeof (fdspace);
+
+		r = recvmsg (fd, &rmsg, 0);
+
+		if (r > 0) {
+			for (cmsg = CMSG_FIRSTHDR (&rmsg); cmsg != NULL;
+					cmsg = CMSG_NXTHDR (&rmsg, cmsg)) {
+				if (cmsg->cmsg_level == SOL_SOCKET &&
+						cmsg->cmsg_type == SCM_RIGHTS &&
+						cmsg->cmsg_len == CMSG_LEN (sizeof (gint))) {
+					memcpy (&rfd, CMSG_DATA (cmsg), sizeof (gint));
+
+					if (priv->passed_fd != -1) {
+						close (priv->passed_fd);
+					}
+
+					priv->passed_fd = rfd;
+				}
+			}
+		}
+	}
 	else {
 		r = read (fd, data, len);
 	}
@@ -1155,12 +1240,65 @@ rspamd_http_ssl_err_handler (gpointer ud, GError *err)
 	rspamd_http_connection_unref (conn);
 }
 
+/*
+ * Feeds data to the parser saving data that follows a complete message
+ */
+static gboolean
+rspamd_http_parse_data (struct rspamd_http_connection_private *priv,
+		const gchar *d, gsize len)
+{
+	gsize nparsed;
+
+	nparsed = http_parser_execute (&priv->parser, &priv->parser_cb, d, len);
+
+	if (HTTP_PARSER_ERRNO (&priv->parser) == HPE_PAUSED) {
+		http_parser_pause (&priv->parser, 0);
+
+		if (nparsed < len) {
+			if (priv->pipelined == NULL) {
+				priv->pipelined = rspamd_fstring_new_init (d + nparsed,
+						len - nparsed);
+			}
+			else {
+				priv->pipelined = rspamd_fstring_append (priv->pipelined,
+						d + nparsed, len - nparsed);
+			}
+
+			if (event_pending (&priv->ev, EV_READ, NULL)) {
+				/* Finish handler has already started to read the next message */
+				event_active (&priv->ev, EV_READ, 0);
+			}
+		}
+
+		return TRUE;
+	}
+
+	return nparsed == len && priv->parser.http_errno == 0;
+}
+
+/*
+ * Switches from the idle timeout of a persistent connection to the normal
+ * IO timeout once the next message starts to arrive
+ */
+static inline void
+rspamd_http_connection_got_data (struct rspamd_http_connection_private *priv)
+{
+	priv->flags |= RSPAMD_HTTP_CONN_FLAG_HAS_DATA;
+
+	if (priv->flags & RSPAMD_HTTP_CONN_FLAG_IDLE) {
+		priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_IDLE;
+		event_add (&priv->ev, priv->ptv);
+	}
+}
+
 static void
 rspamd_http_event_handler (int fd, short what, gpointer ud)
 {
 	struct rspamd_http_connection *conn = (struct rspamd_http_connection *)ud;
 	struct rspamd_http_connection_private *priv;
 	struct _rspamd_http_privbuf *pbuf;
+	struct rspamd_http_message *msg;
+	rspamd_fstring_t *pipelined = NULL;
 	const gchar *d;
 	gssize r;
 	GError *err;
@@ -1169,13 +1307,29 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 	pbuf = priv->buf;
 	REF_RETAIN (pbuf);
 	rspamd_http_connection_ref (conn);
+	/* Data read might be stored in the message's body */
+	msg = priv->msg;
+
+	if (msg) {
+		rspamd_http_message_ref (msg);
+	}
 
 	if (what == EV_READ) {
-		r = rspamd_http_try_read (fd, conn, priv, pbuf, &d);
+		if (priv->pipelined != NULL) {
+			/* Process data left after the previous message */
+			pipelined = priv->pipelined;
+			priv->pipelined = NULL;
+			d = pipelined->str;
+			r = pipelined->len;
+		}
+		else {
+			r = rspamd_http_try_read (fd, conn, priv, pbuf, &d);
+		}
 
 		if (r > 0) {
-			if (http_parser_execute (&priv->parser, &priv->parser_cb,
-					d, r) != (size_t)r || priv->parser.http_errno != 0) {
+			rspamd_http_connection_got_data (priv);
+
+			if (!rspamd_http_parse_data (priv, d, r)) {
 				if (priv->flags & RSPAMD_HTTP_CONN_FLAG_TOO_LARGE) {
 					err = g_error_new (HTTP_ERROR, 413,
 							"Request entity too large: %zu",
@@ -1190,27 +1344,22 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 				conn->error_handler (conn, err);
 				g_error_free (err);
 
-				REF_RELEASE (pbuf);
-				rspamd_http_connection_unref (conn);
-
-				return;
+				goto out;
 			}
 		}
 		else if (r == 0) {
 			/* We can still call http parser */
-			http_parser_execute (&priv->parser, &priv->parser_cb, d, r);
+			rspamd_http_parse_data (priv, d, r);
 
 			if (!conn->finished) {
 				err = g_error_new (HTTP_ERROR,
-						errno,
+						ECONNRESET,
 						"IO read error: unexpected EOF");
 				conn->error_handler (conn, err);
 				g_error_free (err);
 			}
-			REF_RELEASE (pbuf);
-			rspamd_http_connection_unref (conn);
 
-			return;
+			goto out;
 		}
 		else {
 			if (!priv->ssl) {
@@ -1222,10 +1371,7 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 				g_error_free (err);
 			}
 
-			REF_RELEASE (pbuf);
-			rspamd_http_connection_unref (conn);
-
-			return;
+			goto out;
 		}
 	}
 	else if (what == EV_TIMEOUT) {
@@ -1233,18 +1379,16 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 		r = rspamd_http_try_read (fd, conn, priv, pbuf, &d);
 
 		if (r > 0) {
-			if (http_parser_execute (&priv->parser, &priv->parser_cb,
-					d, r) != (size_t)r || priv->parser.http_errno != 0) {
+			rspamd_http_connection_got_data (priv);
+
+			if (!rspamd_http_parse_data (priv, d, r)) {
 				err = g_error_new (HTTP_ERROR, priv->parser.http_errno,
 						"HTTP parser error: %s",
 						http_errno_description (priv->parser.http_errno));
 				conn->error_handler (conn, err);
 				g_error_free (err);
 
-				REF_RELEASE (pbuf);
-				rspamd_http_connection_unref (conn);
-
-				return;
+				goto out;
 			}
 		}
 		else if (r == 0) {
@@ -1255,10 +1399,8 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 				g_error_free (err);
 
 			}
-			REF_RELEASE (pbuf);
-			rspamd_http_connection_unref (conn);
 
-			return;
+			goto out;
 		}
 		else {
 			err = g_error_new (HTTP_ERROR, ETIMEDOUT,
@@ -1266,16 +1408,22 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 			conn->error_handler (conn, err);
 			g_error_free (err);
 
-			REF_RELEASE (pbuf);
-			rspamd_http_connection_unref (conn);
-
-			return;
+			goto out;
 		}
 	}
 	else if (what == EV_WRITE) {
 		rspamd_http_write_helper (conn);
 	}
 
+out:
+	if (pipelined) {
+		rspamd_fstring_free (pipelined);
+	}
+
+	if (msg) {
+		rspamd_http_message_unref (msg);
+	}
+
 	REF_RELEASE (pbuf);
 	rspamd_http_connection_unref (conn);
 }
@@ -1284,10 +1432,17 @@ static void
 rspamd_http_parser_reset (struct rspamd_http_connection *conn)
 {
 	struct rspamd_http_connection_private *priv = conn->priv;
+	gboolean paused;
 
+	/* Connection can be reset from a finish handler of a paused parser */
+	paused = HTTP_PARSER_ERRNO (&priv->parser) == HPE_PAUSED;
 	http_parser_init (&priv->parser,
 		conn->type == RSPAMD_HTTP_SERVER ? HTTP_REQUEST : HTTP_RESPONSE);
 
+	if (paused) {
+		http_parser_pause (&priv->parser, 1);
+	}
+
 	priv->parser_cb.on_url = rspamd_http_on_url;
 	priv->parser_cb.on_status = rspamd_http_on_status;
 	priv->parser_cb.on_header_field = rspamd_http_on_header_field;
@@ -1329,6 +1484,8 @@ rspamd_http_connection_new (
 	priv = g_slice_alloc0 (sizeof (struct rspamd_http_connection_private));
 	conn->priv = priv;
 	priv->ssl_ctx = ssl_ctx;
+	priv->passed_fd = -1;
+	priv->send_fd = -1;
 
 	rspamd_http_parser_reset (conn);
 	priv->parser.data = conn;
@@ -1378,6 +1535,8 @@ rspamd_http_connection_reset (struct rspamd_http_connection *conn)
 	}
 
 	priv->flags |= RSPAMD_HTTP_CONN_FLAG_RESETED;
+	priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_HAS_DATA;
+	priv->send_fd = -1;
 }
 
 struct rspamd_http_message *
@@ -1532,6 +1691,14 @@ rspamd_http_connection_free (struct rspamd_http_connection *conn)
 			rspamd_pubkey_unref (priv->peer_key);
 		}
 
+		if (priv->pipelined) {
+			rspamd_fstring_free (priv->pipelined);
+		}
+
+		if (priv->passed_fd != -1) {
+			close (priv->passed_fd);
+		}
+
 		g_slice_free1 (sizeof (struct rspamd_http_connection_private), priv);
 	}
 
@@ -1576,6 +1743,7 @@ rspamd_http_connection_read_message_common (struct rspamd_http_connection *conn,
 	REF_INIT_RETAIN (priv->buf, rspamd_http_privbuf_dtor);
 	priv->buf->data = rspamd_fstring_sized_new (8192);
 	priv->flags |= RSPAMD_HTTP_CONN_FLAG_NEW_HEADER;
+	priv->flags &= ~(RSPAMD_HTTP_CONN_FLAG_HAS_DATA|RSPAMD_HTTP_CONN_FLAG_IDLE);
 
 	event_set (&priv->ev,
 		fd,
@@ -1588,6 +1756,11 @@ rspamd_http_connection_read_message_common (struct rspamd_http_connection *conn,
 
 	priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_RESETED;
 	event_add (&priv->ev, priv->ptv);
+
+	if (priv->pipelined) {
+		/* Next message has been already received */
+		event_active (&priv->ev, EV_READ, 0);
+	}
 }
 
 void
@@ -1605,6 +1778,23 @@ rspamd_http_connection_read_message_shared (struct rspamd_http_connection *conn,
 			RSPAMD_HTTP_FLAG_SHMEM);
 }
 
+void
+rspamd_http_connection_set_idle_timeout (struct rspamd_http_connection *conn,
+		struct timeval *idle_timeout)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+
+	if (idle_timeout == NULL || priv->pipelined ||
+			(priv->flags & RSPAMD_HTTP_CONN_FLAG_HAS_DATA) ||
+			!event_pending (&priv->ev, EV_READ, NULL)) {
+		return;
+	}
+
+	memcpy (&priv->idle_tv, idle_timeout, sizeof (priv->idle_tv));
+	priv->flags |= RSPAMD_HTTP_CONN_FLAG_IDLE;
+	event_add (&priv->ev, &priv->idle_tv);
+}
+
 static void
 rspamd_http_connection_encrypt_message (
 		struct rspamd_http_connection *conn,
@@ -1735,6 +1925,10 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 	gchar datebuf[64];
 	gint meth_len = 0;
 	struct tm t, *ptm;
+	const gchar *conn_type;
+
+	conn_type = (msg->flags & RSPAMD_HTTP_FLAG_KEEP_ALIVE) ?
+			"keep-alive" : "close";
 
 	if (conn->type == RSPAMD_HTTP_SERVER) {
 		/* Format reply */
@@ -1780,12 +1974,13 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_snprintf (repbuf, replen,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z\r\n"
 											"Content-Type: %s", /* NO \r\n at the end ! */
-									msg->code, &status, "rspamd/" RVERSION,
+									msg->code, &status, conn_type,
+									"rspamd/" RVERSION,
 									datebuf,
 									bodylen, mime_type);
 				}
@@ -1793,11 +1988,12 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_snprintf (repbuf, replen,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z", /* NO \r\n at the end ! */
-									msg->code, &status, "rspamd/" RVERSION,
+									msg->code, &status, conn_type,
+									"rspamd/" RVERSION,
 									datebuf,
 									bodylen);
 				}
@@ -1805,24 +2001,25 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 				/* External reply */
 				rspamd_printf_fstring (buf,
 						"HTTP/1.1 200 OK\r\n"
-						"Connection: close\r\n"
+						"Connection: %s\r\n"
 						"Server: rspamd\r\n"
 						"Date: %s\r\n"
 						"Content-Length: %z\r\n"
 						"Content-Type: application/octet-stream\r\n",
-						datebuf, enclen);
+						conn_type, datebuf, enclen);
 			}
 			else {
 				if (mime_type) {
 					meth_len =
 							rspamd_printf_fstring (buf,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z\r\n"
 											"Content-Type: %s\r\n",
-									msg->code, &status, "rspamd/" RVERSION,
+									msg->code, &status, conn_type,
+									"rspamd/" RVERSION,
 									datebuf,
 									bodylen, mime_type);
 				}
@@ -1830,11 +2027,12 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_printf_fstring (buf,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z\r\n",
-									msg->code, &status, "rspamd/" RVERSION,
+									msg->code, &status, conn_type,
+									"rspamd/" RVERSION,
 									datebuf,
 									bodylen);
 				}
@@ -1897,45 +2095,50 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 							mime_type);
 				}
 			}
+
+			if (msg->flags & RSPAMD_HTTP_FLAG_KEEP_ALIVE) {
+				/* HTTP/1.0 connections are closed by default */
+				rspamd_printf_fstring (buf, "Connection: keep-alive\r\n");
+			}
 		}
 		else {
 			if (encrypted) {
 				if (host != NULL) {
 					rspamd_printf_fstring (buf,
 							"%s %s HTTP/1.1\r\n"
-							"Connection: close\r\n"
+							"Connection: %s\r\n"
 							"Host: %s\r\n"
 							"Content-Length: %z\r\n"
 							"Content-Type: application/octet-stream\r\n",
-							"POST", "/post", host, enclen);
+							"POST", "/post", conn_type, host, enclen);
 				}
 				else {
 					rspamd_printf_fstring (buf,
 							"%s %s HTTP/1.1\r\n"
-							"Connection: close\r\n"
+							"Connection: %s\r\n"
 							"Host: %V\r\n"
 							"Content-Length: %z\r\n"
 							"Content-Type: application/octet-stream\r\n",
-							"POST", "/post", msg->host, enclen);
+							"POST", "/post", conn_type, msg->host, enclen);
 				}
 			}
 			else {
 				if (host != NULL) {
 					rspamd_printf_fstring (buf,
-							"%s %V HTTP/1.1\r\nConnection: close\r\n"
+							"%s %V HTTP/1.1\r\nConnection: %s\r\n"
 							"Host: %s\r\n"
 							"Content-Length: %z\r\n",
-							http_method_str (msg->method), msg->url, host,
-							bodylen);
+							http_method_str (msg->method), msg->url, conn_type,
+							host, bodylen);
 				}
 				else {
 					rspamd_printf_fstring (buf,
 							"%s %V HTTP/1.1\r\n"
-							"Connection: close\r\n"
+							"Connection: %s\r\n"
 							"Host: %V\r\n"
 							"Content-Length: %z\r\n",
-							http_method_str (msg->method), msg->url, msg->host,
-							bodylen);
+							http_method_str (msg->method), msg->url, conn_type,
+							msg->host, bodylen);
 				}
 
 				if (bodylen > 0) {
@@ -2049,6 +2252,12 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 					msg->body_buf.len);
 			rspamd_http_message_add_header (msg, "Shm-Length",
 					tmpbuf);
+
+			if ((msg->flags & RSPAMD_HTTP_FLAG_SHMEM_FD) && !priv->ssl) {
+				/* Peer can map the segment without opening it by name */
+				rspamd_http_message_add_header (msg, "Shm-Fd", "1");
+				priv->send_fd = msg->body_buf.c.shared.shm_fd;
+			}
 		}
 	}
 
@@ -2364,6 +2573,7 @@ rspamd_http_new_message (enum http_parser_type type)
 	new->port = 80;
 	new->type = type;
 	new->method = HTTP_INVALID;
+	new->passed_fd = -1;
 
 	REF_INIT_RETAIN (new, rspamd_http_message_free);
 
@@ -2490,6 +2700,16 @@ rspamd_http_message_shmem_unref (struct rspamd_storage_shmem *p)
 	REF_RELEASE (p);
 }
 
+gint
+rspamd_http_message_steal_fd (struct rspamd_http_message *msg)
+{
+	gint fd = msg->passed_fd;
+
+	msg->passed_fd = -1;
+
+	return fd;
+}
+
 gboolean
 rspamd_http_message_set_body (struct rspamd_http_message *msg,
 		const gchar *data, gsize len)
@@ -2681,6 +2901,12 @@ rspamd_http_message_grow_body (struct rspamd_http_message *msg, gsize len)
 			return FALSE;
 		}
 
+		if (msg->body_buf.str != MAP_FAILED && msg->body_buf.str != NULL &&
+				msg->body_buf.allocated_len >= msg->body_buf.len + len) {
+			/* Segment is large enough, avoid fstat on each append */
+			return TRUE;
+		}
+
 		if (fstat (storage->shared.shm_fd, &st) == -1) {
 			return FALSE;
 		}
@@ -2816,6 +3042,10 @@ rspamd_http_message_free (struct rspamd_http_message *msg)
 
 	rspamd_http_message_storage_cleanup (msg);
 
+	if (msg->passed_fd != -1) {
+		close (msg->passed_fd);
+	}
+
 	if (msg->url != NULL) {
 		rspamd_fstring_free (msg->url);
 	}
@@ -3533,6 +3763,34 @@ rspamd_http_connection_get_peer_key (struct rspamd_http_connection *conn)
 	return NULL;
 }
 
+gboolean
+rspamd_http_connection_is_idle (struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+
+	return !(priv->flags & RSPAMD_HTTP_CONN_FLAG_HAS_DATA) &&
+			priv->pipelined == NULL;
+}
+
+gboolean
+rspamd_http_connection_is_stale (struct rspamd_http_connection *conn,
+		GError *err)
+{
+	if (err == NULL || !rspamd_http_connection_is_idle (conn)) {
+		return FALSE;
+	}
+
+	return err->code == ECONNRESET || err->code == EPIPE;
+}
+
+gboolean
+rspamd_http_connection_is_ssl (struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+
+	return priv->ssl != NULL;
+}
+
 gboolean
 rspamd_http_connection_is_encrypted (struct rspamd_http_connection *conn)
 {
@@ -71,6 +71,15 @@ struct rspamd_storage_shmem {
  * Do not verify server's certificate
  */
 #define RSPAMD_HTTP_FLAG_SSL_NOVERIFY (1 << 6)
+/**
+ * Connection is kept open after the message (set for received messages if a
+ * peer supports persistent connections)
+ */
+#define RSPAMD_HTTP_FLAG_KEEP_ALIVE (1 << 7)
+/**
+ * Pass descriptor of the shared body segment over a unix socket
+ */
+#define RSPAMD_HTTP_FLAG_SHMEM_FD (1 << 8)
 /**
  * Options for HTTP connection
  */
@@ -79,6 +88,7 @@ enum rspamd_http_options {
 	RSPAMD_HTTP_CLIENT_SIMPLE = 0x2, /**< Read HTTP client reply automatically */      //!< RSPAMD_HTTP_CLIENT_SIMPLE
 	RSPAMD_HTTP_CLIENT_ENCRYPTED = 0x4, /**< Encrypt data for client */                //!< RSPAMD_HTTP_CLIENT_ENCRYPTED
 	RSPAMD_HTTP_CLIENT_SHARED = 0x8, /**< Store reply in shared memory */              //!< RSPAMD_HTTP_CLIENT_SHARED
+	RSPAMD_HTTP_ACCEPT_FD = 0x10, /**< Receive descriptors passed over unix socket */ //!< RSPAMD_HTTP_ACCEPT_FD
 };
 
 typedef int (*rspamd_http_body_handler_t) (struct rspamd_http_connection *conn,
@@ -175,6 +185,33 @@ void rspamd_http_connection_set_key (struct rspamd_http_connection *conn,
 const struct rspamd_cryptobox_pubkey* rspamd_http_connection_get_peer_key (
 		struct rspamd_http_connection *conn);
 
+/**
+ * Returns TRUE if no data has been received since the last read request, e.g.
+ * a persistent connection has been closed by a peer between requests
+ * @param conn
+ * @return
+ */
+gboolean rspamd_http_connection_is_idle (struct rspamd_http_connection *conn);
+
+/**
+ * Returns TRUE if an error means that a persistent connection has been closed
+ * by a peer before it has received our request: connection is reset or closed
+ * on write or before the first byte of reply. Timeouts are not included, as
+ * a peer might have processed a request in this case
+ * @param conn
+ * @param err
+ * @return
+ */
+gboolean rspamd_http_connection_is_stale (struct rspamd_http_connection *conn,
+		GError *err);
+
+/**
+ * Returns TRUE if a connection uses TLS
+ * @param conn
+ * @return
+ */
+gboolean rspamd_http_connection_is_ssl (struct rspamd_http_connection *conn);
+
 /**
  * Returns TRUE if a connection is encrypted
  * @param conn
@@ -202,6 +239,17 @@ void rspamd_http_connection_read_message_shared (
 		struct timeval *timeout,
 		struct event_base *base);
 
+/**
+ * Use the specified timeout while waiting for the first byte of a message
+ * being read, e.g. for idle keep-alive connections. The timeout passed to
+ * the read function is used for the rest of the message.
+ * @param conn connection structure
+ * @param idle_timeout timeout to wait for the next message
+ */
+void rspamd_http_connection_set_idle_timeout (
+		struct rspamd_http_connection *conn,
+		struct timeval *idle_timeout);
+
 /**
  * Send reply using initialised connection
  * @param conn connection structure
@@ -455,6 +503,14 @@ void rspamd_http_message_shmem_unref (struct rspamd_storage_shmem *p);
  */
 guint rspamd_http_message_get_flags (struct rspamd_http_message *msg);
 
+/**
+ * Returns descriptor of a shared body segment passed by peer with this message
+ * (if any), caller is responsible for closing of the descriptor
+ * @param msg
+ * @return descriptor or -1
+ */
+gint rspamd_http_message_steal_fd (struct rspamd_http_message *msg);
+
 /**
  * Parse HTTP date header and return it as time_t
  * @param header HTTP date header
@@ -0,0 +1,253 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "http_pool.h"
+#include "upstream.h"
+#include "util.h"
+#include "unix-std.h"
+#include "cfg_file.h"
+
+struct rspamd_http_pool_elt {
+	struct rspamd_http_connection *conn;
+	GQueue *queue;
+	GList *link;
+	gint fd;
+	struct event ev;
+};
+
+struct rspamd_http_pool {
+	struct event_base *ev_base;
+	/* addr:port -> GQueue of idle elts, most recently used first */
+	GHashTable *idle;
+	guint max_idle;
+	struct timeval idle_tv;
+};
+
+static void
+rspamd_http_pool_elt_free (struct rspamd_http_pool_elt *elt,
+		gboolean close_conn)
+{
+	event_del (&elt->ev);
+
+	g_queue_delete_link (elt->queue, elt->link);
+
+	if (close_conn) {
+		rspamd_http_connection_unref (elt->conn);
+		close (elt->fd);
+	}
+
+	g_slice_free1 (sizeof (*elt), elt);
+}
+
+static void
+rspamd_http_pool_elt_cb (gint fd, short what, void *ud)
+{
+	struct rspamd_http_pool_elt *elt = ud;
+
+	/* Either timeout or peer has closed (or written garbage to) the socket */
+	rspamd_http_pool_elt_free (elt, TRUE);
+}
+
+static void
+rspamd_http_pool_queue_dtor (gpointer p)
+{
+	GQueue *queue = p;
+
+	while (queue->head) {
+		rspamd_http_pool_elt_free (queue->head->data, TRUE);
+	}
+
+	g_queue_free (queue);
+}
+
+static gchar *
+rspamd_http_pool_key (const rspamd_inet_addr_t *addr)
+{
+	return g_strdup_printf ("%s:%d", rspamd_inet_address_to_string (addr),
+			rspamd_inet_address_get_port (addr));
+}
+
+struct rspamd_http_pool *
+rspamd_http_pool_init (void)
+{
+	struct rspamd_http_pool *pool;
+
+	pool = g_slice_alloc0 (sizeof (*pool));
+	pool->idle = g_hash_table_new_full (rspamd_str_hash,
+			rspamd_str_equal, g_free, rspamd_http_pool_queue_dtor);
+
+	return pool;
+}
+
+void
+rspamd_http_pool_config (struct rspamd_http_pool *pool,
+		struct rspamd_config *cfg,
+		struct event_base *ev_base)
+{
+	g_assert (pool != NULL);
+
+	pool->ev_base = ev_base;
+	pool->max_idle = cfg->upstream_keepalive_max;
+
+	if (cfg->upstream_keepalive_timeout > 0) {
+		double_to_tv (cfg->upstream_keepalive_timeout, &pool->idle_tv);
+	}
+	else {
+		pool->max_idle = 0;
+	}
+}
+
+struct rspamd_http_connection*
+rspamd_http_pool_acquire (struct rspamd_http_pool *pool,
+		const rspamd_inet_addr_t *addr,
+		rspamd_http_error_handler_t error_handler,
+		rspamd_http_finish_handler_t finish_handler,
+		unsigned opts,
+		gint *pfd)
+{
+	struct rspamd_http_pool_elt *elt;
+	struct rspamd_http_connection *conn;
+	GQueue *queue;
+	gchar *key;
+
+	if (pool == NULL || pool->ev_base == NULL || addr == NULL) {
+		return NULL;
+	}
+
+	key = rspamd_http_pool_key (addr);
+	queue = g_hash_table_lookup (pool->idle, key);
+	g_free (key);
+
+	if (queue == NULL) {
+		return NULL;
+	}
+
+	for (;;) {
+		if (queue->head == NULL) {
+			return NULL;
+		}
+
+		elt = queue->head->data;
+
+		if (rspamd_http_connection_is_idle (elt->conn)) {
+			break;
+		}
+
+		/* Unexpected data has been received after the last reply */
+		rspamd_http_pool_elt_free (elt, TRUE);
+	}
+
+	conn = elt->conn;
+	*pfd = elt->fd;
+	rspamd_http_pool_elt_free (elt, FALSE);
+
+	conn->finished = FALSE;
+	conn->body_handler = NULL;
+	conn->error_handler = error_handler;
+	conn->finish_handler = finish_handler;
+	conn->opts = opts;
+	conn->max_size = 0;
+	conn->ud = NULL;
+
+	return conn;
+}
+
+gboolean
+rspamd_http_pool_release (struct rspamd_http_pool *pool,
+		const rspamd_inet_addr_t *addr,
+		struct rspamd_http_connection *conn,
+		gint fd)
+{
+	struct rspamd_http_pool_elt *elt;
+	GQueue *queue;
+	gchar *key;
+
+	if (pool == NULL || pool->ev_base == NULL || pool->max_idle == 0 ||
+			addr == NULL || conn->type != RSPAMD_HTTP_CLIENT ||
+			rspamd_http_connection_is_ssl (conn) ||
+			rspamd_http_connection_is_encrypted (conn)) {
+		/* Keys and TLS sessions are bound to a particular client */
+		return FALSE;
+	}
+
+	rspamd_http_connection_reset (conn);
+
+	if (!rspamd_http_connection_is_idle (conn)) {
+		/* Peer has sent something after its reply */
+		return FALSE;
+	}
+
+	key = rspamd_http_pool_key (addr);
+	queue = g_hash_table_lookup (pool->idle, key);
+
+	if (queue == NULL) {
+		queue = g_queue_new ();
+		g_hash_table_insert (pool->idle, key, queue);
+	}
+	else {
+		g_free (key);
+	}
+
+	if (queue->length >= pool->max_idle) {
+		return FALSE;
+	}
+
+	elt = g_slice_alloc0 (sizeof (*elt));
+	elt->conn = conn;
+	elt->fd = fd;
+	elt->queue = queue;
+	/* The most recently used connections are reused first */
+	g_queue_push_head (queue, elt);
+	elt->link = queue->head;
+
+	event_set (&elt->ev, fd, EV_READ, rspamd_http_pool_elt_cb, elt);
+	event_base_set (pool->ev_base, &elt->ev);
+	event_add (&elt->ev, &pool->idle_tv);
+
+	return TRUE;
+}
+
+void
+rspamd_http_pool_flush (struct rspamd_http_pool *pool,
+		const rspamd_inet_addr_t *addr)
+{
+	gchar *key;
+
+	if (pool == NULL || addr == NULL) {
+		return;
+	}
+
+	key = rspamd_http_pool_key (addr);
+	g_hash_table_remove (pool->idle, key);
+	g_free (key);
+}
+
+void
+rspamd_http_pool_upstream_fail (struct rspamd_http_pool *pool,
+		struct upstream *up, const rspamd_inet_addr_t *addr)
+{
+	rspamd_http_pool_flush (pool, addr);
+	rspamd_upstream_fail (up);
+}
+
+void
+rspamd_http_pool_destroy (struct rspamd_http_pool *pool)
+{
+	if (pool) {
+		g_hash_table_unref (pool->idle);
+		g_slice_free1 (sizeof (*pool), pool);
+	}
+}
@@ -0,0 +1,108 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBUTIL_HTTP_POOL_H_
+#define SRC_LIBUTIL_HTTP_POOL_H_
+
+#include "config.h"
+#include "http.h"
+#include "addr.h"
+#include <event.h>
+
+/*
+ * Pool of idle persistent client HTTP connections keyed by a peer address
+ */
+struct rspamd_http_pool;
+struct rspamd_config;
+struct upstream;
+
+#define RSPAMD_HTTP_POOL_DEFAULT_MAX_IDLE 32
+#define RSPAMD_HTTP_POOL_DEFAULT_IDLE_TIMEOUT 10.0
+
+/**
+ * Creates new http connections pool
+ * @return
+ */
+struct rspamd_http_pool *rspamd_http_pool_init (void);
+
+/**
+ * Configure http pool and binds it to a specific event base. Unbound pools
+ * never keep connections
+ * @param pool
+ * @param cfg
+ * @param ev_base
+ */
+void rspamd_http_pool_config (struct rspamd_http_pool *pool,
+		struct rspamd_config *cfg,
+		struct event_base *ev_base);
+
+/**
+ * Take an idle connection to the specified address from the pool. Connection
+ * is reset and its handlers and options are replaced with the specified ones.
+ * @param pool
+ * @param addr peer address
+ * @param error_handler
+ * @param finish_handler
+ * @param opts connection options
+ * @param pfd here the socket of the connection is stored
+ * @return connection or NULL if there are no idle connections to this address
+ */
+struct rspamd_http_connection* rspamd_http_pool_acquire (
+		struct rspamd_http_pool *pool,
+		const rspamd_inet_addr_t *addr,
+		rspamd_http_error_handler_t error_handler,
+		rspamd_http_finish_handler_t finish_handler,
+		unsigned opts,
+		gint *pfd);
+
+/**
+ * Return a connection to the pool after a completed keep-alive exchange.
+ * On success the pool owns both the connection and the socket.
+ * @param pool
+ * @param addr peer address
+ * @param conn connection
+ * @param fd socket of the connection
+ * @return FALSE if connection cannot be reused and the caller must close it
+ */
+gboolean rspamd_http_pool_release (struct rspamd_http_pool *pool,
+		const rspamd_inet_addr_t *addr,
+		struct rspamd_http_connection *conn,
+		gint fd);
+
+/**
+ * Close all idle connections to the specified address, e.g. when a peer
+ * has failed
+ * @param pool
+ * @param addr peer address
+ */
+void rspamd_http_pool_flush (struct rspamd_http_pool *pool,
+		const rspamd_inet_addr_t *addr);
+
+/**
+ * Mark upstream as failed and close idle connections to its address
+ * @param pool
+ * @param up upstream
+ * @param addr address of upstream that has failed
+ */
+void rspamd_http_pool_upstream_fail (struct rspamd_http_pool *pool,
+		struct upstream *up, const rspamd_inet_addr_t *addr);
+
+/**
+ * Close all idle connections and destroy pool
+ * @param pool
+ */
+void rspamd_http_pool_destroy (struct rspamd_http_pool *pool);
+
+#endif /* SRC_LIBUTIL_HTTP_POOL_H_ */
@@ -70,6 +70,8 @@ struct rspamd_http_message {
 	gint code;
 	enum http_method method;
 	gint flags;
+	/* Descriptor received via SCM_RIGHTS or -1 */
+	gint passed_fd;
 	ref_entry_t ref;
 };
 
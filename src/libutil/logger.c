@@ -49,6 +49,52 @@ struct rspamd_logger_error_log {
 	guint cur_row;
 };
 
+/*
+ * Shared ring for asynchronous logging: workers append formatted lines and
+ * the main process drains them to the log file. Records are aligned to the
+ * size of their header and never wrap: the rest of the ring is filled with a
+ * padding record instead. A record is ready when its `seq` is equal to its
+ * offset plus one, so stale headers left from the previous cycles are never
+ * confused with the new ones.
+ */
+#define RING_ALIGN(x) (((x) + 15) & ~((guint64)15))
+#define RING_MIN_SIZE (64 * 1024)
+#define RING_MAX_IOV 256
+/* Drain attempts before a record is considered abandoned by a dead writer */
+#define RING_MAX_STALLS 50
+
+#ifdef HAVE_ATOMIC_BUILTINS
+typedef guint64 rspamd_logger_ring_pos_t;
+#else
+/* Glib atomics operate on integers only, positions might wrap */
+typedef guint rspamd_logger_ring_pos_t;
+#endif
+
+enum rspamd_logger_ring_flags {
+	RSPAMD_LOG_RING_DATA = 0,
+	RSPAMD_LOG_RING_PAD,
+};
+
+struct rspamd_logger_ring_hdr {
+	guint32 len;
+	guint32 flags;
+	rspamd_logger_ring_pos_t seq;
+};
+
+struct rspamd_logger_ring {
+	/* Bytes reserved by writers */
+	rspamd_logger_ring_pos_t head;
+	/* Avoid false cache sharing */
+	guchar __padding1[64 - sizeof (rspamd_logger_ring_pos_t)];
+	/* Bytes consumed by reader */
+	rspamd_logger_ring_pos_t tail;
+	guchar __padding2[64 - sizeof (rspamd_logger_ring_pos_t)];
+	guint64 size;
+	pid_t reader;
+	guint stalls;
+	guchar *data;
+};
+
 /**
  * Static structure that store logging parameters
  * It is NOT shared between processes and is created by main process
@@ -57,6 +103,7 @@ struct rspamd_logger_s {
 	rspamd_log_func_t log_func;
 	struct rspamd_config *cfg;
 	struct rspamd_logger_error_log *errlog;
+	struct rspamd_logger_ring *ring;
 	struct rspamd_cryptobox_pubkey *pk;
 	struct rspamd_cryptobox_keypair *keypair;
 	struct {
@@ -415,6 +462,27 @@ rspamd_set_logger (struct rspamd_config *cfg,
 
 	logger->cfg = cfg;
 
+	/* Ring is shared with workers, so it is created once by the main process */
+	if (logger->ring == NULL && pool && cfg->log_async_size > 0 &&
+			cfg->log_type == RSPAMD_LOG_FILE) {
+		logger->ring = rspamd_mempool_alloc0_shared (pool,
+				sizeof (*logger->ring));
+		logger->ring->size = MAX (RING_ALIGN (cfg->log_async_size),
+				RING_MIN_SIZE);
+#ifndef HAVE_ATOMIC_BUILTINS
+		/* Offsets of wrapped positions are valid for power of two sizes only */
+		logger->ring->size = MIN (1ULL << g_bit_storage (logger->ring->size - 1),
+				G_MAXINT32 + 1ULL);
+#endif
+		logger->ring->data = rspamd_mempool_alloc_shared (pool,
+				logger->ring->size);
+		logger->ring->reader = logger->pid;
+	}
+	else if (logger->ring) {
+		/* Pid might be changed since the ring has been created */
+		logger->ring->reader = logger->pid;
+	}
+
 	/* Set up buffer */
 	if (cfg->log_buffered) {
 		if (cfg->log_buf_size != 0) {
@@ -495,6 +563,8 @@ rspamd_log_update_pid (GQuark ptype, rspamd_logger_t *rspamd_log)
 void
 rspamd_log_flush (rspamd_logger_t *rspamd_log)
 {
+	rspamd_log_drain (rspamd_log);
+
 	if (rspamd_log->is_buffered &&
 		(rspamd_log->type == RSPAMD_LOG_CONSOLE ||
 		 rspamd_log->type == RSPAMD_LOG_FILE)) {
@@ -723,6 +793,180 @@ rspamd_default_log_function (gint level_flags,
 }
 
 
+#ifdef HAVE_ATOMIC_BUILTINS
+#define RING_LOAD(p) __atomic_load_n ((p), __ATOMIC_ACQUIRE)
+#define RING_STORE(p, v) __atomic_store_n ((p), (v), __ATOMIC_RELEASE)
+#define RING_CAS(p, pexp, v) __atomic_compare_exchange_n ((p), (pexp), (v), \
+		FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define RING_BEFORE(a, b) ((a) < (b))
+#else
+/* Glib atomic operations are full memory barriers */
+#define RING_LOAD(p) \
+	((rspamd_logger_ring_pos_t)g_atomic_int_get ((volatile gint *)(p)))
+#define RING_STORE(p, v) g_atomic_int_set ((volatile gint *)(p), (gint)(v))
+#define RING_CAS(p, pexp, v) rspamd_log_ring_cas ((p), (pexp), (v))
+#define RING_BEFORE(a, b) ((gint)((a) - (b)) < 0)
+
+static inline gboolean
+rspamd_log_ring_cas (rspamd_logger_ring_pos_t *p,
+		rspamd_logger_ring_pos_t *pexp, rspamd_logger_ring_pos_t v)
+{
+	if (g_atomic_int_compare_and_exchange ((volatile gint *)p,
+			(gint)*pexp, (gint)v)) {
+		return TRUE;
+	}
+
+	*pexp = RING_LOAD (p);
+
+	return FALSE;
+}
+#endif
+
+/*
+ * Append a line to the shared ring, returns FALSE if there is no space left
+ */
+static gboolean
+rspamd_log_ring_push (struct rspamd_logger_ring *ring,
+		const struct iovec *iov, guint iovcnt)
+{
+	struct rspamd_logger_ring_hdr *hdr;
+	rspamd_logger_ring_pos_t head, tail, pos, pad, need;
+	gsize len = 0;
+	guchar *p;
+	guint i;
+
+	for (i = 0; i < iovcnt; i ++) {
+		len += iov[i].iov_len;
+	}
+
+	if (RING_ALIGN (len + sizeof (*hdr)) > ring->size / 2) {
+		return FALSE;
+	}
+
+	head = RING_LOAD (&ring->head);
+
+	do {
+		tail = RING_LOAD (&ring->tail);
+		pos = head % ring->size;
+		need = RING_ALIGN (len + sizeof (*hdr));
+		pad = 0;
+
+		if (pos + need > ring->size) {
+			/* Record cannot wrap, so pad the rest of the ring */
+			pad = ring->size - pos;
+		}
+
+		if ((rspamd_logger_ring_pos_t)(head + pad + need - tail) > ring->size) {
+			return FALSE;
+		}
+	} while (!RING_CAS (&ring->head, &head, head + pad + need));
+
+	if (pad > 0) {
+		hdr = (struct rspamd_logger_ring_hdr *)(ring->data + pos);
+		hdr->len = pad - sizeof (*hdr);
+		hdr->flags = RSPAMD_LOG_RING_PAD;
+		RING_STORE (&hdr->seq, head + 1);
+		head += pad;
+		pos = 0;
+	}
+
+	hdr = (struct rspamd_logger_ring_hdr *)(ring->data + pos);
+	hdr->len = len;
+	hdr->flags = RSPAMD_LOG_RING_DATA;
+	p = (guchar *)(hdr + 1);
+
+	for (i = 0; i < iovcnt; i ++) {
+		memcpy (p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	RING_STORE (&hdr->seq, head + 1);
+
+	return TRUE;
+}
+
+gboolean
+rspamd_log_async_start (rspamd_logger_t *rspamd_log)
+{
+	if (rspamd_log->ring == NULL) {
+		return FALSE;
+	}
+
+	rspamd_log->pid = getpid ();
+	rspamd_log->ring->reader = rspamd_log->pid;
+
+	return TRUE;
+}
+
+gboolean
+rspamd_log_drain (rspamd_logger_t *rspamd_log)
+{
+	struct rspamd_logger_ring *ring = rspamd_log->ring;
+	struct rspamd_logger_ring_hdr *hdr;
+	struct iovec iov[RING_MAX_IOV];
+	rspamd_logger_ring_pos_t head, tail, cur;
+	guint64 dropped = 0;
+	guint niov;
+
+	if (ring == NULL || ring->reader != rspamd_log->pid) {
+		return FALSE;
+	}
+
+	tail = ring->tail;
+
+	for (;;) {
+		head = RING_LOAD (&ring->head);
+		cur = tail;
+		niov = 0;
+
+		while (RING_BEFORE (cur, head) && niov < G_N_ELEMENTS (iov)) {
+			hdr = (struct rspamd_logger_ring_hdr *)(ring->data +
+					cur % ring->size);
+
+			if (RING_LOAD (&hdr->seq) != cur + 1) {
+				/* Record is still being written */
+				break;
+			}
+
+			if (hdr->flags == RSPAMD_LOG_RING_DATA && hdr->len > 0) {
+				iov[niov].iov_base = hdr + 1;
+				iov[niov].iov_len = hdr->len;
+				niov ++;
+			}
+
+			cur += RING_ALIGN (hdr->len + sizeof (*hdr));
+		}
+
+		if (cur == tail) {
+			if (RING_BEFORE (tail, head) && ++ring->stalls > RING_MAX_STALLS) {
+				/* Writer has likely died in the middle of a record */
+				dropped = (rspamd_logger_ring_pos_t)(head - tail);
+				ring->stalls = 0;
+				RING_STORE (&ring->tail, head);
+			}
+
+			break;
+		}
+
+		ring->stalls = 0;
+
+		if (niov > 0) {
+			direct_write_log_line (rspamd_log, iov, niov, TRUE);
+		}
+
+		/* Now writers can reuse space */
+		tail = cur;
+		RING_STORE (&ring->tail, tail);
+	}
+
+	if (dropped > 0) {
+		msg_warn ("dropped %uL bytes of log records from async logging buffer",
+				dropped);
+	}
+
+	return TRUE;
+}
+
 /**
  * Fill buffer with message (limits must be checked BEFORE this call)
  */
@@ -751,6 +995,14 @@ file_log_helper (rspamd_logger_t *rspamd_log,
 	size_t len = 0;
 	guint i;
 
+	if (rspamd_log->ring && rspamd_log->type == RSPAMD_LOG_FILE &&
+			rspamd_log->ring->reader != rspamd_log->pid) {
+		/* Main process writes the line later, fall back if ring is full */
+		if (rspamd_log_ring_push (rspamd_log->ring, iov, iovcnt)) {
+			return;
+		}
+	}
+
 	if (!rspamd_log->is_buffered) {
 		/* Write string directly */
 		direct_write_log_line (rspamd_log, (void *) iov, iovcnt, TRUE);
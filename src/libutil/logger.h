@@ -72,6 +72,21 @@ void rspamd_log_update_pid (GQuark ptype, rspamd_logger_t *logger);
  */
 void rspamd_log_flush (rspamd_logger_t *logger);
 
+/**
+ * Write lines queued by workers to the asynchronous logging buffer, must be
+ * called by the main process periodically
+ * @return FALSE if asynchronous logging is not used by this process
+ */
+gboolean rspamd_log_drain (rspamd_logger_t *logger);
+
+/**
+ * Make the current process the one that drains the asynchronous logging
+ * buffer, must be called by the main process after daemonizing and after
+ * the logger is reconfigured
+ * @return FALSE if asynchronous logging is not enabled
+ */
+gboolean rspamd_log_async_start (rspamd_logger_t *logger);
+
 /**
  * Log function that is compatible for glib messages
  */
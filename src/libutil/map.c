@@ -21,7 +21,9 @@
 #include "map_private.h"
 #include "http.h"
 #include "http_private.h"
+#include "http_pool.h"
 #include "rspamd.h"
+#include "map_compiled.h"
 #include "contrib/zstd/zstd.h"
 
 #ifdef WITH_HYPERSCAN
@@ -54,6 +56,9 @@ static void free_http_cbdata_common (struct http_callback_data *cbd, gboolean pl
 static void free_http_cbdata_dtor (gpointer p);
 static void free_http_cbdata (struct http_callback_data *cbd);
 static void rspamd_map_periodic_callback (gint fd, short what, void *ud);
+static void http_map_error (struct rspamd_http_connection *conn, GError *err);
+static int http_map_finish (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg);
 static void rspamd_map_schedule_periodic (struct rspamd_map *map, gboolean locked,
 		gboolean initial, gboolean errored);
 
@@ -66,6 +71,45 @@ struct rspamd_http_map_cached_cbdata {
 	time_t last_checked;
 };
 
+/**
+ * Connect to HTTP server reusing an idle connection if possible
+ */
+static gboolean
+rspamd_map_http_connect (struct http_callback_data *cbd)
+{
+	guint flags = RSPAMD_HTTP_CLIENT_SIMPLE|RSPAMD_HTTP_CLIENT_SHARED;
+
+	cbd->reused = FALSE;
+	cbd->keepalive = FALSE;
+
+	if (cbd->bk->protocol != MAP_PROTO_HTTPS) {
+		cbd->conn = rspamd_http_pool_acquire (cbd->map->cfg->http_pool,
+				cbd->addr, http_map_error, http_map_finish, flags, &cbd->fd);
+
+		if (cbd->conn) {
+			cbd->reused = TRUE;
+
+			return TRUE;
+		}
+	}
+
+	cbd->fd = rspamd_inet_address_connect (cbd->addr, SOCK_STREAM, TRUE);
+
+	if (cbd->fd == -1) {
+		return FALSE;
+	}
+
+	cbd->conn = rspamd_http_connection_new (NULL,
+			http_map_error,
+			http_map_finish,
+			flags,
+			RSPAMD_HTTP_CLIENT,
+			NULL,
+			cbd->map->cfg->libs_ctx->ssl_ctx);
+
+	return TRUE;
+}
+
 /**
  * Write HTTP request
  */
@@ -78,11 +122,17 @@ write_http_request (struct http_callback_data *cbd)
 
 	map = cbd->map;
 
-	if (cbd->fd != -1) {
-		close (cbd->fd);
+	if (!cbd->keepalive || cbd->fd == -1) {
+		/* Server has not allowed to send the next request using this socket */
+		if (cbd->fd != -1) {
+			close (cbd->fd);
+		}
+
+		cbd->fd = rspamd_inet_address_connect (cbd->addr, SOCK_STREAM, TRUE);
+		cbd->reused = FALSE;
 	}
 
-	cbd->fd = rspamd_inet_address_connect (cbd->addr, SOCK_STREAM, TRUE);
+	cbd->keepalive = FALSE;
 
 	if (cbd->fd != -1) {
 		msg = rspamd_http_new_message (HTTP_REQUEST);
@@ -90,6 +140,9 @@ write_http_request (struct http_callback_data *cbd)
 		if (cbd->bk->protocol == MAP_PROTO_HTTPS) {
 			msg->flags |= RSPAMD_HTTP_FLAG_SSL;
 		}
+		else {
+			msg->flags |= RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+		}
 
 		if (cbd->check) {
 			msg->method = HTTP_HEAD;
@@ -262,7 +315,15 @@ free_http_cbdata_common (struct http_callback_data *cbd, gboolean plan_new)
 	}
 
 	if (cbd->conn) {
-		rspamd_http_connection_unref (cbd->conn);
+		if (cbd->keepalive && rspamd_http_pool_release (cbd->map->cfg->http_pool,
+				cbd->addr, cbd->conn, cbd->fd)) {
+			/* Connection and socket are now owned by the pool */
+			cbd->fd = -1;
+		}
+		else {
+			rspamd_http_connection_unref (cbd->conn);
+		}
+
 		cbd->conn = NULL;
 	}
 
@@ -321,6 +382,25 @@ http_map_error (struct rspamd_http_connection *conn,
 	struct rspamd_map *map;
 
 	map = cbd->map;
+	cbd->keepalive = FALSE;
+
+	if (cbd->reused && rspamd_http_connection_is_stale (conn, err)) {
+		/*
+		 * Server has closed persistent connection before getting our request,
+		 * so we just repeat the current stage using a new socket
+		 */
+		msg_debug_map ("persistent connection to %s has been closed: %e",
+				rspamd_inet_address_to_string_pretty (cbd->addr), err);
+		rspamd_http_connection_reset (cbd->conn);
+		write_http_request (cbd);
+
+		if (cbd->fd != -1) {
+			MAP_RELEASE (cbd, "http_callback_data");
+
+			return;
+		}
+	}
+
 	cbd->periodic->errored = TRUE;
 	msg_err_map ("error reading %s(%s): "
 			"connection with http server terminated incorrectly: %e",
@@ -382,6 +462,12 @@ http_map_finish (struct rspamd_http_connection *conn,
 	map = cbd->map;
 	bk = cbd->bk;
 
+	if (msg->flags & RSPAMD_HTTP_FLAG_KEEP_ALIVE) {
+		/* The next request could be sent using the same socket */
+		cbd->keepalive = TRUE;
+		cbd->reused = TRUE;
+	}
+
 	if (msg->code == 200) {
 
 		if (cbd->check) {
@@ -605,7 +691,7 @@ read_data:
 					cbd->bk->uri,
 					rspamd_inet_address_to_string_pretty (cbd->addr),
 					dlen, zout.pos);
-			map->read_callback (out, zout.pos, &cbd->periodic->cbdata, TRUE);
+			rspamd_map_process_data (map, bk, cbd->periodic, out, zout.pos);
 			g_free (out);
 		}
 		else {
@@ -613,7 +699,7 @@ read_data:
 					cbd->bk->uri,
 					rspamd_inet_address_to_string_pretty (cbd->addr),
 					dlen);
-			map->read_callback (in, cbd->data_len, &cbd->periodic->cbdata, TRUE);
+			rspamd_map_process_data (map, bk, cbd->periodic, in, cbd->data_len);
 		}
 
 		MAP_RELEASE (cbd->shmem_data, "shmem_data");
@@ -654,6 +740,89 @@ err:
 	return 0;
 }
 
+struct rspamd_hash_map_helper {
+	GHashTable *htb;
+	struct rspamd_map_compiled *compiled;
+	/* Some keys were defined more than once */
+	gboolean has_dups;
+	/* The last inserted key, used to index lines of incremental maps */
+	gpointer last_key;
+};
+
+/*
+ * Compiled maps are used as is, so we just pass the mapping to the structure
+ * expected by map's callbacks
+ */
+static gboolean
+read_map_compiled (struct rspamd_map *map, const gchar *fname,
+		guchar *bytes, gsize len, struct map_periodic_cbdata *periodic)
+{
+	struct rspamd_map_compiled *cm;
+	struct rspamd_hash_map_helper *hmap;
+	radix_compressed_t *tree;
+	enum rspamd_map_compiled_type type;
+	GError *err = NULL;
+
+	if (map->read_callback == rspamd_radix_read) {
+		type = RSPAMD_MAP_COMPILED_RADIX;
+	}
+	else if (map->read_callback == rspamd_hosts_read ||
+			map->read_callback == rspamd_kv_list_read) {
+		type = RSPAMD_MAP_COMPILED_HASH;
+	}
+	else {
+		msg_err_map ("%s: compiled maps are not supported for this map",
+				fname);
+		munmap (bytes, len);
+
+		return FALSE;
+	}
+
+	if (periodic->cbdata.cur_data != NULL) {
+		msg_err_map ("%s: compiled map cannot be combined with other sources",
+				fname);
+		munmap (bytes, len);
+
+		return FALSE;
+	}
+
+	cm = rspamd_map_compiled_load (bytes, len, &err);
+
+	if (cm == NULL) {
+		msg_err_map ("%s: cannot load compiled map: %e", fname, err);
+		g_error_free (err);
+		munmap (bytes, len);
+
+		return FALSE;
+	}
+
+	if (rspamd_map_compiled_type (cm) != type) {
+		msg_err_map ("%s: compiled map has type %d but %d is expected", fname,
+				(gint)rspamd_map_compiled_type (cm), (gint)type);
+		rspamd_map_compiled_unref (cm);
+
+		return FALSE;
+	}
+
+	if (type == RSPAMD_MAP_COMPILED_RADIX) {
+		tree = radix_create_compressed_mapped (cm);
+		memcpy (radix_get_pool (tree)->tag.uid, map->tag,
+				sizeof (radix_get_pool (tree)->tag.uid));
+		periodic->cbdata.cur_data = tree;
+		rspamd_map_compiled_unref (cm);
+	}
+	else {
+		hmap = g_slice_alloc0 (sizeof (*hmap));
+		hmap->compiled = cm;
+		periodic->cbdata.cur_data = hmap;
+	}
+
+	msg_info_map ("%s: loaded compiled map of %z elements, %z bytes", fname,
+			rspamd_map_compiled_size (cm), len);
+
+	return TRUE;
+}
+
 /**
  * Callback for reading data from file
  */
@@ -692,6 +861,17 @@ read_map_file (struct rspamd_map *map, struct file_map_data *data,
 		}
 	}
 
+	if (len > 0 && !bk->is_compressed &&
+			rspamd_map_compiled_is_compiled (bytes, len)) {
+		/* Compiled maps are never modified in place */
+		if (bk->lines) {
+			g_array_free (bk->lines, TRUE);
+			bk->lines = NULL;
+		}
+
+		return read_map_compiled (map, data->filename, bytes, len, periodic);
+	}
+
 	if (len > 0) {
 		if (bk->is_compressed) {
 			ZSTD_DStream *zstream;
@@ -742,16 +922,21 @@ read_map_file (struct rspamd_map *map, struct file_map_data *data,
 			msg_info_map ("%s: read map data, %z bytes compressed, "
 					"%z uncompressed)", data->filename,
 					len, zout.pos);
-			map->read_callback (out, zout.pos, &periodic->cbdata, TRUE);
+			rspamd_map_process_data (map, bk, periodic, out, zout.pos);
 			g_free (out);
 		}
 		else {
 			msg_info_map ("%s: read map dat, %z bytes", data->filename,
 					len);
-			map->read_callback (bytes, len, &periodic->cbdata, TRUE);
+			rspamd_map_process_data (map, bk, periodic, bytes, len);
 		}
 	}
 	else {
+		if (bk->lines) {
+			g_array_free (bk->lines, TRUE);
+			bk->lines = NULL;
+		}
+
 		map->read_callback (NULL, 0, &periodic->cbdata, TRUE);
 	}
 
@@ -921,7 +1106,6 @@ rspamd_map_dns_callback (struct rdns_reply *reply, void *arg)
 {
 	struct http_callback_data *cbd = arg;
 	struct rspamd_map *map;
-	guint flags = RSPAMD_HTTP_CLIENT_SIMPLE|RSPAMD_HTTP_CLIENT_SHARED;
 
 	map = cbd->map;
 
@@ -941,19 +1125,9 @@ rspamd_map_dns_callback (struct rdns_reply *reply, void *arg)
 			if (cbd->addr != NULL) {
 				rspamd_inet_address_set_port (cbd->addr, cbd->data->port);
 				/* Try to open a socket */
-				cbd->fd = rspamd_inet_address_connect (cbd->addr, SOCK_STREAM,
-						TRUE);
-
-				if (cbd->fd != -1) {
+				if (rspamd_map_http_connect (cbd)) {
 					cbd->stage = map_load_file;
-					cbd->conn = rspamd_http_connection_new (NULL,
-							http_map_error,
-							http_map_finish,
-							flags,
-							RSPAMD_HTTP_CLIENT,
-							NULL,
-							cbd->map->cfg->libs_ctx->ssl_ctx);
-
+					cbd->keepalive = TRUE;
 					write_http_request (cbd);
 				}
 				else {
@@ -1049,13 +1223,13 @@ rspamd_map_read_cached (struct rspamd_map *map, struct rspamd_map_backend *bk,
 		msg_info_map ("%s: read map data cached %z bytes compressed, "
 				"%z uncompressed", bk->uri,
 				len, zout.pos);
-		map->read_callback (out, zout.pos, &periodic->cbdata, TRUE);
+		rspamd_map_process_data (map, bk, periodic, out, zout.pos);
 		g_free (out);
 	}
 	else {
 		msg_info_map ("%s: read map data cached %z bytes", bk->uri,
 				len);
-		map->read_callback (in, len, &periodic->cbdata, TRUE);
+		rspamd_map_process_data (map, bk, periodic, in, len);
 	}
 
 	munmap (in, len);
@@ -1074,7 +1248,6 @@ rspamd_map_common_http_callback (struct rspamd_map *map,
 {
 	struct http_map_data *data;
 	struct http_callback_data *cbd;
-	guint flags = RSPAMD_HTTP_CLIENT_SIMPLE|RSPAMD_HTTP_CLIENT_SHARED;
 
 	data = bk->data.hd;
 
@@ -1145,19 +1318,10 @@ check:
 	/* Send both A and AAAA requests */
 	if (rspamd_parse_inet_address (&cbd->addr, data->host, strlen (data->host))) {
 		rspamd_inet_address_set_port (cbd->addr, cbd->data->port);
-		cbd->fd = rspamd_inet_address_connect (cbd->addr, SOCK_STREAM,
-				TRUE);
 
-		if (cbd->fd != -1) {
+		if (rspamd_map_http_connect (cbd)) {
 			cbd->stage = map_load_file;
-			cbd->conn = rspamd_http_connection_new (NULL,
-					http_map_error,
-					http_map_finish,
-					flags,
-					RSPAMD_HTTP_CLIENT,
-					NULL,
-					cbd->map->cfg->libs_ctx->ssl_ctx);
-
+			cbd->keepalive = TRUE;
 			write_http_request (cbd);
 			MAP_RELEASE (cbd, "http_callback_data");
 		}
@@ -1620,6 +1784,10 @@ rspamd_map_backend_dtor (struct rspamd_map_backend *bk)
 		rspamd_pubkey_unref (bk->trusted_pubkey);
 	}
 
+	if (bk->lines) {
+		g_array_free (bk->lines, TRUE);
+	}
+
 	g_slice_free1 (sizeof (*bk), bk);
 }
 
@@ -1894,6 +2062,17 @@ rspamd_map_add_from_ucl (struct rspamd_config *cfg,
 			map->poll_timeout = ucl_object_todouble (elt);
 		}
 
+		elt = ucl_object_lookup (obj, "compile");
+		if (elt && ucl_object_type (elt) == UCL_BOOLEAN) {
+			map->compile_mode = ucl_object_toboolean (elt) ?
+					RSPAMD_MAP_COMPILE_ALWAYS : RSPAMD_MAP_COMPILE_NEVER;
+		}
+
+		elt = ucl_object_lookup (obj, "incremental");
+		if (elt && ucl_object_type (elt) == UCL_BOOLEAN) {
+			map->incremental = ucl_object_toboolean (elt);
+		}
+
 		elt = ucl_object_lookup_any (obj, "upstreams", "url", "urls", NULL);
 		if (elt == NULL) {
 			msg_err_config ("map has no urls to be loaded: no elt");
@@ -2360,201 +2539,786 @@ radix_tree_insert_helper (gpointer st, gconstpointer key, gconstpointer value)
 static void
 hash_insert_helper (gpointer st, gconstpointer key, gconstpointer value)
 {
-	GHashTable *ht = st;
+	struct rspamd_hash_map_helper *ht = st;
 	gpointer k, v;
+	guint size;
 
+	size = g_hash_table_size (ht->htb);
 	k = g_strdup (key);
 	v = g_strdup (value);
-	g_hash_table_replace (ht, k, v);
-}
+	g_hash_table_replace (ht->htb, k, v);
+	ht->last_key = k;
 
-/* Helpers */
-gchar *
-rspamd_hosts_read (
-	gchar * chunk,
-	gint len,
-	struct map_cb_data *data,
-	gboolean final)
-{
-	if (data->cur_data == NULL) {
-		data->cur_data = g_hash_table_new_full (rspamd_strcase_hash,
-				rspamd_strcase_equal, g_free, g_free);
+	if (g_hash_table_size (ht->htb) == size) {
+		ht->has_dups = TRUE;
 	}
-	return rspamd_parse_kv_list (
-			   chunk,
-			   len,
-			   data,
-			   hash_insert_helper,
-			   hash_fill,
-			   final);
 }
 
-void
-rspamd_hosts_fin (struct map_cb_data *data)
+static struct rspamd_hash_map_helper *
+rspamd_map_helper_new_hash (void)
 {
-	struct rspamd_map *map = data->map;
+	struct rspamd_hash_map_helper *ht;
 
-	if (data->prev_data) {
-		g_hash_table_unref (data->prev_data);
-	}
-	if (data->cur_data) {
-		msg_info_map ("read hash of %d elements", g_hash_table_size
-				(data->cur_data));
-	}
+	ht = g_slice_alloc0 (sizeof (*ht));
+	ht->htb = g_hash_table_new_full (rspamd_strcase_hash,
+			rspamd_strcase_equal, g_free, g_free);
+
+	return ht;
 }
 
-gchar *
-rspamd_kv_list_read (
-	gchar * chunk,
-	gint len,
-	struct map_cb_data *data,
-	gboolean final)
+static gsize
+rspamd_map_helper_hash_size (struct rspamd_hash_map_helper *ht)
 {
-	if (data->cur_data == NULL) {
-		data->cur_data = g_hash_table_new_full (rspamd_strcase_hash,
-				rspamd_strcase_equal, g_free, g_free);
+	if (ht->compiled) {
+		return rspamd_map_compiled_size (ht->compiled);
 	}
-	return rspamd_parse_kv_list (
-			   chunk,
-			   len,
-			   data,
-			   hash_insert_helper,
-			   "",
-			   final);
+
+	return g_hash_table_size (ht->htb);
 }
 
 void
-rspamd_kv_list_fin (struct map_cb_data *data)
+rspamd_hash_map_destroy (struct rspamd_hash_map_helper *map)
 {
-	struct rspamd_map *map = data->map;
+	if (map) {
+		if (map->htb) {
+			g_hash_table_unref (map->htb);
+		}
 
-	if (data->prev_data) {
-		g_hash_table_unref (data->prev_data);
-	}
-	if (data->cur_data) {
-		msg_info_map ("read hash of %d elements", g_hash_table_size
-				(data->cur_data));
+		if (map->compiled) {
+			rspamd_map_compiled_unref (map->compiled);
+		}
+
+		g_slice_free1 (sizeof (*map), map);
 	}
 }
 
-gchar *
-rspamd_radix_read (
-	gchar * chunk,
-	gint len,
-	struct map_cb_data *data,
-	gboolean final)
+gboolean
+rspamd_map_compile_data (map_cb_t read_cb, gpointer data,
+		GByteArray *out, GError **err)
 {
-	radix_compressed_t *tree;
-	rspamd_mempool_t *rpool;
-	struct rspamd_map *map = data->map;
+	struct rspamd_hash_map_helper *ht = data;
 
-	if (data->cur_data == NULL) {
-		tree = radix_create_compressed ();
-		rpool = radix_get_pool (tree);
-		memcpy (rpool->tag.uid, map->tag, sizeof (rpool->tag.uid));
-		data->cur_data = tree;
+	if (read_cb == rspamd_radix_read) {
+		return rspamd_map_compiled_write_radix (data, out, err);
 	}
-	return rspamd_parse_kv_list (
-			   chunk,
-			   len,
-			   data,
-			   radix_tree_insert_helper,
-			   hash_fill,
-			   final);
+	else if ((read_cb == rspamd_hosts_read || read_cb == rspamd_kv_list_read) &&
+			ht->htb != NULL) {
+		return rspamd_map_compiled_write_hash (ht->htb, out, err);
+	}
+
+	g_set_error (err, g_quark_from_static_string ("map"), EINVAL,
+			"map type cannot be compiled");
+
+	return FALSE;
 }
 
-void
-rspamd_radix_fin (struct map_cb_data *data)
+gconstpointer
+rspamd_match_hash_map (struct rspamd_hash_map_helper *map, const gchar *in)
 {
-	struct rspamd_map *map = data->map;
-
-	if (data->prev_data) {
-		radix_destroy_compressed (data->prev_data);
+	if (map == NULL || in == NULL) {
+		return NULL;
 	}
-	if (data->cur_data) {
-		msg_info_map ("read radix trie of %z elements: %s",
-				radix_get_size (data->cur_data), radix_get_info (data->cur_data));
+
+	if (map->compiled) {
+		return rspamd_map_compiled_hash_lookup (map->compiled, in, strlen (in));
 	}
+
+	return g_hash_table_lookup (map->htb, in);
 }
 
-enum rspamd_regexp_map_flags {
-	RSPAMD_REGEXP_FLAG_UTF = (1 << 0),
-	RSPAMD_REGEXP_FLAG_MULTIPLE = (1 << 1)
+/*
+ * Incremental maps: each backend keeps hashes of the last loaded lines
+ * instead of their content. On reload lines of the new content are hashed
+ * and only lines with unknown hashes are parsed and applied to the current
+ * data. Lines of hash maps also refer to their keys in the hash table, so
+ * removed lines could be removed from it as well
+ */
+struct rspamd_map_line {
+	guint64 hash;
+	/* Key owned by the hash map or NULL */
+	gpointer key;
 };
 
-struct rspamd_regexp_map {
-	struct rspamd_map *map;
-	GPtrArray *regexps;
-	GPtrArray *values;
-	enum rspamd_regexp_map_flags map_flags;
-#ifdef WITH_HYPERSCAN
-	hs_database_t *hs_db;
-	hs_scratch_t *hs_scratch;
-	const gchar **patterns;
-	gint *flags;
-	gint *ids;
-#endif
+struct rspamd_map_new_line {
+	guint64 hash;
+	const gchar *begin;
+	gsize len;
+	/* Position in the content */
+	guint pos;
+	/* Index in the new lines array */
+	guint idx;
+	gpointer key;
 };
 
-static struct rspamd_regexp_map *
-rspamd_regexp_map_create (struct rspamd_map *map,
-		enum rspamd_regexp_map_flags flags)
+static gint
+rspamd_map_line_cmp (gconstpointer a, gconstpointer b)
 {
-	struct rspamd_regexp_map *re_map;
+	const struct rspamd_map_line *l1 = a, *l2 = b;
 
-	re_map = g_slice_alloc0 (sizeof (*re_map));
-	re_map->values = g_ptr_array_new ();
-	re_map->regexps = g_ptr_array_new ();
-	re_map->map = map;
-	re_map->map_flags = flags;
+	if (l1->hash != l2->hash) {
+		return l1->hash < l2->hash ? -1 : 1;
+	}
 
-	return re_map;
+	return 0;
 }
 
-
-static void
-rspamd_regexp_map_destroy (struct rspamd_regexp_map *re_map)
+static gint
+rspamd_map_new_line_cmp (gconstpointer a, gconstpointer b)
 {
-	rspamd_regexp_t *re;
-	guint i;
+	const struct rspamd_map_new_line *l1 = a, *l2 = b;
 
-	for (i = 0; i < re_map->regexps->len; i ++) {
-		re = g_ptr_array_index (re_map->regexps, i);
-		rspamd_regexp_unref (re);
-	}
-
-	for (i = 0; i < re_map->values->len; i ++) {
-		g_free (g_ptr_array_index (re_map->values, i));
+	if (l1->hash != l2->hash) {
+		return l1->hash < l2->hash ? -1 : 1;
 	}
 
-	g_ptr_array_free (re_map->regexps, TRUE);
-	g_ptr_array_free (re_map->values, TRUE);
+	return (gint)l1->pos - (gint)l2->pos;
+}
 
-#ifdef WITH_HYPERSCAN
-	if (re_map->hs_scratch) {
-		hs_free_scratch (re_map->hs_scratch);
-	}
-	if (re_map->hs_db) {
-		hs_free_database (re_map->hs_db);
-	}
-	if (re_map->patterns) {
-		g_free (re_map->patterns);
-	}
-	if (re_map->flags) {
-		g_free (re_map->flags);
-	}
-	if (re_map->ids) {
-		g_free (re_map->ids);
-	}
-#endif
+static gint
+rspamd_map_new_line_pos_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_map_new_line *l1 = a, *l2 = b;
 
-	g_slice_free1 (sizeof (*re_map), re_map);
+	return (gint)l1->pos - (gint)l2->pos;
 }
 
-static void
-rspamd_re_map_insert_helper (gpointer st, gconstpointer key, gconstpointer value)
+static inline const gchar *
+rspamd_map_next_line (const gchar *p, const gchar *end, rspamd_ftok_t *tok)
 {
-	struct rspamd_regexp_map *re_map = st;
+	const gchar *eol;
+
+	eol = memchr (p, '\n', end - p);
+
+	if (eol == NULL) {
+		eol = end;
+	}
+	else {
+		/* Keep the end of line, so the line could be parsed alone */
+		eol ++;
+	}
+
+	tok->begin = p;
+	tok->len = eol - p;
+
+	return eol;
+}
+
+/* Empty lines and comments do not affect the map's data */
+static inline gboolean
+rspamd_map_line_is_empty (const rspamd_ftok_t *tok)
+{
+	const gchar *p = tok->begin, *end = tok->begin + tok->len;
+
+	while (p < end && g_ascii_isspace (*p)) {
+		p ++;
+	}
+
+	return p == end || *p == '#';
+}
+
+static inline guint64
+rspamd_map_line_hash (const rspamd_ftok_t *tok)
+{
+	const gchar *p = tok->begin;
+	gsize len = tok->len;
+
+	/* The last line might have no end of line */
+	while (len > 0 && (p[len - 1] == '\n' || p[len - 1] == '\r')) {
+		len --;
+	}
+
+	return rspamd_cryptobox_fast_hash (p, len, rspamd_hash_seed ());
+}
+
+static inline gboolean
+rspamd_map_is_hash (struct rspamd_map *map)
+{
+	return map->read_callback == rspamd_hosts_read ||
+			map->read_callback == rspamd_kv_list_read;
+}
+
+static inline const gchar *
+rspamd_map_hash_default (struct rspamd_map *map)
+{
+	return map->read_callback == rspamd_hosts_read ? hash_fill : "";
+}
+
+static void
+rspamd_map_parse_line (struct map_cb_data *cbdata, const rspamd_ftok_t *tok,
+		insert_func func, const gchar *default_value)
+{
+	cbdata->state = 0;
+	rspamd_parse_kv_list ((gchar *)tok->begin, tok->len, cbdata, func,
+			default_value, TRUE);
+}
+
+/*
+ * Reads the whole map and returns hashes of its lines sorted by hash.
+ * Returns NULL if the data could not be changed incrementally later
+ */
+static GArray *
+rspamd_map_read_indexed (struct rspamd_map *map, struct map_cb_data *cbdata,
+		gchar *in, gsize len)
+{
+	struct rspamd_hash_map_helper *ht = NULL;
+	struct rspamd_map_line line;
+	GArray *lines;
+	rspamd_ftok_t tok;
+	const gchar *p = in, *end = in + len;
+
+	if (rspamd_map_is_hash (map)) {
+		if (cbdata->cur_data == NULL) {
+			cbdata->cur_data = rspamd_map_helper_new_hash ();
+		}
+
+		ht = cbdata->cur_data;
+	}
+	else {
+		map->read_callback (in, len, cbdata, TRUE);
+	}
+
+	lines = g_array_new (FALSE, FALSE, sizeof (line));
+
+	while (p < end) {
+		p = rspamd_map_next_line (p, end, &tok);
+
+		if (rspamd_map_line_is_empty (&tok)) {
+			continue;
+		}
+
+		line.hash = rspamd_map_line_hash (&tok);
+		line.key = NULL;
+
+		if (ht) {
+			/* Hash maps are parsed line by line to find keys of lines */
+			ht->last_key = NULL;
+			rspamd_map_parse_line (cbdata, &tok, hash_insert_helper,
+					rspamd_map_hash_default (map));
+			line.key = ht->last_key;
+		}
+
+		g_array_append_val (lines, line);
+	}
+
+	if (ht && ht->has_dups) {
+		/* Replaced keys are freed, and the result depends on lines order */
+		g_array_free (lines, TRUE);
+
+		return NULL;
+	}
+
+	g_array_sort (lines, rspamd_map_line_cmp);
+
+	return lines;
+}
+
+/*
+ * Compares hashes of the previous lines with the new content. Lines of the
+ * new content are returned in `new_lines` sorted by hash with keys of the
+ * unchanged lines, `added` has added lines in order of the content and
+ * `removed` has keys of the removed lines. Returns FALSE if changes are too
+ * large to be applied incrementally
+ */
+static gboolean
+rspamd_map_diff_lines (GArray *old, const gchar *in, gsize len,
+		GArray *new_lines, GArray *added, GPtrArray *removed,
+		gsize *nremoved)
+{
+	struct rspamd_map_new_line *nl, cur;
+	struct rspamd_map_line *ol, line;
+	GArray *cur_lines;
+	rspamd_ftok_t tok;
+	const gchar *p = in, *end = in + len;
+	guint i = 0, j = 0;
+
+	cur_lines = g_array_new (FALSE, FALSE, sizeof (cur));
+	memset (&cur, 0, sizeof (cur));
+
+	while (p < end) {
+		p = rspamd_map_next_line (p, end, &tok);
+
+		if (!rspamd_map_line_is_empty (&tok)) {
+			cur.hash = rspamd_map_line_hash (&tok);
+			cur.begin = tok.begin;
+			cur.len = tok.len;
+			cur.pos = cur_lines->len;
+			g_array_append_val (cur_lines, cur);
+		}
+	}
+
+	g_array_sort (cur_lines, rspamd_map_new_line_cmp);
+	*nremoved = 0;
+
+	while (i < old->len || j < cur_lines->len) {
+		ol = i < old->len ?
+				&g_array_index (old, struct rspamd_map_line, i) : NULL;
+		nl = j < cur_lines->len ?
+				&g_array_index (cur_lines, struct rspamd_map_new_line, j) : NULL;
+
+		if (ol && nl && ol->hash == nl->hash) {
+			/* Unchanged line */
+			line.hash = nl->hash;
+			line.key = ol->key;
+			g_array_append_val (new_lines, line);
+			i ++;
+			j ++;
+		}
+		else if (ol && (nl == NULL || ol->hash < nl->hash)) {
+			if (ol->key) {
+				g_ptr_array_add (removed, ol->key);
+			}
+
+			(*nremoved) ++;
+			i ++;
+		}
+		else {
+			line.hash = nl->hash;
+			line.key = NULL;
+			nl->idx = new_lines->len;
+			g_array_append_val (new_lines, line);
+			g_array_append_val (added, *nl);
+			j ++;
+		}
+	}
+
+	/* Added lines are applied in order of the content */
+	g_array_sort (added, rspamd_map_new_line_pos_cmp);
+	g_array_free (cur_lines, TRUE);
+
+	/* Parsing large changes is slower than just rereading a map */
+	return *nremoved + added->len <= new_lines->len / 2;
+}
+
+static gboolean
+rspamd_map_apply_hash_delta (struct rspamd_map *map,
+		struct rspamd_hash_map_helper *ht, GArray *new_lines,
+		GArray *added, GPtrArray *removed)
+{
+	struct rspamd_hash_map_helper *add;
+	struct rspamd_map_new_line *al;
+	struct map_cb_data cbdata;
+	GHashTable *rm;
+	GHashTableIter it;
+	rspamd_ftok_t tok;
+	gpointer k, v, orig;
+	gboolean ret = FALSE;
+	guint i;
+
+	if (ht->htb == NULL || ht->has_dups) {
+		return FALSE;
+	}
+
+	memset (&cbdata, 0, sizeof (cbdata));
+	cbdata.map = map;
+	cbdata.cur_data = add = rspamd_map_helper_new_hash ();
+	rm = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+	for (i = 0; i < added->len; i ++) {
+		al = &g_array_index (added, struct rspamd_map_new_line, i);
+		tok.begin = al->begin;
+		tok.len = al->len;
+		add->last_key = NULL;
+		rspamd_map_parse_line (&cbdata, &tok, hash_insert_helper,
+				rspamd_map_hash_default (map));
+		al->key = add->last_key;
+	}
+
+	for (i = 0; i < removed->len; i ++) {
+		g_hash_table_insert (rm, g_ptr_array_index (removed, i),
+				GINT_TO_POINTER (1));
+	}
+
+	/*
+	 * The result must be the same as after reading of the whole map, so
+	 * added keys should not override keys of lines that are still in the map
+	 */
+	if (add->has_dups) {
+		goto out;
+	}
+
+	g_hash_table_iter_init (&it, add->htb);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		if (g_hash_table_lookup_extended (ht->htb, k, &orig, NULL) &&
+				g_hash_table_lookup (rm, orig) == NULL) {
+			goto out;
+		}
+	}
+
+	for (i = 0; i < removed->len; i ++) {
+		g_hash_table_remove (ht->htb, g_ptr_array_index (removed, i));
+	}
+
+	for (i = 0; i < added->len; i ++) {
+		al = &g_array_index (added, struct rspamd_map_new_line, i);
+
+		if (al->key) {
+			v = g_hash_table_lookup (add->htb, al->key);
+			g_hash_table_steal (add->htb, al->key);
+			g_hash_table_insert (ht->htb, al->key, v);
+			g_array_index (new_lines, struct rspamd_map_line, al->idx).key =
+					al->key;
+		}
+	}
+
+	ret = TRUE;
+
+out:
+	rspamd_hash_map_destroy (add);
+	g_hash_table_unref (rm);
+
+	return ret;
+}
+
+struct rspamd_map_radix_delta {
+	radix_compressed_t *tree;
+	gboolean dup;
+};
+
+static void
+radix_delta_insert_helper (gpointer st, gconstpointer key, gconstpointer value)
+{
+	struct rspamd_map_radix_delta *rd = st;
+	gsize size;
+	gint n;
+
+	size = radix_get_size (rd->tree);
+	n = rspamd_radix_add_iplist (key, ",", rd->tree,
+			rspamd_mempool_strdup (radix_get_pool (rd->tree), value), FALSE);
+
+	if (radix_get_size (rd->tree) - size != (gsize)n) {
+		rd->dup = TRUE;
+	}
+}
+
+static gboolean
+rspamd_map_apply_radix_delta (struct rspamd_map *map,
+		radix_compressed_t *tree, GArray *added, gsize nremoved)
+{
+	struct rspamd_map_radix_delta rd;
+	struct rspamd_map_new_line *al;
+	struct map_cb_data cbdata;
+	rspamd_ftok_t tok;
+	guint i;
+
+	/* Radix trie does not support removal of prefixes */
+	if (nremoved > 0) {
+		return FALSE;
+	}
+
+	memset (&cbdata, 0, sizeof (cbdata));
+	cbdata.map = map;
+	cbdata.cur_data = &rd;
+	rd.tree = tree;
+	rd.dup = FALSE;
+
+	for (i = 0; i < added->len && !rd.dup; i ++) {
+		al = &g_array_index (added, struct rspamd_map_new_line, i);
+		tok.begin = al->begin;
+		tok.len = al->len;
+		rspamd_map_parse_line (&cbdata, &tok, radix_delta_insert_helper,
+				hash_fill);
+	}
+
+	/*
+	 * Trie keeps the first value of a duplicate prefix, so the result of
+	 * a full reread depends on lines order. The trie is replaced by the
+	 * reread then, so the prefixes inserted so far are not a problem
+	 */
+	return !rd.dup;
+}
+
+static gboolean
+rspamd_map_read_incremental (struct rspamd_map *map,
+		struct rspamd_map_backend *bk, struct map_periodic_cbdata *periodic,
+		const gchar *in, gsize len)
+{
+	GArray *new_lines, *added;
+	GPtrArray *removed;
+	gpointer data = periodic->cbdata.prev_data;
+	gsize nremoved = 0;
+	gboolean ret = FALSE;
+
+	if (bk->lines == NULL || data == NULL || data != *map->user_data ||
+			periodic->cbdata.cur_data != NULL) {
+		return FALSE;
+	}
+
+	new_lines = g_array_sized_new (FALSE, FALSE, sizeof (struct rspamd_map_line),
+			bk->lines->len);
+	added = g_array_new (FALSE, FALSE, sizeof (struct rspamd_map_new_line));
+	removed = g_ptr_array_new ();
+
+	if (rspamd_map_diff_lines (bk->lines, in, len, new_lines, added, removed,
+			&nremoved)) {
+		if (rspamd_map_is_hash (map)) {
+			ret = rspamd_map_apply_hash_delta (map, data, new_lines, added,
+					removed);
+		}
+		else {
+			ret = rspamd_map_apply_radix_delta (map, data, added, nremoved);
+		}
+	}
+
+	if (ret) {
+		msg_info_map ("%s: applied changes incrementally, %z lines removed, "
+				"%ud lines added", bk->uri, nremoved, added->len);
+		/* Data is modified in place, so it must not be destroyed */
+		periodic->cbdata.cur_data = data;
+		periodic->cbdata.prev_data = NULL;
+		g_array_free (bk->lines, TRUE);
+		bk->lines = new_lines;
+	}
+	else {
+		msg_info_map ("%s: cannot apply changes incrementally, "
+				"reread the whole map", bk->uri);
+		g_array_free (new_lines, TRUE);
+	}
+
+	g_array_free (added, TRUE);
+	g_ptr_array_free (removed, TRUE);
+
+	return ret;
+}
+
+void
+rspamd_map_process_data (struct rspamd_map *map,
+		struct rspamd_map_backend *bk, struct map_periodic_cbdata *periodic,
+		gchar *in, gsize len)
+{
+	if (map->incremental && map->backends->len == 1 &&
+			(rspamd_map_is_hash (map) ||
+			map->read_callback == rspamd_radix_read)) {
+		if (!rspamd_map_read_incremental (map, bk, periodic, in, len)) {
+			if (bk->lines) {
+				g_array_free (bk->lines, TRUE);
+			}
+
+			bk->lines = rspamd_map_read_indexed (map, &periodic->cbdata,
+					in, len);
+		}
+	}
+	else {
+		map->read_callback (in, len, &periodic->cbdata, TRUE);
+	}
+}
+
+/* Helpers */
+gchar *
+rspamd_hosts_read (
+	gchar * chunk,
+	gint len,
+	struct map_cb_data *data,
+	gboolean final)
+{
+	if (data->cur_data == NULL) {
+		data->cur_data = rspamd_map_helper_new_hash ();
+	}
+	return rspamd_parse_kv_list (
+			   chunk,
+			   len,
+			   data,
+			   hash_insert_helper,
+			   hash_fill,
+			   final);
+}
+
+void
+rspamd_hosts_fin (struct map_cb_data *data)
+{
+	struct rspamd_map *map = data->map;
+
+	if (data->prev_data) {
+		rspamd_hash_map_destroy (data->prev_data);
+	}
+	if (data->cur_data) {
+		msg_info_map ("read hash of %z elements",
+				rspamd_map_helper_hash_size (data->cur_data));
+	}
+}
+
+gchar *
+rspamd_kv_list_read (
+	gchar * chunk,
+	gint len,
+	struct map_cb_data *data,
+	gboolean final)
+{
+	if (data->cur_data == NULL) {
+		data->cur_data = rspamd_map_helper_new_hash ();
+	}
+	return rspamd_parse_kv_list (
+			   chunk,
+			   len,
+			   data,
+			   hash_insert_helper,
+			   "",
+			   final);
+}
+
+void
+rspamd_kv_list_fin (struct map_cb_data *data)
+{
+	struct rspamd_map *map = data->map;
+
+	if (data->prev_data) {
+		rspamd_hash_map_destroy (data->prev_data);
+	}
+	if (data->cur_data) {
+		msg_info_map ("read hash of %z elements",
+				rspamd_map_helper_hash_size (data->cur_data));
+	}
+}
+
+gchar *
+rspamd_radix_read (
+	gchar * chunk,
+	gint len,
+	struct map_cb_data *data,
+	gboolean final)
+{
+	radix_compressed_t *tree;
+	rspamd_mempool_t *rpool;
+	struct rspamd_map *map = data->map;
+
+	if (data->cur_data == NULL) {
+		tree = radix_create_compressed ();
+		rpool = radix_get_pool (tree);
+		memcpy (rpool->tag.uid, map->tag, sizeof (rpool->tag.uid));
+		data->cur_data = tree;
+	}
+	return rspamd_parse_kv_list (
+			   chunk,
+			   len,
+			   data,
+			   radix_tree_insert_helper,
+			   hash_fill,
+			   final);
+}
+
+void
+rspamd_radix_fin (struct map_cb_data *data)
+{
+	struct rspamd_map *map = data->map;
+
+	if (data->prev_data) {
+		radix_destroy_compressed (data->prev_data);
+	}
+	if (data->cur_data) {
+		msg_info_map ("read radix trie of %z elements: %s",
+				radix_get_size (data->cur_data), radix_get_info (data->cur_data));
+
+		if (map->compile_mode == RSPAMD_MAP_COMPILE_ALWAYS) {
+			radix_compile_compressed (data->cur_data);
+		}
+	}
+}
+
+enum rspamd_regexp_map_flags {
+	RSPAMD_REGEXP_FLAG_UTF = (1 << 0),
+	RSPAMD_REGEXP_FLAG_MULTIPLE = (1 << 1)
+};
+
+struct rspamd_regexp_map {
+	struct rspamd_map *map;
+	GPtrArray *regexps;
+	GPtrArray *values;
+	enum rspamd_regexp_map_flags map_flags;
+#ifdef WITH_HYPERSCAN
+	hs_database_t *hs_db;
+	hs_scratch_t *hs_scratch;
+	const gchar **patterns;
+	gint *flags;
+	gint *ids;
+	/* Hash of patterns, flags and platform used to name cached databases */
+	guchar hs_hash[rspamd_cryptobox_HASHBYTES];
+	/* Waiting for hs_helper to compile the database */
+	gboolean hs_pending;
+#endif
+};
+
+#ifdef WITH_HYPERSCAN
+/*
+ * Databases for regexp maps are cached in files named by the map's tag and
+ * the hash of its content: `<tag>-<hash>.hsmc` is a serialized hyperscan
+ * database, `<tag>-<hash>.hsmr` is a request for hs_helper with the
+ * following layout:
+ *
+ * Magic - 8 bytes
+ * n - number of regexps (4 bytes)
+ * n * <regexp flags> (4 bytes each)
+ * n * <pattern length (4 bytes), pattern, zero byte>
+ */
+static const guchar rspamd_re_map_request_magic[] = {'r', 's', 'm', 'p',
+		'r', 'q', '0', '1'};
+static gboolean hs_deferred = FALSE;
+
+static const gchar *
+rspamd_re_map_cache_dir (struct rspamd_config *cfg)
+{
+	return cfg->hs_cache_dir ? cfg->hs_cache_dir : RSPAMD_DBDIR "/";
+}
+#endif
+
+static struct rspamd_regexp_map *
+rspamd_regexp_map_create (struct rspamd_map *map,
+		enum rspamd_regexp_map_flags flags)
+{
+	struct rspamd_regexp_map *re_map;
+
+	re_map = g_slice_alloc0 (sizeof (*re_map));
+	re_map->values = g_ptr_array_new ();
+	re_map->regexps = g_ptr_array_new ();
+	re_map->map = map;
+	re_map->map_flags = flags;
+
+	return re_map;
+}
+
+
+static void
+rspamd_regexp_map_destroy (struct rspamd_regexp_map *re_map)
+{
+	rspamd_regexp_t *re;
+	guint i;
+
+	for (i = 0; i < re_map->regexps->len; i ++) {
+		re = g_ptr_array_index (re_map->regexps, i);
+		rspamd_regexp_unref (re);
+	}
+
+	for (i = 0; i < re_map->values->len; i ++) {
+		g_free (g_ptr_array_index (re_map->values, i));
+	}
+
+	g_ptr_array_free (re_map->regexps, TRUE);
+	g_ptr_array_free (re_map->values, TRUE);
+
+#ifdef WITH_HYPERSCAN
+	if (re_map->hs_scratch) {
+		hs_free_scratch (re_map->hs_scratch);
+	}
+	if (re_map->hs_db) {
+		hs_free_database (re_map->hs_db);
+	}
+	if (re_map->patterns) {
+		g_free (re_map->patterns);
+	}
+	if (re_map->flags) {
+		g_free (re_map->flags);
+	}
+	if (re_map->ids) {
+		g_free (re_map->ids);
+	}
+#endif
+
+	g_slice_free1 (sizeof (*re_map), re_map);
+}
+
+static void
+rspamd_re_map_insert_helper (gpointer st, gconstpointer key, gconstpointer value)
+{
+	struct rspamd_regexp_map *re_map = st;
 	struct rspamd_map *map;
 	rspamd_regexp_t *re;
 	GError *err = NULL;
@@ -2589,6 +3353,157 @@ rspamd_re_map_insert_helper (gpointer st, gconstpointer key, gconstpointer value
 	g_ptr_array_add (re_map->values, g_strdup (value));
 }
 
+#ifdef WITH_HYPERSCAN
+static gboolean
+rspamd_re_map_try_load_hs (struct rspamd_regexp_map *re_map)
+{
+	struct rspamd_map *map = re_map->map;
+	gchar fp[PATH_MAX];
+	gpointer data;
+	gsize len;
+
+	rspamd_snprintf (fp, sizeof (fp), "%s/%s-%*xs.hsmc",
+			rspamd_re_map_cache_dir (map->cfg), map->tag,
+			(gint)rspamd_cryptobox_HASHBYTES / 2, re_map->hs_hash);
+
+	if ((data = rspamd_file_xmap (fp, PROT_READ, &len, TRUE)) == NULL) {
+		return FALSE;
+	}
+
+	if (hs_deserialize_database (data, len, &re_map->hs_db) != HS_SUCCESS) {
+		munmap (data, len);
+		/* Remove stale file */
+		(void)unlink (fp);
+		re_map->hs_db = NULL;
+
+		return FALSE;
+	}
+
+	munmap (data, len);
+
+	if (hs_alloc_scratch (re_map->hs_db, &re_map->hs_scratch) != HS_SUCCESS) {
+		msg_err_map ("cannot allocate scratch space for hyperscan");
+		hs_free_database (re_map->hs_db);
+		re_map->hs_db = NULL;
+
+		return FALSE;
+	}
+
+	msg_info_map ("loaded hyperscan database for regexp map from %s", fp);
+	re_map->hs_pending = FALSE;
+
+	return TRUE;
+}
+
+static void
+rspamd_re_map_try_save_hs (struct rspamd_regexp_map *re_map)
+{
+	struct rspamd_map *map = re_map->map;
+	gchar fp[PATH_MAX], np[PATH_MAX];
+	const gchar *dir;
+	char *bytes = NULL;
+	gsize len;
+	gint fd;
+
+	dir = rspamd_re_map_cache_dir (map->cfg);
+	rspamd_snprintf (fp, sizeof (fp), "%s/%s-%*xs.hsmc.tmp", dir, map->tag,
+			(gint)rspamd_cryptobox_HASHBYTES / 2, re_map->hs_hash);
+
+	if ((fd = rspamd_file_xopen (fp, O_WRONLY | O_CREAT | O_EXCL, 00644, 0)) != -1) {
+		if (hs_serialize_database (re_map->hs_db, &bytes, &len) == HS_SUCCESS) {
+			if (write (fd, bytes, len) == -1) {
+				msg_warn_map ("cannot write hyperscan cache to %s: %s",
+						fp, strerror (errno));
+				unlink (fp);
+			}
+			else {
+				fsync (fd);
+				rspamd_snprintf (np, sizeof (np), "%s/%s-%*xs.hsmc", dir,
+						map->tag, (gint)rspamd_cryptobox_HASHBYTES / 2,
+						re_map->hs_hash);
+
+				if (rename (fp, np) == -1) {
+					msg_warn_map ("cannot rename hyperscan cache from %s to %s: %s",
+							fp, np, strerror (errno));
+					unlink (fp);
+				}
+			}
+
+			free (bytes);
+		}
+		else {
+			msg_warn_map ("cannot serialize hyperscan cache to %s", fp);
+			unlink (fp);
+		}
+
+		close (fd);
+	}
+}
+
+/*
+ * Writes request to compile regexp map for hs_helper unless some other
+ * worker has already done it
+ */
+static void
+rspamd_re_map_save_request (struct rspamd_regexp_map *re_map)
+{
+	struct rspamd_map *map = re_map->map;
+	gchar fp[PATH_MAX], np[PATH_MAX];
+	const gchar *dir;
+	GByteArray *req;
+	guint32 n, plen, fl;
+	guint i;
+	gint fd;
+
+	dir = rspamd_re_map_cache_dir (map->cfg);
+	rspamd_snprintf (np, sizeof (np), "%s/%s-%*xs.hsmr", dir, map->tag,
+			(gint)rspamd_cryptobox_HASHBYTES / 2, re_map->hs_hash);
+
+	if (access (np, R_OK) != -1) {
+		return;
+	}
+
+	rspamd_snprintf (fp, sizeof (fp), "%s/%s-%*xs.hsmr.tmp", dir, map->tag,
+			(gint)rspamd_cryptobox_HASHBYTES / 2, re_map->hs_hash);
+
+	if ((fd = rspamd_file_xopen (fp, O_WRONLY | O_CREAT | O_EXCL, 00644, 0)) == -1) {
+		return;
+	}
+
+	n = re_map->regexps->len;
+	req = g_byte_array_new ();
+	g_byte_array_append (req, rspamd_re_map_request_magic,
+			sizeof (rspamd_re_map_request_magic));
+	g_byte_array_append (req, (const guint8 *)&n, sizeof (n));
+
+	for (i = 0; i < n; i ++) {
+		fl = re_map->flags[i];
+		g_byte_array_append (req, (const guint8 *)&fl, sizeof (fl));
+	}
+
+	for (i = 0; i < n; i ++) {
+		plen = strlen (re_map->patterns[i]);
+		g_byte_array_append (req, (const guint8 *)&plen, sizeof (plen));
+		g_byte_array_append (req, (const guint8 *)re_map->patterns[i],
+				plen + 1);
+	}
+
+	if (write (fd, req->data, req->len) == -1) {
+		msg_warn_map ("cannot write hyperscan request to %s: %s",
+				fp, strerror (errno));
+		unlink (fp);
+	}
+	else if (rename (fp, np) == -1) {
+		msg_warn_map ("cannot rename hyperscan request from %s to %s: %s",
+				fp, np, strerror (errno));
+		unlink (fp);
+	}
+
+	close (fd);
+	g_byte_array_free (req, TRUE);
+}
+#endif
+
 static void
 rspamd_re_map_finalize (struct rspamd_regexp_map *re_map)
 {
@@ -2598,6 +3513,7 @@ rspamd_re_map_finalize (struct rspamd_regexp_map *re_map)
 	hs_compile_error_t *err;
 	struct rspamd_map *map;
 	rspamd_regexp_t *re;
+	rspamd_cryptobox_hash_state_t st;
 	gint pcre_flags;
 
 	map = re_map->map;
@@ -2616,6 +3532,8 @@ rspamd_re_map_finalize (struct rspamd_regexp_map *re_map)
 	re_map->patterns = g_new (const gchar *, re_map->regexps->len);
 	re_map->flags = g_new (gint, re_map->regexps->len);
 	re_map->ids = g_new (gint, re_map->regexps->len);
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+	rspamd_cryptobox_hash_update (&st, (const guchar *)&plt, sizeof (plt));
 
 	for (i = 0; i < re_map->regexps->len; i ++) {
 		re = g_ptr_array_index (re_map->regexps, i);
@@ -2646,9 +3564,29 @@ rspamd_re_map_finalize (struct rspamd_regexp_map *re_map)
 		}
 
 		re_map->ids[i] = i;
+		rspamd_cryptobox_hash_update (&st, (const guchar *)&re_map->flags[i],
+				sizeof (re_map->flags[i]));
+		rspamd_cryptobox_hash_update (&st, (const guchar *)re_map->patterns[i],
+				strlen (re_map->patterns[i]) + 1);
 	}
 
+	rspamd_cryptobox_hash_final (&st, re_map->hs_hash);
+
 	if (re_map->regexps->len > 0 && re_map->patterns) {
+		if (rspamd_re_map_try_load_hs (re_map)) {
+			return;
+		}
+
+		if (hs_deferred) {
+			/* Use pcre until hs_helper compiles the database */
+			rspamd_re_map_save_request (re_map);
+			re_map->hs_pending = TRUE;
+			msg_info_map ("hyperscan database for regexp map %s is not cached, "
+					"wait for hs_helper to compile it", map->name);
+
+			return;
+		}
+
 		if (hs_compile_multi (re_map->patterns,
 				re_map->flags,
 				re_map->ids,
@@ -2673,6 +3611,9 @@ rspamd_re_map_finalize (struct rspamd_regexp_map *re_map)
 			hs_free_database (re_map->hs_db);
 			re_map->hs_db = NULL;
 		}
+		else {
+			rspamd_re_map_try_save_hs (re_map);
+		}
 	}
 	else {
 		msg_err_map ("regexp map is empty");
@@ -2743,6 +3684,246 @@ rspamd_regexp_list_fin (struct map_cb_data *data)
 	}
 }
 
+void
+rspamd_regexp_map_defer_hyperscan (gboolean defer)
+{
+#ifdef WITH_HYPERSCAN
+	hs_deferred = defer;
+#endif
+}
+
+guint
+rspamd_regexp_map_load_hyperscan (struct rspamd_config *cfg)
+{
+	guint nloaded = 0;
+#ifdef WITH_HYPERSCAN
+	struct rspamd_regexp_map *re_map;
+	struct rspamd_map *map;
+	GList *cur;
+
+	for (cur = cfg->maps; cur != NULL; cur = g_list_next (cur)) {
+		map = cur->data;
+
+		if (map->read_callback != rspamd_regexp_list_read_single &&
+				map->read_callback != rspamd_regexp_list_read_multiple) {
+			continue;
+		}
+
+		re_map = *map->user_data;
+
+		if (re_map != NULL && re_map->hs_pending &&
+				rspamd_re_map_try_load_hs (re_map)) {
+			nloaded ++;
+		}
+	}
+#endif
+
+	return nloaded;
+}
+
+gboolean
+rspamd_regexp_map_is_valid_hyperscan_file (struct rspamd_config *cfg,
+		const gchar *path)
+{
+	struct rspamd_map *map;
+	const gchar *base, *dash;
+	GList *cur;
+
+	base = strrchr (path, G_DIR_SEPARATOR);
+	base = base ? base + 1 : path;
+	dash = strchr (base, '-');
+
+	if (dash == NULL) {
+		return FALSE;
+	}
+
+	for (cur = cfg->maps; cur != NULL; cur = g_list_next (cur)) {
+		map = cur->data;
+
+		if (map->read_callback != rspamd_regexp_list_read_single &&
+				map->read_callback != rspamd_regexp_list_read_multiple) {
+			continue;
+		}
+
+		if (strlen (map->tag) == (gsize)(dash - base) &&
+				memcmp (map->tag, base, dash - base) == 0) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static GQuark
+rspamd_regexp_map_quark (void)
+{
+	return g_quark_from_static_string ("regexp-map");
+}
+
+gboolean
+rspamd_regexp_map_compile_hyperscan (const gchar *path, GError **err)
+{
+#ifndef WITH_HYPERSCAN
+	g_set_error (err, rspamd_regexp_map_quark (), EINVAL,
+			"hyperscan is disabled");
+
+	return FALSE;
+#else
+	guchar *data, *p, *end;
+	const gchar **patterns = NULL;
+	guint *flags = NULL, *ids = NULL;
+	guint32 n, plen, i;
+	gsize len, pathlen;
+	hs_platform_info_t plt;
+	hs_compile_error_t *hs_errors;
+	hs_database_t *db = NULL;
+	gchar fp[PATH_MAX], np[PATH_MAX];
+	char *bytes = NULL;
+	gsize serialized_len;
+	gboolean ret = FALSE;
+	gint fd;
+
+	pathlen = strlen (path);
+
+	if (pathlen < sizeof (".hsmr") || pathlen >= sizeof (np) - 4 ||
+			memcmp (path + pathlen - 5, ".hsmr", 5) != 0) {
+		g_set_error (err, rspamd_regexp_map_quark (), EINVAL,
+				"%s is not a regexp map request", path);
+
+		return FALSE;
+	}
+
+	data = rspamd_file_xmap (path, PROT_READ, &len, TRUE);
+
+	if (data == NULL) {
+		g_set_error (err, rspamd_regexp_map_quark (), errno,
+				"cannot open %s: %s", path, strerror (errno));
+
+		return FALSE;
+	}
+
+	p = data;
+	end = data + len;
+
+	if (len < sizeof (rspamd_re_map_request_magic) + sizeof (n) ||
+			memcmp (p, rspamd_re_map_request_magic,
+					sizeof (rspamd_re_map_request_magic)) != 0) {
+		g_set_error (err, rspamd_regexp_map_quark (), EINVAL,
+				"bad magic in %s", path);
+		goto out;
+	}
+
+	p += sizeof (rspamd_re_map_request_magic);
+	memcpy (&n, p, sizeof (n));
+	p += sizeof (n);
+
+	if (n == 0 || (gsize)(end - p) / sizeof (guint32) < n) {
+		g_set_error (err, rspamd_regexp_map_quark (), EINVAL,
+				"bad number of expressions in %s: %u", path, n);
+		goto out;
+	}
+
+	patterns = g_new (const gchar *, n);
+	flags = g_new (guint, n);
+	ids = g_new (guint, n);
+	memcpy (flags, p, n * sizeof (guint32));
+	p += n * sizeof (guint32);
+
+	for (i = 0; i < n; i ++) {
+		if ((gsize)(end - p) < sizeof (plen)) {
+			break;
+		}
+
+		memcpy (&plen, p, sizeof (plen));
+		p += sizeof (plen);
+
+		if ((gsize)(end - p) <= plen || p[plen] != '\0') {
+			break;
+		}
+
+		patterns[i] = (const gchar *)p;
+		ids[i] = i;
+		p += plen + 1;
+	}
+
+	if (i != n) {
+		g_set_error (err, rspamd_regexp_map_quark (), EINVAL,
+				"truncated expression %u in %s", i, path);
+		goto out;
+	}
+
+	if (hs_populate_platform (&plt) != HS_SUCCESS) {
+		g_set_error (err, rspamd_regexp_map_quark (), EINVAL,
+				"cannot populate hyperscan platform");
+		goto out;
+	}
+
+	if (hs_compile_multi (patterns, flags, ids, n, HS_MODE_BLOCK, &plt,
+			&db, &hs_errors) != HS_SUCCESS) {
+		g_set_error (err, rspamd_regexp_map_quark (), EINVAL,
+				"cannot create tree of regexp when processing '%s': %s",
+				hs_errors->expression >= 0 ?
+						patterns[hs_errors->expression] : "unknown regexp",
+				hs_errors->message);
+		hs_free_compile_error (hs_errors);
+		goto out;
+	}
+
+	if (hs_serialize_database (db, &bytes, &serialized_len) != HS_SUCCESS) {
+		g_set_error (err, rspamd_regexp_map_quark (), EINVAL,
+				"cannot serialize tree of regexp for %s", path);
+		goto out;
+	}
+
+	/* <tag>-<hash>.hsmr -> <tag>-<hash>.hsmc */
+	rspamd_snprintf (np, sizeof (np), "%*s.hsmc", (gint)pathlen - 5, path);
+	rspamd_snprintf (fp, sizeof (fp), "%s.tmp", np);
+	fd = rspamd_file_xopen (fp, O_WRONLY | O_CREAT | O_TRUNC, 00644, 0);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_regexp_map_quark (), errno,
+				"cannot open %s: %s", fp, strerror (errno));
+		goto out;
+	}
+
+	if (write (fd, bytes, serialized_len) == -1) {
+		g_set_error (err, rspamd_regexp_map_quark (), errno,
+				"cannot write %s: %s", fp, strerror (errno));
+		close (fd);
+		unlink (fp);
+		goto out;
+	}
+
+	fsync (fd);
+	close (fd);
+
+	if (rename (fp, np) == -1) {
+		g_set_error (err, rspamd_regexp_map_quark (), errno,
+				"cannot rename %s to %s: %s", fp, np, strerror (errno));
+		unlink (fp);
+		goto out;
+	}
+
+	ret = TRUE;
+
+out:
+	if (bytes) {
+		free (bytes);
+	}
+
+	if (db) {
+		hs_free_database (db);
+	}
+
+	g_free (patterns);
+	g_free (flags);
+	g_free (ids);
+	munmap (data, len);
+
+	return ret;
+#endif
+}
+
 #ifdef WITH_HYPERSCAN
 static int
 rspamd_match_hs_single_handler (unsigned int id, unsigned long long from,
@@ -97,6 +97,8 @@ void rspamd_radix_fin (struct map_cb_data *data);
 /**
  * Host list is an ordinal list of hosts or domains
  */
+struct rspamd_hash_map_helper;
+
 gchar * rspamd_hosts_read (
 	gchar *chunk,
 	gint len,
@@ -165,4 +167,65 @@ gpointer rspamd_match_regexp_map_single (struct rspamd_regexp_map *map,
 gpointer rspamd_match_regexp_map_all (struct rspamd_regexp_map *map,
 		const gchar *in, gsize len);
 
+/**
+ * Leave compilation of hyperscan databases for regexp maps to hs_helper:
+ * maps that are not cached yet are matched by pcre until their databases
+ * are loaded by `rspamd_regexp_map_load_hyperscan`
+ * @param defer
+ */
+void rspamd_regexp_map_defer_hyperscan (gboolean defer);
+
+/**
+ * Load cached hyperscan databases for regexp maps waiting for hs_helper
+ * @param cfg
+ * @return number of loaded databases
+ */
+guint rspamd_regexp_map_load_hyperscan (struct rspamd_config *cfg);
+
+/**
+ * Check whether cached hyperscan database (`<tag>-<hash>.hsmc` file) belongs
+ * to some regexp map of the config
+ * @param cfg
+ * @param path database path
+ * @return TRUE if the map is still defined in the config
+ */
+gboolean rspamd_regexp_map_is_valid_hyperscan_file (struct rspamd_config *cfg,
+		const gchar *path);
+
+/**
+ * Compile regexp map request (`<tag>-<hash>.hsmr` file) written by a worker
+ * to the cached hyperscan database `<tag>-<hash>.hsmc` in the same directory
+ * @param path request path
+ * @param err error
+ * @return TRUE if database has been saved
+ */
+gboolean rspamd_regexp_map_compile_hyperscan (const gchar *path, GError **err);
+
+/**
+ * Find value for the specified key in hosts or kv list map (case insensitive)
+ * @param map
+ * @param in zero terminated key
+ * @return value or NULL if key has not been found
+ */
+gconstpointer rspamd_match_hash_map (struct rspamd_hash_map_helper *map,
+		const gchar *in);
+
+/**
+ * Serialize data read by radix, hosts or kv list callbacks to the compiled
+ * map format that could be loaded by file maps directly
+ * @param read_cb read callback that has produced `data`
+ * @param data map data
+ * @param out output buffer
+ * @param err error
+ * @return TRUE if data has been serialized
+ */
+gboolean rspamd_map_compile_data (map_cb_t read_cb, gpointer data,
+		GByteArray *out, GError **err);
+
+/**
+ * Destroy hosts or kv list map data
+ * @param map
+ */
+void rspamd_hash_map_destroy (struct rspamd_hash_map_helper *map);
+
 #endif
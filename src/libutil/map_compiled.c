@@ -0,0 +1,858 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "map_compiled.h"
+#include "str_util.h"
+#include "ref.h"
+#include "cryptobox.h"
+#include "unix-std.h"
+
+#define MAP_COMPILED_BYTE_ORDER 0x01020304U
+#define MAP_COMPILED_ALIGN 8
+#define MAP_COMPILED_MAX_SEEDS 32
+#define MAP_COMPILED_MAX_DISP (1U << 20)
+/* Second hash seed of perfect hash */
+#define MAP_COMPILED_SEED2 0x3b1a98c35a3b7d41ULL
+#define LPM4_CHILD 0x80000000U
+#define LPM4_CHUNK_SIZE 256
+#define LPM4_TBL16_SIZE (1U << 16)
+
+/*
+ * Sections follow the header aligned to 8 bytes, all offsets are from the
+ * start of the file
+ *
+ * hash:  groups: u32 displacement[ngroups], slots: slot[nslots]
+ * radix: index: u32 tbl16[65536] u32 tbl8[nchunks * 256],
+ *        values: u32 string offset[nvalues],
+ *        groups: group6[ngroups] (ordered by prefix length descending),
+ *        slots of each group6
+ */
+struct rspamd_map_compiled_hdr {
+	gchar magic[8];
+	guint32 version;
+	guint32 byte_order;
+	guint32 type;
+	guint32 ngroups;
+	guint32 nslots;
+	guint32 nchunks;
+	guint32 nvalues;
+	guint32 reserved;
+	guint64 nelts;
+	guint64 seed;
+	guint64 len;
+	guint64 groups_off;
+	guint64 slots_off;
+	guint64 index_off;
+	guint64 values_off;
+	guint64 strings_off;
+	guint64 strings_len;
+};
+
+struct rspamd_map_compiled_slot {
+	guint32 key_off;
+	guint32 key_len;
+	guint32 value_off;
+	guint32 hash;
+};
+
+struct rspamd_map_compiled_group6 {
+	guint32 bits;
+	guint32 nslots;
+	guint64 off;
+};
+
+struct rspamd_map_compiled_slot6 {
+	guint8 addr[16];
+	guint32 value;
+	guint32 reserved;
+};
+
+struct rspamd_map_compiled {
+	guchar *data;
+	gsize len;
+	const struct rspamd_map_compiled_hdr *hdr;
+	const gchar *strings;
+	ref_entry_t ref;
+};
+
+static GQuark
+rspamd_map_compiled_quark (void)
+{
+	return g_quark_from_static_string ("map-compiled");
+}
+
+static void
+rspamd_map_compiled_dtor (struct rspamd_map_compiled *cm)
+{
+	munmap (cm->data, cm->len);
+	g_slice_free1 (sizeof (*cm), cm);
+}
+
+static gboolean
+rspamd_map_compiled_check_section (const struct rspamd_map_compiled_hdr *hdr,
+		guint64 off, guint64 len)
+{
+	return off >= sizeof (*hdr) && off <= hdr->len && len <= hdr->len - off &&
+			off % MAP_COMPILED_ALIGN == 0;
+}
+
+gboolean
+rspamd_map_compiled_is_compiled (const guchar *data, gsize len)
+{
+	return len >= sizeof (struct rspamd_map_compiled_hdr) &&
+			memcmp (data, RSPAMD_MAP_COMPILED_MAGIC,
+					sizeof (RSPAMD_MAP_COMPILED_MAGIC)) == 0;
+}
+
+struct rspamd_map_compiled *
+rspamd_map_compiled_load (guchar *data, gsize len, GError **err)
+{
+	const struct rspamd_map_compiled_hdr *hdr;
+	const struct rspamd_map_compiled_group6 *groups;
+	struct rspamd_map_compiled *cm;
+	gboolean valid;
+	guint i;
+
+	if (!rspamd_map_compiled_is_compiled (data, len)) {
+		g_set_error (err, rspamd_map_compiled_quark (), EINVAL,
+				"bad magic");
+
+		return NULL;
+	}
+
+	hdr = (const struct rspamd_map_compiled_hdr *)data;
+
+	if ((uintptr_t)data % MAP_COMPILED_ALIGN != 0) {
+		g_set_error (err, rspamd_map_compiled_quark (), EINVAL,
+				"misaligned data");
+
+		return NULL;
+	}
+
+	if (hdr->version != RSPAMD_MAP_COMPILED_VERSION ||
+			hdr->byte_order != MAP_COMPILED_BYTE_ORDER) {
+		g_set_error (err, rspamd_map_compiled_quark (), EINVAL,
+				"unsupported version %u or byte order", hdr->version);
+
+		return NULL;
+	}
+
+	if (hdr->len != len || hdr->reserved != 0 ||
+			hdr->strings_len >= G_MAXUINT32 ||
+			!rspamd_map_compiled_check_section (hdr, hdr->strings_off,
+					hdr->strings_len) ||
+			(hdr->strings_len > 0 &&
+					data[hdr->strings_off + hdr->strings_len - 1] != '\0')) {
+		g_set_error (err, rspamd_map_compiled_quark (), EINVAL,
+				"truncated or corrupted file");
+
+		return NULL;
+	}
+
+	switch (hdr->type) {
+	case RSPAMD_MAP_COMPILED_HASH:
+		valid = hdr->ngroups > 0 && hdr->nslots > 0 &&
+				hdr->nelts <= hdr->nslots &&
+				rspamd_map_compiled_check_section (hdr, hdr->groups_off,
+						(guint64)hdr->ngroups * sizeof (guint32)) &&
+				rspamd_map_compiled_check_section (hdr, hdr->slots_off,
+						(guint64)hdr->nslots *
+						sizeof (struct rspamd_map_compiled_slot));
+		break;
+	case RSPAMD_MAP_COMPILED_RADIX:
+		valid = hdr->nchunks < LPM4_CHILD &&
+				rspamd_map_compiled_check_section (hdr, hdr->index_off,
+						(LPM4_TBL16_SIZE + (guint64)hdr->nchunks *
+						LPM4_CHUNK_SIZE) * sizeof (guint32)) &&
+				rspamd_map_compiled_check_section (hdr, hdr->values_off,
+						(guint64)hdr->nvalues * sizeof (guint32)) &&
+				rspamd_map_compiled_check_section (hdr, hdr->groups_off,
+						(guint64)hdr->ngroups *
+						sizeof (struct rspamd_map_compiled_group6));
+
+		if (valid) {
+			groups = (const struct rspamd_map_compiled_group6 *)
+					(data + hdr->groups_off);
+
+			/* Lookup relies on groups being ordered by prefix length */
+			for (i = 0; i < hdr->ngroups && valid; i ++) {
+				valid = groups[i].bits <= 128 && groups[i].nslots > 0 &&
+						(i == 0 || groups[i].bits < groups[i - 1].bits) &&
+						(groups[i].nslots & (groups[i].nslots - 1)) == 0 &&
+						rspamd_map_compiled_check_section (hdr, groups[i].off,
+								(guint64)groups[i].nslots *
+								sizeof (struct rspamd_map_compiled_slot6));
+			}
+		}
+		break;
+	default:
+		valid = FALSE;
+		break;
+	}
+
+	if (!valid) {
+		g_set_error (err, rspamd_map_compiled_quark (), EINVAL,
+				"invalid sections for map of type %u", hdr->type);
+
+		return NULL;
+	}
+
+	cm = g_slice_alloc (sizeof (*cm));
+	cm->data = data;
+	cm->len = len;
+	cm->hdr = hdr;
+	cm->strings = (const gchar *)data + hdr->strings_off;
+	REF_INIT_RETAIN (cm, rspamd_map_compiled_dtor);
+
+	return cm;
+}
+
+enum rspamd_map_compiled_type
+rspamd_map_compiled_type (struct rspamd_map_compiled *cm)
+{
+	return cm->hdr->type;
+}
+
+gsize
+rspamd_map_compiled_size (struct rspamd_map_compiled *cm)
+{
+	return cm->hdr->nelts;
+}
+
+struct rspamd_map_compiled *
+rspamd_map_compiled_ref (struct rspamd_map_compiled *cm)
+{
+	REF_RETAIN (cm);
+
+	return cm;
+}
+
+void
+rspamd_map_compiled_unref (struct rspamd_map_compiled *cm)
+{
+	REF_RELEASE (cm);
+}
+
+static inline guint32
+rspamd_map_compiled_slot_idx (guint64 h, guint64 h2, guint32 disp,
+		guint32 nslots)
+{
+	return ((guint32)h + (guint64)disp * ((guint32)h2 | 1)) % nslots;
+}
+
+const gchar *
+rspamd_map_compiled_hash_lookup (struct rspamd_map_compiled *cm,
+		const gchar *key, gsize keylen)
+{
+	const struct rspamd_map_compiled_hdr *hdr = cm->hdr;
+	const struct rspamd_map_compiled_slot *slot;
+	const guint32 *disp;
+	guint64 h, h2;
+	guint32 g;
+
+	if (hdr->type != RSPAMD_MAP_COMPILED_HASH) {
+		return NULL;
+	}
+
+	disp = (const guint32 *)(cm->data + hdr->groups_off);
+	h = rspamd_icase_hash (key, keylen, hdr->seed);
+	h2 = rspamd_icase_hash (key, keylen, hdr->seed ^ MAP_COMPILED_SEED2);
+	g = (h >> 32) % hdr->ngroups;
+	slot = (const struct rspamd_map_compiled_slot *)(cm->data + hdr->slots_off);
+	slot += rspamd_map_compiled_slot_idx (h, h2, disp[g], hdr->nslots);
+
+	if (slot->key_len != keylen || slot->hash != (guint32)h ||
+			(guint64)slot->key_off + keylen >= hdr->strings_len ||
+			slot->value_off >= hdr->strings_len) {
+		return NULL;
+	}
+
+	if (g_ascii_strncasecmp (cm->strings + slot->key_off, key, keylen) != 0) {
+		return NULL;
+	}
+
+	return cm->strings + slot->value_off;
+}
+
+static inline uintptr_t
+rspamd_map_compiled_radix_value (struct rspamd_map_compiled *cm, guint32 v)
+{
+	const guint32 *values;
+
+	if (v == 0 || v > cm->hdr->nvalues) {
+		return RADIX_NO_VALUE;
+	}
+
+	values = (const guint32 *)(cm->data + cm->hdr->values_off);
+
+	if (values[v - 1] >= cm->hdr->strings_len) {
+		return RADIX_NO_VALUE;
+	}
+
+	return (uintptr_t)(cm->strings + values[v - 1]);
+}
+
+static inline guint64
+rspamd_map_compiled_addr_hash (const guint8 *addr, guint64 seed)
+{
+	return rspamd_cryptobox_fast_hash (addr, 16, seed);
+}
+
+static void
+rspamd_map_compiled_mask_addr (guint8 *dst, const guint8 *src, gsize srclen,
+		guint bits)
+{
+	guint nbytes = bits / NBBY;
+
+	memset (dst, 0, 16);
+	memcpy (dst, src, MIN (nbytes, srclen));
+
+	if (bits % NBBY && nbytes < srclen) {
+		dst[nbytes] = src[nbytes] & (0xff << (NBBY - bits % NBBY));
+	}
+}
+
+uintptr_t
+rspamd_map_compiled_radix_lookup (struct rspamd_map_compiled *cm,
+		const guint8 *key, gsize keylen)
+{
+	const struct rspamd_map_compiled_hdr *hdr = cm->hdr;
+	const struct rspamd_map_compiled_group6 *groups;
+	const struct rspamd_map_compiled_slot6 *slots;
+	const guint32 *tbl16, *tbl8;
+	guint8 masked[16];
+	guint32 addr, e, c;
+	guint64 h, mask, probe;
+	guint i;
+
+	if (hdr->type != RSPAMD_MAP_COMPILED_RADIX) {
+		return RADIX_NO_VALUE;
+	}
+
+	if (keylen == sizeof (guint32)) {
+		tbl16 = (const guint32 *)(cm->data + hdr->index_off);
+		tbl8 = tbl16 + LPM4_TBL16_SIZE;
+		addr = ((guint32)key[0] << 24) | ((guint32)key[1] << 16) |
+				((guint32)key[2] << 8) | (guint32)key[3];
+		e = tbl16[addr >> 16];
+
+		if (e & LPM4_CHILD) {
+			c = e & ~LPM4_CHILD;
+
+			if (c >= hdr->nchunks) {
+				return RADIX_NO_VALUE;
+			}
+
+			e = tbl8[c * LPM4_CHUNK_SIZE + ((addr >> 8) & 0xff)];
+
+			if (e & LPM4_CHILD) {
+				c = e & ~LPM4_CHILD;
+
+				if (c >= hdr->nchunks) {
+					return RADIX_NO_VALUE;
+				}
+
+				e = tbl8[c * LPM4_CHUNK_SIZE + (addr & 0xff)];
+			}
+		}
+
+		return rspamd_map_compiled_radix_value (cm, e);
+	}
+
+	if (keylen > sizeof (masked)) {
+		return RADIX_NO_VALUE;
+	}
+
+	groups = (const struct rspamd_map_compiled_group6 *)
+			(cm->data + hdr->groups_off);
+
+	for (i = 0; i < hdr->ngroups; i ++) {
+		if (groups[i].bits > keylen * NBBY) {
+			continue;
+		}
+
+		rspamd_map_compiled_mask_addr (masked, key, keylen, groups[i].bits);
+		slots = (const struct rspamd_map_compiled_slot6 *)
+				(cm->data + groups[i].off);
+		mask = groups[i].nslots - 1;
+		h = rspamd_map_compiled_addr_hash (masked, hdr->seed) & mask;
+
+		/* Table might have no empty slots if the file is damaged */
+		for (probe = 0; probe <= mask && slots[h].value != 0; probe ++) {
+			if (memcmp (slots[h].addr, masked, sizeof (masked)) == 0) {
+				return rspamd_map_compiled_radix_value (cm, slots[h].value);
+			}
+
+			h = (h + 1) & mask;
+		}
+	}
+
+	return RADIX_NO_VALUE;
+}
+
+/*
+ * Writers
+ */
+static void
+rspamd_map_compiled_align (GByteArray *out)
+{
+	static const guint8 zeroes[MAP_COMPILED_ALIGN] = {0};
+	guint pad = out->len % MAP_COMPILED_ALIGN;
+
+	if (pad) {
+		g_byte_array_append (out, zeroes, MAP_COMPILED_ALIGN - pad);
+	}
+}
+
+static void
+rspamd_map_compiled_init_hdr (struct rspamd_map_compiled_hdr *hdr,
+		enum rspamd_map_compiled_type type, GByteArray *out)
+{
+	memset (hdr, 0, sizeof (*hdr));
+	memcpy (hdr->magic, RSPAMD_MAP_COMPILED_MAGIC,
+			sizeof (RSPAMD_MAP_COMPILED_MAGIC));
+	hdr->version = RSPAMD_MAP_COMPILED_VERSION;
+	hdr->byte_order = MAP_COMPILED_BYTE_ORDER;
+	hdr->type = type;
+	g_byte_array_set_size (out, 0);
+	g_byte_array_append (out, (const guint8 *)hdr, sizeof (*hdr));
+}
+
+static void
+rspamd_map_compiled_finish (struct rspamd_map_compiled_hdr *hdr,
+		GByteArray *out, GByteArray *strings)
+{
+	rspamd_map_compiled_align (out);
+	hdr->strings_off = out->len;
+	hdr->strings_len = strings->len;
+	g_byte_array_append (out, strings->data, strings->len);
+	rspamd_map_compiled_align (out);
+	hdr->len = out->len;
+	memcpy (out->data, hdr, sizeof (*hdr));
+}
+
+static guint32
+rspamd_map_compiled_add_string (GByteArray *strings, const gchar *str,
+		gsize len)
+{
+	guint32 off = strings->len;
+	static const guint8 zero = 0;
+
+	g_byte_array_append (strings, (const guint8 *)str, len);
+	g_byte_array_append (strings, &zero, 1);
+
+	return off;
+}
+
+struct rspamd_map_compiled_hkey {
+	const gchar *key;
+	gsize keylen;
+	const gchar *value;
+	guint64 h;
+	guint64 h2;
+	guint32 group;
+	guint32 slot;
+};
+
+struct rspamd_map_compiled_hgroup {
+	guint32 id;
+	guint32 start;
+	guint32 count;
+};
+
+static gint
+rspamd_map_compiled_hgroup_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_map_compiled_hgroup *g1 = a, *g2 = b;
+
+	if (g1->count != g2->count) {
+		return g1->count > g2->count ? -1 : 1;
+	}
+
+	return (gint)g1->id - (gint)g2->id;
+}
+
+static gint
+rspamd_map_compiled_hkey_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_map_compiled_hkey *k1 = a, *k2 = b;
+
+	if (k1->group != k2->group) {
+		return k1->group < k2->group ? -1 : 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Find displacements for all groups, larger groups are placed first
+ */
+static gboolean
+rspamd_map_compiled_place (struct rspamd_map_compiled_hkey *keys, guint n,
+		guint32 *disp, guint ngroups, guint nslots)
+{
+	struct rspamd_map_compiled_hgroup *groups;
+	guint8 *taken;
+	guint32 d, i, j, k, s;
+	gboolean ok = TRUE, fits;
+
+	groups = g_malloc0 (ngroups * sizeof (*groups));
+	taken = g_malloc0 (nslots);
+
+	for (i = 0; i < ngroups; i ++) {
+		groups[i].id = i;
+	}
+
+	for (i = 0; i < n; i ++) {
+		if (groups[keys[i].group].count == 0) {
+			groups[keys[i].group].start = i;
+		}
+
+		groups[keys[i].group].count ++;
+	}
+
+	qsort (groups, ngroups, sizeof (*groups), rspamd_map_compiled_hgroup_cmp);
+
+	for (i = 0; i < ngroups && ok; i ++) {
+		if (groups[i].count == 0) {
+			break;
+		}
+
+		fits = FALSE;
+
+		for (d = 0; d < MAP_COMPILED_MAX_DISP && !fits; d ++) {
+			fits = TRUE;
+
+			for (j = 0; j < groups[i].count && fits; j ++) {
+				struct rspamd_map_compiled_hkey *hk = &keys[groups[i].start + j];
+
+				s = rspamd_map_compiled_slot_idx (hk->h, hk->h2, d, nslots);
+
+				if (taken[s]) {
+					fits = FALSE;
+				}
+				else {
+					for (k = 0; k < j; k ++) {
+						if (keys[groups[i].start + k].slot == s) {
+							fits = FALSE;
+							break;
+						}
+					}
+				}
+
+				hk->slot = s;
+			}
+
+			if (fits) {
+				disp[groups[i].id] = d;
+
+				for (j = 0; j < groups[i].count; j ++) {
+					taken[keys[groups[i].start + j].slot] = 1;
+				}
+			}
+		}
+
+		ok = fits;
+	}
+
+	g_free (groups);
+	g_free (taken);
+
+	return ok;
+}
+
+gboolean
+rspamd_map_compiled_write_hash (GHashTable *htb, GByteArray *out,
+		GError **err)
+{
+	struct rspamd_map_compiled_hdr hdr;
+	struct rspamd_map_compiled_hkey *keys;
+	struct rspamd_map_compiled_slot *slots;
+	GByteArray *strings;
+	GHashTableIter it;
+	gpointer k, v;
+	guint32 *disp, i, n, ngroups, nslots, attempt;
+	gboolean placed = FALSE;
+
+	n = g_hash_table_size (htb);
+	ngroups = n / 4 + 1;
+	nslots = n + n / 4 + 1;
+	keys = g_malloc0 ((n + 1) * sizeof (*keys));
+	disp = g_malloc0 (ngroups * sizeof (*disp));
+
+	i = 0;
+	g_hash_table_iter_init (&it, htb);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		keys[i].key = k;
+		keys[i].keylen = strlen (k);
+		keys[i].value = v ? v : "";
+		i ++;
+	}
+
+	rspamd_map_compiled_init_hdr (&hdr, RSPAMD_MAP_COMPILED_HASH, out);
+
+	for (attempt = 0; attempt < MAP_COMPILED_MAX_SEEDS && !placed; attempt ++) {
+		hdr.seed = rspamd_cryptobox_fast_hash (&attempt, sizeof (attempt),
+				MAP_COMPILED_SEED2);
+
+		for (i = 0; i < n; i ++) {
+			keys[i].h = rspamd_icase_hash (keys[i].key, keys[i].keylen,
+					hdr.seed);
+			keys[i].h2 = rspamd_icase_hash (keys[i].key, keys[i].keylen,
+					hdr.seed ^ MAP_COMPILED_SEED2);
+			keys[i].group = (keys[i].h >> 32) % ngroups;
+		}
+
+		qsort (keys, n, sizeof (*keys), rspamd_map_compiled_hkey_cmp);
+		memset (disp, 0, ngroups * sizeof (*disp));
+		placed = rspamd_map_compiled_place (keys, n, disp, ngroups, nslots);
+	}
+
+	if (!placed) {
+		g_set_error (err, rspamd_map_compiled_quark (), EINVAL,
+				"cannot build perfect hash for %u keys", n);
+		g_free (keys);
+		g_free (disp);
+
+		return FALSE;
+	}
+
+	strings = g_byte_array_new ();
+	slots = g_malloc0 (nslots * sizeof (*slots));
+
+	for (i = 0; i < n; i ++) {
+		slots[keys[i].slot].key_off = rspamd_map_compiled_add_string (strings,
+				keys[i].key, keys[i].keylen);
+		slots[keys[i].slot].key_len = keys[i].keylen;
+		slots[keys[i].slot].value_off = rspamd_map_compiled_add_string (strings,
+				keys[i].value, strlen (keys[i].value));
+		slots[keys[i].slot].hash = (guint32)keys[i].h;
+	}
+
+	if (strings->len >= G_MAXUINT32) {
+		g_set_error (err, rspamd_map_compiled_quark (), E2BIG,
+				"too large strings section: %u bytes", strings->len);
+		g_free (keys);
+		g_free (disp);
+		g_free (slots);
+		g_byte_array_free (strings, TRUE);
+
+		return FALSE;
+	}
+
+	hdr.nelts = n;
+	hdr.ngroups = ngroups;
+	hdr.nslots = nslots;
+	rspamd_map_compiled_align (out);
+	hdr.groups_off = out->len;
+	g_byte_array_append (out, (const guint8 *)disp, ngroups * sizeof (*disp));
+	rspamd_map_compiled_align (out);
+	hdr.slots_off = out->len;
+	g_byte_array_append (out, (const guint8 *)slots, nslots * sizeof (*slots));
+	rspamd_map_compiled_finish (&hdr, out, strings);
+
+	g_free (keys);
+	g_free (disp);
+	g_free (slots);
+	g_byte_array_free (strings, TRUE);
+
+	return TRUE;
+}
+
+struct rspamd_map_compiled_prefix6 {
+	guint8 addr[16];
+	guint32 bits;
+	guint32 value;
+};
+
+struct rspamd_map_compiled_radix_cbdata {
+	GArray *prefixes;
+	GHashTable *values;
+	GArray *values_offs;
+	GByteArray *strings;
+};
+
+static guint32
+rspamd_map_compiled_radix_value_idx (
+		struct rspamd_map_compiled_radix_cbdata *cbd, uintptr_t value)
+{
+	guint32 idx, off;
+	const gchar *str = (const gchar *)value;
+
+	idx = GPOINTER_TO_UINT (g_hash_table_lookup (cbd->values,
+			(gconstpointer)value));
+
+	if (idx == 0) {
+		off = rspamd_map_compiled_add_string (cbd->strings, str, strlen (str));
+		g_array_append_val (cbd->values_offs, off);
+		idx = cbd->values_offs->len;
+		g_hash_table_insert (cbd->values, (gpointer)value,
+				GUINT_TO_POINTER (idx));
+	}
+
+	return idx;
+}
+
+static void
+rspamd_map_compiled_radix_walk_cb (const guint8 *prefix, guint bits,
+		uintptr_t value, gpointer ud)
+{
+	struct rspamd_map_compiled_radix_cbdata *cbd = ud;
+	struct rspamd_map_compiled_prefix6 p;
+
+	rspamd_map_compiled_mask_addr (p.addr, prefix, sizeof (p.addr), bits);
+	p.bits = bits;
+	p.value = rspamd_map_compiled_radix_value_idx (cbd, value);
+	g_array_append_val (cbd->prefixes, p);
+}
+
+static gint
+rspamd_map_compiled_prefix6_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_map_compiled_prefix6 *p1 = a, *p2 = b;
+
+	if (p1->bits != p2->bits) {
+		return p1->bits > p2->bits ? -1 : 1;
+	}
+
+	return memcmp (p1->addr, p2->addr, sizeof (p1->addr));
+}
+
+static guint32
+rspamd_map_compiled_remap_lpm (struct rspamd_map_compiled_radix_cbdata *cbd,
+		guint32 e, const uintptr_t *values)
+{
+	if (e == 0 || (e & LPM4_CHILD)) {
+		return e;
+	}
+
+	return rspamd_map_compiled_radix_value_idx (cbd, values[e - 1]);
+}
+
+gboolean
+rspamd_map_compiled_write_radix (radix_compressed_t *tree, GByteArray *out,
+		GError **err)
+{
+	struct rspamd_map_compiled_hdr hdr;
+	struct rspamd_map_compiled_radix_cbdata cbd;
+	struct rspamd_map_compiled_prefix6 *p;
+	struct rspamd_map_compiled_group6 *groups;
+	struct rspamd_map_compiled_slot6 *slots;
+	const guint32 *tbl16, *tbl8;
+	const uintptr_t *lpm_values;
+	gsize nchunks, nlpm_values, i, j, start, nslots;
+	guint32 e, ngroups;
+	guint64 h, groups_off;
+
+	if (!radix_get_compiled_tables (tree, &tbl16, &tbl8, &nchunks,
+			&lpm_values, &nlpm_values)) {
+		g_set_error (err, rspamd_map_compiled_quark (), EINVAL,
+				"cannot compile radix trie");
+
+		return FALSE;
+	}
+
+	cbd.prefixes = g_array_new (FALSE, FALSE, sizeof (*p));
+	cbd.values = g_hash_table_new (g_direct_hash, g_direct_equal);
+	cbd.values_offs = g_array_new (FALSE, FALSE, sizeof (guint32));
+	cbd.strings = g_byte_array_new ();
+
+	rspamd_map_compiled_init_hdr (&hdr, RSPAMD_MAP_COMPILED_RADIX, out);
+	hdr.seed = MAP_COMPILED_SEED2;
+	hdr.nelts = radix_get_size (tree);
+	hdr.nchunks = nchunks;
+
+	/* IPv4 table */
+	rspamd_map_compiled_align (out);
+	hdr.index_off = out->len;
+
+	for (i = 0; i < LPM4_TBL16_SIZE; i ++) {
+		e = rspamd_map_compiled_remap_lpm (&cbd, tbl16[i], lpm_values);
+		g_byte_array_append (out, (const guint8 *)&e, sizeof (e));
+	}
+
+	for (i = 0; i < nchunks * LPM4_CHUNK_SIZE; i ++) {
+		e = rspamd_map_compiled_remap_lpm (&cbd, tbl8[i], lpm_values);
+		g_byte_array_append (out, (const guint8 *)&e, sizeof (e));
+	}
+
+	/* Other keys: hash table per prefix length */
+	radix_walk_compressed (tree, rspamd_map_compiled_radix_walk_cb, &cbd);
+	g_array_sort (cbd.prefixes, rspamd_map_compiled_prefix6_cmp);
+	p = (struct rspamd_map_compiled_prefix6 *)cbd.prefixes->data;
+
+	ngroups = 0;
+
+	for (i = 0; i < cbd.prefixes->len; i ++) {
+		if (i == 0 || p[i].bits != p[i - 1].bits) {
+			ngroups ++;
+		}
+	}
+
+	rspamd_map_compiled_align (out);
+	groups_off = out->len;
+	g_byte_array_set_size (out, out->len + ngroups * sizeof (*groups));
+	hdr.groups_off = groups_off;
+	hdr.ngroups = ngroups;
+	ngroups = 0;
+
+	for (start = 0; start < cbd.prefixes->len; start = i) {
+		for (i = start; i < cbd.prefixes->len && p[i].bits == p[start].bits;
+				i ++);
+
+		for (nslots = 1; nslots < (i - start) * 2; nslots <<= 1);
+
+		rspamd_map_compiled_align (out);
+		groups = (struct rspamd_map_compiled_group6 *)(out->data + groups_off);
+		groups[ngroups].bits = p[start].bits;
+		groups[ngroups].nslots = nslots;
+		groups[ngroups].off = out->len;
+		ngroups ++;
+
+		slots = g_malloc0 (nslots * sizeof (*slots));
+
+		for (j = start; j < i; j ++) {
+			h = rspamd_map_compiled_addr_hash (p[j].addr, hdr.seed) &
+					(nslots - 1);
+
+			while (slots[h].value != 0) {
+				h = (h + 1) & (nslots - 1);
+			}
+
+			memcpy (slots[h].addr, p[j].addr, sizeof (slots[h].addr));
+			slots[h].value = p[j].value;
+		}
+
+		g_byte_array_append (out, (const guint8 *)slots,
+				nslots * sizeof (*slots));
+		g_free (slots);
+	}
+
+	rspamd_map_compiled_align (out);
+	hdr.nvalues = cbd.values_offs->len;
+	hdr.values_off = out->len;
+	g_byte_array_append (out, (const guint8 *)cbd.values_offs->data,
+			cbd.values_offs->len * sizeof (guint32));
+	rspamd_map_compiled_finish (&hdr, out, cbd.strings);
+
+	g_array_free (cbd.prefixes, TRUE);
+	g_hash_table_unref (cbd.values);
+	g_array_free (cbd.values_offs, TRUE);
+	g_byte_array_free (cbd.strings, TRUE);
+
+	return TRUE;
+}
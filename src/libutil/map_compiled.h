@@ -0,0 +1,125 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBUTIL_MAP_COMPILED_H_
+#define SRC_LIBUTIL_MAP_COMPILED_H_
+
+#include "config.h"
+#include "radix.h"
+
+/*
+ * Immutable binary maps produced by `rspamadm compile_map`. Such files are
+ * mapped to memory and used as is, so all workers share the same pages and
+ * reload is just a remap.
+ *
+ * Hash maps (hosts and kv lists) are stored as a perfect hash: a key is
+ * hashed to a group and group's displacement selects a unique slot.
+ * Radix maps are stored as a flat table for IPv4 (16-8-8 strides) and as
+ * per prefix length hash tables for longer keys. All strings are zero
+ * terminated, so values could be returned directly from the mapping.
+ */
+
+#define RSPAMD_MAP_COMPILED_MAGIC "rspmapc"
+#define RSPAMD_MAP_COMPILED_VERSION 1
+
+enum rspamd_map_compiled_type {
+	RSPAMD_MAP_COMPILED_HASH = 1,
+	RSPAMD_MAP_COMPILED_RADIX,
+};
+
+struct rspamd_map_compiled;
+
+/**
+ * Check whether data starts with compiled map header
+ * @param data
+ * @param len
+ * @return
+ */
+gboolean rspamd_map_compiled_is_compiled (const guchar *data, gsize len);
+
+/**
+ * Load compiled map from the mapped data, on success data is owned by the
+ * returned structure and is unmapped when it is released
+ * @param data mapped data
+ * @param len length of data
+ * @param err error
+ * @return new compiled map or NULL
+ */
+struct rspamd_map_compiled *rspamd_map_compiled_load (guchar *data,
+		gsize len, GError **err);
+
+/**
+ * Returns type of the compiled map
+ */
+enum rspamd_map_compiled_type rspamd_map_compiled_type (
+		struct rspamd_map_compiled *cm);
+
+/**
+ * Returns number of elements in the compiled map
+ */
+gsize rspamd_map_compiled_size (struct rspamd_map_compiled *cm);
+
+/**
+ * Find key in a compiled hash map (case insensitive)
+ * @param cm
+ * @param key
+ * @param keylen
+ * @return value or NULL if key has not been found
+ */
+const gchar *rspamd_map_compiled_hash_lookup (struct rspamd_map_compiled *cm,
+		const gchar *key, gsize keylen);
+
+/**
+ * Find key in a compiled radix map
+ * @param cm
+ * @param key
+ * @param keylen
+ * @return value or `RADIX_NO_VALUE`
+ */
+uintptr_t rspamd_map_compiled_radix_lookup (struct rspamd_map_compiled *cm,
+		const guint8 *key, gsize keylen);
+
+/**
+ * Increase refcount
+ */
+struct rspamd_map_compiled *rspamd_map_compiled_ref (
+		struct rspamd_map_compiled *cm);
+
+/**
+ * Decrease refcount and unmap data if needed
+ */
+void rspamd_map_compiled_unref (struct rspamd_map_compiled *cm);
+
+/**
+ * Serialize hash table of strings to the compiled format
+ * @param htb source table
+ * @param out output buffer
+ * @param err error
+ * @return TRUE if table has been serialized
+ */
+gboolean rspamd_map_compiled_write_hash (GHashTable *htb, GByteArray *out,
+		GError **err);
+
+/**
+ * Serialize radix trie with string values to the compiled format
+ * @param tree source trie
+ * @param out output buffer
+ * @param err error
+ * @return TRUE if trie has been serialized
+ */
+gboolean rspamd_map_compiled_write_radix (radix_compressed_t *tree,
+		GByteArray *out, GError **err);
+
+#endif
@@ -48,6 +48,11 @@ enum fetch_proto {
 	MAP_PROTO_STATIC
 };
 
+enum rspamd_map_compile_mode {
+	RSPAMD_MAP_COMPILE_NEVER = 0,
+	RSPAMD_MAP_COMPILE_ALWAYS
+};
+
 struct rspamd_map_backend {
 	enum fetch_proto protocol;
 	gboolean is_signed;
@@ -60,6 +65,8 @@ struct rspamd_map_backend {
 		struct static_map_data *sd;
 	} data;
 	gchar *uri;
+	/* Hashes of the last loaded lines, used by incremental maps */
+	GArray *lines;
 	ref_entry_t ref;
 };
 
@@ -90,6 +97,10 @@ struct rspamd_map {
 	/* Shared cache data */
 	struct rspamd_map_cachepoint *cache;
 	gchar tag[MEMPOOL_UID_LEN];
+	/* Whether to build flat lookup tables for radix maps, off by default */
+	enum rspamd_map_compile_mode compile_mode;
+	/* Whether to apply changed lines only instead of rereading all data */
+	gboolean incremental;
 	rspamd_map_dtor dtor;
 	gpointer dtor_data;
 };
@@ -152,6 +163,8 @@ struct http_callback_data {
 	struct map_periodic_cbdata *periodic;
 	struct rspamd_cryptobox_pubkey *pk;
 	gboolean check;
+	gboolean keepalive;
+	gboolean reused;
 	struct rspamd_storage_shmem *shmem_data;
 	struct rspamd_storage_shmem *shmem_sig;
 	struct rspamd_storage_shmem *shmem_pubkey;
@@ -166,4 +179,12 @@ struct http_callback_data {
 	ref_entry_t ref;
 };
 
+/**
+ * Parses data read from a map's backend, applies changed lines only if the
+ * map is incremental
+ */
+void rspamd_map_process_data (struct rspamd_map *map,
+		struct rspamd_map_backend *bk, struct map_periodic_cbdata *periodic,
+		gchar *in, gsize len);
+
 #endif /* SRC_LIBUTIL_MAP_PRIVATE_H_ */
@@ -19,6 +19,7 @@
 #include "logger.h"
 #include "ottery.h"
 #include "unix-std.h"
+#include "mempool_vars_internal.h"
 
 #ifdef HAVE_SCHED_YIELD
 #include <sched.h>
@@ -41,11 +42,52 @@
  */
 #undef MEMORY_GREEDY
 
+/* Maximum number of distinct tags we collect sizes statistics for */
+#define MEMPOOL_MAX_ENTRIES 64
+/* Pages larger than this are not suggested for new pools and not reused */
+#define MEMPOOL_MAX_REUSED_CHAIN (1024 * 1024)
+/* Maximum total size of pages kept for reuse in a process */
+#define MEMPOOL_MAX_FREE_BYTES (16 * 1024 * 1024)
+
+/*
+ * Typical amount of memory used by pools with a specific tag, so pools for
+ * e.g. tasks get a single page large enough for the whole task
+ */
+struct rspamd_mempool_entry_point {
+	gchar tag[MEMPOOL_TAG_LEN];
+	gsize avg_used;
+};
+
+/*
+ * Traced allocations per source location or context and pool tag (or heap
+ * name for contexts)
+ */
+struct rspamd_mempool_trace_elt {
+	gchar *name;
+	gchar tag[MEMPOOL_TAG_LEN];
+	gsize bytes;
+	gsize allocations;
+};
+
 /* Internal statistic */
 static rspamd_mempool_stat_t *mem_pool_stat = NULL;
 /* Environment variable */
 static gboolean env_checked = FALSE;
 static gboolean always_malloc = FALSE;
+/* Per process sizes statistics and pages freed by the previous pools */
+static struct rspamd_mempool_entry_point mem_pool_entries[MEMPOOL_MAX_ENTRIES];
+static guint mem_pool_nentries = 0;
+/* Tag -> entry index, so pools with unknown tags do not scan all entries */
+static GHashTable *mem_pool_entries_hash = NULL;
+static struct _pool_chain *free_chains = NULL;
+static gsize free_chains_bytes = 0;
+G_LOCK_DEFINE_STATIC (mem_pool_cache);
+/* Allocations tracing */
+static gboolean trace_enabled = FALSE;
+static const gchar *trace_ctx = NULL;
+static GHashTable *trace_locations = NULL;
+static GHashTable *trace_contexts = NULL;
+G_LOCK_DEFINE_STATIC (mem_pool_trace);
 
 /**
  * Function that return free space in pool page
@@ -60,6 +102,121 @@ pool_chain_free (struct _pool_chain *chain)
 			chain->len - occupied : 0);
 }
 
+/*
+ * Find a free page that fits the requested size without wasting too much
+ */
+static struct _pool_chain *
+rspamd_mempool_chain_reuse (gsize size)
+{
+	struct _pool_chain *cur, *prev = NULL;
+
+	if (size > MEMPOOL_MAX_REUSED_CHAIN) {
+		return NULL;
+	}
+
+	G_LOCK (mem_pool_cache);
+
+	for (cur = free_chains; cur != NULL; prev = cur, cur = cur->next) {
+		if (cur->len >= size && cur->len <= size * 2) {
+			if (prev) {
+				prev->next = cur->next;
+			}
+			else {
+				free_chains = cur->next;
+			}
+
+			free_chains_bytes -= cur->len;
+			break;
+		}
+	}
+
+	G_UNLOCK (mem_pool_cache);
+
+	return cur;
+}
+
+/*
+ * Keep a non-shared page for reuse by the next pools or free it
+ */
+static void
+rspamd_mempool_chain_release (struct _pool_chain *chain)
+{
+	if (!always_malloc && chain->len <= MEMPOOL_MAX_REUSED_CHAIN) {
+		G_LOCK (mem_pool_cache);
+
+		if (free_chains_bytes + chain->len <= MEMPOOL_MAX_FREE_BYTES) {
+			chain->next = free_chains;
+			free_chains = chain;
+			free_chains_bytes += chain->len;
+			G_UNLOCK (mem_pool_cache);
+
+			return;
+		}
+
+		G_UNLOCK (mem_pool_cache);
+	}
+
+	g_slice_free1 (chain->len + sizeof (struct _pool_chain), chain);
+}
+
+static struct rspamd_mempool_entry_point *
+rspamd_mempool_get_entry (const gchar *tag)
+{
+	struct rspamd_mempool_entry_point *entry;
+
+	G_LOCK (mem_pool_cache);
+
+	if (mem_pool_entries_hash == NULL) {
+		mem_pool_entries_hash = g_hash_table_new (rspamd_str_hash,
+				rspamd_str_equal);
+	}
+
+	entry = g_hash_table_lookup (mem_pool_entries_hash, tag);
+
+	if (entry == NULL && mem_pool_nentries < G_N_ELEMENTS (mem_pool_entries)) {
+		entry = &mem_pool_entries[mem_pool_nentries ++];
+		rspamd_strlcpy (entry->tag, tag, sizeof (entry->tag));
+		entry->avg_used = 0;
+		g_hash_table_insert (mem_pool_entries_hash, entry->tag, entry);
+	}
+
+	G_UNLOCK (mem_pool_cache);
+
+	return entry;
+}
+
+/*
+ * Page size for a new pool: the typical usage with some reserve rounded up
+ * to the system page size
+ */
+static gsize
+rspamd_mempool_entry_suggest (struct rspamd_mempool_entry_point *entry)
+{
+	gsize sz, page_size = rspamd_mempool_suggest_size ();
+
+	sz = entry->avg_used + entry->avg_used / 4;
+	sz = (sz + page_size - 1) / page_size * page_size;
+
+	return MIN (sz, MEMPOOL_MAX_REUSED_CHAIN - MEM_ALIGNMENT);
+}
+
+static void
+rspamd_mempool_entry_update (struct rspamd_mempool_entry_point *entry,
+		gsize used)
+{
+	G_LOCK (mem_pool_cache);
+
+	if (entry->avg_used == 0) {
+		entry->avg_used = used;
+	}
+	else {
+		/* Exponential moving average with alpha = 1/4 */
+		entry->avg_used = (entry->avg_used * 3 + used) / 4;
+	}
+
+	G_UNLOCK (mem_pool_cache);
+}
+
 static struct _pool_chain *
 rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 {
@@ -110,9 +267,19 @@ rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 		g_atomic_int_add (&mem_pool_stat->bytes_allocated, size);
 	}
 	else {
-		map = g_slice_alloc (sizeof (struct _pool_chain) + size);
-		chain = map;
-		chain->begin = ((guint8 *) chain) + sizeof (struct _pool_chain);
+		chain = rspamd_mempool_chain_reuse (size);
+
+		if (chain) {
+			/* Reused page might be larger than requested */
+			size = chain->len;
+			g_atomic_int_inc (&mem_pool_stat->chunks_recycled);
+		}
+		else {
+			map = g_slice_alloc (sizeof (struct _pool_chain) + size);
+			chain = map;
+			chain->begin = ((guint8 *) chain) + sizeof (struct _pool_chain);
+		}
+
 		g_atomic_int_add (&mem_pool_stat->bytes_allocated, size);
 		g_atomic_int_inc (&mem_pool_stat->chunks_allocated);
 	}
@@ -120,6 +287,7 @@ rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 	chain->pos = align_ptr (chain->begin, MEM_ALIGNMENT);
 	chain->len = size;
 	chain->lock = NULL;
+	chain->next = NULL;
 
 	return chain;
 }
@@ -186,6 +354,92 @@ rspamd_mempool_append_chain (rspamd_mempool_t * pool,
 	g_ptr_array_add (pool->pools[pool_type], chain);
 }
 
+static guint
+rspamd_mempool_trace_hash (gconstpointer p)
+{
+	const struct rspamd_mempool_trace_elt *elt = p;
+
+	return rspamd_str_hash (elt->name) ^ rspamd_str_hash (elt->tag);
+}
+
+static gboolean
+rspamd_mempool_trace_equal (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_mempool_trace_elt *e1 = a, *e2 = b;
+
+	return strcmp (e1->name, e2->name) == 0 && strcmp (e1->tag, e2->tag) == 0;
+}
+
+static void
+rspamd_mempool_trace_add (GHashTable **ptbl, const gchar *name,
+		const gchar *tag, gsize bytes)
+{
+	struct rspamd_mempool_trace_elt srch, *elt;
+
+	srch.name = (gchar *)name;
+	rspamd_strlcpy (srch.tag, tag, sizeof (srch.tag));
+
+	G_LOCK (mem_pool_trace);
+
+	if (*ptbl == NULL) {
+		*ptbl = g_hash_table_new (rspamd_mempool_trace_hash,
+				rspamd_mempool_trace_equal);
+	}
+
+	elt = g_hash_table_lookup (*ptbl, &srch);
+
+	if (elt == NULL) {
+		/* Elements are never freed, so callers may keep them */
+		elt = g_malloc0 (sizeof (*elt));
+		elt->name = g_strdup (name);
+		memcpy (elt->tag, srch.tag, sizeof (elt->tag));
+		g_hash_table_insert (*ptbl, elt, elt);
+	}
+
+	elt->bytes += bytes;
+	elt->allocations ++;
+
+	G_UNLOCK (mem_pool_trace);
+}
+
+static void
+rspamd_mempool_check_env (void)
+{
+	if (!env_checked) {
+		/* Check G_SLICE=always-malloc to allow memory pool debug */
+		const char *g_slice;
+
+		g_slice = getenv ("VALGRIND");
+		if (g_slice != NULL) {
+			always_malloc = TRUE;
+		}
+
+		if (getenv ("RSPAMD_MEMPOOL_TRACE") != NULL) {
+			trace_enabled = TRUE;
+		}
+
+		env_checked = TRUE;
+	}
+}
+
+/*
+ * Generate new uid for a pool
+ */
+static void
+rspamd_mempool_gen_uid (rspamd_mempool_t *pool)
+{
+	unsigned char uidbuf[10];
+	const gchar hexdigits[] = "0123456789abcdef";
+	unsigned i;
+
+	ottery_rand_bytes (uidbuf, sizeof (uidbuf));
+	for (i = 0; i < G_N_ELEMENTS (uidbuf); i ++) {
+		pool->tag.uid[i * 2] = hexdigits[(uidbuf[i] >> 4) & 0xf];
+		pool->tag.uid[i * 2 + 1] = hexdigits[uidbuf[i] & 0xf];
+	}
+	pool->tag.uid[19] = '\0';
+}
+
 /**
  * Allocate new memory poll
  * @param size size of pool's page
@@ -196,9 +450,6 @@ rspamd_mempool_new (gsize size, const gchar *tag)
 {
 	rspamd_mempool_t *new;
 	gpointer map;
-	unsigned char uidbuf[10];
-	const gchar hexdigits[] = "0123456789abcdef";
-	unsigned i;
 
 	g_return_val_if_fail (size > 0, NULL);
 	/* Allocate statistic structure if it is not allocated before */
@@ -239,16 +490,7 @@ rspamd_mempool_new (gsize size, const gchar *tag)
 		memset (map, 0, sizeof (rspamd_mempool_stat_t));
 	}
 
-	if (!env_checked) {
-		/* Check G_SLICE=always-malloc to allow memory pool debug */
-		const char *g_slice;
-
-		g_slice = getenv ("VALGRIND");
-		if (g_slice != NULL) {
-			always_malloc = TRUE;
-		}
-		env_checked = TRUE;
-	}
+	rspamd_mempool_check_env ();
 
 	new = g_slice_alloc0 (sizeof (rspamd_mempool_t));
 	new->destructors = g_array_sized_new (FALSE, FALSE,
@@ -259,18 +501,21 @@ rspamd_mempool_new (gsize size, const gchar *tag)
 
 	if (tag) {
 		rspamd_strlcpy (new->tag.tagname, tag, sizeof (new->tag.tagname));
+
+		if (!always_malloc) {
+			new->entry = rspamd_mempool_get_entry (new->tag.tagname);
+
+			if (new->entry && new->entry->avg_used > 0) {
+				new->elt_len = MAX (size,
+						rspamd_mempool_entry_suggest (new->entry));
+			}
+		}
 	}
 	else {
 		new->tag.tagname[0] = '\0';
 	}
 
-	/* Generate new uid */
-	ottery_rand_bytes (uidbuf, sizeof (uidbuf));
-	for (i = 0; i < G_N_ELEMENTS (uidbuf); i ++) {
-		new->tag.uid[i * 2] = hexdigits[(uidbuf[i] >> 4) & 0xf];
-		new->tag.uid[i * 2 + 1] = hexdigits[uidbuf[i] & 0xf];
-	}
-	new->tag.uid[19] = '\0';
+	rspamd_mempool_gen_uid (new);
 
 	mem_pool_stat->pools_allocated++;
 
@@ -279,7 +524,7 @@ rspamd_mempool_new (gsize size, const gchar *tag)
 
 static void *
 memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size,
-		enum rspamd_mempool_chain_type pool_type)
+		enum rspamd_mempool_chain_type pool_type, const gchar *loc)
 {
 	guint8 *tmp;
 	struct _pool_chain *new, *cur;
@@ -287,6 +532,17 @@ memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size,
 
 	if (pool) {
 		POOL_MTX_LOCK ();
+
+		if (G_UNLIKELY (trace_enabled)) {
+			rspamd_mempool_trace_add (&trace_locations, loc,
+					pool->tag.tagname, size);
+
+			if (trace_ctx) {
+				rspamd_mempool_trace_add (&trace_contexts, trace_ctx,
+						"mempool", size);
+			}
+		}
+
 		if (always_malloc && pool_type != RSPAMD_MEMPOOL_SHARED) {
 			void *ptr;
 
@@ -344,21 +600,22 @@ memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size,
 
 
 void *
-rspamd_mempool_alloc (rspamd_mempool_t * pool, gsize size)
+rspamd_mempool_alloc_ (rspamd_mempool_t * pool, gsize size, const gchar *loc)
 {
-	return memory_pool_alloc_common (pool, size, RSPAMD_MEMPOOL_NORMAL);
+	return memory_pool_alloc_common (pool, size, RSPAMD_MEMPOOL_NORMAL, loc);
 }
 
 void *
-rspamd_mempool_alloc_tmp (rspamd_mempool_t * pool, gsize size)
+rspamd_mempool_alloc_tmp_ (rspamd_mempool_t * pool, gsize size,
+		const gchar *loc)
 {
-	return memory_pool_alloc_common (pool, size, RSPAMD_MEMPOOL_TMP);
+	return memory_pool_alloc_common (pool, size, RSPAMD_MEMPOOL_TMP, loc);
 }
 
 void *
-rspamd_mempool_alloc0 (rspamd_mempool_t * pool, gsize size)
+rspamd_mempool_alloc0_ (rspamd_mempool_t * pool, gsize size, const gchar *loc)
 {
-	void *pointer = rspamd_mempool_alloc (pool, size);
+	void *pointer = rspamd_mempool_alloc_ (pool, size, loc);
 	if (pointer) {
 		memset (pointer, 0, size);
 	}
@@ -366,9 +623,10 @@ rspamd_mempool_alloc0 (rspamd_mempool_t * pool, gsize size)
 }
 
 void *
-rspamd_mempool_alloc0_tmp (rspamd_mempool_t * pool, gsize size)
+rspamd_mempool_alloc0_tmp_ (rspamd_mempool_t * pool, gsize size,
+		const gchar *loc)
 {
-	void *pointer = rspamd_mempool_alloc_tmp (pool, size);
+	void *pointer = rspamd_mempool_alloc_tmp_ (pool, size, loc);
 	if (pointer) {
 		memset (pointer, 0, size);
 	}
@@ -376,9 +634,10 @@ rspamd_mempool_alloc0_tmp (rspamd_mempool_t * pool, gsize size)
 }
 
 void *
-rspamd_mempool_alloc0_shared (rspamd_mempool_t * pool, gsize size)
+rspamd_mempool_alloc0_shared_ (rspamd_mempool_t * pool, gsize size,
+		const gchar *loc)
 {
-	void *pointer = rspamd_mempool_alloc_shared (pool, size);
+	void *pointer = rspamd_mempool_alloc_shared_ (pool, size, loc);
 	if (pointer) {
 		memset (pointer, 0, size);
 	}
@@ -386,14 +645,16 @@ rspamd_mempool_alloc0_shared (rspamd_mempool_t * pool, gsize size)
 }
 
 void *
-rspamd_mempool_alloc_shared (rspamd_mempool_t * pool, gsize size)
+rspamd_mempool_alloc_shared_ (rspamd_mempool_t * pool, gsize size,
+		const gchar *loc)
 {
-	return memory_pool_alloc_common (pool, size, RSPAMD_MEMPOOL_SHARED);
+	return memory_pool_alloc_common (pool, size, RSPAMD_MEMPOOL_SHARED, loc);
 }
 
 
 gchar *
-rspamd_mempool_strdup (rspamd_mempool_t * pool, const gchar *src)
+rspamd_mempool_strdup_ (rspamd_mempool_t * pool, const gchar *src,
+		const gchar *loc)
 {
 	gsize len;
 	gchar *newstr;
@@ -403,7 +664,7 @@ rspamd_mempool_strdup (rspamd_mempool_t * pool, const gchar *src)
 	}
 
 	len = strlen (src);
-	newstr = rspamd_mempool_alloc (pool, len + 1);
+	newstr = rspamd_mempool_alloc_ (pool, len + 1, loc);
 	memcpy (newstr, src, len);
 	newstr[len] = '\0';
 
@@ -411,7 +672,8 @@ rspamd_mempool_strdup (rspamd_mempool_t * pool, const gchar *src)
 }
 
 gchar *
-rspamd_mempool_fstrdup (rspamd_mempool_t * pool, const struct f_str_s *src)
+rspamd_mempool_fstrdup_ (rspamd_mempool_t * pool, const struct f_str_s *src,
+		const gchar *loc)
 {
 	gchar *newstr;
 
@@ -419,7 +681,7 @@ rspamd_mempool_fstrdup (rspamd_mempool_t * pool, const struct f_str_s *src)
 		return NULL;
 	}
 
-	newstr = rspamd_mempool_alloc (pool, src->len + 1);
+	newstr = rspamd_mempool_alloc_ (pool, src->len + 1, loc);
 	memcpy (newstr, src->str, src->len);
 	newstr[src->len] = '\0';
 
@@ -427,7 +689,8 @@ rspamd_mempool_fstrdup (rspamd_mempool_t * pool, const struct f_str_s *src)
 }
 
 gchar *
-rspamd_mempool_ftokdup (rspamd_mempool_t *pool, const rspamd_ftok_t *src)
+rspamd_mempool_ftokdup_ (rspamd_mempool_t *pool, const rspamd_ftok_t *src,
+		const gchar *loc)
 {
 	gchar *newstr;
 
@@ -435,7 +698,7 @@ rspamd_mempool_ftokdup (rspamd_mempool_t *pool, const rspamd_ftok_t *src)
 		return NULL;
 	}
 
-	newstr = rspamd_mempool_alloc (pool, src->len + 1);
+	newstr = rspamd_mempool_alloc_ (pool, src->len + 1, loc);
 	memcpy (newstr, src->begin, src->len);
 	newstr[src->len] = '\0';
 
@@ -443,7 +706,8 @@ rspamd_mempool_ftokdup (rspamd_mempool_t *pool, const rspamd_ftok_t *src)
 }
 
 gchar *
-rspamd_mempool_strdup_shared (rspamd_mempool_t * pool, const gchar *src)
+rspamd_mempool_strdup_shared_ (rspamd_mempool_t * pool, const gchar *src,
+		const gchar *loc)
 {
 	gsize len;
 	gchar *newstr;
@@ -453,7 +717,7 @@ rspamd_mempool_strdup_shared (rspamd_mempool_t * pool, const gchar *src)
 	}
 
 	len = strlen (src);
-	newstr = rspamd_mempool_alloc_shared (pool, len + 1);
+	newstr = rspamd_mempool_alloc_shared_ (pool, len + 1, loc);
 	memcpy (newstr, src, len);
 	newstr[len] = '\0';
 
@@ -499,18 +763,15 @@ rspamd_mempool_replace_destructor (rspamd_mempool_t * pool,
 	}
 }
 
-void
-rspamd_mempool_delete (rspamd_mempool_t * pool)
+/*
+ * Call all pool destructors, pool mutex must be locked
+ */
+static void
+rspamd_mempool_call_destructors (rspamd_mempool_t *pool)
 {
-	struct _pool_chain *cur;
 	struct _pool_destructors *destructor;
-	gpointer ptr;
-	guint i, j;
-	gsize len;
-
-	POOL_MTX_LOCK ();
+	guint i;
 
-	/* Call all pool destructors */
 	for (i = 0; i < pool->destructors->len; i ++) {
 		destructor = &g_array_index (pool->destructors, struct _pool_destructors, i);
 		/* Avoid calling destructors for NULL pointers */
@@ -518,13 +779,34 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 			destructor->func (destructor->data);
 		}
 	}
+}
 
-	g_array_free (pool->destructors, TRUE);
+/*
+ * Release pool pages and private data, the first normal page is rewound and
+ * kept if `keep_first` is TRUE
+ */
+static void
+rspamd_mempool_free_chains (rspamd_mempool_t *pool, gboolean keep_first)
+{
+	struct _pool_chain *cur;
+	gpointer ptr;
+	guint i, j;
+	gsize len, used = 0;
 
 	for (i = 0; i < G_N_ELEMENTS (pool->pools); i ++) {
 		if (pool->pools[i]) {
 			for (j = 0; j < pool->pools[i]->len; j++) {
 				cur = g_ptr_array_index (pool->pools[i], j);
+
+				if (i == RSPAMD_MEMPOOL_NORMAL) {
+					used += cur->pos - cur->begin;
+
+					if (keep_first && j == 0) {
+						cur->pos = align_ptr (cur->begin, MEM_ALIGNMENT);
+						continue;
+					}
+				}
+
 				g_atomic_int_add (&mem_pool_stat->bytes_allocated,
 						-((gint)cur->len));
 				g_atomic_int_add (&mem_pool_stat->chunks_allocated, -1);
@@ -535,18 +817,33 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 					munmap ((void *)cur, len);
 				}
 				else {
-					g_slice_free1 (len, cur);
+					rspamd_mempool_chain_release (cur);
 				}
 			}
 
-			g_ptr_array_free (pool->pools[i], TRUE);
+			if (keep_first && i == RSPAMD_MEMPOOL_NORMAL) {
+				g_ptr_array_set_size (pool->pools[i],
+						MIN (pool->pools[i]->len, 1));
+			}
+			else {
+				g_ptr_array_free (pool->pools[i], TRUE);
+				pool->pools[i] = NULL;
+			}
 		}
 	}
 
+	if (pool->entry && used > 0) {
+		rspamd_mempool_entry_update (pool->entry, used);
+	}
+
 	if (pool->variables) {
 		g_hash_table_destroy (pool->variables);
+		pool->variables = NULL;
 	}
 
+	/* Indexed variables live in the pool's pages */
+	pool->vars = NULL;
+
 	if (pool->trash_stack) {
 		for (i = 0; i < pool->trash_stack->len; i++) {
 			ptr = g_ptr_array_index (pool->trash_stack, i);
@@ -554,19 +851,42 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 		}
 
 		g_ptr_array_free (pool->trash_stack, TRUE);
+		pool->trash_stack = NULL;
 	}
+}
+
+void
+rspamd_mempool_delete (rspamd_mempool_t * pool)
+{
+	POOL_MTX_LOCK ();
+
+	rspamd_mempool_call_destructors (pool);
+	g_array_free (pool->destructors, TRUE);
+	rspamd_mempool_free_chains (pool, FALSE);
 
 	g_atomic_int_inc (&mem_pool_stat->pools_freed);
 	POOL_MTX_UNLOCK ();
 	g_slice_free (rspamd_mempool_t, pool);
 }
 
+void
+rspamd_mempool_reset (rspamd_mempool_t *pool)
+{
+	POOL_MTX_LOCK ();
+
+	rspamd_mempool_call_destructors (pool);
+	g_array_set_size (pool->destructors, 0);
+	rspamd_mempool_free_chains (pool, TRUE);
+	rspamd_mempool_gen_uid (pool);
+
+	POOL_MTX_UNLOCK ();
+}
+
 void
 rspamd_mempool_cleanup_tmp (rspamd_mempool_t * pool)
 {
 	struct _pool_chain *cur;
 	guint i;
-	gsize len;
 
 	POOL_MTX_LOCK ();
 
@@ -576,9 +896,8 @@ rspamd_mempool_cleanup_tmp (rspamd_mempool_t * pool)
 			g_atomic_int_add (&mem_pool_stat->bytes_allocated,
 					-((gint)cur->len));
 			g_atomic_int_add (&mem_pool_stat->chunks_allocated, -1);
-			len = cur->len + sizeof (struct _pool_chain);
 
-			g_slice_free1 (len, cur);
+			rspamd_mempool_chain_release (cur);
 		}
 
 		g_ptr_array_free (pool->pools[RSPAMD_MEMPOOL_TMP], TRUE);
@@ -601,6 +920,7 @@ rspamd_mempool_stat (rspamd_mempool_stat_t * st)
 		st->shared_chunks_allocated = mem_pool_stat->shared_chunks_allocated;
 		st->chunks_freed = mem_pool_stat->chunks_freed;
 		st->oversized_chunks = mem_pool_stat->oversized_chunks;
+		st->chunks_recycled = mem_pool_stat->chunks_recycled;
 	}
 }
 
@@ -624,6 +944,92 @@ rspamd_mempool_suggest_size (void)
 #endif
 }
 
+gboolean
+rspamd_mempool_trace_enabled (void)
+{
+	rspamd_mempool_check_env ();
+
+	return trace_enabled;
+}
+
+void
+rspamd_mempool_trace_enable (gboolean enabled)
+{
+	/* Environment must not override the explicit setting later */
+	rspamd_mempool_check_env ();
+	trace_enabled = enabled;
+}
+
+void
+rspamd_mempool_trace_set_context (const gchar *ctx)
+{
+	trace_ctx = ctx;
+}
+
+void
+rspamd_mempool_trace_account (const gchar *ctx, const gchar *tag,
+		gsize bytes)
+{
+	if (trace_enabled && ctx) {
+		rspamd_mempool_trace_add (&trace_contexts, ctx, tag, bytes);
+	}
+}
+
+static gint
+rspamd_mempool_trace_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_mempool_trace_elt *e1 = *(const struct rspamd_mempool_trace_elt **)a,
+			*e2 = *(const struct rspamd_mempool_trace_elt **)b;
+
+	if (e1->bytes > e2->bytes) {
+		return -1;
+	}
+	else if (e1->bytes < e2->bytes) {
+		return 1;
+	}
+
+	return 0;
+}
+
+void
+rspamd_mempool_trace_foreach (gboolean by_context,
+		rspamd_mempool_trace_cb cb, gpointer ud)
+{
+	GHashTable *tbl;
+	GHashTableIter it;
+	GPtrArray *elts;
+	struct rspamd_mempool_trace_elt *elt;
+	gpointer k, v;
+	guint i;
+
+	G_LOCK (mem_pool_trace);
+	tbl = by_context ? trace_contexts : trace_locations;
+
+	if (tbl == NULL) {
+		G_UNLOCK (mem_pool_trace);
+
+		return;
+	}
+
+	/* Callback might allocate something from a pool, so do not hold lock */
+	elts = g_ptr_array_sized_new (g_hash_table_size (tbl));
+	g_hash_table_iter_init (&it, tbl);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		g_ptr_array_add (elts, v);
+	}
+
+	G_UNLOCK (mem_pool_trace);
+	g_ptr_array_sort (elts, rspamd_mempool_trace_cmp);
+
+	for (i = 0; i < elts->len; i ++) {
+		elt = g_ptr_array_index (elts, i);
+		cb (elt->name, elt->tag, elt->bytes, elt->allocations, ud);
+	}
+
+	g_ptr_array_free (elts, TRUE);
+}
+
 #if !defined(HAVE_PTHREAD_PROCESS_SHARED) || defined(DISABLE_PTHREAD_MUTEX)
 /*
  * Own emulation
@@ -839,12 +1245,96 @@ rspamd_mempool_wunlock_rwlock (rspamd_mempool_rwlock_t * lock)
 }
 #endif
 
+static const gchar *mempool_var_names[] = {
+#define RSPAMD_MEMPOOL_VAR_NAME(name) RSPAMD_MEMPOOL_##name,
+	RSPAMD_MEMPOOL_VARS (RSPAMD_MEMPOOL_VAR_NAME)
+#undef RSPAMD_MEMPOOL_VAR_NAME
+};
+
+/*
+ * Returns index of a registered variable or -1 for any other name
+ */
+static gint
+rspamd_mempool_variable_idx (const gchar *name)
+{
+	static GHashTable *names = NULL;
+	static gsize initialized = 0;
+	gpointer pidx;
+	guint i;
+
+	if (g_once_init_enter (&initialized)) {
+		names = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+
+		for (i = 0; i < G_N_ELEMENTS (mempool_var_names); i ++) {
+			/* Store index + 1 to distinguish it from missing value */
+			g_hash_table_insert (names, (gpointer)mempool_var_names[i],
+					GUINT_TO_POINTER (i + 1));
+		}
+
+		g_once_init_leave (&initialized, 1);
+	}
+
+	pidx = g_hash_table_lookup (names, name);
+
+	return pidx ? (gint)GPOINTER_TO_UINT (pidx) - 1 : -1;
+}
+
+void
+rspamd_mempool_set_variable_idx (rspamd_mempool_t *pool, guint idx,
+		gpointer value, rspamd_mempool_destruct_t destructor)
+{
+	g_assert (idx < RSPAMD_MEMPOOL_VAR_MAX);
+
+	if (pool->vars == NULL) {
+		pool->vars = rspamd_mempool_alloc0 (pool,
+				sizeof (gpointer) * RSPAMD_MEMPOOL_VAR_MAX);
+	}
+
+	pool->vars[idx] = value;
+
+	if (destructor != NULL) {
+		rspamd_mempool_add_destructor (pool, destructor, value);
+	}
+}
+
+gpointer
+rspamd_mempool_get_variable_idx (rspamd_mempool_t *pool, guint idx)
+{
+	g_assert (idx < RSPAMD_MEMPOOL_VAR_MAX);
+
+	if (pool->vars == NULL) {
+		return NULL;
+	}
+
+	return pool->vars[idx];
+}
+
+void
+rspamd_mempool_remove_variable_idx (rspamd_mempool_t *pool, guint idx)
+{
+	g_assert (idx < RSPAMD_MEMPOOL_VAR_MAX);
+
+	if (pool->vars != NULL) {
+		pool->vars[idx] = NULL;
+	}
+}
+
 void
 rspamd_mempool_set_variable (rspamd_mempool_t *pool,
 	const gchar *name,
 	gpointer value,
 	rspamd_mempool_destruct_t destructor)
 {
+	gint idx;
+
+	idx = rspamd_mempool_variable_idx (name);
+
+	if (idx != -1) {
+		rspamd_mempool_set_variable_idx (pool, idx, value, destructor);
+
+		return;
+	}
+
 	if (pool->variables == NULL) {
 		pool->variables = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
 	}
@@ -859,6 +1349,14 @@ rspamd_mempool_set_variable (rspamd_mempool_t *pool,
 gpointer
 rspamd_mempool_get_variable (rspamd_mempool_t *pool, const gchar *name)
 {
+	gint idx;
+
+	idx = rspamd_mempool_variable_idx (name);
+
+	if (idx != -1) {
+		return rspamd_mempool_get_variable_idx (pool, idx);
+	}
+
 	if (pool->variables == NULL) {
 		return NULL;
 	}
@@ -869,7 +1367,14 @@ rspamd_mempool_get_variable (rspamd_mempool_t *pool, const gchar *name)
 void
 rspamd_mempool_remove_variable (rspamd_mempool_t *pool, const gchar *name)
 {
-	if (pool->variables != NULL) {
+	gint idx;
+
+	idx = rspamd_mempool_variable_idx (name);
+
+	if (idx != -1) {
+		rspamd_mempool_remove_variable_idx (pool, idx);
+	}
+	else if (pool->variables != NULL) {
 		g_hash_table_remove (pool->variables, name);
 	}
 }
@@ -66,6 +66,7 @@ struct _pool_chain {
 	guint8 *pos;                    /**< current start of free space in block   */
 	gsize len;                      /**< length of block                        */
 	rspamd_mempool_mutex_t *lock;
+	struct _pool_chain *next;       /**< next free chain kept for reuse         */
 };
 
 /**
@@ -90,13 +91,16 @@ struct rspamd_mempool_tag {
  * Memory pool type
  */
 struct rspamd_mutex_s;
+struct rspamd_mempool_entry_point;
 typedef struct memory_pool_s {
 	GPtrArray *pools[RSPAMD_MEMPOOL_MAX];
 	GArray *destructors;
 	GPtrArray *trash_stack;
 	GHashTable *variables;                  /**< private memory pool variables			*/
+	gpointer *vars;                         /**< variables registered in mempool_vars_internal.h */
 	gsize elt_len;							/**< size of an element						*/
 	struct rspamd_mempool_tag tag;          /**< memory pool tag						*/
+	struct rspamd_mempool_entry_point *entry; /**< sizes statistics for pools with this tag */
 } rspamd_mempool_t;
 
 /**
@@ -110,13 +114,17 @@ typedef struct memory_pool_stat_s {
 	guint shared_chunks_allocated;      /**< shared chunks allocated							*/
 	guint chunks_freed;                 /**< chunks freed										*/
 	guint oversized_chunks;             /**< oversized chunks									*/
+	guint chunks_recycled;              /**< chunks reused from the previous pools				*/
 } rspamd_mempool_stat_t;
 
 
 
 /**
- * Allocate new memory poll
+ * Allocate new memory poll. For the pools with a tag, the size of the first
+ * page is adjusted to the typical amount of memory used by the previous pools
+ * with the same tag.
  * @param size size of pool's page
+ * @param tag pool tag
  * @return new memory pool object
  */
 rspamd_mempool_t *rspamd_mempool_new (gsize size, const gchar *tag);
@@ -127,7 +135,10 @@ rspamd_mempool_t *rspamd_mempool_new (gsize size, const gchar *tag);
  * @param size bytes to allocate
  * @return pointer to allocated object
  */
-void * rspamd_mempool_alloc (rspamd_mempool_t * pool, gsize size);
+void * rspamd_mempool_alloc_ (rspamd_mempool_t * pool, gsize size,
+		const gchar *loc);
+#define rspamd_mempool_alloc(pool, size) \
+	rspamd_mempool_alloc_ ((pool), (size), G_STRLOC)
 
 /**
  * Get memory from temporary pool
@@ -135,7 +146,10 @@ void * rspamd_mempool_alloc (rspamd_mempool_t * pool, gsize size);
  * @param size bytes to allocate
  * @return pointer to allocated object
  */
-void * rspamd_mempool_alloc_tmp (rspamd_mempool_t * pool, gsize size);
+void * rspamd_mempool_alloc_tmp_ (rspamd_mempool_t * pool, gsize size,
+		const gchar *loc);
+#define rspamd_mempool_alloc_tmp(pool, size) \
+	rspamd_mempool_alloc_tmp_ ((pool), (size), G_STRLOC)
 
 /**
  * Get memory and set it to zero
@@ -143,7 +157,10 @@ void * rspamd_mempool_alloc_tmp (rspamd_mempool_t * pool, gsize size);
  * @param size bytes to allocate
  * @return pointer to allocated object
  */
-void * rspamd_mempool_alloc0 (rspamd_mempool_t * pool, gsize size);
+void * rspamd_mempool_alloc0_ (rspamd_mempool_t * pool, gsize size,
+		const gchar *loc);
+#define rspamd_mempool_alloc0(pool, size) \
+	rspamd_mempool_alloc0_ ((pool), (size), G_STRLOC)
 
 /**
  * Get memory and set it to zero
@@ -151,7 +168,10 @@ void * rspamd_mempool_alloc0 (rspamd_mempool_t * pool, gsize size);
  * @param size bytes to allocate
  * @return pointer to allocated object
  */
-void * rspamd_mempool_alloc0_tmp (rspamd_mempool_t * pool, gsize size);
+void * rspamd_mempool_alloc0_tmp_ (rspamd_mempool_t * pool, gsize size,
+		const gchar *loc);
+#define rspamd_mempool_alloc0_tmp(pool, size) \
+	rspamd_mempool_alloc0_tmp_ ((pool), (size), G_STRLOC)
 
 /**
  * Cleanup temporary data in pool
@@ -164,7 +184,10 @@ void rspamd_mempool_cleanup_tmp (rspamd_mempool_t * pool);
  * @param src source string
  * @return pointer to newly created string that is copy of src
  */
-gchar * rspamd_mempool_strdup (rspamd_mempool_t * pool, const gchar *src);
+gchar * rspamd_mempool_strdup_ (rspamd_mempool_t * pool, const gchar *src,
+		const gchar *loc);
+#define rspamd_mempool_strdup(pool, src) \
+	rspamd_mempool_strdup_ ((pool), (src), G_STRLOC)
 
 /**
  * Make a copy of fixed string in pool as null terminated string
@@ -172,8 +195,10 @@ gchar * rspamd_mempool_strdup (rspamd_mempool_t * pool, const gchar *src);
  * @param src source string
  * @return pointer to newly created string that is copy of src
  */
-gchar * rspamd_mempool_fstrdup (rspamd_mempool_t * pool,
-	const struct f_str_s *src);
+gchar * rspamd_mempool_fstrdup_ (rspamd_mempool_t * pool,
+	const struct f_str_s *src, const gchar *loc);
+#define rspamd_mempool_fstrdup(pool, src) \
+	rspamd_mempool_fstrdup_ ((pool), (src), G_STRLOC)
 
 struct f_str_tok;
 
@@ -183,18 +208,28 @@ struct f_str_tok;
  * @param src source string
  * @return pointer to newly created string that is copy of src
  */
-gchar * rspamd_mempool_ftokdup (rspamd_mempool_t *pool,
-		const struct f_str_tok *src);
+gchar * rspamd_mempool_ftokdup_ (rspamd_mempool_t *pool,
+		const struct f_str_tok *src, const gchar *loc);
+#define rspamd_mempool_ftokdup(pool, src) \
+	rspamd_mempool_ftokdup_ ((pool), (src), G_STRLOC)
 
 /**
  * Allocate piece of shared memory
  * @param pool memory pool object
  * @param size bytes to allocate
  */
-void * rspamd_mempool_alloc_shared (rspamd_mempool_t * pool, gsize size);
-void * rspamd_mempool_alloc0_shared (rspamd_mempool_t *pool, gsize size);
-gchar * rspamd_mempool_strdup_shared (rspamd_mempool_t * pool,
-	const gchar *src);
+void * rspamd_mempool_alloc_shared_ (rspamd_mempool_t * pool, gsize size,
+		const gchar *loc);
+#define rspamd_mempool_alloc_shared(pool, size) \
+	rspamd_mempool_alloc_shared_ ((pool), (size), G_STRLOC)
+void * rspamd_mempool_alloc0_shared_ (rspamd_mempool_t *pool, gsize size,
+		const gchar *loc);
+#define rspamd_mempool_alloc0_shared(pool, size) \
+	rspamd_mempool_alloc0_shared_ ((pool), (size), G_STRLOC)
+gchar * rspamd_mempool_strdup_shared_ (rspamd_mempool_t * pool,
+	const gchar *src, const gchar *loc);
+#define rspamd_mempool_strdup_shared(pool, src) \
+	rspamd_mempool_strdup_shared_ ((pool), (src), G_STRLOC)
 /**
  * Add destructor callback to pool
  * @param pool memory pool object
@@ -227,6 +262,13 @@ void rspamd_mempool_replace_destructor (rspamd_mempool_t *pool,
  */
 void rspamd_mempool_delete (rspamd_mempool_t *pool);
 
+/**
+ * Call destructors chain and release all pool's memory but the first page,
+ * so the pool can be used again as if it was just created
+ * @param pool memory pool object
+ */
+void rspamd_mempool_reset (rspamd_mempool_t *pool);
+
 /**
  * Get new mutex from pool (allocated in shared memory)
  * @param pool memory pool object
@@ -294,6 +336,50 @@ void rspamd_mempool_stat_reset (void);
  */
 gsize rspamd_mempool_suggest_size (void);
 
+/*
+ * Allocations tracing: when rspamd is started with RSPAMD_MEMPOOL_TRACE
+ * environment variable set, every allocation is accounted per its source
+ * location and pool tag, as well as per the current context (e.g. symbol)
+ */
+typedef void (*rspamd_mempool_trace_cb) (const gchar *name, const gchar *tag,
+		gsize bytes, gsize allocations, gpointer ud);
+
+/**
+ * Returns TRUE if allocations tracing is enabled
+ */
+gboolean rspamd_mempool_trace_enabled (void);
+
+/**
+ * Enable or disable allocations tracing regardless of the environment
+ * @param enabled
+ */
+void rspamd_mempool_trace_enable (gboolean enabled);
+
+/**
+ * Set context, e.g. name of symbol being checked, to which allocations are
+ * attributed. Context string must be valid until it is reset to NULL.
+ * @param ctx context name or NULL
+ */
+void rspamd_mempool_trace_set_context (const gchar *ctx);
+
+/**
+ * Account growth of some other heap (e.g. Lua) for a context
+ * @param ctx context name
+ * @param tag name of heap
+ * @param bytes number of bytes
+ */
+void rspamd_mempool_trace_account (const gchar *ctx, const gchar *tag,
+		gsize bytes);
+
+/**
+ * Iterate over traced allocations, the largest ones first
+ * @param by_context iterate over contexts rather than source locations
+ * @param cb callback
+ * @param ud user data
+ */
+void rspamd_mempool_trace_foreach (gboolean by_context,
+		rspamd_mempool_trace_cb cb, gpointer ud);
+
 /**
  * Set memory pool variable
  * @param pool memory pool object
@@ -320,6 +406,31 @@ gpointer rspamd_mempool_get_variable (rspamd_mempool_t *pool,
  */
 void rspamd_mempool_remove_variable (rspamd_mempool_t *pool,
 		const gchar *name);
+
+/**
+ * Set memory pool variable by its index from mempool_vars_internal.h
+ * @param pool memory pool object
+ * @param idx RSPAMD_MEMPOOL_VAR_* index
+ * @param value value of variable
+ * @param destructor pointer to function-destructor
+ */
+void rspamd_mempool_set_variable_idx (rspamd_mempool_t *pool, guint idx,
+		gpointer value, rspamd_mempool_destruct_t destructor);
+
+/**
+ * Get memory pool variable by its index from mempool_vars_internal.h
+ * @param pool memory pool object
+ * @param idx RSPAMD_MEMPOOL_VAR_* index
+ * @return NULL or pointer to variable data
+ */
+gpointer rspamd_mempool_get_variable_idx (rspamd_mempool_t *pool, guint idx);
+
+/**
+ * Removes variable from memory pool by its index
+ * @param pool memory pool object
+ * @param idx RSPAMD_MEMPOOL_VAR_* index
+ */
+void rspamd_mempool_remove_variable_idx (rspamd_mempool_t *pool, guint idx);
 /**
  * Prepend element to a list creating it in the memory pool
  * @param l
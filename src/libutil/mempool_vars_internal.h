@@ -37,5 +37,52 @@
 #define RSPAMD_MEMPOOL_ARC_SIGN_KEY "arc_key"
 #define RSPAMD_MEMPOOL_ARC_SIGN_SELECTOR "arc_selector"
 #define RSPAMD_MEMPOOL_STAT_SIGNATURE "stat_signature"
+#define RSPAMD_MEMPOOL_ZSTD_STREAM "zstd_stream"
+#define RSPAMD_MEMPOOL_STAT_USER "stat_user"
+#define RSPAMD_MEMPOOL_WORDS_HASH "words_hash"
+#define RSPAMD_MEMPOOL_BAYES_PROB "bayes_prob"
+#define RSPAMD_MEMPOOL_PARTS_DISTANCE "parts_distance"
+#define RSPAMD_MEMPOOL_FUZZY_STAT "fuzzy_stat"
+#define RSPAMD_MEMPOOL_FUZZY_SHINGLES "fuzzy_shingles"
+
+/*
+ * Variables that are stored in a flat array of a pool rather than in its hash
+ * table. They are accessed by RSPAMD_MEMPOOL_VAR_<name> indexes using
+ * rspamd_mempool_{get,set}_variable_idx, whilst string API (e.g. from Lua)
+ * maps the names defined above to the same slots.
+ */
+#define RSPAMD_MEMPOOL_VARS(X) \
+	X (AVG_WORDS_LEN) \
+	X (SHORT_WORDS_CNT) \
+	X (HEADERS_HASH) \
+	X (SETTINGS_HASH) \
+	X (MTA_TAG) \
+	X (MTA_NAME) \
+	X (CACHED_REPLY) \
+	X (SPF_DOMAIN) \
+	X (PRINCIPAL_RECIPIENT) \
+	X (PROFILE) \
+	X (MILTER_REPLY) \
+	X (DKIM_SIGNATURE) \
+	X (DMARC_CHECKS) \
+	X (DKIM_SIGN_KEY) \
+	X (DKIM_SIGN_SELECTOR) \
+	X (ARC_SIGN_KEY) \
+	X (ARC_SIGN_SELECTOR) \
+	X (STAT_SIGNATURE) \
+	X (ZSTD_STREAM) \
+	X (STAT_USER) \
+	X (WORDS_HASH) \
+	X (BAYES_PROB) \
+	X (PARTS_DISTANCE) \
+	X (FUZZY_STAT) \
+	X (FUZZY_SHINGLES)
+
+enum rspamd_mempool_var_id {
+#define RSPAMD_MEMPOOL_VAR_ENUM(name) RSPAMD_MEMPOOL_VAR_##name,
+	RSPAMD_MEMPOOL_VARS (RSPAMD_MEMPOOL_VAR_ENUM)
+#undef RSPAMD_MEMPOOL_VAR_ENUM
+	RSPAMD_MEMPOOL_VAR_MAX
+};
 
 #endif
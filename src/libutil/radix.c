@@ -18,6 +18,7 @@
 #include "rspamd.h"
 #include "mem_pool.h"
 #include "btrie.h"
+#include "map_compiled.h"
 
 #define msg_err_radix(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         "radix", tree->pool->tag.uid, \
@@ -36,12 +37,66 @@
         G_STRFUNC, \
         __VA_ARGS__)
 
+/*
+ * Entries of lpm4 tables are either 0 (no value), index of value + 1 or
+ * index of the next level chunk of 256 entries with the high bit set
+ */
+#define LPM4_CHILD 0x80000000U
+#define LPM4_CHUNK_SIZE 256
+
+struct radix_lpm4 {
+	guint32 *tbl16;
+	guint32 *tbl8;
+	uintptr_t *values;
+	gsize nchunks;
+	gsize nvalues;
+};
+
 struct radix_tree_compressed {
 	rspamd_mempool_t *pool;
 	size_t size;
 	struct btrie *tree;
+	struct radix_lpm4 *lpm4;
+	struct rspamd_map_compiled *compiled;
 };
 
+static inline uintptr_t
+radix_lpm4_lookup (const struct radix_lpm4 *lpm, const guint8 *key)
+{
+	guint32 addr, e;
+
+	addr = ((guint32)key[0] << 24) | ((guint32)key[1] << 16) |
+			((guint32)key[2] << 8) | (guint32)key[3];
+	e = lpm->tbl16[addr >> 16];
+
+	if (e & LPM4_CHILD) {
+		e = lpm->tbl8[((e & ~LPM4_CHILD) * LPM4_CHUNK_SIZE) +
+				((addr >> 8) & 0xff)];
+
+		if (e & LPM4_CHILD) {
+			e = lpm->tbl8[((e & ~LPM4_CHILD) * LPM4_CHUNK_SIZE) +
+					(addr & 0xff)];
+		}
+	}
+
+	if (e == 0) {
+		return RADIX_NO_VALUE;
+	}
+
+	return lpm->values[e - 1];
+}
+
+static void
+radix_lpm4_destroy (struct radix_lpm4 *lpm)
+{
+	if (lpm) {
+		g_free (lpm->tbl16);
+		g_free (lpm->tbl8);
+		g_free (lpm->values);
+		g_slice_free1 (sizeof (*lpm), lpm);
+	}
+}
+
 uintptr_t
 radix_find_compressed (radix_compressed_t * tree, const guint8 *key, gsize keylen)
 {
@@ -49,6 +104,14 @@ radix_find_compressed (radix_compressed_t * tree, const guint8 *key, gsize keyle
 
 	g_assert (tree != NULL);
 
+	if (tree->compiled) {
+		return rspamd_map_compiled_radix_lookup (tree->compiled, key, keylen);
+	}
+
+	if (tree->lpm4 && keylen == sizeof (guint32)) {
+		return radix_lpm4_lookup (tree->lpm4, key);
+	}
+
 	ret = btrie_lookup (tree->tree, key, keylen * NBBY);
 
 	if (ret == NULL) {
@@ -71,11 +134,17 @@ radix_insert_compressed (radix_compressed_t * tree,
 	int ret;
 
 	g_assert (tree != NULL);
+	g_assert (tree->compiled == NULL);
 	g_assert (keybits >= masklen);
 
 	msg_debug_radix ("want insert value %p with mask %z, key: %*xs",
 			(gpointer)value, keybits - masklen, (int)keylen, key);
 
+	if (tree->lpm4) {
+		radix_lpm4_destroy (tree->lpm4);
+		tree->lpm4 = NULL;
+	}
+
 	old = radix_find_compressed (tree, key, keylen);
 
 	ret = btrie_add_prefix (tree->tree, key, keybits - masklen,
@@ -122,6 +191,22 @@ radix_create_compressed (void)
 	tree->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
 	tree->size = 0;
 	tree->tree = btrie_init (tree->pool);
+	tree->lpm4 = NULL;
+	tree->compiled = NULL;
+
+	return tree;
+}
+
+radix_compressed_t *
+radix_create_compressed_mapped (struct rspamd_map_compiled *cm)
+{
+	radix_compressed_t *tree;
+
+	g_assert (rspamd_map_compiled_type (cm) == RSPAMD_MAP_COMPILED_RADIX);
+
+	tree = radix_create_compressed ();
+	tree->compiled = rspamd_map_compiled_ref (cm);
+	tree->size = rspamd_map_compiled_size (cm);
 
 	return tree;
 }
@@ -130,11 +215,211 @@ void
 radix_destroy_compressed (radix_compressed_t *tree)
 {
 	if (tree) {
+		radix_lpm4_destroy (tree->lpm4);
+
+		if (tree->compiled) {
+			rspamd_map_compiled_unref (tree->compiled);
+		}
+
 		rspamd_mempool_delete (tree->pool);
 		g_slice_free1 (sizeof (*tree), tree);
 	}
 }
 
+struct radix_lpm4_build {
+	guint32 *tbl16;
+	GArray *tbl8;
+	GArray *values;
+};
+
+static guint32
+radix_lpm4_new_chunk (struct radix_lpm4_build *b, guint32 fill)
+{
+	guint32 idx, i, *chunk;
+
+	idx = b->tbl8->len / LPM4_CHUNK_SIZE;
+	g_array_set_size (b->tbl8, b->tbl8->len + LPM4_CHUNK_SIZE);
+	chunk = &g_array_index (b->tbl8, guint32, idx * LPM4_CHUNK_SIZE);
+
+	for (i = 0; i < LPM4_CHUNK_SIZE; i ++) {
+		chunk[i] = fill;
+	}
+
+	return idx;
+}
+
+static void
+radix_lpm4_fill (guint32 *ent, guint32 n, guint32 val)
+{
+	guint32 i;
+
+	for (i = 0; i < n; i ++) {
+		ent[i] = val;
+	}
+}
+
+/*
+ * Prefixes are walked in preorder, so any prefix is filled after all
+ * prefixes that cover it and overrides their values within its range
+ */
+static void
+radix_lpm4_walk_cb (const btrie_oct_t *prefix, unsigned len,
+		const void *data, int post, void *user_data)
+{
+	struct radix_lpm4_build *b = user_data;
+	guint32 addr, val, e, c, pos;
+	uintptr_t v = (uintptr_t)data;
+
+	if (post || len > 32) {
+		return;
+	}
+
+	g_array_append_val (b->values, v);
+	val = b->values->len;
+	addr = ((guint32)prefix[0] << 24) | ((guint32)prefix[1] << 16) |
+			((guint32)prefix[2] << 8) | (guint32)prefix[3];
+
+	if (len < 32) {
+		addr &= ~(0xffffffffU >> len);
+	}
+
+	if (len <= 16) {
+		radix_lpm4_fill (&b->tbl16[addr >> 16], 1U << (16 - len), val);
+
+		return;
+	}
+
+	e = b->tbl16[addr >> 16];
+
+	if (e & LPM4_CHILD) {
+		c = e & ~LPM4_CHILD;
+	}
+	else {
+		c = radix_lpm4_new_chunk (b, e);
+		b->tbl16[addr >> 16] = c | LPM4_CHILD;
+	}
+
+	pos = c * LPM4_CHUNK_SIZE + ((addr >> 8) & 0xff);
+
+	if (len <= 24) {
+		radix_lpm4_fill (&g_array_index (b->tbl8, guint32, pos),
+				1U << (24 - len), val);
+
+		return;
+	}
+
+	e = g_array_index (b->tbl8, guint32, pos);
+
+	if (e & LPM4_CHILD) {
+		c = e & ~LPM4_CHILD;
+	}
+	else {
+		c = radix_lpm4_new_chunk (b, e);
+		g_array_index (b->tbl8, guint32, pos) = c | LPM4_CHILD;
+	}
+
+	pos = c * LPM4_CHUNK_SIZE + (addr & 0xff);
+	radix_lpm4_fill (&g_array_index (b->tbl8, guint32, pos),
+			1U << (32 - len), val);
+}
+
+gboolean
+radix_compile_compressed (radix_compressed_t *tree)
+{
+	struct radix_lpm4_build b;
+	struct radix_lpm4 *lpm;
+
+	g_assert (tree != NULL);
+
+	if (tree->lpm4) {
+		return TRUE;
+	}
+
+	if (tree->compiled) {
+		return FALSE;
+	}
+
+	b.tbl16 = g_malloc0 ((1U << 16) * sizeof (guint32));
+	b.tbl8 = g_array_new (FALSE, FALSE, sizeof (guint32));
+	b.values = g_array_new (FALSE, FALSE, sizeof (uintptr_t));
+
+	btrie_walk (tree->tree, radix_lpm4_walk_cb, &b);
+
+	if (b.values->len >= LPM4_CHILD ||
+			b.tbl8->len / LPM4_CHUNK_SIZE >= LPM4_CHILD) {
+		msg_err_radix ("cannot compile radix trie: too many prefixes");
+		g_free (b.tbl16);
+		g_array_free (b.tbl8, TRUE);
+		g_array_free (b.values, TRUE);
+
+		return FALSE;
+	}
+
+	lpm = g_slice_alloc (sizeof (*lpm));
+	lpm->nchunks = b.tbl8->len / LPM4_CHUNK_SIZE;
+	lpm->nvalues = b.values->len;
+	lpm->tbl16 = b.tbl16;
+	lpm->tbl8 = (guint32 *)g_array_free (b.tbl8, FALSE);
+	lpm->values = (uintptr_t *)g_array_free (b.values, FALSE);
+	tree->lpm4 = lpm;
+
+	msg_debug_radix ("compiled %z ipv4 prefixes to %z chunks",
+			lpm->nvalues, lpm->nchunks);
+
+	return TRUE;
+}
+
+gboolean
+radix_get_compiled_tables (radix_compressed_t *tree,
+		const guint32 **tbl16, const guint32 **tbl8, gsize *nchunks,
+		const uintptr_t **values, gsize *nvalues)
+{
+	if (!radix_compile_compressed (tree)) {
+		return FALSE;
+	}
+
+	*tbl16 = tree->lpm4->tbl16;
+	*tbl8 = tree->lpm4->tbl8;
+	*nchunks = tree->lpm4->nchunks;
+	*values = tree->lpm4->values;
+	*nvalues = tree->lpm4->nvalues;
+
+	return TRUE;
+}
+
+struct radix_walk_cbdata {
+	radix_walk_cb cb;
+	gpointer ud;
+};
+
+static void
+radix_walk_helper (const btrie_oct_t *prefix, unsigned len,
+		const void *data, int post, void *user_data)
+{
+	struct radix_walk_cbdata *cbd = user_data;
+
+	if (!post) {
+		cbd->cb (prefix, len, (uintptr_t)data, cbd->ud);
+	}
+}
+
+void
+radix_walk_compressed (radix_compressed_t *tree, radix_walk_cb cb,
+		gpointer ud)
+{
+	struct radix_walk_cbdata cbd;
+
+	g_assert (tree != NULL);
+
+	if (tree->compiled) {
+		return;
+	}
+
+	cbd.cb = cb;
+	cbd.ud = ud;
+	btrie_walk (tree->tree, radix_walk_helper, &cbd);
+}
+
 uintptr_t
 radix_find_compressed_addr (radix_compressed_t *tree,
 		const rspamd_inet_addr_t *addr)
@@ -372,5 +657,9 @@ radix_get_info (radix_compressed_t *tree)
 		return NULL;
 	}
 
+	if (tree->compiled) {
+		return "compiled map";
+	}
+
 	return btrie_stats (tree->tree);
 }
@@ -24,6 +24,10 @@
 
 
 typedef struct radix_tree_compressed radix_compressed_t;
+struct rspamd_map_compiled;
+
+typedef void (*radix_walk_cb) (const guint8 *prefix, guint bits,
+		uintptr_t value, gpointer ud);
 
 /**
  * Insert new key to the radix trie
@@ -59,6 +63,50 @@ uintptr_t radix_find_compressed (radix_compressed_t * tree, const guint8 *key,
 uintptr_t radix_find_compressed_addr (radix_compressed_t *tree,
 		const rspamd_inet_addr_t *addr);
 
+/**
+ * Build flat lookup table for IPv4 keys from the current trie content (strides
+ * of 16, 8 and 8 bits), so such lookups take at most three memory accesses.
+ * Other keys are still looked up in the trie. The table is dropped on the next
+ * insertion
+ * @param tree
+ * @return TRUE if table has been built
+ */
+gboolean radix_compile_compressed (radix_compressed_t *tree);
+
+/**
+ * Get flat IPv4 lookup table of the trie compiling it if needed. Table entries
+ * are indexes of values + 1 (0 means no value) or indexes of the next level
+ * chunks of 256 entries with the high bit set
+ * @param tree
+ * @param tbl16 first level table of 65536 entries
+ * @param tbl8 chunks
+ * @param nchunks number of chunks
+ * @param values values
+ * @param nvalues number of values
+ * @return TRUE if table is available
+ */
+gboolean radix_get_compiled_tables (radix_compressed_t *tree,
+		const guint32 **tbl16, const guint32 **tbl8, gsize *nchunks,
+		const uintptr_t **values, gsize *nvalues);
+
+/**
+ * Call `cb` for each prefix in the trie, prefixes that cover others are
+ * visited first
+ * @param tree
+ * @param cb
+ * @param ud
+ */
+void radix_walk_compressed (radix_compressed_t *tree, radix_walk_cb cb,
+		gpointer ud);
+
+/**
+ * Create read only radix trie that performs lookups in a compiled map
+ * @param cm compiled map of radix type (reference is retained)
+ * @return
+ */
+radix_compressed_t *radix_create_compressed_mapped (
+		struct rspamd_map_compiled *cm);
+
 /**
  * Destroy the complete radix trie
  * @param tree
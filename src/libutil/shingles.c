@@ -111,6 +111,80 @@ rspamd_shingles_get_keys_cached (const guchar key[SHINGLES_KEY_SIZE])
 	return keys;
 }
 
+/*
+ * Stores hashes of all pipes for a single window position. With the default
+ * filter we do not need to keep all hashes, so the minimums are updated
+ * in place, otherwise hashes are stored in pipe-major order for the filter.
+ */
+static inline void
+rspamd_shingles_push_lanes (struct rspamd_shingle *res, guint64 *hashes,
+		const guint64 *lanes, gsize pos, gsize hlen)
+{
+	guint j;
+
+	if (hashes == NULL) {
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+			res->hashes[j] = lanes[j] < res->hashes[j] ?
+					lanes[j] : res->hashes[j];
+		}
+	}
+	else {
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+			hashes[j * hlen + pos] = lanes[j];
+		}
+	}
+}
+
+static guint64 *
+rspamd_shingles_init_lanes (struct rspamd_shingle *res,
+		rspamd_shingles_filter filter, gsize hlen)
+{
+	guint j;
+
+	if (filter == rspamd_shingles_default_filter) {
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+			res->hashes[j] = G_MAXUINT64;
+		}
+
+		return NULL;
+	}
+
+	return g_malloc (hlen * sizeof (guint64) * RSPAMD_SHINGLE_SIZE);
+}
+
+static void
+rspamd_shingles_filter_lanes (struct rspamd_shingle *res, guint64 *hashes,
+		gsize hlen, const guchar *key,
+		rspamd_shingles_filter filter, gpointer filterd)
+{
+	guint i;
+
+	if (hashes != NULL) {
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			res->hashes[i] = filter (&hashes[i * hlen], hlen,
+					i, key, filterd);
+		}
+
+		g_free (hashes);
+	}
+}
+
+static enum rspamd_cryptobox_fast_hash_type
+rspamd_shingles_fast_hash_type (enum rspamd_shingle_alg alg)
+{
+	switch (alg) {
+	case RSPAMD_SHINGLES_XXHASH:
+		return RSPAMD_CRYPTOBOX_XXHASH64;
+	case RSPAMD_SHINGLES_OLD:
+	case RSPAMD_SHINGLES_MUMHASH:
+		return RSPAMD_CRYPTOBOX_MUMHASH;
+	default:
+		break;
+	}
+
+	return RSPAMD_CRYPTOBOX_HASHFAST_INDEPENDENT;
+}
+
 struct rspamd_shingle* RSPAMD_OPTIMIZE("unroll-loops")
 rspamd_shingles_from_text (GArray *input,
 		const guchar key[16],
@@ -120,9 +194,8 @@ rspamd_shingles_from_text (GArray *input,
 		enum rspamd_shingle_alg alg)
 {
 	struct rspamd_shingle *res;
-	guint64 **hashes;
+	guint64 *hashes, lanes[RSPAMD_SHINGLE_SIZE];
 	guchar **keys;
-	rspamd_fstring_t *row;
 	rspamd_stat_token_t *word;
 	guint64 val;
 	gint i, j, k;
@@ -136,98 +209,117 @@ rspamd_shingles_from_text (GArray *input,
 		res = g_malloc (sizeof (*res));
 	}
 
-	row = rspamd_fstring_sized_new (256);
-
 	/* Init hashes pipes and keys */
-	hashes = g_slice_alloc (sizeof (*hashes) * RSPAMD_SHINGLE_SIZE);
 	hlen = input->len > SHINGLES_WINDOW ?
 			(input->len - SHINGLES_WINDOW + 1) : 1;
 	keys = rspamd_shingles_get_keys_cached (key);
-
-	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-		hashes[i] = g_slice_alloc (hlen * sizeof (guint64));
-	}
+	hashes = rspamd_shingles_init_lanes (res, filter, hlen);
 
 	/* Now parse input words into a vector of hashes using rolling window */
 	if (alg == RSPAMD_SHINGLES_OLD) {
+		guchar rowbuf[1024], *row;
+		rspamd_fstring_t *large_row = NULL;
+		gsize rlen;
+
 		for (i = 0; i <= (gint)input->len; i ++) {
 			if (i - beg >= SHINGLES_WINDOW || i == (gint)input->len) {
+				rlen = 0;
+
 				for (j = beg; j < i; j ++) {
 					word = &g_array_index (input, rspamd_stat_token_t, j);
-					row = rspamd_fstring_append (row, word->begin, word->len);
+					rlen += word->len;
+				}
+
+				if (rlen <= sizeof (rowbuf)) {
+					row = rowbuf;
+				}
+				else {
+					/* Rare case of very long words */
+					if (large_row == NULL) {
+						large_row = rspamd_fstring_sized_new (rlen);
+					}
+					else if (large_row->allocated < rlen) {
+						large_row = rspamd_fstring_grow (large_row, rlen);
+					}
+
+					row = (guchar *)large_row->str;
+				}
+
+				rlen = 0;
+
+				for (j = beg; j < i; j ++) {
+					word = &g_array_index (input, rspamd_stat_token_t, j);
+					memcpy (row + rlen, word->begin, word->len);
+					rlen += word->len;
 				}
 
 				/* Now we need to create a new row here */
 				for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
-					rspamd_cryptobox_siphash ((guchar *)&val, row->str, row->len,
+					rspamd_cryptobox_siphash ((guchar *)&val, row, rlen,
 							keys[j]);
-					g_assert (hlen > beg);
-					hashes[j][beg] = val;
+					lanes[j] = val;
 				}
 
+				g_assert (hlen > beg);
+				rspamd_shingles_push_lanes (res, hashes, lanes, beg, hlen);
 				beg++;
-
-				row = rspamd_fstring_assign (row, "", 0);
 			}
 		}
+
+		if (large_row) {
+			rspamd_fstring_free (large_row);
+		}
 	}
 	else {
-		guint64 res[SHINGLES_WINDOW * RSPAMD_SHINGLE_SIZE], seed;
-
-		switch (alg) {
-		case RSPAMD_SHINGLES_XXHASH:
-			ht = RSPAMD_CRYPTOBOX_XXHASH64;
-			break;
-		case RSPAMD_SHINGLES_MUMHASH:
-			ht = RSPAMD_CRYPTOBOX_MUMHASH;
-			break;
-		default:
-			ht = RSPAMD_CRYPTOBOX_HASHFAST_INDEPENDENT;
-			break;
+		/* Window of hashes for all pipes, stored position-major */
+		guint64 window[SHINGLES_WINDOW][RSPAMD_SHINGLE_SIZE],
+				seeds[RSPAMD_SHINGLE_SIZE];
+
+		ht = rspamd_shingles_fast_hash_type (alg);
+
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+			memcpy (&seeds[j], keys[j], sizeof (seeds[j]));
 		}
 
-		memset (res, 0, sizeof (res));
+		memset (window, 0, sizeof (window));
+
 		for (i = 0; i <= (gint)input->len; i ++) {
 			if (i - beg >= SHINGLES_WINDOW || i == (gint)input->len) {
+				word = &g_array_index (input, rspamd_stat_token_t, beg);
 
-				for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
-					/* Shift hashes window to right */
-					for (k = 0; k < SHINGLES_WINDOW - 1; k ++) {
-						res[j * SHINGLES_WINDOW + k] =
-								res[j * SHINGLES_WINDOW + k + 1];
-					}
+				/* Shift hashes window to right */
+				memmove (window[0], window[1],
+						sizeof (window[0]) * (SHINGLES_WINDOW - 1));
 
-					word = &g_array_index (input, rspamd_stat_token_t, beg);
-					/* Insert the last element to the pipe */
-					memcpy (&seed, keys[j], sizeof (seed));
-					res[j * SHINGLES_WINDOW + SHINGLES_WINDOW - 1] =
+				/* Insert the last element to the pipes */
+				for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+					window[SHINGLES_WINDOW - 1][j] =
 							rspamd_cryptobox_fast_hash_specific (ht,
 									word->begin, word->len,
-									seed);
+									seeds[j]);
+				}
+
+				/* Independent lanes, so this loop is vectorized */
+				for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
 					val = 0;
+
 					for (k = 0; k < SHINGLES_WINDOW; k ++) {
-						val ^= res[j * SHINGLES_WINDOW + k] >>
+						val ^= window[k][j] >>
 								(8 * (SHINGLES_WINDOW - k - 1));
 					}
 
-					g_assert (hlen > beg);
-					hashes[j][beg] = val;
+					lanes[j] = val;
 				}
+
+				g_assert (hlen > beg);
+				rspamd_shingles_push_lanes (res, hashes, lanes, beg, hlen);
 				beg++;
 			}
 		}
 	}
 
 	/* Now we need to filter all hashes and make a shingles result */
-	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-		res->hashes[i] = filter (hashes[i], hlen,
-				i, key, filterd);
-		g_slice_free1 (hlen * sizeof (guint64), hashes[i]);
-	}
-
-	g_slice_free1 (sizeof (*hashes) * RSPAMD_SHINGLE_SIZE, hashes);
-
-	rspamd_fstring_free (row);
+	rspamd_shingles_filter_lanes (res, hashes, hlen, key, filter, filterd);
 
 	return res;
 }
@@ -241,14 +333,12 @@ rspamd_shingles_from_image (guchar *dct,
 		enum rspamd_shingle_alg alg)
 {
 	struct rspamd_shingle *shingle;
-	guint64 **hashes;
+	guint64 *hashes, lanes[RSPAMD_SHINGLE_SIZE], seeds[RSPAMD_SHINGLE_SIZE];
 	guchar **keys;
 	guint64 d;
-	guint64 val;
 	gint i, j;
-	gsize hlen, beg = 0;
+	gsize hlen;
 	enum rspamd_cryptobox_fast_hash_type ht;
-	guint64 res[SHINGLES_WINDOW * RSPAMD_SHINGLE_SIZE], seed;
 
 	if (pool != NULL) {
 		shingle = rspamd_mempool_alloc (pool, sizeof (*shingle));
@@ -258,55 +348,29 @@ rspamd_shingles_from_image (guchar *dct,
 	}
 
 	/* Init hashes pipes and keys */
-	hashes = g_slice_alloc (sizeof (*hashes) * RSPAMD_SHINGLE_SIZE);
-	hlen = RSPAMD_DCT_LEN / NBBY  + 1;
+	hlen = RSPAMD_DCT_LEN / NBBY;
 	keys = rspamd_shingles_get_keys_cached (key);
+	hashes = rspamd_shingles_init_lanes (shingle, filter, hlen);
+	ht = rspamd_shingles_fast_hash_type (alg);
 
-	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-		hashes[i] = g_slice_alloc (hlen * sizeof (guint64));
+	for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+		memcpy (&seeds[j], keys[j], sizeof (seeds[j]));
 	}
 
-	switch (alg) {
-	case RSPAMD_SHINGLES_OLD:
-		ht = RSPAMD_CRYPTOBOX_MUMHASH;
-		break;
-	case RSPAMD_SHINGLES_XXHASH:
-		ht = RSPAMD_CRYPTOBOX_XXHASH64;
-		break;
-	case RSPAMD_SHINGLES_MUMHASH:
-		ht = RSPAMD_CRYPTOBOX_MUMHASH;
-		break;
-	default:
-		ht = RSPAMD_CRYPTOBOX_HASHFAST_INDEPENDENT;
-		break;
-	}
-
-	memset (res, 0, sizeof (res));
-#define INNER_CYCLE_SHINGLES(s, e) for (j = (s); j < (e); j ++) { \
-	d = dct[beg]; \
-	memcpy (&seed, keys[j], sizeof (seed)); \
-	val = rspamd_cryptobox_fast_hash_specific (ht, \
-					&d, sizeof (d), \
-					seed); \
-	hashes[j][beg] = val; \
-}
 	for (i = 0; i < RSPAMD_DCT_LEN / NBBY; i ++) {
-		INNER_CYCLE_SHINGLES (0, RSPAMD_SHINGLE_SIZE / 4);
-		INNER_CYCLE_SHINGLES (RSPAMD_SHINGLE_SIZE / 4, RSPAMD_SHINGLE_SIZE / 2);
-		INNER_CYCLE_SHINGLES (RSPAMD_SHINGLE_SIZE / 2, 3 * RSPAMD_SHINGLE_SIZE / 4);
-		INNER_CYCLE_SHINGLES (3 * RSPAMD_SHINGLE_SIZE / 4, RSPAMD_SHINGLE_SIZE);
+		d = dct[i];
 
-		beg++;
-	}
-#undef INNER_CYCLE_SHINGLES
-	/* Now we need to filter all hashes and make a shingles result */
-	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-		shingle->hashes[i] = filter (hashes[i], hlen,
-				i, key, filterd);
-		g_slice_free1 (hlen * sizeof (guint64), hashes[i]);
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+			lanes[j] = rspamd_cryptobox_fast_hash_specific (ht,
+					&d, sizeof (d),
+					seeds[j]);
+		}
+
+		rspamd_shingles_push_lanes (shingle, hashes, lanes, i, hlen);
 	}
 
-	g_slice_free1 (sizeof (*hashes) * RSPAMD_SHINGLE_SIZE, hashes);
+	/* Now we need to filter all hashes and make a shingles result */
+	rspamd_shingles_filter_lanes (shingle, hashes, hlen, key, filter, filterd);
 
 	return shingle;
 }
@@ -21,6 +21,7 @@
 #include "rdns.h"
 #include "cryptobox.h"
 #include "utlist.h"
+#include <math.h>
 
 struct upstream_inet_addr_entry {
 	rspamd_inet_addr_t *addr;
@@ -38,7 +39,13 @@ struct upstream {
 	guint errors;
 	guint checked;
 	guint dns_requests;
+	/* Requests sent but not yet completed */
+	guint inflight;
 	gint active_idx;
+	/* Exponentially weighted moving average of requests latency */
+	gdouble latency;
+	/* Time of the last latency update */
+	gdouble latency_ts;
 	gchar *name;
 	struct event ev;
 	struct timeval tv;
@@ -58,6 +65,12 @@ struct upstream {
 	ref_entry_t ref;
 };
 
+#define RSPAMD_UPSTREAM_LATENCY_SAMPLES 128
+/* Do not estimate percentiles from fewer samples */
+#define RSPAMD_UPSTREAM_LATENCY_MIN_SAMPLES 16
+/* Recalculate percentile after this number of new samples */
+#define RSPAMD_UPSTREAM_LATENCY_RECALC 16
+
 struct upstream_list {
 	struct upstream_ctx *ctx;
 	GPtrArray *ups;
@@ -67,6 +80,15 @@ struct upstream_list {
 	guint cur_elt;
 	enum rspamd_upstream_flag flags;
 	enum rspamd_upstream_rotation rot_alg;
+	/* Ring of the recent latencies of all upstreams in the list */
+	struct {
+		gdouble samples[RSPAMD_UPSTREAM_LATENCY_SAMPLES];
+		guint nsamples;
+		guint cur;
+		guint since_recalc;
+		gdouble percentile;
+		gdouble cached;
+	} latency;
 };
 
 struct upstream_ctx {
@@ -92,6 +114,16 @@ struct upstream_ctx {
 #define RSPAMD_UPSTREAM_UNLOCK(x) rspamd_mutex_unlock(x)
 #endif
 
+/* Weight of a new sample in latency moving average */
+#define RSPAMD_UPSTREAM_LATENCY_ALPHA 0.2
+/* Latency assumed for upstreams without replies yet, so they are probed */
+#define RSPAMD_UPSTREAM_LATENCY_MIN 0.001
+/*
+ * Latency of an upstream that has not been selected for a while is halved
+ * each this number of seconds, so it is eventually probed again
+ */
+#define RSPAMD_UPSTREAM_LATENCY_HALFLIFE 10.0
+
 /* 4 errors in 10 seconds */
 static guint default_max_errors = 4;
 static gdouble default_revive_time = 60;
@@ -473,6 +505,160 @@ rspamd_upstream_ok (struct upstream *up)
 	RSPAMD_UPSTREAM_UNLOCK (up->lock);
 }
 
+void
+rspamd_upstream_request_start (struct upstream *up)
+{
+	RSPAMD_UPSTREAM_LOCK (up->lock);
+	up->inflight ++;
+	RSPAMD_UPSTREAM_UNLOCK (up->lock);
+}
+
+/*
+ * Returns the latency moving average decayed according to the time passed
+ * since its last update
+ */
+static inline gdouble
+rspamd_upstream_decayed_latency (struct upstream *up, gdouble now)
+{
+	gdouble age = now - up->latency_ts;
+
+	if (up->latency == 0 || age <= 0) {
+		return up->latency;
+	}
+
+	return up->latency * pow (0.5, age / RSPAMD_UPSTREAM_LATENCY_HALFLIFE);
+}
+
+static void
+rspamd_upstream_update_latency (struct upstream *up, gdouble latency)
+{
+	gdouble now = rspamd_get_ticks ();
+
+	if (up->latency == 0) {
+		up->latency = latency;
+	}
+	else {
+		up->latency = RSPAMD_UPSTREAM_LATENCY_ALPHA * latency +
+				(1.0 - RSPAMD_UPSTREAM_LATENCY_ALPHA) *
+				rspamd_upstream_decayed_latency (up, now);
+	}
+
+	up->latency_ts = now;
+}
+
+void
+rspamd_upstream_request_finish (struct upstream *up, gdouble latency)
+{
+	struct upstream_list *ls = up->ls;
+
+	RSPAMD_UPSTREAM_LOCK (up->lock);
+
+	if (up->inflight > 0) {
+		up->inflight --;
+	}
+
+	if (latency >= 0) {
+		rspamd_upstream_update_latency (up, latency);
+	}
+
+	RSPAMD_UPSTREAM_UNLOCK (up->lock);
+
+	if (latency >= 0 && ls) {
+		RSPAMD_UPSTREAM_LOCK (ls->lock);
+		ls->latency.samples[ls->latency.cur] = latency;
+		ls->latency.cur = (ls->latency.cur + 1) %
+				RSPAMD_UPSTREAM_LATENCY_SAMPLES;
+
+		if (ls->latency.nsamples < RSPAMD_UPSTREAM_LATENCY_SAMPLES) {
+			ls->latency.nsamples ++;
+		}
+
+		ls->latency.since_recalc ++;
+		RSPAMD_UPSTREAM_UNLOCK (ls->lock);
+	}
+}
+
+void
+rspamd_upstream_request_cancel (struct upstream *up, gdouble elapsed)
+{
+	RSPAMD_UPSTREAM_LOCK (up->lock);
+
+	if (up->inflight > 0) {
+		up->inflight --;
+	}
+
+	/*
+	 * Cancelled request tells only that an upstream is not faster than the
+	 * elapsed time, and it must not bias the list percentiles
+	 */
+	if (elapsed > rspamd_upstream_decayed_latency (up, rspamd_get_ticks ())) {
+		rspamd_upstream_update_latency (up, elapsed);
+	}
+
+	RSPAMD_UPSTREAM_UNLOCK (up->lock);
+}
+
+gdouble
+rspamd_upstream_latency (struct upstream *up)
+{
+	return up->latency;
+}
+
+static gint
+rspamd_upstream_latency_cmp (gconstpointer a, gconstpointer b)
+{
+	gdouble d1 = *(const gdouble *)a, d2 = *(const gdouble *)b;
+
+	if (d1 < d2) {
+		return -1;
+	}
+	else if (d1 > d2) {
+		return 1;
+	}
+
+	return 0;
+}
+
+gdouble
+rspamd_upstreams_latency_percentile (struct upstream_list *ups,
+		gdouble percentile)
+{
+	gdouble sorted[RSPAMD_UPSTREAM_LATENCY_SAMPLES], ret;
+	guint idx;
+
+	g_assert (percentile >= 0 && percentile <= 1.0);
+
+	RSPAMD_UPSTREAM_LOCK (ups->lock);
+
+	if (ups->latency.nsamples < RSPAMD_UPSTREAM_LATENCY_MIN_SAMPLES) {
+		RSPAMD_UPSTREAM_UNLOCK (ups->lock);
+
+		return 0;
+	}
+
+	if (ups->latency.percentile == percentile && ups->latency.cached > 0 &&
+			ups->latency.since_recalc < RSPAMD_UPSTREAM_LATENCY_RECALC) {
+		ret = ups->latency.cached;
+		RSPAMD_UPSTREAM_UNLOCK (ups->lock);
+
+		return ret;
+	}
+
+	memcpy (sorted, ups->latency.samples,
+			ups->latency.nsamples * sizeof (sorted[0]));
+	qsort (sorted, ups->latency.nsamples, sizeof (sorted[0]),
+			rspamd_upstream_latency_cmp);
+	idx = percentile * (ups->latency.nsamples - 1);
+	ret = sorted[idx];
+
+	ups->latency.percentile = percentile;
+	ups->latency.cached = ret;
+	ups->latency.since_recalc = 0;
+	RSPAMD_UPSTREAM_UNLOCK (ups->lock);
+
+	return ret;
+}
+
 void
 rspamd_upstream_set_weight (struct upstream *up, guint weight)
 {
@@ -713,6 +899,12 @@ rspamd_upstreams_parse_line (struct upstream_list *ups,
 		ups->rot_alg = RSPAMD_UPSTREAM_SEQUENTIAL;
 		p += sizeof ("sequential:") - 1;
 	}
+	else if (g_ascii_strncasecmp (p,
+			"least-loaded:",
+			sizeof ("least-loaded:") - 1) == 0) {
+		ups->rot_alg = RSPAMD_UPSTREAM_LEAST_LOADED;
+		p += sizeof ("least-loaded:") - 1;
+	}
 
 	while (p < end) {
 		len = strcspn (p, separators);
@@ -903,6 +1095,89 @@ rspamd_upstream_get_hashed (struct upstream_list *ups, const guint8 *key, guint
 	return g_ptr_array_index (ups->alive, idx);
 }
 
+static inline gdouble
+rspamd_upstream_load (struct upstream *up, gdouble now)
+{
+	return MAX (rspamd_upstream_decayed_latency (up, now),
+			RSPAMD_UPSTREAM_LATENCY_MIN) *
+			(up->inflight + 1) * (up->errors + 1);
+}
+
+/*
+ * Power of two choices: compare expected delays of two random upstreams,
+ * which avoids herding on a single upstream that looks the best
+ */
+static struct upstream*
+rspamd_upstream_get_least_loaded (struct upstream_list *ups,
+		struct upstream *except)
+{
+	struct upstream *first, *second;
+	guint i, j, nalive;
+	gdouble now;
+
+	RSPAMD_UPSTREAM_LOCK (ups->lock);
+	nalive = ups->alive->len;
+
+	if (except && except->active_idx != -1) {
+		if (nalive < 2) {
+			RSPAMD_UPSTREAM_UNLOCK (ups->lock);
+
+			return NULL;
+		}
+
+		/* Select among all alive upstreams but the excluded one */
+		nalive --;
+	}
+	else {
+		except = NULL;
+	}
+
+	if (nalive == 0) {
+		RSPAMD_UPSTREAM_UNLOCK (ups->lock);
+
+		return NULL;
+	}
+	else if (nalive == 1) {
+		first = g_ptr_array_index (ups->alive, 0);
+
+		if (first == except) {
+			first = g_ptr_array_index (ups->alive, 1);
+		}
+
+		RSPAMD_UPSTREAM_UNLOCK (ups->lock);
+
+		return first;
+	}
+
+	i = ottery_rand_range (nalive - 1);
+	j = ottery_rand_range (nalive - 2);
+
+	if (j >= i) {
+		j ++;
+	}
+
+	if (except) {
+		/* Skip excluded upstream by shifting indices after it */
+		if (i >= (guint)except->active_idx) {
+			i ++;
+		}
+		if (j >= (guint)except->active_idx) {
+			j ++;
+		}
+	}
+
+	first = g_ptr_array_index (ups->alive, i);
+	second = g_ptr_array_index (ups->alive, j);
+	RSPAMD_UPSTREAM_UNLOCK (ups->lock);
+	now = rspamd_get_ticks ();
+
+	if (rspamd_upstream_load (second, now) < rspamd_upstream_load (first, now)) {
+		return second;
+	}
+
+	return first;
+}
+
 static struct upstream*
 rspamd_upstream_get_common (struct upstream_list *ups,
 		enum rspamd_upstream_rotation default_type,
@@ -941,6 +1216,9 @@ rspamd_upstream_get_common (struct upstream_list *ups,
 	case RSPAMD_UPSTREAM_ROUND_ROBIN:
 		up = rspamd_upstream_get_round_robin (ups, TRUE);
 		break;
+	case RSPAMD_UPSTREAM_LEAST_LOADED:
+		up = rspamd_upstream_get_least_loaded (ups, NULL);
+		break;
 	case RSPAMD_UPSTREAM_MASTER_SLAVE:
 		up = rspamd_upstream_get_round_robin (ups, FALSE);
 		break;
@@ -977,6 +1255,44 @@ rspamd_upstream_get_forced (struct upstream_list *ups,
 	return rspamd_upstream_get_common (ups, forced_type, key, keylen, TRUE);
 }
 
+struct upstream*
+rspamd_upstream_get_except (struct upstream_list *ups,
+		struct upstream *except,
+		enum rspamd_upstream_rotation default_type,
+		const guchar *key, gsize keylen)
+{
+	struct upstream *up;
+	enum rspamd_upstream_rotation type;
+	guint i;
+
+	if (except == NULL) {
+		return rspamd_upstream_get (ups, default_type, key, keylen);
+	}
+
+	type = ups->rot_alg != RSPAMD_UPSTREAM_UNDEF ? ups->rot_alg : default_type;
+
+	if (type == RSPAMD_UPSTREAM_LEAST_LOADED) {
+		up = rspamd_upstream_get_least_loaded (ups, except);
+
+		if (up) {
+			up->checked ++;
+		}
+
+		return up;
+	}
+
+	/* Other rotations are not random, so give them a few attempts */
+	for (i = 0; i < rspamd_upstreams_alive (ups); i ++) {
+		up = rspamd_upstream_get (ups, default_type, key, keylen);
+
+		if (up != except) {
+			return up;
+		}
+	}
+
+	return NULL;
+}
+
 void
 rspamd_upstream_reresolve (struct upstream_ctx *ctx)
 {
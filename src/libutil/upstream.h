@@ -12,6 +12,7 @@ enum rspamd_upstream_rotation {
 	RSPAMD_UPSTREAM_ROUND_ROBIN,
 	RSPAMD_UPSTREAM_MASTER_SLAVE,
 	RSPAMD_UPSTREAM_SEQUENTIAL,
+	RSPAMD_UPSTREAM_LEAST_LOADED,
 	RSPAMD_UPSTREAM_UNDEF
 };
 
@@ -62,6 +63,45 @@ void rspamd_upstream_fail (struct upstream *up);
  */
 void rspamd_upstream_ok (struct upstream *up);
 
+/**
+ * Account a request sent to an upstream, used by least loaded rotation
+ * @param up
+ */
+void rspamd_upstream_request_start (struct upstream *up);
+
+/**
+ * Account the end of a request started by `rspamd_upstream_request_start`
+ * @param up
+ * @param latency time of request in seconds or negative number if a request
+ * has not been completed
+ */
+void rspamd_upstream_request_finish (struct upstream *up, gdouble latency);
+
+/**
+ * Account the end of a request that has been abandoned before its reply, e.g.
+ * when another upstream has replied first. Elapsed time is used as the lower
+ * bound of the upstream latency but it is not counted in the list percentiles
+ * @param up
+ * @param elapsed time since the request start in seconds
+ */
+void rspamd_upstream_request_cancel (struct upstream *up, gdouble elapsed);
+
+/**
+ * Returns average latency of an upstream (or 0 if it is unknown)
+ * @param up
+ * @return
+ */
+gdouble rspamd_upstream_latency (struct upstream *up);
+
+/**
+ * Returns latency percentile over the recent requests to the list upstreams
+ * @param ups
+ * @param percentile value in the range [0, 1]
+ * @return latency in seconds or 0 if there are not enough requests yet
+ */
+gdouble rspamd_upstreams_latency_percentile (struct upstream_list *ups,
+		gdouble percentile);
+
 /**
  * Set weight for an upstream
  * @param up
@@ -220,6 +260,18 @@ struct upstream* rspamd_upstream_get_forced (struct upstream_list *ups,
 		enum rspamd_upstream_rotation forced_type,
 		const guchar *key, gsize keylen);
 
+/**
+ * Get new upstream from the list that differs from the specified one
+ * @param ups upstream list
+ * @param except upstream that should not be selected
+ * @param default_type type of rotation algorithm
+ * @return upstream or NULL if there are no other alive upstreams
+ */
+struct upstream* rspamd_upstream_get_except (struct upstream_list *ups,
+		struct upstream *except,
+		enum rspamd_upstream_rotation default_type,
+		const guchar *key, gsize keylen);
+
 /**
  * Re-resolve addresses for all upstreams registered
  */
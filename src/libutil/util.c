@@ -2219,24 +2219,12 @@ rspamd_config_libs (struct rspamd_external_libs_ctx *ctx,
 gboolean
 rspamd_libs_reset_decompression (struct rspamd_external_libs_ctx *ctx)
 {
-	gsize r;
-
 	if (ctx->in_zstream == NULL) {
 		msg_err ("cannot create decompression stream");
 		return FALSE;
 	}
 	else {
-		if (ctx->in_dict) {
-			r = ZSTD_initDStream_usingDict (ctx->in_zstream,
-					ctx->in_dict->dict, ctx->in_dict->size);
-		}
-		else {
-			r = ZSTD_initDStream (ctx->in_zstream);
-		}
-
-		if (ZSTD_isError (r)) {
-			msg_err ("cannot init decompression stream: %s",
-					ZSTD_getErrorName (r));
+		if (!rspamd_zstd_init_decompression (ctx->in_zstream, ctx->in_dict)) {
 			ZSTD_freeDStream (ctx->in_zstream);
 			ctx->in_zstream = NULL;
 
@@ -2250,30 +2238,159 @@ rspamd_libs_reset_decompression (struct rspamd_external_libs_ctx *ctx)
 gboolean
 rspamd_libs_reset_compression (struct rspamd_external_libs_ctx *ctx)
 {
-	gsize r;
-
 	if (ctx->out_zstream == NULL) {
 		msg_err ("cannot create compression stream");
 
 		return FALSE;
 	}
 	else {
-		if (ctx->out_dict) {
-			r = ZSTD_initCStream_usingDict (ctx->out_zstream,
-					ctx->out_dict->dict, ctx->out_dict->size, 1);
+		if (!rspamd_zstd_init_compression (ctx->out_zstream, ctx->out_dict)) {
+			ZSTD_freeCStream (ctx->out_zstream);
+			ctx->out_zstream = NULL;
+
+			return FALSE;
 		}
-		else {
-			r = ZSTD_initCStream (ctx->out_zstream, 1);
+	}
+
+	return TRUE;
+}
+
+struct zstd_dictionary *
+rspamd_libs_zstd_dictionary (struct rspamd_external_libs_ctx *ctx, guint id)
+{
+	if (ctx->in_dict && ctx->in_dict->id == id) {
+		return ctx->in_dict;
+	}
+
+	if (ctx->out_dict && ctx->out_dict->id == id) {
+		return ctx->out_dict;
+	}
+
+	return NULL;
+}
+
+gboolean
+rspamd_zstd_init_compression (void *zstream, struct zstd_dictionary *dict)
+{
+	gsize r;
+
+	if (dict) {
+		r = ZSTD_initCStream_usingDict (zstream, dict->dict, dict->size, 1);
+	}
+	else {
+		r = ZSTD_initCStream (zstream, 1);
+	}
+
+	if (ZSTD_isError (r)) {
+		msg_err ("cannot init compression stream: %s",
+				ZSTD_getErrorName (r));
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_zstd_init_decompression (void *zstream, struct zstd_dictionary *dict)
+{
+	gsize r;
+
+	if (dict) {
+		r = ZSTD_initDStream_usingDict (zstream, dict->dict, dict->size);
+	}
+	else {
+		r = ZSTD_initDStream (zstream);
+	}
+
+	if (ZSTD_isError (r)) {
+		msg_err ("cannot init decompression stream: %s",
+				ZSTD_getErrorName (r));
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+rspamd_fstring_t *
+rspamd_zstd_compress (void *zstream, const void *in, gsize inlen,
+		const gchar **err)
+{
+	ZSTD_inBuffer zin;
+	ZSTD_outBuffer zout;
+	rspamd_fstring_t *out;
+	gsize r;
+
+	out = rspamd_fstring_sized_new (ZSTD_compressBound (inlen));
+	zin.pos = 0;
+	zin.src = in;
+	zin.size = inlen;
+	zout.pos = 0;
+	zout.dst = out->str;
+	zout.size = out->allocated;
+
+	while (zin.pos < zin.size) {
+		r = ZSTD_compressStream (zstream, &zout, &zin);
+
+		if (ZSTD_isError (r)) {
+			*err = ZSTD_getErrorName (r);
+			rspamd_fstring_free (out);
+
+			return NULL;
 		}
+	}
+
+	r = ZSTD_endStream (zstream, &zout);
+
+	if (ZSTD_isError (r)) {
+		*err = ZSTD_getErrorName (r);
+		rspamd_fstring_free (out);
+
+		return NULL;
+	}
+
+	out->len = zout.pos;
+
+	return out;
+}
+
+gboolean
+rspamd_zstd_decompress_chunk (void *zstream, const void *in, gsize inlen,
+		rspamd_fstring_t **out, const gchar **err)
+{
+	ZSTD_inBuffer zin;
+	ZSTD_outBuffer zout;
+	gsize r;
+
+	zin.pos = 0;
+	zin.src = in;
+	zin.size = inlen;
+
+	for (;;) {
+		if ((*out)->len == (*out)->allocated) {
+			/* We need to extend output buffer */
+			*out = rspamd_fstring_grow (*out, ZSTD_DStreamOutSize ());
+		}
+
+		zout.dst = (*out)->str;
+		zout.pos = (*out)->len;
+		zout.size = (*out)->allocated;
+
+		r = ZSTD_decompressStream (zstream, &zout, &zin);
 
 		if (ZSTD_isError (r)) {
-			msg_err ("cannot init compression stream: %s",
-					ZSTD_getErrorName (r));
-			ZSTD_freeCStream (ctx->out_zstream);
-			ctx->out_zstream = NULL;
+			*err = ZSTD_getErrorName (r);
 
 			return FALSE;
 		}
+
+		(*out)->len = zout.pos;
+
+		/* Full output buffer means that decoder might have more data */
+		if (zin.pos == zin.size && zout.pos < zout.size) {
+			break;
+		}
 	}
 
 	return TRUE;
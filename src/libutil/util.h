@@ -408,6 +408,52 @@ gboolean rspamd_libs_reset_decompression (struct rspamd_external_libs_ctx *ctx);
  */
 gboolean rspamd_libs_reset_compression (struct rspamd_external_libs_ctx *ctx);
 
+struct zstd_dictionary;
+/**
+ * Find zstd dictionary (either input or output one) by its id
+ * @param ctx
+ * @param id dictionary id
+ * @return dictionary or NULL if it is not loaded
+ */
+struct zstd_dictionary *rspamd_libs_zstd_dictionary (
+		struct rspamd_external_libs_ctx *ctx, guint id);
+
+/**
+ * Reset zstd compression stream to use the specified dictionary
+ * @param zstream ZSTD_CStream
+ * @param dict dictionary or NULL
+ */
+gboolean rspamd_zstd_init_compression (void *zstream,
+		struct zstd_dictionary *dict);
+
+/**
+ * Reset zstd decompression stream to use the specified dictionary
+ * @param zstream ZSTD_DStream
+ * @param dict dictionary or NULL
+ */
+gboolean rspamd_zstd_init_decompression (void *zstream,
+		struct zstd_dictionary *dict);
+
+/**
+ * Compress data as a single frame using initialized compression stream
+ * @param zstream ZSTD_CStream
+ * @return compressed data or NULL in case of error
+ */
+rspamd_fstring_t *rspamd_zstd_compress (void *zstream,
+		const void *in, gsize inlen, const gchar **err);
+
+/**
+ * Decompress a portion of zstd frame appending output to `out`, so a frame
+ * could be decoded while it is being received
+ * @param zstream ZSTD_DStream
+ * @param out output buffer (might be reallocated)
+ * @param err error description
+ * @return FALSE in case of error
+ */
+gboolean rspamd_zstd_decompress_chunk (void *zstream,
+		const void *in, gsize inlen, rspamd_fstring_t **out,
+		const gchar **err);
+
 /**
  * Destroy external libraries context
  */
@@ -20,6 +20,7 @@
 #include "libserver/cfg_rcl.h"
 #include "libserver/worker_util.h"
 #include "libserver/rspamd_control.h"
+#include "libserver/log_record.h"
 #include "libutil/addr.h"
 #include "lua/lua_common.h"
 #include "unix-std.h"
@@ -42,6 +43,64 @@ worker_t log_helper_worker = {
 };
 
 static const guint64 rspamd_log_helper_magic = 0x1090bb46aaa74c9aULL;
+static const guint default_batch_rows = 10000;
+static const gdouble default_flush_interval = 60.0;
+
+/*
+ * Columns of exported blocks, they are written in ClickHouse Native format:
+ * block:  ncols:varuint nrows:varuint column[ncols]
+ * column: name:string type:string data
+ * Arrays are written as cumulative UInt64 offsets followed by nested data
+ */
+enum rspamd_log_helper_column {
+	LOG_COL_TS = 0,
+	LOG_COL_MESSAGE_ID,
+	LOG_COL_IP,
+	LOG_COL_USER,
+	LOG_COL_FROM,
+	LOG_COL_RCPT,
+	LOG_COL_ACTION,
+	LOG_COL_SCORE,
+	LOG_COL_REQUIRED_SCORE,
+	LOG_COL_SIZE,
+	LOG_COL_SCAN_TIME,
+	LOG_COL_VIRTUAL_TIME,
+	LOG_COL_SETTINGS_ID,
+	LOG_COL_SYMBOLS,
+	LOG_COL_SCORES,
+	LOG_COL_URLS,
+	LOG_COL_MAX
+};
+
+static const struct {
+	const gchar *name;
+	const gchar *type;
+	gboolean is_array;
+} rspamd_log_helper_columns[LOG_COL_MAX] = {
+	[LOG_COL_TS] = {"Time", "DateTime", FALSE},
+	[LOG_COL_MESSAGE_ID] = {"MessageId", "String", FALSE},
+	[LOG_COL_IP] = {"IP", "String", FALSE},
+	[LOG_COL_USER] = {"User", "String", FALSE},
+	[LOG_COL_FROM] = {"From", "String", FALSE},
+	[LOG_COL_RCPT] = {"Rcpt", "Array(String)", TRUE},
+	[LOG_COL_ACTION] = {"Action", "String", FALSE},
+	[LOG_COL_SCORE] = {"Score", "Float64", FALSE},
+	[LOG_COL_REQUIRED_SCORE] = {"RequiredScore", "Float64", FALSE},
+	[LOG_COL_SIZE] = {"Size", "UInt64", FALSE},
+	[LOG_COL_SCAN_TIME] = {"ScanTime", "Float64", FALSE},
+	[LOG_COL_VIRTUAL_TIME] = {"VirtualTime", "Float64", FALSE},
+	[LOG_COL_SETTINGS_ID] = {"SettingsId", "UInt32", FALSE},
+	[LOG_COL_SYMBOLS] = {"Symbols.Names", "Array(String)", TRUE},
+	[LOG_COL_SCORES] = {"Symbols.Scores", "Array(Float64)", TRUE},
+	[LOG_COL_URLS] = {"Urls", "Array(String)", TRUE},
+};
+
+struct rspamd_log_helper_block {
+	GByteArray *data[LOG_COL_MAX];
+	GByteArray *offsets[LOG_COL_MAX];
+	guint64 nested[LOG_COL_MAX];
+	guint nrows;
+};
 
 /*
  * Worker's context
@@ -59,6 +118,17 @@ struct log_helper_ctx {
 	struct rspamd_worker_lua_script *scripts;
 	lua_State *L;
 	gint pair[2];
+	/* Records export */
+	gchar *output_dir;
+	guint32 batch_rows;
+	gdouble flush_interval;
+	gint rec_pair[2];
+	struct event rec_ev;
+	struct event flush_ev;
+	struct rspamd_log_helper_block block;
+	struct rspamd_log_record rec;
+	guchar *rec_buf;
+	guint nblocks;
 };
 
 static gpointer
@@ -68,11 +138,38 @@ init_log_helper (struct rspamd_config *cfg)
 	GQuark type;
 
 	type = g_quark_try_string ("log_helper");
-	(void)type;
 	ctx = rspamd_mempool_alloc (cfg->cfg_pool, sizeof (*ctx));
 
 	ctx->magic = rspamd_log_helper_magic;
 	ctx->cfg = cfg;
+	ctx->output_dir = NULL;
+	ctx->batch_rows = default_batch_rows;
+	ctx->flush_interval = default_flush_interval;
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"output_dir",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct log_helper_ctx, output_dir),
+			0,
+			"Directory where to save blocks of task records");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"batch_rows",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct log_helper_ctx, batch_rows),
+			RSPAMD_CL_FLAG_INT_32,
+			"Maximum number of records in a single block");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"flush_interval",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct log_helper_ctx, flush_interval),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Maximum time to keep records before writing a block");
 
 	return ctx;
 }
@@ -164,12 +261,318 @@ rspamd_log_helper_read (gint fd, short what, gpointer ud)
 	}
 }
 
+static void
+rspamd_log_helper_append_varuint (GByteArray *ar, guint64 val)
+{
+	guint8 c;
+
+	do {
+		c = val & 0x7f;
+		val >>= 7;
+
+		if (val) {
+			c |= 0x80;
+		}
+
+		g_byte_array_append (ar, &c, 1);
+	} while (val);
+}
+
+static void
+rspamd_log_helper_append_string (GByteArray *ar, const gchar *s, gsize len)
+{
+	rspamd_log_helper_append_varuint (ar, len);
+	g_byte_array_append (ar, (const guint8 *)s, len);
+}
+
+static void
+rspamd_log_helper_append_u64 (GByteArray *ar, guint64 val)
+{
+	val = GUINT64_TO_LE (val);
+	g_byte_array_append (ar, (const guint8 *)&val, sizeof (val));
+}
+
+static void
+rspamd_log_helper_append_u32 (GByteArray *ar, guint32 val)
+{
+	val = GUINT32_TO_LE (val);
+	g_byte_array_append (ar, (const guint8 *)&val, sizeof (val));
+}
+
+static void
+rspamd_log_helper_append_double (GByteArray *ar, gdouble val)
+{
+	guint64 u;
+
+	memcpy (&u, &val, sizeof (u));
+	rspamd_log_helper_append_u64 (ar, u);
+}
+
+static void
+rspamd_log_helper_block_init (struct rspamd_log_helper_block *blk)
+{
+	guint i;
+
+	memset (blk, 0, sizeof (*blk));
+
+	for (i = 0; i < LOG_COL_MAX; i ++) {
+		blk->data[i] = g_byte_array_new ();
+
+		if (rspamd_log_helper_columns[i].is_array) {
+			blk->offsets[i] = g_byte_array_new ();
+		}
+	}
+}
+
+static void
+rspamd_log_helper_block_destroy (struct rspamd_log_helper_block *blk)
+{
+	guint i;
+
+	for (i = 0; i < LOG_COL_MAX; i ++) {
+		g_byte_array_free (blk->data[i], TRUE);
+
+		if (blk->offsets[i]) {
+			g_byte_array_free (blk->offsets[i], TRUE);
+		}
+	}
+}
+
+static void
+rspamd_log_helper_block_add (struct rspamd_log_helper_block *blk,
+		struct rspamd_log_record *rec)
+{
+	struct rspamd_log_record_symbol *sym;
+	rspamd_ftok_t *tok;
+	guint i;
+
+#define ADD_TOK(col, tok) rspamd_log_helper_append_string (blk->data[(col)], \
+		(tok).begin, (tok).len)
+#define END_ARRAY(col, n) do { \
+	blk->nested[(col)] += (n); \
+	rspamd_log_helper_append_u64 (blk->offsets[(col)], blk->nested[(col)]); \
+} while (0)
+
+	rspamd_log_helper_append_u32 (blk->data[LOG_COL_TS], rec->ts);
+	ADD_TOK (LOG_COL_MESSAGE_ID, rec->message_id);
+	ADD_TOK (LOG_COL_IP, rec->ip);
+	ADD_TOK (LOG_COL_USER, rec->user);
+	ADD_TOK (LOG_COL_FROM, rec->from);
+
+	for (i = 0; i < rec->rcpts->len; i ++) {
+		tok = &g_array_index (rec->rcpts, rspamd_ftok_t, i);
+		ADD_TOK (LOG_COL_RCPT, *tok);
+	}
+
+	END_ARRAY (LOG_COL_RCPT, rec->rcpts->len);
+
+	ADD_TOK (LOG_COL_ACTION, rec->action);
+	rspamd_log_helper_append_double (blk->data[LOG_COL_SCORE], rec->score);
+	rspamd_log_helper_append_double (blk->data[LOG_COL_REQUIRED_SCORE],
+			rec->required_score);
+	rspamd_log_helper_append_u64 (blk->data[LOG_COL_SIZE], rec->size);
+	rspamd_log_helper_append_double (blk->data[LOG_COL_SCAN_TIME],
+			rec->scan_time);
+	rspamd_log_helper_append_double (blk->data[LOG_COL_VIRTUAL_TIME],
+			rec->virtual_time);
+	rspamd_log_helper_append_u32 (blk->data[LOG_COL_SETTINGS_ID],
+			rec->settings_id);
+
+	for (i = 0; i < rec->symbols->len; i ++) {
+		sym = &g_array_index (rec->symbols, struct rspamd_log_record_symbol, i);
+		ADD_TOK (LOG_COL_SYMBOLS, sym->name);
+		rspamd_log_helper_append_double (blk->data[LOG_COL_SCORES],
+				sym->score);
+	}
+
+	END_ARRAY (LOG_COL_SYMBOLS, rec->symbols->len);
+	END_ARRAY (LOG_COL_SCORES, rec->symbols->len);
+
+	for (i = 0; i < rec->urls->len; i ++) {
+		tok = &g_array_index (rec->urls, rspamd_ftok_t, i);
+		ADD_TOK (LOG_COL_URLS, *tok);
+	}
+
+	END_ARRAY (LOG_COL_URLS, rec->urls->len);
+
+#undef ADD_TOK
+#undef END_ARRAY
+
+	blk->nrows ++;
+}
+
+static gboolean
+rspamd_log_helper_write_all (gint fd, GByteArray *ar)
+{
+	gsize written = 0;
+	gssize r;
+
+	while (written < ar->len) {
+		r = write (fd, ar->data + written, ar->len - written);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return FALSE;
+		}
+
+		written += r;
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_log_helper_flush (struct log_helper_ctx *ctx)
+{
+	struct rspamd_log_helper_block *blk = &ctx->block;
+	GByteArray *hdr;
+	gchar tmppath[PATH_MAX], path[PATH_MAX];
+	gboolean ret = TRUE;
+	gint fd;
+	guint i;
+
+	if (blk->nrows == 0) {
+		return;
+	}
+
+	rspamd_snprintf (path, sizeof (path), "%s%crspamd-%L-%P-%ud.native",
+			ctx->output_dir, G_DIR_SEPARATOR, (gint64)time (NULL), getpid (),
+			ctx->nblocks ++);
+	rspamd_snprintf (tmppath, sizeof (tmppath), "%s.tmp", path);
+	fd = open (tmppath, O_WRONLY | O_CREAT | O_TRUNC, 00644);
+
+	if (fd == -1) {
+		msg_err ("cannot create %s: %s, drop %ud records", tmppath,
+				strerror (errno), blk->nrows);
+	}
+	else {
+		hdr = g_byte_array_new ();
+		rspamd_log_helper_append_varuint (hdr, LOG_COL_MAX);
+		rspamd_log_helper_append_varuint (hdr, blk->nrows);
+		ret = rspamd_log_helper_write_all (fd, hdr);
+
+		for (i = 0; i < LOG_COL_MAX && ret; i ++) {
+			g_byte_array_set_size (hdr, 0);
+			rspamd_log_helper_append_string (hdr,
+					rspamd_log_helper_columns[i].name,
+					strlen (rspamd_log_helper_columns[i].name));
+			rspamd_log_helper_append_string (hdr,
+					rspamd_log_helper_columns[i].type,
+					strlen (rspamd_log_helper_columns[i].type));
+			ret = rspamd_log_helper_write_all (fd, hdr);
+
+			if (ret && blk->offsets[i]) {
+				ret = rspamd_log_helper_write_all (fd, blk->offsets[i]);
+			}
+
+			if (ret) {
+				ret = rspamd_log_helper_write_all (fd, blk->data[i]);
+			}
+		}
+
+		g_byte_array_free (hdr, TRUE);
+		close (fd);
+
+		if (!ret) {
+			msg_err ("cannot write %s: %s, drop %ud records", tmppath,
+					strerror (errno), blk->nrows);
+			unlink (tmppath);
+		}
+		else if (rename (tmppath, path) == -1) {
+			msg_err ("cannot rename %s to %s: %s", tmppath, path,
+					strerror (errno));
+			unlink (tmppath);
+		}
+		else {
+			msg_info ("saved %ud records to %s", blk->nrows, path);
+		}
+	}
+
+	for (i = 0; i < LOG_COL_MAX; i ++) {
+		g_byte_array_set_size (blk->data[i], 0);
+
+		if (blk->offsets[i]) {
+			g_byte_array_set_size (blk->offsets[i], 0);
+		}
+	}
+
+	memset (blk->nested, 0, sizeof (blk->nested));
+	blk->nrows = 0;
+}
+
+static void
+rspamd_log_helper_flush_timer (gint fd, short what, gpointer ud)
+{
+	struct log_helper_ctx *ctx = ud;
+
+	rspamd_log_helper_flush (ctx);
+}
+
+static void
+rspamd_log_helper_read_records (gint fd, short what, gpointer ud)
+{
+	struct log_helper_ctx *ctx = ud;
+	gssize r;
+
+	r = read (fd, ctx->rec_buf, RSPAMD_LOG_RECORD_BUF_SIZE);
+
+	if (r > 0) {
+		if (!rspamd_log_record_parse (&ctx->rec, ctx->rec_buf, r)) {
+			msg_warn ("cannot parse record from log pipe: %z bytes", r);
+		}
+		else {
+			rspamd_log_helper_block_add (&ctx->block, &ctx->rec);
+
+			if (ctx->block.nrows >= ctx->batch_rows) {
+				rspamd_log_helper_flush (ctx);
+			}
+		}
+	}
+	else if (r == -1) {
+		if (errno != EAGAIN && errno != EINTR) {
+			msg_warn ("cannot read data from records pipe: %s",
+					strerror (errno));
+			event_del (&ctx->rec_ev);
+		}
+	}
+	else {
+		msg_warn ("cannot read data from records pipe: EOF");
+		event_del (&ctx->rec_ev);
+	}
+}
+
+static void
+rspamd_log_helper_records_reply_handler (struct rspamd_worker *worker,
+		struct rspamd_srv_reply *rep, gint rep_fd,
+		gpointer ud)
+{
+	struct log_helper_ctx *ctx = ud;
+	struct timeval tv;
+
+	close (ctx->rec_pair[1]);
+	msg_info ("start exporting records to %s", ctx->output_dir);
+	event_set (&ctx->rec_ev, ctx->rec_pair[0], EV_READ | EV_PERSIST,
+			rspamd_log_helper_read_records, ctx);
+	event_base_set (ctx->ev_base, &ctx->rec_ev);
+	event_add (&ctx->rec_ev, NULL);
+
+	event_set (&ctx->flush_ev, -1, EV_PERSIST, rspamd_log_helper_flush_timer,
+			ctx);
+	event_base_set (ctx->ev_base, &ctx->flush_ev);
+	double_to_tv (ctx->flush_interval, &tv);
+	event_add (&ctx->flush_ev, &tv);
+}
+
 static void
 rspamd_log_helper_reply_handler (struct rspamd_worker *worker,
 		struct rspamd_srv_reply *rep, gint rep_fd,
 		gpointer ud)
 {
 	struct log_helper_ctx *ctx = ud;
+	struct rspamd_srv_command srv_cmd;
 
 	close (ctx->pair[1]);
 	msg_info ("start waiting for log events");
@@ -177,6 +580,19 @@ rspamd_log_helper_reply_handler (struct rspamd_worker *worker,
 			rspamd_log_helper_read, ctx);
 	event_base_set (ctx->ev_base, &ctx->log_ev);
 	event_add (&ctx->log_ev, NULL);
+
+	if (ctx->rec_pair[1] != -1) {
+		/*
+		 * Replies are read from the same pipe, so we ask for records pipe
+		 * merely when the previous request is finished
+		 */
+		memset (&srv_cmd, 0, sizeof (srv_cmd));
+		srv_cmd.type = RSPAMD_SRV_LOG_PIPE;
+		srv_cmd.cmd.log_pipe.type = RSPAMD_LOG_PIPE_RECORDS;
+		rspamd_srv_send_command (worker, ctx->ev_base, &srv_cmd,
+				ctx->rec_pair[1], rspamd_log_helper_records_reply_handler,
+				ctx);
+	}
 }
 
 static void
@@ -211,11 +627,31 @@ start_log_helper (struct rspamd_worker *worker)
 		exit (EXIT_SUCCESS);
 	}
 
+	ctx->rec_pair[0] = -1;
+	ctx->rec_pair[1] = -1;
+
+	if (ctx->output_dir) {
+		if (ctx->batch_rows == 0) {
+			ctx->batch_rows = default_batch_rows;
+		}
+
+		if (rspamd_socketpair (ctx->rec_pair, FALSE) == -1) {
+			msg_err ("cannot create socketpair: %s, records are not exported",
+					strerror (errno));
+			ctx->rec_pair[0] = -1;
+			ctx->rec_pair[1] = -1;
+		}
+		else {
+			rspamd_log_helper_block_init (&ctx->block);
+			rspamd_log_record_init (&ctx->rec);
+			ctx->rec_buf = g_malloc (RSPAMD_LOG_RECORD_BUF_SIZE);
+		}
+	}
+
 	memset (&srv_cmd, 0, sizeof (srv_cmd));
 	srv_cmd.type = RSPAMD_SRV_LOG_PIPE;
 	srv_cmd.cmd.log_pipe.type = RSPAMD_LOG_PIPE_SYMBOLS;
 
-
 	/* Wait for startup being completed */
 	rspamd_mempool_lock_mutex (worker->srv->start_mtx);
 	rspamd_srv_send_command (worker, ctx->ev_base, &srv_cmd, ctx->pair[1],
@@ -225,6 +661,14 @@ start_log_helper (struct rspamd_worker *worker)
 			worker);
 	event_base_loop (ctx->ev_base, 0);
 	close (ctx->pair[0]);
+
+	if (ctx->rec_pair[0] != -1) {
+		rspamd_log_helper_flush (ctx);
+		close (ctx->rec_pair[0]);
+		rspamd_log_helper_block_destroy (&ctx->block);
+		rspamd_log_record_destroy (&ctx->rec);
+		g_free (ctx->rec_buf);
+	}
 	rspamd_worker_block_signals ();
 
 	rspamd_log_close (worker->srv->logger);
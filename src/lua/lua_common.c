@@ -1264,6 +1264,8 @@ lua_worker_get_stat (lua_State *L)
 		ucl_object_insert_key (top,
 			ucl_object_fromint (stat->control_connections_count),
 			"control_connections", 0, false);
+		ucl_object_insert_key (top,
+			ucl_object_fromint (stat->tasks_shed), "tasks_shed", 0, false);
 		ucl_object_insert_key (top,
 			ucl_object_fromint (mem_st.pools_allocated), "pools_allocated", 0,
 			false);
@@ -1280,6 +1282,8 @@ lua_worker_get_stat (lua_State *L)
 			"shared_chunks_allocated", 0, false);
 		ucl_object_insert_key (top,
 			ucl_object_fromint (mem_st.chunks_freed), "chunks_freed", 0, false);
+		ucl_object_insert_key (top,
+			ucl_object_fromint (mem_st.chunks_recycled), "chunks_recycled", 0, false);
 		ucl_object_insert_key (top,
 			ucl_object_fromint (
 				mem_st.oversized_chunks), "chunks_oversized", 0, false);
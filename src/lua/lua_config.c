@@ -1395,6 +1395,9 @@ lua_parse_symbol_type (const gchar *str)
 		else if (strcmp (str, "postfilter") == 0) {
 			ret = SYMBOL_TYPE_POSTFILTER|SYMBOL_TYPE_GHOST;
 		}
+		else if (strcmp (str, "connfilter") == 0) {
+			ret = SYMBOL_TYPE_CONNFILTER|SYMBOL_TYPE_GHOST;
+		}
 		else {
 			msg_warn ("bad type: %s", str);
 		}
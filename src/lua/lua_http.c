@@ -53,6 +53,9 @@ static const struct luaL_reg httplib_m[] = {
 
 #define RSPAMD_LUA_HTTP_FLAG_TEXT (1 << 0)
 #define RSPAMD_LUA_HTTP_FLAG_NOVERIFY (1 << 1)
+#define RSPAMD_LUA_HTTP_FLAG_REUSED (1 << 2)
+#define RSPAMD_LUA_HTTP_FLAG_KEEPALIVE (1 << 3)
+#define RSPAMD_LUA_HTTP_FLAG_RETRY (1 << 4)
 
 struct lua_http_cbdata {
 	lua_State *L;
@@ -96,10 +99,19 @@ lua_http_fin (gpointer arg)
 
 	luaL_unref (cbd->L, LUA_REGISTRYINDEX, cbd->cbref);
 	if (cbd->conn) {
-		/* Here we already have a connection, so we need to unref it */
-		rspamd_http_connection_unref (cbd->conn);
+		if ((cbd->flags & RSPAMD_LUA_HTTP_FLAG_KEEPALIVE) &&
+				rspamd_http_pool_release (cbd->cfg->http_pool, cbd->addr,
+						cbd->conn, cbd->fd)) {
+			/* Connection and socket are now owned by the pool */
+			cbd->fd = -1;
+		}
+		else {
+			/* Here we already have a connection, so we need to unref it */
+			rspamd_http_connection_unref (cbd->conn);
+		}
 	}
-	else if (cbd->msg != NULL) {
+
+	if (cbd->msg != NULL) {
 		/* We need to free message */
 		rspamd_http_message_unref (cbd->msg);
 	}
@@ -155,11 +167,39 @@ lua_http_push_error (struct lua_http_cbdata *cbd, const char *err)
 	}
 }
 
+static gboolean lua_http_make_connection (struct lua_http_cbdata *cbd);
+
 static void
 lua_http_error_handler (struct rspamd_http_connection *conn, GError *err)
 {
 	struct lua_http_cbdata *cbd = (struct lua_http_cbdata *)conn->ud;
 
+	if ((cbd->flags & RSPAMD_LUA_HTTP_FLAG_REUSED) && cbd->msg &&
+			(cbd->msg->method == HTTP_GET || cbd->msg->method == HTTP_HEAD ||
+					(cbd->flags & RSPAMD_LUA_HTTP_FLAG_RETRY)) &&
+			rspamd_http_connection_is_stale (conn, err)) {
+		/*
+		 * Peer has closed persistent connection before getting our request,
+		 * so we just repeat it using a new connection. Other methods are
+		 * repeated only if caller allows that, as they might be not idempotent
+		 */
+		msg_debug ("persistent connection to %V has been closed: %s",
+				cbd->msg->host, err->message);
+		rspamd_http_connection_unref (cbd->conn);
+		cbd->conn = NULL;
+		close (cbd->fd);
+		cbd->fd = -1;
+
+		if (lua_http_make_connection (cbd)) {
+			return;
+		}
+
+		lua_http_push_error (cbd, "unable to make connection to the host");
+		lua_http_maybe_free (cbd);
+
+		return;
+	}
+
 	lua_http_push_error (cbd, err->message);
 	lua_http_maybe_free (cbd);
 }
@@ -173,6 +213,10 @@ lua_http_finish_handler (struct rspamd_http_connection *conn,
 	const gchar *body;
 	gsize body_len;
 
+	if (cbd->cfg && (msg->flags & RSPAMD_HTTP_FLAG_KEEP_ALIVE)) {
+		cbd->flags |= RSPAMD_LUA_HTTP_FLAG_KEEPALIVE;
+	}
+
 	lua_rawgeti (cbd->L, LUA_REGISTRYINDEX, cbd->cbref);
 	/* Error */
 	lua_pushnil (cbd->L);
@@ -221,8 +265,39 @@ static gboolean
 lua_http_make_connection (struct lua_http_cbdata *cbd)
 {
 	int fd;
+	gboolean persistent;
 
 	rspamd_inet_address_set_port (cbd->addr, cbd->msg->port);
+	/* Keys and TLS sessions are not shared between requests */
+	persistent = cbd->cfg != NULL && cbd->local_kp == NULL &&
+			cbd->peer_pk == NULL && !(cbd->msg->flags & RSPAMD_HTTP_FLAG_SSL);
+
+	if (persistent && !(cbd->flags & RSPAMD_LUA_HTTP_FLAG_REUSED)) {
+		cbd->conn = rspamd_http_pool_acquire (cbd->cfg->http_pool,
+				cbd->addr,
+				lua_http_error_handler,
+				lua_http_finish_handler,
+				RSPAMD_HTTP_CLIENT_SIMPLE,
+				&cbd->fd);
+
+		if (cbd->conn) {
+			cbd->flags |= RSPAMD_LUA_HTTP_FLAG_REUSED;
+			cbd->msg->flags |= RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+
+			if (cbd->max_size) {
+				rspamd_http_connection_set_max_size (cbd->conn, cbd->max_size);
+			}
+
+			/* Keep message to repeat request if connection is stale */
+			rspamd_http_connection_write_message (cbd->conn,
+					rspamd_http_message_ref (cbd->msg),
+					cbd->host, cbd->mime_type, cbd, cbd->fd,
+					&cbd->tv, cbd->ev_base);
+
+			return TRUE;
+		}
+	}
+
 	fd = rspamd_inet_address_connect (cbd->addr, SOCK_STREAM, TRUE);
 
 	if (fd == -1) {
@@ -263,6 +338,10 @@ lua_http_make_connection (struct lua_http_cbdata *cbd)
 			cbd->msg->flags |= RSPAMD_HTTP_FLAG_SSL_NOVERIFY;
 		}
 
+		if (persistent) {
+			cbd->msg->flags |= RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+		}
+
 		if (cbd->max_size) {
 			rspamd_http_connection_set_max_size (cbd->conn, cbd->max_size);
 		}
@@ -339,6 +418,7 @@ lua_http_push_headers (lua_State *L, struct rspamd_http_message *msg)
  * @param {string} mime_type MIME type of the HTTP content (for example, `text/html`)
  * @param {string/text} body full body content, can be opaque `rspamd{text}` to avoid data copying
  * @param {number} timeout floating point request timeout value in seconds (default is 5.0 seconds)
+ * @param {boolean} retry repeat request if a persistent connection has been closed by a peer before getting it, this is always done for `GET` and `HEAD` requests
  * @return {boolean} `true` if a request has been successfully scheduled. If this value is `false` then some error occurred, the callback thus will not be called
  */
 static gint
@@ -583,6 +663,15 @@ lua_http_request (lua_State *L)
 		}
 
 		lua_pop (L, 1);
+
+		lua_pushstring (L, "retry");
+		lua_gettable (L, 1);
+
+		if (!!lua_toboolean (L, -1)) {
+			flags |= RSPAMD_LUA_HTTP_FLAG_RETRY;
+		}
+
+		lua_pop (L, 1);
 	}
 	else {
 		msg_err ("http request has bad params");
@@ -20,7 +20,7 @@
 #include "utlist.h"
 #include "unix-std.h"
 #include "libmime/smtp_parsers.h"
-#include "libserver/mempool_vars_internal.h"
+#include "libutil/mempool_vars_internal.h"
 #include <math.h>
 
 /***
@@ -3583,16 +3583,16 @@ lua_task_set_milter_reply (lua_State *L)
 	reply = ucl_object_lua_import (L, 2);
 
 	if (reply != NULL && task != NULL) {
-		prev = rspamd_mempool_get_variable (task->task_pool,
-				RSPAMD_MEMPOOL_MILTER_REPLY);
+		prev = rspamd_mempool_get_variable_idx (task->task_pool,
+				RSPAMD_MEMPOOL_VAR_MILTER_REPLY);
 
 		if (prev) {
 			ucl_object_merge (prev, reply, false);
 			ucl_object_unref (reply);
 		}
 		else {
-			rspamd_mempool_set_variable (task->task_pool,
-					RSPAMD_MEMPOOL_MILTER_REPLY,
+			rspamd_mempool_set_variable_idx (task->task_pool,
+					RSPAMD_MEMPOOL_VAR_MILTER_REPLY,
 					reply, (rspamd_mempool_destruct_t) ucl_object_unref);
 		}
 	}
@@ -3670,7 +3670,8 @@ lua_task_get_settings_id (lua_State *L)
 	guint32 *hp;
 
 	if (task != NULL) {
-		hp = rspamd_mempool_get_variable (task->task_pool, "settings_hash");
+		hp = rspamd_mempool_get_variable_idx (task->task_pool,
+				RSPAMD_MEMPOOL_VAR_SETTINGS_HASH);
 
 		if (hp) {
 			lua_pushnumber (L, *hp);
@@ -38,7 +38,7 @@
 #include "rspamd.h"
 #include "utlist.h"
 #include "lua/lua_common.h"
-#include "libserver/mempool_vars_internal.h"
+#include "libutil/mempool_vars_internal.h"
 
 #define DEFAULT_SYMBOL_REJECT "R_DKIM_REJECT"
 #define DEFAULT_SYMBOL_TEMPFAIL "R_DKIM_TEMPFAIL"
@@ -67,7 +67,7 @@ struct dkim_ctx {
 
 	rspamd_mempool_t *dkim_pool;
 	radix_compressed_t *whitelist_ip;
-	GHashTable *dkim_domains;
+	struct rspamd_hash_map_helper *dkim_domains;
 	guint strict_multiplier;
 	guint time_jitter;
 	rspamd_lru_hash_t *dkim_hash;
@@ -771,7 +771,8 @@ lua_dkim_sign_handler (lua_State *L)
 	if (hdr) {
 
 		if (!no_cache) {
-			rspamd_mempool_set_variable (task->task_pool, "dkim-signature",
+			rspamd_mempool_set_variable_idx (task->task_pool,
+					RSPAMD_MEMPOOL_VAR_DKIM_SIGNATURE,
 					hdr, rspamd_gstring_free_hard);
 		}
 
@@ -798,7 +799,7 @@ dkim_module_reconfig (struct rspamd_config *cfg)
 	radix_destroy_compressed (dkim_module_ctx->whitelist_ip);
 
 	if (dkim_module_ctx->dkim_domains) {
-		g_hash_table_destroy (dkim_module_ctx->dkim_domains);
+		rspamd_hash_map_destroy (dkim_module_ctx->dkim_domains);
 	}
 
 	if (dkim_module_ctx->dkim_hash) {
@@ -862,7 +863,7 @@ dkim_module_check (struct dkim_check_result *res)
 			if (dkim_module_ctx->dkim_domains != NULL) {
 				/* Perform strict check */
 				if ((strict_value =
-						g_hash_table_lookup (dkim_module_ctx->dkim_domains,
+						rspamd_match_hash_map (dkim_module_ctx->dkim_domains,
 								rspamd_dkim_get_domain (cur->ctx))) != NULL) {
 					if (!dkim_module_parse_strict (strict_value, &cur->mult_allow,
 							&cur->mult_deny)) {
@@ -978,8 +979,8 @@ dkim_symbol_callback (struct rspamd_task *task, void *unused)
 	guint checked = 0, i, *dmarc_checks;
 
 	/* Allow dmarc */
-	dmarc_checks = rspamd_mempool_get_variable (task->task_pool,
-			RSPAMD_MEMPOOL_DMARC_CHECKS);
+	dmarc_checks = rspamd_mempool_get_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_DMARC_CHECKS);
 
 	if (dmarc_checks) {
 		(*dmarc_checks) ++;
@@ -988,8 +989,8 @@ dkim_symbol_callback (struct rspamd_task *task, void *unused)
 		dmarc_checks = rspamd_mempool_alloc (task->task_pool,
 				sizeof (*dmarc_checks));
 		*dmarc_checks = 1;
-		rspamd_mempool_set_variable (task->task_pool,
-				RSPAMD_MEMPOOL_DMARC_CHECKS,
+		rspamd_mempool_set_variable_idx (task->task_pool,
+				RSPAMD_MEMPOOL_VAR_DMARC_CHECKS,
 				dmarc_checks, NULL);
 	}
 
@@ -1066,7 +1067,7 @@ dkim_symbol_callback (struct rspamd_task *task, void *unused)
 
 				if (dkim_module_ctx->trusted_only &&
 						(dkim_module_ctx->dkim_domains == NULL ||
-								g_hash_table_lookup (dkim_module_ctx->dkim_domains,
+								rspamd_match_hash_map (dkim_module_ctx->dkim_domains,
 										rspamd_dkim_get_domain (ctx)) == NULL)) {
 					msg_debug_task ("skip dkim check for %s domain",
 							rspamd_dkim_get_domain (ctx));
@@ -1315,8 +1316,8 @@ dkim_sign_callback (struct rspamd_task *task, void *unused)
 						ctx);
 
 				if (hdr) {
-					rspamd_mempool_set_variable (task->task_pool,
-							"dkim-signature",
+					rspamd_mempool_set_variable_idx (task->task_pool,
+							RSPAMD_MEMPOOL_VAR_DKIM_SIGNATURE,
 							hdr, rspamd_gstring_free_hard);
 				}
 
@@ -42,6 +42,7 @@
 #include "unix-std.h"
 #include "libutil/http_private.h"
 #include "libstat/stat_api.h"
+#include "libutil/mempool_vars_internal.h"
 #include <math.h>
 
 #define DEFAULT_SYMBOL "R_FUZZY_HASH"
@@ -1259,6 +1260,11 @@ fuzzy_cmd_hash (struct fuzzy_rule *rule,
 struct rspamd_cached_shingles {
 	struct rspamd_shingle *sh;
 	guchar digest[rspamd_cryptobox_HASHBYTES];
+	/* Shingles depend on object, algorithm and shingles key */
+	gpointer p;
+	enum rspamd_shingle_alg alg;
+	gint key_part;
+	struct rspamd_cached_shingles *next;
 };
 
 static struct rspamd_cached_shingles *
@@ -1266,14 +1272,21 @@ fuzzy_cmd_get_cached (struct fuzzy_rule *rule,
 		rspamd_mempool_t *pool,
 		gpointer p)
 {
-	gchar key[32];
+	struct rspamd_cached_shingles *cur;
 	gint key_part;
 
 	memcpy (&key_part, rule->shingles_key->str, sizeof (key_part));
-	rspamd_snprintf (key, sizeof (key), "%p%s%d", p, rule->algorithm_str,
-			key_part);
+	cur = rspamd_mempool_get_variable_idx (pool,
+			RSPAMD_MEMPOOL_VAR_FUZZY_SHINGLES);
+
+	LL_FOREACH (cur, cur) {
+		if (cur->p == p && cur->alg == rule->alg &&
+				cur->key_part == key_part) {
+			return cur;
+		}
+	}
 
-	return rspamd_mempool_get_variable (pool, key);
+	return NULL;
 }
 
 static void
@@ -1282,14 +1295,16 @@ fuzzy_cmd_set_cached (struct fuzzy_rule *rule,
 		gpointer p,
 		struct rspamd_cached_shingles *data)
 {
-	gchar key[32];
-	gint key_part;
-
-	memcpy (&key_part, rule->shingles_key->str, sizeof (key_part));
-	rspamd_snprintf (key, sizeof (key), "%p%s%d", p, rule->algorithm_str,
-			key_part);
-	/* Key is copied */
-	rspamd_mempool_set_variable (pool, key, data, NULL);
+	struct rspamd_cached_shingles *head;
+
+	memcpy (&data->key_part, rule->shingles_key->str, sizeof (data->key_part));
+	data->p = p;
+	data->alg = rule->alg;
+	head = rspamd_mempool_get_variable_idx (pool,
+			RSPAMD_MEMPOOL_VAR_FUZZY_SHINGLES);
+	LL_PREPEND (head, data);
+	rspamd_mempool_set_variable_idx (pool, RSPAMD_MEMPOOL_VAR_FUZZY_SHINGLES,
+			head, NULL);
 }
 
 /*
@@ -1865,11 +1880,13 @@ fuzzy_check_try_read (struct fuzzy_client_session *session)
 					pval->fuzzy_cnt = rep->flag;
 					pval->name = session->rule->name;
 
-					res = rspamd_mempool_get_variable (task->task_pool, "fuzzy_stat");
+					res = rspamd_mempool_get_variable_idx (task->task_pool,
+							RSPAMD_MEMPOOL_VAR_FUZZY_STAT);
 
 					if (res == NULL) {
 						res = g_list_append (NULL, pval);
-						rspamd_mempool_set_variable (task->task_pool, "fuzzy_stat",
+						rspamd_mempool_set_variable_idx (task->task_pool,
+								RSPAMD_MEMPOOL_VAR_FUZZY_STAT,
 								res, (rspamd_mempool_destruct_t)g_list_free);
 					}
 					else {
@@ -425,6 +425,8 @@ if opts then
       callback = greylist_set,
       priority = 6
     })
+    -- Not a connection filter: greylisting keys include a hash of the message
+    -- body, and both keys are checked together
     rspamd_config:register_symbol({
       name = 'GREYLIST_CHECK',
       type = 'prefilter',
@@ -86,7 +86,13 @@ local function ip_to_rbl(ip, rbl)
   return table.concat(ip:inversed_str_octets(), '.') .. '.' .. rbl
 end
 
-local function rbl_cb (task)
+-- RBLs that need neither message headers nor other symbols can be checked
+-- before the message is parsed
+local function is_envelope_rbl(rbl)
+  return not (rbl['received'] or rbl['emails'] or rbl['dkim'])
+end
+
+local function rbl_cb (task, envelope)
   local function gen_rbl_callback(rule)
     return function (_, to_resolve, results, err)
       if err and (err ~= 'requested record is not found' and err ~= 'no records with this name') then
@@ -163,6 +169,10 @@ local function rbl_cb (task)
   local notgot = {}
 
   local alive_rbls = fun.filter(function(_, rbl)
+    if is_envelope_rbl(rbl) ~= envelope then
+      return false
+    end
+
     if rbl.monitored then
       if not rbl.monitored:alive() then
         return false
@@ -452,7 +462,18 @@ local need_dkim = false
 
 local id = rspamd_config:register_symbol({
   type = 'callback',
-  callback = rbl_cb,
+  callback = function(task)
+    rbl_cb(task, false)
+  end,
+  flags = 'empty,nice'
+})
+-- Started after settings are applied, see settings plugin
+local envelope_id = rspamd_config:register_symbol({
+  name = 'RBL_ENVELOPE_CHECK',
+  type = 'connfilter',
+  callback = function(task)
+    rbl_cb(task, true)
+  end,
   flags = 'empty,nice'
 })
 
@@ -466,12 +487,16 @@ for key,rbl in pairs(opts['rbls']) do
       end
     end
     if not rbl['enabled'] then return end
+    local parent = id
+    if is_envelope_rbl(rbl) then
+      parent = envelope_id
+    end
     if type(rbl['returncodes']) == 'table' then
       for s,_ in pairs(rbl['returncodes']) do
         if type(rspamd_config.get_api_version) ~= 'nil' then
           rspamd_config:register_symbol({
             name = s,
-            parent = id,
+            parent = parent,
             type = 'virtual'
           })
 
@@ -513,7 +538,7 @@ for key,rbl in pairs(opts['rbls']) do
     if type(rspamd_config.get_api_version) ~= 'nil' and rbl['symbol'] then
       rspamd_config:register_symbol({
         name = rbl['symbol'],
-        parent = id,
+        parent = parent,
         type = 'virtual'
       })
 
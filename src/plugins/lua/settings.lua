@@ -641,6 +641,8 @@ if redis_section then
     end
   end
 
+  -- Handlers are arbitrary user functions that may need the message, so they
+  -- cannot be started as connection filters
   fun.each(function(id, h)
     rspamd_config:register_symbol({
       name = 'REDIS_SETTINGS' .. tostring(id),
@@ -662,9 +664,31 @@ elseif set_section and type(set_section) == "table" then
   process_settings_table(set_section)
 end
 
+-- Settings are checked before the message is parsed if SMTP sender and
+-- recipients are known, as rules would match MIME addresses otherwise
+local function check_settings_envelope(task)
+  if task:get_from('smtp') and task:get_recipients('smtp') then
+    task:cache_set('settings_checked', true)
+    check_settings(task)
+  end
+end
+
+local function check_settings_message(task)
+  if not task:cache_get('settings_checked') then
+    check_settings(task)
+  end
+end
+
+-- Connection filters are started in priority order, so this one goes first
+rspamd_config:register_symbol({
+  name = 'SETTINGS_ENVELOPE_CHECK',
+  type = 'connfilter',
+  callback = check_settings_envelope,
+  priority = 10
+})
 rspamd_config:register_symbol({
   name = 'SETTINGS_CHECK',
   type = 'prefilter',
-  callback = check_settings,
+  callback = check_settings_message,
   priority = 10
 })
@@ -33,7 +33,7 @@
 #include "libutil/hash.h"
 #include "libutil/map.h"
 #include "rspamd.h"
-#include "libserver/mempool_vars_internal.h"
+#include "libutil/mempool_vars_internal.h"
 
 #define DEFAULT_SYMBOL_FAIL "R_SPF_FAIL"
 #define DEFAULT_SYMBOL_SOFTFAIL "R_SPF_SOFTFAIL"
@@ -279,12 +279,13 @@ spf_module_config (struct rspamd_config *cfg)
 				&spf_module_ctx->whitelist_ip, NULL);
 	}
 
+	/* SPF uses envelope sender, HELO and IP only, so it can start early */
 	cb_id = rspamd_symbols_cache_add_symbol (cfg->cache,
 		spf_module_ctx->symbol_fail,
 		0,
 		spf_symbol_callback,
 		NULL,
-		SYMBOL_TYPE_NORMAL|SYMBOL_TYPE_FINE|SYMBOL_TYPE_EMPTY, -1);
+		SYMBOL_TYPE_CONNFILTER|SYMBOL_TYPE_FINE|SYMBOL_TYPE_EMPTY, -1);
 	rspamd_symbols_cache_add_symbol (cfg->cache,
 			spf_module_ctx->symbol_softfail, 0,
 			NULL, NULL,
@@ -557,8 +558,8 @@ spf_symbol_callback (struct rspamd_task *task, void *unused)
 	gint *dmarc_checks;
 
 	/* Allow dmarc */
-	dmarc_checks = rspamd_mempool_get_variable (task->task_pool,
-			RSPAMD_MEMPOOL_DMARC_CHECKS);
+	dmarc_checks = rspamd_mempool_get_variable_idx (task->task_pool,
+			RSPAMD_MEMPOOL_VAR_DMARC_CHECKS);
 
 	if (dmarc_checks) {
 		(*dmarc_checks) ++;
@@ -567,8 +568,8 @@ spf_symbol_callback (struct rspamd_task *task, void *unused)
 		dmarc_checks = rspamd_mempool_alloc (task->task_pool,
 				sizeof (*dmarc_checks));
 		*dmarc_checks = 1;
-		rspamd_mempool_set_variable (task->task_pool,
-				RSPAMD_MEMPOOL_DMARC_CHECKS,
+		rspamd_mempool_set_variable_idx (task->task_pool,
+				RSPAMD_MEMPOOL_VAR_DMARC_CHECKS,
 				dmarc_checks, NULL);
 	}
 
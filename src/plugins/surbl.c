@@ -285,11 +285,7 @@ surbl_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 	surbl_module_ctx->surbl_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
 
 	surbl_module_ctx->redirectors = NULL;
-	surbl_module_ctx->whitelist = g_hash_table_new (rspamd_strcase_hash,
-			rspamd_strcase_equal);
-	rspamd_mempool_add_destructor (surbl_module_ctx->surbl_pool,
-			(rspamd_mempool_destruct_t) g_hash_table_destroy,
-			surbl_module_ctx->whitelist);
+	surbl_module_ctx->whitelist = NULL;
 	surbl_module_ctx->exceptions = rspamd_mempool_alloc0 (
 			surbl_module_ctx->surbl_pool, MAX_LEVELS * sizeof (GHashTable *));
 	surbl_module_ctx->redirector_cbid = -1;
@@ -952,16 +948,12 @@ surbl_module_reconfig (struct rspamd_config *cfg)
 	surbl_module_ctx->surbl_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
 
 	surbl_module_ctx->redirectors = NULL;
-	surbl_module_ctx->whitelist = g_hash_table_new (rspamd_strcase_hash,
-			rspamd_strcase_equal);
+	surbl_module_ctx->whitelist = NULL;
 	/* Zero exceptions hashes */
 	surbl_module_ctx->exceptions = rspamd_mempool_alloc0 (
 		surbl_module_ctx->surbl_pool,
 		MAX_LEVELS * sizeof (GHashTable *));
 	/* Register destructors */
-	rspamd_mempool_add_destructor (surbl_module_ctx->surbl_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_destroy,
-		surbl_module_ctx->whitelist);
 	rspamd_mempool_add_destructor (surbl_module_ctx->surbl_pool,
 		(rspamd_mempool_destruct_t) g_hash_table_destroy,
 		surbl_module_ctx->redirector_tlds);
@@ -1109,7 +1101,7 @@ format_surbl_request (rspamd_mempool_t * pool,
 	url->surbllen = r;
 
 	if (!forced &&
-			g_hash_table_lookup (surbl_module_ctx->whitelist, result) != NULL) {
+			rspamd_match_hash_map (surbl_module_ctx->whitelist, result) != NULL) {
 		msg_debug_pool ("url %s is whitelisted", result);
 		g_set_error (err, SURBL_ERROR,
 				WHITELIST_ERROR,
@@ -27,7 +27,7 @@ struct surbl_ctx {
 	gchar *metric;
 	const gchar *redirector_symbol;
 	GHashTable **exceptions;
-	GHashTable *whitelist;
+	struct rspamd_hash_map_helper *whitelist;
 	void *redirector_map_data;
 	GHashTable *redirector_tlds;
 	guint use_redirector;
@@ -28,6 +28,8 @@ extern struct rspamadm_command grep_command;
 extern struct rspamadm_command signtool_command;
 extern struct rspamadm_command lua_command;
 extern struct rspamadm_command dkim_keygen_command;
+extern struct rspamadm_command zstd_train_command;
+extern struct rspamadm_command compile_map_command;
 
 const struct rspamadm_command *commands[] = {
 	&help_command,
@@ -44,6 +46,8 @@ const struct rspamadm_command *commands[] = {
 	&signtool_command,
 	&lua_command,
 	&dkim_keygen_command,
+	&zstd_train_command,
+	&compile_map_command,
 	NULL
 };
 
@@ -0,0 +1,166 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "printf.h"
+#include "util.h"
+#include "libutil/map.h"
+#include "libutil/map_private.h"
+
+static gchar *output = NULL;
+static gchar *type = "hosts";
+
+static void rspamadm_compile_map (gint argc, gchar **argv);
+static const char *rspamadm_compile_map_help (gboolean full_help);
+
+struct rspamadm_command compile_map_command = {
+		.name = "compile_map",
+		.flags = 0,
+		.help = rspamadm_compile_map_help,
+		.run = rspamadm_compile_map
+};
+
+static GOptionEntry entries[] = {
+		{"output",  'o', 0, G_OPTION_ARG_STRING, &output,
+				"Save compiled map to the specified file", NULL},
+		{"type",  't', 0, G_OPTION_ARG_STRING, &type,
+				"Map type: hosts, kv or radix (hosts by default)", NULL},
+		{NULL,       0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+static const char *
+rspamadm_compile_map_help (gboolean full_help)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Compile map to binary format\n\n"
+				"Usage: rspamadm compile_map [-t type] [-o file] <map>\n"
+				"Where options are:\n\n"
+				"-t: map type: hosts, kv or radix\n"
+				"-o: save compiled map to file instead of <map>.bin\n"
+				"--help: shows available options and commands\n\n"
+				"Compiled map could be used instead of the source file in "
+				"any file map of\nthe same type. It is mapped to memory "
+				"and shared by all workers.";
+	}
+	else {
+		help_str = "Compile maps to binary format";
+	}
+
+	return help_str;
+}
+
+static void
+rspamadm_compile_map (gint argc, gchar **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct rspamd_map map;
+	struct map_cb_data cbdata;
+	map_cb_t read_cb;
+	map_fin_cb_t fin_cb;
+	GByteArray *out;
+	gchar *data, *outname;
+	gsize len;
+
+	context = g_option_context_new (
+			"compile_map - compile maps to binary format");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd administration utility version "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	if (argc < 2) {
+		rspamd_fprintf (stderr, "no map specified\n");
+		exit (EXIT_FAILURE);
+	}
+
+	if (g_ascii_strcasecmp (type, "hosts") == 0) {
+		read_cb = rspamd_hosts_read;
+		fin_cb = rspamd_hosts_fin;
+	}
+	else if (g_ascii_strcasecmp (type, "kv") == 0) {
+		read_cb = rspamd_kv_list_read;
+		fin_cb = rspamd_kv_list_fin;
+	}
+	else if (g_ascii_strcasecmp (type, "radix") == 0) {
+		read_cb = rspamd_radix_read;
+		fin_cb = rspamd_radix_fin;
+	}
+	else {
+		rspamd_fprintf (stderr, "invalid map type: %s\n", type);
+		exit (EXIT_FAILURE);
+	}
+
+	if (!g_file_get_contents (argv[1], &data, &len, &error)) {
+		rspamd_fprintf (stderr, "cannot read %s: %e\n", argv[1], error);
+		g_error_free (error);
+		exit (EXIT_FAILURE);
+	}
+
+	memset (&map, 0, sizeof (map));
+	memset (&cbdata, 0, sizeof (cbdata));
+	map.name = argv[1];
+	map.compile_mode = RSPAMD_MAP_COMPILE_NEVER;
+	cbdata.map = &map;
+
+	read_cb (data, len, &cbdata, TRUE);
+	fin_cb (&cbdata);
+
+	if (cbdata.cur_data == NULL) {
+		rspamd_fprintf (stderr, "no data has been read from %s\n", argv[1]);
+		exit (EXIT_FAILURE);
+	}
+
+	out = g_byte_array_new ();
+
+	if (!rspamd_map_compile_data (read_cb, cbdata.cur_data, out, &error)) {
+		rspamd_fprintf (stderr, "cannot compile %s: %e\n", argv[1], error);
+		g_error_free (error);
+		exit (EXIT_FAILURE);
+	}
+
+	if (output) {
+		outname = g_strdup (output);
+	}
+	else {
+		outname = g_strdup_printf ("%s.bin", argv[1]);
+	}
+
+	if (!g_file_set_contents (outname, (const gchar *)out->data, out->len,
+			&error)) {
+		rspamd_fprintf (stderr, "cannot write %s: %e\n", outname, error);
+		g_error_free (error);
+		exit (EXIT_FAILURE);
+	}
+
+	rspamd_printf ("compiled %s map %s: %ud bytes saved to %s\n", type,
+			argv[1], out->len, outname);
+
+	g_free (outname);
+	g_free (data);
+	g_byte_array_free (out, TRUE);
+	g_option_context_free (context);
+}
@@ -81,7 +81,8 @@ rspamadm_control_help (gboolean full_help)
 				"Supported commands:\n"
 				"stat - show statistics\n"
 				"reload - reload workers dynamic data\n"
-				"reresolve - resolve upstreams addresses\n";
+				"reresolve - resolve upstreams addresses\n"
+				"memtrace - show traced memory pool allocations\n";
 	}
 	else {
 		help_str = "Manage rspamd main control interface";
@@ -212,6 +213,10 @@ rspamadm_control (gint argc, gchar **argv)
 			g_ascii_strcasecmp (cmd, "fuzzy_sync") == 0) {
 		path = "/fuzzysync";
 	}
+	else if (g_ascii_strcasecmp (cmd, "memtrace") == 0 ||
+			g_ascii_strcasecmp (cmd, "memory_trace") == 0) {
+		path = "/memtrace";
+	}
 	else {
 		rspamd_fprintf (stderr, "unknown command: %s\n", cmd);
 		exit (1);
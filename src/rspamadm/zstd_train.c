@@ -0,0 +1,278 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "printf.h"
+#include "util.h"
+#include "unix-std.h"
+#include "contrib/zstd/zdict.h"
+
+static gchar *output = "rspamd.zstd";
+static guint dict_size = 112640;
+static guint sample_size = 131072;
+static guint max_samples = 0;
+static gdouble probability = 1.0;
+
+static void rspamadm_zstd_train (gint argc, gchar **argv);
+static const char *rspamadm_zstd_train_help (gboolean full_help);
+
+struct rspamadm_command zstd_train_command = {
+		.name = "zstd_train",
+		.flags = 0,
+		.help = rspamadm_zstd_train_help,
+		.run = rspamadm_zstd_train
+};
+
+static GOptionEntry entries[] = {
+		{"output",  'o', 0, G_OPTION_ARG_STRING, &output,
+				"Save dictionary to the specified file", NULL},
+		{"size",  's', 0, G_OPTION_ARG_INT, &dict_size,
+				"Maximum dictionary size (110K by default)", NULL},
+		{"sample",  'm', 0, G_OPTION_ARG_INT, &sample_size,
+				"Use at most N bytes from each message (128K by default)", NULL},
+		{"max-samples",  'n', 0, G_OPTION_ARG_INT, &max_samples,
+				"Use at most N messages", NULL},
+		{"probability",  'p', 0, G_OPTION_ARG_DOUBLE, &probability,
+				"Use each message with the specified probability", NULL},
+		{NULL,       0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+struct rspamadm_zstd_samples {
+	GByteArray *data;
+	GArray *sizes;
+};
+
+static const char *
+rspamadm_zstd_train_help (gboolean full_help)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Train zstd dictionary for proxy to scanner transport\n\n"
+				"Usage: rspamadm zstd_train [-o file] [-s size] [-m size] "
+				"[-n count] [-p probability] <file|dir> ...\n"
+				"Where options are:\n\n"
+				"-o: save dictionary to file instead of rspamd.zstd\n"
+				"-s: maximum dictionary size\n"
+				"-m: use at most the specified number of bytes from each message\n"
+				"-n: use at most the specified number of messages\n"
+				"-p: sample messages with the specified probability\n"
+				"--help: shows available options and commands\n\n"
+				"Directories are scanned recursively, symlinked directories "
+				"inside them are skipped.\nThe resulting file "
+				"could be used as\nboth `zstd_input_dictionary` and "
+				"`zstd_output_dictionary` options.";
+	}
+	else {
+		help_str = "Train zstd dictionaries";
+	}
+
+	return help_str;
+}
+
+static gboolean
+rspamadm_zstd_samples_full (struct rspamadm_zstd_samples *samples)
+{
+	return max_samples > 0 && samples->sizes->len >= max_samples;
+}
+
+static void
+rspamadm_zstd_add_file (struct rspamadm_zstd_samples *samples,
+		const gchar *path)
+{
+	gint fd;
+	gssize r;
+	gsize len, old_len;
+
+	if (rspamadm_zstd_samples_full (samples)) {
+		return;
+	}
+
+	if (probability < 1.0 && rspamd_random_double_fast () >= probability) {
+		return;
+	}
+
+	fd = open (path, O_RDONLY);
+
+	if (fd == -1) {
+		rspamd_fprintf (stderr, "cannot open %s: %s\n", path, strerror (errno));
+		return;
+	}
+
+	old_len = samples->data->len;
+	g_byte_array_set_size (samples->data, old_len + sample_size);
+	len = 0;
+
+	while (len < sample_size) {
+		r = read (fd, samples->data->data + old_len + len, sample_size - len);
+
+		if (r <= 0) {
+			if (r == -1) {
+				rspamd_fprintf (stderr, "cannot read %s: %s\n", path,
+						strerror (errno));
+				len = 0;
+			}
+
+			break;
+		}
+
+		len += r;
+	}
+
+	close (fd);
+	g_byte_array_set_size (samples->data, old_len + len);
+
+	if (len > 0) {
+		g_array_append_val (samples->sizes, len);
+	}
+}
+
+/*
+ * Symlinks found while walking directories are followed for files only, so
+ * loops of symlinked directories are not possible
+ */
+static void
+rspamadm_zstd_add_path (struct rspamadm_zstd_samples *samples,
+		const gchar *path, gboolean toplevel)
+{
+	GDir *dir;
+	GError *err = NULL;
+	const gchar *name;
+	gchar *fpath;
+	struct stat st;
+
+	if (lstat (path, &st) == -1) {
+		rspamd_fprintf (stderr, "cannot stat %s: %s\n", path, strerror (errno));
+		return;
+	}
+
+	if (S_ISLNK (st.st_mode)) {
+		if (stat (path, &st) == -1) {
+			rspamd_fprintf (stderr, "cannot stat %s: %s\n", path,
+					strerror (errno));
+			return;
+		}
+
+		if (S_ISDIR (st.st_mode) && !toplevel) {
+			rspamd_fprintf (stderr, "skip symlinked directory %s\n", path);
+			return;
+		}
+	}
+
+	if (S_ISREG (st.st_mode)) {
+		rspamadm_zstd_add_file (samples, path);
+		return;
+	}
+	else if (!S_ISDIR (st.st_mode)) {
+		/* Sockets, fifos and devices are not samples */
+		return;
+	}
+
+	dir = g_dir_open (path, 0, &err);
+
+	if (dir == NULL) {
+		rspamd_fprintf (stderr, "cannot open directory %s: %e\n", path, err);
+		g_error_free (err);
+		return;
+	}
+
+	while ((name = g_dir_read_name (dir)) != NULL &&
+			!rspamadm_zstd_samples_full (samples)) {
+		fpath = g_build_filename (path, name, NULL);
+		rspamadm_zstd_add_path (samples, fpath, FALSE);
+		g_free (fpath);
+	}
+
+	g_dir_close (dir);
+}
+
+static void
+rspamadm_zstd_train (gint argc, gchar **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct rspamadm_zstd_samples samples;
+	gpointer dict;
+	gsize dict_len;
+	FILE *f;
+	gint i;
+
+	context = g_option_context_new (
+			"zstd_train - train zstd dictionaries");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd administration utility version "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	if (argc < 2) {
+		rspamd_fprintf (stderr, "no samples specified\n");
+		exit (EXIT_FAILURE);
+	}
+
+	if (dict_size < 1024 || sample_size == 0) {
+		rspamd_fprintf (stderr, "invalid dictionary or sample size\n");
+		exit (EXIT_FAILURE);
+	}
+
+	samples.data = g_byte_array_new ();
+	samples.sizes = g_array_new (FALSE, FALSE, sizeof (gsize));
+
+	for (i = 1; i < argc; i ++) {
+		rspamadm_zstd_add_path (&samples, argv[i], TRUE);
+	}
+
+	if (samples.sizes->len == 0) {
+		rspamd_fprintf (stderr, "no samples have been read\n");
+		exit (EXIT_FAILURE);
+	}
+
+	dict = g_malloc (dict_size);
+	dict_len = ZDICT_trainFromBuffer (dict, dict_size, samples.data->data,
+			(const size_t *)samples.sizes->data, samples.sizes->len);
+
+	if (ZDICT_isError (dict_len)) {
+		rspamd_fprintf (stderr, "cannot train dictionary from %ud samples: %s\n",
+				samples.sizes->len, ZDICT_getErrorName (dict_len));
+		exit (EXIT_FAILURE);
+	}
+
+	f = fopen (output, "w");
+
+	if (f == NULL || fwrite (dict, 1, dict_len, f) != dict_len) {
+		rspamd_fprintf (stderr, "cannot write dictionary to %s: %s\n",
+				output, strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+
+	fclose (f);
+	rspamd_printf ("trained dictionary %ud from %ud samples (%z bytes): "
+			"%z bytes saved to %s\n",
+			ZDICT_getDictID (dict, dict_len), samples.sizes->len,
+			(gsize)samples.data->len, dict_len, output);
+
+	g_free (dict);
+	g_byte_array_free (samples.data, TRUE);
+	g_array_free (samples.sizes, TRUE);
+	g_option_context_free (context);
+}
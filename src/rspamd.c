@@ -268,6 +268,36 @@ config_logger (rspamd_mempool_t *pool, gpointer ud)
 	}
 }
 
+static struct event log_drain_ev;
+
+static void
+rspamd_log_drain_handler (gint fd, short what, gpointer arg)
+{
+	struct rspamd_main *rspamd_main = arg;
+
+	rspamd_log_drain (rspamd_main->logger);
+}
+
+/*
+ * Write lines queued by workers if async logging is enabled, this might
+ * happen on start or on config reload
+ */
+static void
+rspamd_log_drain_start (struct rspamd_main *rspamd_main)
+{
+	struct timeval tv;
+
+	if (rspamd_log_async_start (rspamd_main->logger) &&
+			!event_pending (&log_drain_ev, EV_TIMEOUT, NULL)) {
+		event_set (&log_drain_ev, -1, EV_TIMEOUT|EV_PERSIST,
+				rspamd_log_drain_handler, rspamd_main);
+		event_base_set (rspamd_main->ev_base, &log_drain_ev);
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		event_add (&log_drain_ev, &tv);
+	}
+}
+
 static void
 reread_config (struct rspamd_main *rspamd_main)
 {
@@ -937,6 +967,7 @@ rspamd_hup_handler (gint signo, short what, gpointer arg)
 				rspamd_main->workers_uid,
 				rspamd_main->workers_gid);
 	reread_config (rspamd_main);
+	rspamd_log_drain_start (rspamd_main);
 	rspamd_check_core_limits (rspamd_main);
 	spawn_workers (rspamd_main, rspamd_main->ev_base);
 }
@@ -1397,6 +1428,8 @@ main (gint argc, gchar **argv, gchar **env)
 	event_base_set (ev_base, &usr1_ev);
 	event_add (&usr1_ev, NULL);
 
+	rspamd_log_drain_start (rspamd_main);
+
 	rspamd_check_core_limits (rspamd_main);
 	rspamd_mempool_lock_mutex (rspamd_main->start_mtx);
 	spawn_workers (rspamd_main, ev_base);
@@ -1449,6 +1482,10 @@ main (gint argc, gchar **argv, gchar **env)
 	event_base_loop (ev_base, 0);
 	event_del (&term_ev);
 
+	if (event_pending (&log_drain_ev, EV_TIMEOUT, NULL)) {
+		event_del (&log_drain_ev);
+	}
+
 	/* Maybe save roll history */
 	if (rspamd_main->cfg->history_file) {
 		rspamd_roll_history_save (rspamd_main->history,
@@ -246,6 +246,7 @@ struct rspamd_stat {
 	guint connections_count;                            /**< total connections count						*/
 	guint control_connections_count;                    /**< connections count to control interface			*/
 	guint messages_learned;                             /**< messages learned								*/
+	guint tasks_shed;                                   /**< tasks replied without full scan due to overload	*/
 };
 
 /**
@@ -19,6 +19,7 @@
 #include "libutil/upstream.h"
 #include "libutil/http.h"
 #include "libutil/http_private.h"
+#include "libutil/http_pool.h"
 #include "libserver/protocol.h"
 #include "libserver/cfg_file.h"
 #include "libserver/url.h"
@@ -38,6 +39,7 @@
 /* Rotate keys each minute by default */
 #define DEFAULT_ROTATION_TIME 60.0
 #define DEFAULT_RETRIES 5
+#define DEFAULT_KEEPALIVE_TIMEOUT 30.0
 
 #define msg_err_session(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         session->pool->tag.tagname, session->pool->tag.uid, \
@@ -79,6 +81,11 @@ struct rspamd_http_upstream {
 	gboolean local;
 	gboolean self_scan;
 	gboolean compress;
+	/*
+	 * Latency percentile after which a scan request is duplicated to another
+	 * upstream, 0 (default) to disable
+	 */
+	gdouble hedge;
 };
 
 struct rspamd_http_mirror {
@@ -137,12 +144,20 @@ struct rspamd_proxy_ctx {
 	gchar *spam_header;
 	/* Sessions cache */
 	void *sessions_cache;
+	/* Keep client connections alive between requests */
+	gboolean keepalive;
+	gdouble keepalive_timeout;
+	struct timeval keepalive_tv;
+	/* Idle persistent connections to backends */
+	struct rspamd_http_pool *http_pool;
 };
 
 enum rspamd_backend_flags {
 	RSPAMD_BACKEND_REPLIED = 1 << 0,
 	RSPAMD_BACKEND_CLOSED = 1 << 1,
 	RSPAMD_BACKEND_PARSED = 1 << 2,
+	RSPAMD_BACKEND_KEEPALIVE = 1 << 3,
+	RSPAMD_BACKEND_REUSED = 1 << 4,
 };
 
 struct rspamd_proxy_session;
@@ -152,6 +167,7 @@ struct rspamd_proxy_backend_connection {
 	struct rspamd_cryptobox_keypair *local_key;
 	struct rspamd_cryptobox_pubkey *remote_key;
 	struct upstream *up;
+	rspamd_inet_addr_t *addr;
 	struct rspamd_http_connection *backend_conn;
 	ucl_object_t *results;
 	const gchar *err;
@@ -162,6 +178,8 @@ struct rspamd_proxy_backend_connection {
 	gint parser_from_ref;
 	gint parser_to_ref;
 	struct rspamd_task *task;
+	/* Time when request has been sent, 0 if there is no request in flight */
+	gdouble start;
 };
 
 enum rspamd_proxy_legacy_support {
@@ -181,16 +199,27 @@ struct rspamd_proxy_session {
 	gchar *fname;
 	gpointer shmem_ref;
 	struct rspamd_proxy_backend_connection *master_conn;
+	/* Duplicate of the master request sent to another upstream */
+	struct rspamd_proxy_backend_connection *hedge_conn;
+	struct rspamd_http_upstream *backend;
+	struct event hedge_ev;
 	struct rspamd_http_message *client_message;
 	GPtrArray *mirror_conns;
 	gsize map_len;
 	gint client_sock;
 	enum rspamd_proxy_legacy_support legacy_support;
 	gint retries;
+	gboolean keepalive;
+	gboolean idle;
+	/* Client accepts compressed replies */
+	gboolean compress_reply;
+	struct zstd_dictionary *reply_dict;
 	ref_entry_t ref;
 };
 
 static gboolean proxy_send_master_message (struct rspamd_proxy_session *session);
+static struct rspamd_proxy_session *proxy_session_new (
+		struct rspamd_worker *worker, gint nfd, rspamd_inet_addr_t *addr);
 
 static GQuark
 rspamd_proxy_quark (void)
@@ -427,6 +456,17 @@ rspamd_proxy_parse_upstream (rspamd_mempool_t *pool,
 		ucl_object_todouble_safe (elt, &up->timeout);
 	}
 
+	elt = ucl_object_lookup (obj, "hedge");
+	if (elt) {
+		if (!ucl_object_todouble_safe (elt, &up->hedge) ||
+				up->hedge < 0 || up->hedge >= 1.0) {
+			g_set_error (err, rspamd_proxy_quark (), 100,
+					"hedge must be a latency percentile in range [0, 1)");
+
+			goto err;
+		}
+	}
+
 	/*
 	 * Accept lua function here in form
 	 * fun :: String -> UCL
@@ -724,6 +764,8 @@ init_rspamd_proxy (struct rspamd_config *cfg)
 	rspamd_mempool_add_destructor (cfg->cfg_pool,
 			(rspamd_mempool_destruct_t)rspamd_array_free_hard, ctx->cmp_refs);
 	ctx->max_retries = DEFAULT_RETRIES;
+	ctx->keepalive = TRUE;
+	ctx->keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -807,18 +849,69 @@ init_rspamd_proxy (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, spam_header),
 			0,
 			"Use the specific spam header instead of X-Spam");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, keepalive),
+			0,
+			"Keep client connections alive between requests, default: true");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive_timeout",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, keepalive_timeout),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Time to wait for the next request on a persistent client connection, "
+			"default: " G_STRINGIFY (DEFAULT_KEEPALIVE_TIMEOUT) " seconds");
 
 	return ctx;
 }
 
+static void
+proxy_backend_request_done (struct rspamd_proxy_backend_connection *conn,
+		gboolean measure)
+{
+	if (conn->up && conn->start > 0) {
+		rspamd_upstream_request_finish (conn->up,
+				measure ? rspamd_get_ticks () - conn->start : -1);
+		conn->start = 0;
+	}
+}
+
+static void
+proxy_backend_request_cancel (struct rspamd_proxy_backend_connection *conn)
+{
+	if (conn->up && conn->start > 0) {
+		rspamd_upstream_request_cancel (conn->up,
+				rspamd_get_ticks () - conn->start);
+		conn->start = 0;
+	}
+}
+
 static void
 proxy_backend_close_connection (struct rspamd_proxy_backend_connection *conn)
 {
 	if (conn && !(conn->flags & RSPAMD_BACKEND_CLOSED)) {
+		proxy_backend_request_done (conn, FALSE);
+
 		if (conn->backend_conn) {
-			rspamd_http_connection_reset (conn->backend_conn);
-			rspamd_http_connection_unref (conn->backend_conn);
-			close (conn->backend_sock);
+			if (!(conn->flags & RSPAMD_BACKEND_KEEPALIVE) ||
+					conn->s->worker->wanna_die ||
+					!rspamd_http_pool_release (conn->s->ctx->http_pool,
+							conn->addr, conn->backend_conn,
+							conn->backend_sock)) {
+				rspamd_http_connection_reset (conn->backend_conn);
+				rspamd_http_connection_unref (conn->backend_conn);
+				close (conn->backend_sock);
+			}
+		}
+
+		if (conn->addr) {
+			rspamd_inet_address_free (conn->addr);
+			conn->addr = NULL;
 		}
 
 		conn->flags |= RSPAMD_BACKEND_CLOSED;
@@ -952,6 +1045,14 @@ proxy_session_dtor (struct rspamd_proxy_session *session)
 		proxy_backend_close_connection (session->master_conn);
 	}
 
+	if (session->hedge_conn) {
+		proxy_backend_close_connection (session->hedge_conn);
+	}
+
+	if (event_get_base (&session->hedge_ev)) {
+		event_del (&session->hedge_ev);
+	}
+
 	if (session->client_milter_conn) {
 		rspamd_milter_session_unref (session->client_milter_conn);
 	}
@@ -1010,111 +1111,184 @@ proxy_session_dtor (struct rspamd_proxy_session *session)
 	g_slice_free1 (sizeof (*session), session);
 }
 
+/*
+ * Compression of replies is negotiated separately between proxy and backends,
+ * so proxy could always read results
+ */
 static void
-proxy_request_compress (struct rspamd_http_message *msg)
+proxy_request_accept_compression (struct rspamd_proxy_ctx *ctx,
+		struct rspamd_http_message *msg, gboolean compress)
 {
+	struct rspamd_external_libs_ctx *libs = ctx->cfg->libs_ctx;
+
+	rspamd_http_message_remove_header (msg, "Accept-Compression");
+	rspamd_http_message_remove_header (msg, "Accept-Dictionary");
+
+	if (compress && libs->in_zstream) {
+		rspamd_http_message_add_header (msg, "Accept-Compression", "zstd");
+
+		if (libs->out_dict) {
+			gchar dict_str[32];
+
+			rspamd_snprintf (dict_str, sizeof (dict_str), "%ud",
+					libs->out_dict->id);
+			rspamd_http_message_add_header (msg, "Accept-Dictionary", dict_str);
+		}
+	}
+}
+
+static void
+proxy_request_compress (struct rspamd_proxy_ctx *ctx,
+		struct rspamd_http_message *msg)
+{
+	struct rspamd_external_libs_ctx *libs = ctx->cfg->libs_ctx;
 	guint flags;
-	ZSTD_CCtx *zctx;
 	rspamd_fstring_t *body;
-	const gchar *in;
+	const gchar *in, *err = NULL;
 	gsize inlen;
 
 	flags = rspamd_http_message_get_flags (msg);
 
 	if (!rspamd_http_message_find_header (msg, "Compression")) {
-		if ((flags & RSPAMD_HTTP_FLAG_SHMEM) ||
-				!(flags & RSPAMD_HTTP_FLAG_HAS_BODY)) {
-			/* Cannot compress shared or empty message */
+		if (!(flags & RSPAMD_HTTP_FLAG_HAS_BODY)) {
+			/* Cannot compress empty message */
 			return;
 		}
 
+		/* Shared body is compressed to a private buffer and then detached */
 		in = rspamd_http_message_get_body (msg, &inlen);
 
-		if (in == NULL || inlen == 0) {
+		if (in == NULL || inlen == 0 || libs->out_zstream == NULL) {
 			return;
 		}
 
-		body = rspamd_fstring_sized_new (ZSTD_compressBound (inlen));
-		zctx = ZSTD_createCCtx ();
-		body->len = ZSTD_compressCCtx (zctx, body->str, body->allocated,
-				in, inlen, 1);
+		/* Messages are compressed using the same dictionary as scanners expect */
+		if (!rspamd_zstd_init_compression (libs->out_zstream, libs->in_dict)) {
+			return;
+		}
 
-		if (ZSTD_isError (body->len)) {
-			msg_err ("compression error");
-			rspamd_fstring_free (body);
-			ZSTD_freeCCtx (zctx);
+		body = rspamd_zstd_compress (libs->out_zstream, in, inlen, &err);
+
+		if (body == NULL) {
+			msg_err ("compression error: %s", err);
 
 			return;
 		}
 
-		ZSTD_freeCCtx (zctx);
 		rspamd_http_message_set_body_from_fstring_steal (msg, body);
 		rspamd_http_message_add_header (msg, "Compression", "zstd");
+
+		if (libs->in_dict) {
+			gchar dict_str[32];
+
+			rspamd_snprintf (dict_str, sizeof (dict_str), "%ud",
+					libs->in_dict->id);
+			rspamd_http_message_add_header (msg, "Dictionary", dict_str);
+		}
 	}
 }
 
 static void
-proxy_request_decompress (struct rspamd_http_message *msg)
+proxy_request_decompress (struct rspamd_proxy_ctx *ctx,
+		struct rspamd_http_message *msg)
 {
+	struct rspamd_external_libs_ctx *libs = ctx->cfg->libs_ctx;
+	struct zstd_dictionary *dict = NULL;
 	rspamd_fstring_t *body;
-	const gchar *in;
-	gsize inlen, outlen, r;
-	ZSTD_DStream *zstream;
-	ZSTD_inBuffer zin;
-	ZSTD_outBuffer zout;
+	const rspamd_ftok_t *tok;
+	const gchar *in, *err = NULL;
+	gsize inlen, outlen;
+	gulong dict_id;
 
 	if (rspamd_http_message_find_header (msg, "Compression")) {
 		in = rspamd_http_message_get_body (msg, &inlen);
 
-		if (in == NULL || inlen == 0) {
+		if (in == NULL || inlen == 0 || libs->in_zstream == NULL) {
 			return;
 		}
 
-		zstream = ZSTD_createDStream ();
-		ZSTD_initDStream (zstream);
+		tok = rspamd_http_message_find_header (msg, "Dictionary");
 
-		zin.pos = 0;
-		zin.src = in;
-		zin.size = inlen;
+		if (tok) {
+			if (!rspamd_strtoul (tok->begin, tok->len, &dict_id) ||
+					(dict = rspamd_libs_zstd_dictionary (libs, dict_id)) == NULL) {
+				msg_err ("cannot decompress: unknown dictionary %T", tok);
 
-		if ((outlen = ZSTD_getDecompressedSize (zin.src, zin.size)) == 0) {
-			outlen = ZSTD_DStreamOutSize ();
+				return;
+			}
 		}
 
-		body = rspamd_fstring_sized_new (outlen);
-		zout.dst = body->str;
-		zout.pos = 0;
-		zout.size = outlen;
+		if (!rspamd_zstd_init_decompression (libs->in_zstream, dict)) {
+			return;
+		}
 
-		while (zin.pos < zin.size) {
-			r = ZSTD_decompressStream (zstream, &zout, &zin);
+		if ((outlen = ZSTD_getDecompressedSize (in, inlen)) == 0) {
+			outlen = ZSTD_DStreamOutSize ();
+		}
 
-			if (ZSTD_isError (r)) {
-				msg_err ("Decompression error: %s", ZSTD_getErrorName (r));
-				ZSTD_freeDStream (zstream);
-				rspamd_fstring_free (body);
+		body = rspamd_fstring_sized_new (outlen);
 
-				return;
-			}
+		if (!rspamd_zstd_decompress_chunk (libs->in_zstream, in, inlen,
+				&body, &err)) {
+			msg_err ("Decompression error: %s", err);
+			rspamd_fstring_free (body);
 
-			if (zout.pos == zout.size) {
-				/* We need to extend output buffer */
-				zout.size = zout.size * 1.5 + 1.0;
-				body = rspamd_fstring_grow (body, zout.size);
-				zout.size = body->allocated;
-				zout.dst = body->str;
-			}
+			return;
 		}
 
-		body->len = zout.pos;
-		ZSTD_freeDStream (zstream);
 		rspamd_http_message_set_body_from_fstring_steal (msg, body);
 		rspamd_http_message_remove_header (msg, "Compression");
+		rspamd_http_message_remove_header (msg, "Dictionary");
 	}
 
 	return;
 }
 
+/*
+ * Compress reply for a client that has asked for it
+ */
+static void
+proxy_reply_compress (struct rspamd_proxy_session *session,
+		struct rspamd_http_message *msg)
+{
+	struct rspamd_external_libs_ctx *libs = session->ctx->cfg->libs_ctx;
+	rspamd_fstring_t *body;
+	const gchar *in, *err = NULL;
+	gsize inlen;
+
+	if (rspamd_http_message_find_header (msg, "Compression") ||
+			libs->out_zstream == NULL) {
+		return;
+	}
+
+	in = rspamd_http_message_get_body (msg, &inlen);
+
+	if (in == NULL || inlen == 0 ||
+			!rspamd_zstd_init_compression (libs->out_zstream,
+					session->reply_dict)) {
+		return;
+	}
+
+	body = rspamd_zstd_compress (libs->out_zstream, in, inlen, &err);
+
+	if (body == NULL) {
+		msg_err_session ("compression error: %s", err);
+
+		return;
+	}
+
+	rspamd_http_message_set_body_from_fstring_steal (msg, body);
+	rspamd_http_message_add_header (msg, "Compression", "zstd");
+
+	if (session->reply_dict) {
+		gchar dict_str[32];
+
+		rspamd_snprintf (dict_str, sizeof (dict_str), "%ud",
+				session->reply_dict->id);
+		rspamd_http_message_add_header (msg, "Dictionary", dict_str);
+	}
+}
+
 static struct rspamd_proxy_session *
 proxy_session_refresh (struct rspamd_proxy_session *session)
 {
@@ -1265,7 +1439,7 @@ proxy_backend_mirror_finish_handler (struct rspamd_http_connection *conn,
 
 	session = bk_conn->s;
 
-	proxy_request_decompress (msg);
+	proxy_request_decompress (session->ctx, msg);
 
 	if (!proxy_backend_parse_results (session, bk_conn, session->ctx->lua_state,
 			bk_conn->parser_from_ref, msg->body_buf.begin, msg->body_buf.len)) {
@@ -1337,7 +1511,11 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 			continue;
 		}
 
+		proxy_request_accept_compression (session->ctx, msg, m->compress);
+
 		msg->method = HTTP_GET;
+		/* Mirror connections are not reused */
+		msg->flags &= ~RSPAMD_HTTP_FLAG_KEEP_ALIVE;
 
 		if (msg->url->len == 0) {
 			msg->url = rspamd_fstring_append (msg->url, "/check", strlen ("/check"));
@@ -1381,7 +1559,7 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 			}
 
 			if (m->compress) {
-				proxy_request_compress (msg);
+				proxy_request_compress (session->ctx, msg);
 
 				if (session->client_milter_conn) {
 					rspamd_http_message_add_header (msg, "Content-Type",
@@ -1419,6 +1597,7 @@ proxy_client_write_error (struct rspamd_proxy_session *session, gint code,
 		REF_RELEASE (session);
 	}
 	else {
+		session->keepalive = FALSE;
 		reply = rspamd_http_new_message (HTTP_RESPONSE);
 		reply->code = code;
 		reply->status = rspamd_fstring_new_init (status, strlen (status));
@@ -1435,13 +1614,58 @@ proxy_backend_master_error_handler (struct rspamd_http_connection *conn, GError
 	struct rspamd_proxy_session *session;
 
 	session = bk_conn->s;
+
+	if (session->hedge_conn) {
+		/* Another request is still in flight, so just wait for its reply */
+		msg_info_session ("abnormally closing %s connection from backend: %s, "
+				"error: %s", bk_conn->name,
+				rspamd_inet_address_to_string (bk_conn->addr),
+				err->message);
+
+		if (!((bk_conn->flags & RSPAMD_BACKEND_REUSED) &&
+				rspamd_http_connection_is_stale (conn, err))) {
+			rspamd_http_pool_upstream_fail (session->ctx->http_pool,
+					bk_conn->up, bk_conn->addr);
+		}
+
+		proxy_backend_close_connection (bk_conn);
+
+		if (bk_conn == session->master_conn) {
+			session->master_conn = session->hedge_conn;
+			session->master_conn->name = "master";
+		}
+
+		session->hedge_conn = NULL;
+
+		return;
+	}
+
+	if ((bk_conn->flags & RSPAMD_BACKEND_REUSED) &&
+			rspamd_http_connection_is_stale (conn, err)) {
+		/*
+		 * Backend has closed persistent connection before getting our request,
+		 * so it is not an upstream failure: just retry with a new connection
+		 */
+		msg_debug_session ("persistent connection to %s has been closed: %s",
+				rspamd_inet_address_to_string (session->master_conn->addr),
+				err->message);
+		proxy_backend_close_connection (session->master_conn);
+
+		if (!proxy_send_master_message (session)) {
+			proxy_client_write_error (session, err->code, err->message);
+		}
+
+		return;
+	}
+
 	msg_info_session ("abnormally closing connection from backend: %s, error: %s,"
 			" retries left: %d",
-		rspamd_inet_address_to_string (rspamd_upstream_addr (session->master_conn->up)),
+		rspamd_inet_address_to_string (session->master_conn->addr),
 		err->message,
 		session->ctx->max_retries - session->retries);
 	session->retries ++;
-	rspamd_upstream_fail (bk_conn->up);
+	rspamd_http_pool_upstream_fail (session->ctx->http_pool, bk_conn->up,
+			bk_conn->addr);
 	proxy_backend_close_connection (session->master_conn);
 
 	if (session->ctx->max_retries &&
@@ -1469,13 +1693,39 @@ static gint
 proxy_backend_master_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
 {
-	struct rspamd_proxy_backend_connection *bk_conn = conn->ud;
+	struct rspamd_proxy_backend_connection *bk_conn = conn->ud, *other;
 	struct rspamd_proxy_session *session, *nsession;
 	rspamd_fstring_t *reply;
 
 	session = bk_conn->s;
+
+	if (event_get_base (&session->hedge_ev)) {
+		event_del (&session->hedge_ev);
+	}
+
+	if (session->hedge_conn) {
+		/* The first reply wins, another request is cancelled */
+		other = bk_conn == session->master_conn ?
+				session->hedge_conn : session->master_conn;
+		msg_info_session ("got reply to the %s request from %s, cancel "
+				"request to %s", bk_conn->name,
+				rspamd_inet_address_to_string (bk_conn->addr),
+				rspamd_inet_address_to_string (other->addr));
+		/* Slow upstream is at least as slow as we have waited for it */
+		proxy_backend_request_cancel (other);
+		proxy_backend_close_connection (other);
+		session->master_conn = bk_conn;
+		session->master_conn->name = "master";
+		session->hedge_conn = NULL;
+	}
+
+	proxy_backend_request_done (bk_conn, TRUE);
 	rspamd_http_connection_steal_msg (session->master_conn->backend_conn);
-	proxy_request_decompress (msg);
+	proxy_request_decompress (session->ctx, msg);
+
+	if (msg->flags & RSPAMD_HTTP_FLAG_KEEP_ALIVE) {
+		bk_conn->flags |= RSPAMD_BACKEND_KEEPALIVE;
+	}
 
 	rspamd_http_message_remove_header (msg, "Content-Length");
 	rspamd_http_message_remove_header (msg, "Key");
@@ -1519,6 +1769,18 @@ proxy_backend_master_finish_handler (struct rspamd_http_connection *conn,
 		rspamd_http_message_free (msg);
 	}
 	else {
+		if (session->keepalive) {
+			msg->flags |= RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+		}
+		else {
+			msg->flags &= ~RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+		}
+
+		if (session->compress_reply &&
+				session->legacy_support == LEGACY_SUPPORT_NO) {
+			proxy_reply_compress (session, msg);
+		}
+
 		rspamd_http_connection_write_message (session->client_conn,
 				msg, NULL, NULL, session, session->client_sock,
 				bk_conn->io_tv, session->ctx->ev_base);
@@ -1573,6 +1835,10 @@ rspamd_proxy_scan_self_reply (struct rspamd_task *task)
 		REF_RELEASE (session);
 	}
 	else {
+		if (session->keepalive) {
+			msg->flags |= RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+		}
+
 		rspamd_http_connection_reset (session->client_conn);
 		rspamd_http_connection_write_message (session->client_conn,
 				msg,
@@ -1678,10 +1944,256 @@ rspamd_proxy_self_scan (struct rspamd_proxy_session *session)
 	return TRUE;
 }
 
+/*
+ * Selects an upstream (other than `except` if specified) and sends a copy of
+ * the client's message to it using `bk_conn`
+ */
 static gboolean
-proxy_send_master_message (struct rspamd_proxy_session *session)
+proxy_backend_send_message (struct rspamd_proxy_session *session,
+		struct rspamd_proxy_backend_connection *bk_conn,
+		struct rspamd_http_upstream *backend,
+		struct upstream *except)
 {
 	struct rspamd_http_message *msg;
+
+	bk_conn->up = rspamd_upstream_get_except (backend->u, except,
+			RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
+	bk_conn->io_tv = &backend->io_tv;
+
+	if (bk_conn->up == NULL) {
+		return FALSE;
+	}
+
+	bk_conn->flags &= ~(RSPAMD_BACKEND_CLOSED|
+			RSPAMD_BACKEND_KEEPALIVE|RSPAMD_BACKEND_REUSED);
+	bk_conn->addr = rspamd_inet_address_copy (
+			rspamd_upstream_addr (bk_conn->up));
+
+	if (!backend->key) {
+		bk_conn->backend_conn = rspamd_http_pool_acquire (
+				session->ctx->http_pool,
+				bk_conn->addr,
+				proxy_backend_master_error_handler,
+				proxy_backend_master_finish_handler,
+				RSPAMD_HTTP_CLIENT_SIMPLE,
+				&bk_conn->backend_sock);
+
+		if (bk_conn->backend_conn) {
+			msg_debug_session ("reuse persistent connection to %s",
+					rspamd_inet_address_to_string (bk_conn->addr));
+			bk_conn->flags |= RSPAMD_BACKEND_REUSED;
+			goto connected;
+		}
+	}
+
+	bk_conn->backend_sock = rspamd_inet_address_connect (bk_conn->addr,
+			SOCK_STREAM, TRUE);
+
+	if (bk_conn->backend_sock == -1) {
+		msg_err_session ("cannot connect upstream: %s(%s)",
+				backend->name,
+				rspamd_inet_address_to_string (bk_conn->addr));
+		rspamd_http_pool_upstream_fail (session->ctx->http_pool,
+				bk_conn->up, bk_conn->addr);
+		rspamd_inet_address_free (bk_conn->addr);
+		bk_conn->addr = NULL;
+
+		return FALSE;
+	}
+
+	bk_conn->backend_conn = rspamd_http_connection_new (
+			NULL,
+			proxy_backend_master_error_handler,
+			proxy_backend_master_finish_handler,
+			RSPAMD_HTTP_CLIENT_SIMPLE,
+			RSPAMD_HTTP_CLIENT,
+			session->ctx->keys_cache,
+			NULL);
+connected:
+	bk_conn->parser_from_ref = backend->parser_from_ref;
+	bk_conn->parser_to_ref = backend->parser_to_ref;
+
+	msg = rspamd_http_connection_copy_msg (session->client_message);
+	proxy_request_accept_compression (session->ctx, msg,
+			backend->compress);
+
+	/* Encrypted connections are not reused as keys are rotated */
+	if (!backend->key) {
+		msg->flags |= RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+	}
+	else {
+		msg->flags &= ~RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+	}
+
+	if (backend->key) {
+		msg->peer_key = rspamd_pubkey_ref (backend->key);
+		rspamd_http_connection_set_key (bk_conn->backend_conn,
+				session->ctx->local_key);
+	}
+
+	rspamd_upstream_request_start (bk_conn->up);
+	bk_conn->start = rspamd_get_ticks ();
+
+	if (backend->local ||
+			rspamd_inet_address_is_local (bk_conn->addr, FALSE)) {
+
+		if (session->fname) {
+			rspamd_http_message_add_header (msg, "File", session->fname);
+		}
+
+		if (rspamd_inet_address_get_af (bk_conn->addr) == AF_UNIX) {
+			/* Pass segment itself, so scanner maps it without opening */
+			msg->flags |= RSPAMD_HTTP_FLAG_SHMEM_FD;
+		}
+
+		rspamd_http_connection_write_message_shared (
+				bk_conn->backend_conn,
+				msg, NULL, NULL, bk_conn,
+				bk_conn->backend_sock,
+				bk_conn->io_tv, session->ctx->ev_base);
+	}
+	else {
+		if (session->fname) {
+			rspamd_http_message_set_body (msg,
+					session->map, session->map_len);
+		}
+
+		if (backend->compress) {
+			proxy_request_compress (session->ctx, msg);
+			if (session->client_milter_conn) {
+				rspamd_http_message_add_header (msg, "Content-Type",
+						"application/octet-stream");
+			}
+		}
+		else {
+			if (session->client_milter_conn) {
+				rspamd_http_message_add_header (msg, "Content-Type",
+						"text/plain");
+			}
+		}
+
+		rspamd_http_connection_write_message (
+				bk_conn->backend_conn,
+				msg, NULL, NULL, bk_conn,
+				bk_conn->backend_sock,
+				bk_conn->io_tv, session->ctx->ev_base);
+	}
+
+	return TRUE;
+}
+
+static void
+proxy_backend_hedge_cb (gint fd, short what, gpointer ud)
+{
+	struct rspamd_proxy_session *session = ud;
+	struct rspamd_proxy_backend_connection *bk_conn;
+
+	if (session->hedge_conn || session->master_conn == NULL ||
+			(session->master_conn->flags & RSPAMD_BACKEND_CLOSED)) {
+		return;
+	}
+
+	bk_conn = rspamd_mempool_alloc0 (session->pool, sizeof (*bk_conn));
+	bk_conn->s = session;
+	bk_conn->name = "hedge";
+
+	if (!proxy_backend_send_message (session, bk_conn, session->backend,
+			session->master_conn->up)) {
+		msg_info_session ("cannot send hedged request to %s",
+				session->backend->name);
+
+		return;
+	}
+
+	msg_info_session ("%s has not replied in %.3f seconds, send hedged "
+			"request to %s",
+			rspamd_inet_address_to_string (session->master_conn->addr),
+			rspamd_get_ticks () - session->master_conn->start,
+			rspamd_inet_address_to_string (bk_conn->addr));
+	session->hedge_conn = bk_conn;
+}
+
+/*
+ * Only scan requests are hedged: other commands, e.g. learning via controller,
+ * must never be executed twice
+ */
+static gboolean
+proxy_request_is_scan (struct rspamd_http_message *msg)
+{
+	struct http_parser_url u;
+	const gchar *p;
+	gsize pathlen;
+	guint i;
+	static const gchar *scan_cmds[] = {
+		"check",
+		"checkv2",
+		"scan",
+		"symbols",
+		"report",
+		"report_ifspam",
+	};
+
+	if (msg->url == NULL || msg->url->len == 0 ||
+			http_parser_parse_url (msg->url->str, msg->url->len, 0, &u) != 0 ||
+			!(u.field_set & (1 << UF_PATH))) {
+		return FALSE;
+	}
+
+	p = msg->url->str + u.field_data[UF_PATH].off;
+	pathlen = u.field_data[UF_PATH].len;
+
+	if (pathlen > 0 && *p == '/') {
+		p ++;
+		pathlen --;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (scan_cmds); i ++) {
+		if (strlen (scan_cmds[i]) == pathlen &&
+				rspamd_lc_cmp (p, scan_cmds[i], pathlen) == 0) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * Sends the same request to another upstream if the master one has not
+ * replied within the configured latency percentile
+ */
+static void
+proxy_backend_plan_hedge (struct rspamd_proxy_session *session,
+		struct rspamd_http_upstream *backend)
+{
+	struct timeval tv;
+	gdouble delay;
+
+	if (event_get_base (&session->hedge_ev)) {
+		event_del (&session->hedge_ev);
+	}
+
+	if (backend->hedge == 0 || session->hedge_conn ||
+			rspamd_upstreams_alive (backend->u) < 2 ||
+			!proxy_request_is_scan (session->client_message)) {
+		return;
+	}
+
+	delay = rspamd_upstreams_latency_percentile (backend->u, backend->hedge);
+
+	if (delay == 0) {
+		/* Not enough statistics */
+		return;
+	}
+
+	double_to_tv (delay, &tv);
+	evtimer_set (&session->hedge_ev, proxy_backend_hedge_cb, session);
+	event_base_set (session->ctx->ev_base, &session->hedge_ev);
+	event_add (&session->hedge_ev, &tv);
+}
+
+static gboolean
+proxy_send_master_message (struct rspamd_proxy_session *session)
+{
 	struct rspamd_http_upstream *backend = NULL;
 	const rspamd_ftok_t *host;
 	gchar hostbuf[512];
@@ -1709,6 +2221,8 @@ proxy_send_master_message (struct rspamd_proxy_session *session)
 		if (backend->self_scan) {
 			return rspamd_proxy_self_scan (session);
 		}
+
+		session->backend = backend;
 retry:
 		if (session->ctx->max_retries &&
 				session->retries > session->ctx->max_retries) {
@@ -1717,90 +2231,19 @@ retry:
 			goto err;
 		}
 
-		session->master_conn->up = rspamd_upstream_get (backend->u,
-				RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
-		session->master_conn->io_tv = &backend->io_tv;
-
-		if (session->master_conn->up == NULL) {
-			msg_err_session ("cannot select upstream for %s",
-					host ? hostbuf : "default");
-			goto err;
-		}
-
-		session->master_conn->backend_sock = rspamd_inet_address_connect (
-				rspamd_upstream_addr (session->master_conn->up),
-				SOCK_STREAM, TRUE);
+		if (!proxy_backend_send_message (session, session->master_conn,
+				backend, NULL)) {
+			if (session->master_conn->up == NULL) {
+				msg_err_session ("cannot select upstream for %s",
+						host ? hostbuf : "default");
+				goto err;
+			}
 
-		if (session->master_conn->backend_sock == -1) {
-			msg_err_session ("cannot connect upstream: %s(%s)",
-					host ? hostbuf : "default",
-							rspamd_inet_address_to_string (rspamd_upstream_addr (
-									session->master_conn->up)));
-			rspamd_upstream_fail (session->master_conn->up);
 			session->retries ++;
 			goto retry;
 		}
 
-		session->master_conn->backend_conn = rspamd_http_connection_new (
-				NULL,
-				proxy_backend_master_error_handler,
-				proxy_backend_master_finish_handler,
-				RSPAMD_HTTP_CLIENT_SIMPLE,
-				RSPAMD_HTTP_CLIENT,
-				session->ctx->keys_cache,
-				NULL);
-		session->master_conn->flags &= ~RSPAMD_BACKEND_CLOSED;
-		session->master_conn->parser_from_ref = backend->parser_from_ref;
-		session->master_conn->parser_to_ref = backend->parser_to_ref;
-
-		msg = rspamd_http_connection_copy_msg (session->client_message);
-
-		if (backend->key) {
-			msg->peer_key = rspamd_pubkey_ref (backend->key);
-			rspamd_http_connection_set_key (session->master_conn->backend_conn,
-					session->ctx->local_key);
-		}
-
-		if (backend->local ||
-				rspamd_inet_address_is_local (
-						rspamd_upstream_addr (session->master_conn->up), FALSE)) {
-
-			if (session->fname) {
-				rspamd_http_message_add_header (msg, "File", session->fname);
-			}
-
-			rspamd_http_connection_write_message_shared (
-					session->master_conn->backend_conn,
-					msg, NULL, NULL, session->master_conn,
-					session->master_conn->backend_sock,
-					session->master_conn->io_tv, session->ctx->ev_base);
-		}
-		else {
-			if (session->fname) {
-				rspamd_http_message_set_body (msg,
-						session->map, session->map_len);
-			}
-
-			if (backend->compress) {
-				proxy_request_compress (msg);
-				if (session->client_milter_conn) {
-					rspamd_http_message_add_header (msg, "Content-Type",
-							"application/octet-stream");
-				}
-			}
-			else {
-				if (session->client_milter_conn) {
-					rspamd_http_message_add_header (msg, "Content-Type",
-							"text/plain");
-				}
-			}
-
-			rspamd_http_connection_write_message (
-					session->master_conn->backend_conn,
-					msg, NULL, NULL, session->master_conn,
-					session->master_conn->backend_sock,
-					session->master_conn->io_tv, session->ctx->ev_base);
-		}
+		proxy_backend_plan_hedge (session, backend);
 	}
 
 	return TRUE;
@@ -1825,6 +2268,15 @@ proxy_client_error_handler (struct rspamd_http_connection *conn, GError *err)
 {
 	struct rspamd_proxy_session *session = conn->ud;
 
+	if (session->idle && rspamd_http_connection_is_idle (conn)) {
+		msg_debug_session ("closing idle connection from: %s, error: %s",
+				rspamd_inet_address_to_string (session->client_addr),
+				err->message);
+		REF_RELEASE (session);
+
+		return;
+	}
+
 	msg_info_session ("abnormally closing connection from: %s, error: %s",
 		rspamd_inet_address_to_string (session->client_addr), err->message);
 	/* Terminate session immediately */
@@ -1832,18 +2284,48 @@ proxy_client_error_handler (struct rspamd_http_connection *conn, GError *err)
 	REF_RELEASE (session);
 }
 
+static void
+proxy_client_accept_compression (struct rspamd_proxy_session *session,
+		struct rspamd_http_message *msg)
+{
+	struct rspamd_external_libs_ctx *libs = session->ctx->cfg->libs_ctx;
+	const rspamd_ftok_t *tok;
+	gulong dict_id;
+
+	tok = rspamd_http_message_find_header (msg, "Accept-Compression");
+
+	if (tok && tok->len == 4 &&
+			g_ascii_strncasecmp (tok->begin, "zstd", 4) == 0) {
+		session->compress_reply = TRUE;
+		tok = rspamd_http_message_find_header (msg, "Accept-Dictionary");
+
+		if (tok && libs->out_dict &&
+				rspamd_strtoul (tok->begin, tok->len, &dict_id) &&
+				dict_id == libs->out_dict->id) {
+			session->reply_dict = libs->out_dict;
+		}
+	}
+}
+
 static gint
 proxy_client_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
 {
-	struct rspamd_proxy_session *session = conn->ud;
+	struct rspamd_proxy_session *session = conn->ud, *nsession;
 
 	if (!session->master_conn) {
+		session->idle = FALSE;
 		session->master_conn = rspamd_mempool_alloc0 (session->pool,
 				sizeof (*session->master_conn));
 		session->master_conn->s = session;
 		session->master_conn->name = "master";
 
+		if (session->ctx->keepalive &&
+				(msg->flags & RSPAMD_HTTP_FLAG_KEEP_ALIVE) &&
+				!rspamd_http_connection_is_encrypted (conn)) {
+			session->keepalive = TRUE;
+		}
+
 		/* Reset spamc legacy */
 		if (msg->method >= HTTP_SYMBOLS) {
 			msg->method = HTTP_GET;
@@ -1866,6 +2348,8 @@ proxy_client_finish_handler (struct rspamd_http_connection *conn,
 			goto err;
 		}
 
+		proxy_client_accept_compression (session, msg);
+
 		session->client_message = rspamd_http_connection_steal_msg (
 				session->client_conn);
 		session->shmem_ref = rspamd_http_message_shmem_ref (session->client_message);
@@ -1880,6 +2364,28 @@ proxy_client_finish_handler (struct rspamd_http_connection *conn,
 	else {
 		msg_info_session ("finished master connection");
 		proxy_backend_close_connection (session->master_conn);
+
+		if (session->keepalive && !session->worker->wanna_die) {
+			/* Pass client connection to a new session to wait for the next request */
+			nsession = proxy_session_new (session->worker, session->client_sock,
+					session->client_addr);
+			nsession->client_conn = session->client_conn;
+			nsession->client_conn->ud = nsession;
+			nsession->idle = TRUE;
+			session->client_conn = NULL;
+			session->client_sock = -1;
+			session->client_addr = NULL;
+
+			rspamd_http_connection_reset (nsession->client_conn);
+			rspamd_http_connection_read_message_shared (nsession->client_conn,
+					nsession,
+					nsession->client_sock,
+					&session->ctx->io_tv,
+					session->ctx->ev_base);
+			rspamd_http_connection_set_idle_timeout (nsession->client_conn,
+					&session->ctx->keepalive_tv);
+		}
+
 		REF_RELEASE (session);
 	}
 
@@ -1902,10 +2408,15 @@ proxy_milter_finish_handler (gint fd,
 {
 	struct rspamd_proxy_session *session = ud;
 	struct rspamd_http_message *msg;
+	gsize mlen = 0;
 
 	session->client_milter_conn = rms;
 
-	if (rms->message == NULL || rms->message->len == 0) {
+	if (rms->message) {
+		rspamd_http_message_get_body (rms->message, &mlen);
+	}
+
+	if (mlen == 0) {
 		msg_info_session ("finished milter connection");
 		proxy_backend_close_connection (session->master_conn);
 		REF_RELEASE (session);
@@ -1920,6 +2431,7 @@ proxy_milter_finish_handler (gint fd,
 		session->master_conn->s = session;
 		session->master_conn->name = "master";
 		session->client_message = msg;
+		session->shmem_ref = rspamd_http_message_shmem_ref (msg);
 
 		proxy_open_mirror_connections (session);
 		proxy_send_master_message (session);
@@ -1941,6 +2453,32 @@ proxy_milter_error_handler (gint fd,
 	REF_RELEASE (session);
 }
 
+static struct rspamd_proxy_session *
+proxy_session_new (struct rspamd_worker *worker, gint nfd,
+		rspamd_inet_addr_t *addr)
+{
+	struct rspamd_proxy_ctx *ctx = worker->ctx;
+	struct rspamd_proxy_session *session;
+
+	session = g_slice_alloc0 (sizeof (*session));
+	REF_INIT_RETAIN (session, proxy_session_dtor);
+	session->client_sock = nfd;
+	session->client_addr = addr;
+	session->mirror_conns = g_ptr_array_sized_new (ctx->mirrors->len);
+
+	session->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+			"proxy");
+	session->ctx = ctx;
+	session->worker = worker;
+
+	if (ctx->sessions_cache) {
+		rspamd_worker_session_cache_add (ctx->sessions_cache,
+				session->pool->tag.uid, &session->ref.refcount, session);
+	}
+
+	return session;
+}
+
 static void
 proxy_accept_socket (gint fd, short what, void *arg)
 {
@@ -1962,21 +2500,7 @@ proxy_accept_socket (gint fd, short what, void *arg)
 		return;
 	}
 
-	session = g_slice_alloc0 (sizeof (*session));
-	REF_INIT_RETAIN (session, proxy_session_dtor);
-	session->client_sock = nfd;
-	session->client_addr = addr;
-	session->mirror_conns = g_ptr_array_sized_new (ctx->mirrors->len);
-
-	session->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
-			"proxy");
-	session->ctx = ctx;
-	session->worker = worker;
-
-	if (ctx->sessions_cache) {
-		rspamd_worker_session_cache_add (ctx->sessions_cache,
-				session->pool->tag.uid, &session->ref.refcount, session);
-	}
+	session = proxy_session_new (worker, nfd, addr);
 
 	if (!ctx->milter) {
 		session->client_conn = rspamd_http_connection_new (NULL,
@@ -2046,6 +2570,10 @@ start_rspamd_proxy (struct rspamd_worker *worker) {
 			ctx->ev_base,
 			worker->srv->cfg);
 	double_to_tv (ctx->timeout, &ctx->io_tv);
+	double_to_tv (ctx->keepalive_timeout, &ctx->keepalive_tv);
+
+	ctx->http_pool = worker->srv->cfg->http_pool;
+
 	rspamd_map_watch (worker->srv->cfg, ctx->ev_base, ctx->resolver, 0);
 
 	rspamd_upstreams_library_config (worker->srv->cfg, ctx->cfg->ups_ctx,
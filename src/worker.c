@@ -28,6 +28,7 @@
 #include "libserver/url.h"
 #include "libserver/dns.h"
 #include "libmime/message.h"
+#include "libmime/filter.h"
 #include "rspamd.h"
 #include "keypairs_cache.h"
 #include "libstat/stat_api.h"
@@ -45,10 +46,45 @@
 #define DEFAULT_WORKER_IO_TIMEOUT 60000
 /* Timeout for task processing */
 #define DEFAULT_TASK_TIMEOUT 8.0
+/* Interval between event loop lag probes */
+#define LOOP_LAG_PROBE_INTERVAL 0.5
+/* Smoothing factor for loop lag and task latency */
+#define OVERLOAD_EWMA_ALPHA 0.3
+/* Leave overloaded state when all metrics drop below this share of limits */
+#define OVERLOAD_HYSTERESIS 0.8
+#define DEFAULT_OVERLOAD_ACTION "none"
+#define OVERLOAD_MESSAGE "Server is overloaded, try again later"
+#define OVERLOAD_ACTION_SKIP (-1)
+/* Idle timeout for persistent connections */
+#define DEFAULT_KEEPALIVE_TIMEOUT 30.0
 
 gpointer init_worker (struct rspamd_config *cfg);
 void start_worker (struct rspamd_worker *worker);
 
+static void rspamd_worker_task_start (struct rspamd_worker *worker,
+		struct rspamd_task *task);
+static void rspamd_worker_keepalive (struct rspamd_task *task,
+		struct rspamd_worker_ctx *ctx);
+static gint rspamd_worker_body_handler (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg,
+		const gchar *chunk, gsize len);
+static void rspamd_worker_error_handler (struct rspamd_http_connection *conn,
+		GError *err);
+static gint rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg);
+
+/*
+ * Persistent connection waiting for the next request, task is created when
+ * the request arrives
+ */
+struct rspamd_worker_idle_conn {
+	struct rspamd_worker *worker;
+	struct rspamd_http_connection *http_conn;
+	rspamd_inet_addr_t *addr;
+	rspamd_mempool_t *pool;
+	gint sock;
+};
+
 worker_t normal_worker = {
 		"normal",                   /* Name */
 		init_worker,                /* Init function */
@@ -143,6 +179,130 @@ reduce_tasks_count (gpointer arg)
 	}
 }
 
+static void
+rspamd_worker_check_overload (struct rspamd_worker *worker,
+		struct rspamd_worker_ctx *ctx)
+{
+	gboolean overloaded = FALSE;
+	gdouble factor;
+
+	if (!ctx->shed_enabled) {
+		return;
+	}
+
+	/* Use lower limits to leave overloaded state to avoid flapping */
+	factor = ctx->overloaded ? OVERLOAD_HYSTERESIS : 1.0;
+
+	if (ctx->max_tasks != 0 && worker->nconns > ctx->max_tasks * factor) {
+		overloaded = TRUE;
+	}
+	else if (ctx->max_loop_lag > 0 &&
+			ctx->loop_lag > ctx->max_loop_lag * factor) {
+		overloaded = TRUE;
+	}
+	else if (ctx->max_task_latency > 0 &&
+			ctx->task_latency > ctx->max_task_latency * factor) {
+		overloaded = TRUE;
+	}
+
+	if (overloaded != ctx->overloaded) {
+		if (overloaded) {
+			msg_warn_ctx ("worker is overloaded: %ud tasks, loop lag: %.3f, "
+					"task latency: %.3f; shedding new tasks",
+					worker->nconns, ctx->loop_lag, ctx->task_latency);
+		}
+		else {
+			msg_info_ctx ("worker is no longer overloaded: %ud tasks, "
+					"loop lag: %.3f, task latency: %.3f",
+					worker->nconns, ctx->loop_lag, ctx->task_latency);
+		}
+
+		ctx->overloaded = overloaded;
+	}
+}
+
+static void
+rspamd_worker_lag_probe (gint fd, short what, gpointer ud)
+{
+	struct rspamd_worker *worker = ud;
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+	struct timeval tv;
+	gdouble now, lag;
+
+	now = rspamd_get_ticks ();
+	lag = now - ctx->lag_probe_ts - LOOP_LAG_PROBE_INTERVAL;
+
+	if (lag < 0) {
+		lag = 0;
+	}
+
+	ctx->loop_lag = ctx->loop_lag * (1.0 - OVERLOAD_EWMA_ALPHA) +
+			lag * OVERLOAD_EWMA_ALPHA;
+
+	if (!ctx->latency_updated) {
+		/*
+		 * No task has been fully processed since the last probe (e.g. all of
+		 * them have been shed), so decay latency to allow recovery
+		 */
+		ctx->task_latency *= (1.0 - OVERLOAD_EWMA_ALPHA);
+	}
+
+	ctx->latency_updated = FALSE;
+	rspamd_worker_check_overload (worker, ctx);
+
+	ctx->lag_probe_ts = now;
+	double_to_tv (LOOP_LAG_PROBE_INTERVAL, &tv);
+	event_add (&ctx->lag_ev, &tv);
+}
+
+/*
+ * Reply to a task without scanning when worker is overloaded
+ */
+static void
+rspamd_worker_shed_task (struct rspamd_task *task,
+		struct rspamd_worker_ctx *ctx)
+{
+	struct rspamd_metric_result *mres;
+	gint action = ctx->overload_action;
+
+	task->flags |= RSPAMD_TASK_FLAG_OVERLOADED;
+	task->flags &= ~RSPAMD_TASK_FLAG_LEARN_AUTO;
+	task->worker->srv->stat->tasks_shed ++;
+
+	if (action == OVERLOAD_ACTION_SKIP) {
+		msg_info_task ("worker is overloaded, skip scanning");
+		task->flags |= RSPAMD_TASK_FLAG_SKIP;
+
+		return;
+	}
+
+	if (!task->result) {
+		mres = rspamd_create_metric_result (task);
+
+		if (mres != NULL) {
+			mres->score = mres->metric->actions[action].score;
+			mres->action = action;
+		}
+	}
+	else {
+		task->result->action = action;
+	}
+
+	task->pre_result.action = action;
+	task->pre_result.str = OVERLOAD_MESSAGE;
+	ucl_object_insert_key (task->messages,
+			ucl_object_fromstring (OVERLOAD_MESSAGE), "smtp_message", 0,
+			false);
+	msg_info_task ("worker is overloaded, set pre-result to %s",
+			rspamd_action_to_str (action));
+
+	task->processed_stages |= (RSPAMD_TASK_STAGE_PRE_FILTERS |
+			RSPAMD_TASK_STAGE_FILTERS |
+			RSPAMD_TASK_STAGE_CLASSIFIERS |
+			RSPAMD_TASK_STAGE_CLASSIFIERS_PRE |
+			RSPAMD_TASK_STAGE_CLASSIFIERS_POST);
+}
+
 void
 rspamd_task_timeout (gint fd, short what, gpointer ud)
 {
@@ -220,33 +380,63 @@ rspamd_worker_guard_handler (gint fd, short what, void *data)
 	}
 }
 
-static gint
-rspamd_worker_body_handler (struct rspamd_http_connection *conn,
-	struct rspamd_http_message *msg,
-	const gchar *chunk, gsize len)
+/*
+ * Handles request line, returns FALSE if there is no message to process
+ */
+static gboolean
+rspamd_worker_handle_request (struct rspamd_task *task,
+		struct rspamd_worker_ctx *ctx,
+		struct rspamd_http_message *msg)
 {
-	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
-	struct rspamd_worker_ctx *ctx;
-	struct timeval task_tv;
-	struct event *guard_ev;
-
-	ctx = task->worker->ctx;
+	if (ctx->keepalive && (msg->flags & RSPAMD_HTTP_FLAG_KEEP_ALIVE) &&
+			!rspamd_http_connection_is_encrypted (task->http_conn)) {
+		task->flags |= RSPAMD_TASK_FLAG_KEEPALIVE;
+	}
 
 	if (!rspamd_protocol_handle_request (task, msg)) {
 		msg_err_task ("cannot handle request: %e", task->err);
 		task->flags |= RSPAMD_TASK_FLAG_SKIP;
+
+		return FALSE;
+	}
+
+	if (task->cmd == CMD_PING) {
+		task->flags |= RSPAMD_TASK_FLAG_SKIP;
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_worker_load_message (struct rspamd_task *task,
+		struct rspamd_worker_ctx *ctx,
+		struct rspamd_http_message *msg,
+		const gchar *chunk, gsize len)
+{
+	if (!rspamd_task_load_message (task, msg, chunk, len)) {
+		msg_err_task ("cannot load message: %e", task->err);
+		task->flags |= RSPAMD_TASK_FLAG_SKIP;
 	}
 	else {
-		if (task->cmd == CMD_PING) {
-			task->flags |= RSPAMD_TASK_FLAG_SKIP;
-		}
-		else {
-			if (!rspamd_task_load_message (task, msg, chunk, len)) {
-				msg_err_task ("cannot load message: %e", task->err);
-				task->flags |= RSPAMD_TASK_FLAG_SKIP;
-			}
+		rspamd_worker_check_overload (task->worker, ctx);
+
+		if (ctx->overloaded) {
+			rspamd_worker_shed_task (task, ctx);
 		}
 	}
+}
+
+/*
+ * Sets task timeout and socket guard and processes the loaded message
+ */
+static void
+rspamd_worker_task_run (struct rspamd_task *task,
+		struct rspamd_worker_ctx *ctx)
+{
+	struct timeval task_tv;
+	struct event *guard_ev;
 
 	/* Set global timeout for the task */
 	if (ctx->task_timeout > 0.0) {
@@ -258,27 +448,114 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 	}
 
 	/* Set socket guard */
-	guard_ev = rspamd_mempool_alloc (task->task_pool, sizeof (*guard_ev));
+	if (!(task->flags & RSPAMD_TASK_FLAG_KEEPALIVE)) {
+		guard_ev = rspamd_mempool_alloc (task->task_pool, sizeof (*guard_ev));
 #ifdef EV_CLOSED
-	event_set (guard_ev, task->sock, EV_READ|EV_PERSIST|EV_CLOSED,
+		event_set (guard_ev, task->sock, EV_READ|EV_PERSIST|EV_CLOSED,
 				rspamd_worker_guard_handler, task);
 #else
-	event_set (guard_ev, task->sock, EV_READ|EV_PERSIST,
-			rspamd_worker_guard_handler, task);
+		event_set (guard_ev, task->sock, EV_READ|EV_PERSIST,
+				rspamd_worker_guard_handler, task);
+#endif
+		event_base_set (task->ev_base, guard_ev);
+		event_add (guard_ev, NULL);
+		task->guard_ev = guard_ev;
+	}
+#ifdef EV_CLOSED
+	else {
+		/* Client can send the next request, so watch for close only */
+		guard_ev = rspamd_mempool_alloc (task->task_pool, sizeof (*guard_ev));
+		event_set (guard_ev, task->sock, EV_PERSIST|EV_CLOSED,
+				rspamd_worker_guard_handler, task);
+		event_base_set (task->ev_base, guard_ev);
+		event_add (guard_ev, NULL);
+		task->guard_ev = guard_ev;
+	}
 #endif
-	event_base_set (task->ev_base, guard_ev);
-	event_add (guard_ev, NULL);
-	task->guard_ev = guard_ev;
 
 	rspamd_task_process (task, RSPAMD_TASK_PROCESS_ALL);
+}
+
+static gint
+rspamd_worker_body_handler (struct rspamd_http_connection *conn,
+	struct rspamd_http_message *msg,
+	const gchar *chunk, gsize len)
+{
+	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
+	struct rspamd_worker_ctx *ctx;
+
+	ctx = task->worker->ctx;
+
+	if (conn->opts & RSPAMD_HTTP_BODY_PARTIAL) {
+		if (!(task->flags & RSPAMD_TASK_FLAG_WAIT_BODY)) {
+			/*
+			 * The first portion of the body: envelope is already known, so
+			 * we can start connection filters while the rest is received
+			 */
+			task->flags |= RSPAMD_TASK_FLAG_WAIT_BODY;
+
+			if (rspamd_worker_handle_request (task, ctx, msg)) {
+				rspamd_protocol_handle_headers (task, msg);
+				rspamd_task_process (task, RSPAMD_TASK_PROCESS_ALL);
+			}
+		}
+
+		/* Compressed body is decoded as it arrives */
+		if (!RSPAMD_TASK_IS_SKIPPED (task) &&
+				!rspamd_task_decompress_chunk (task, chunk, len)) {
+			msg_err_task ("cannot load message: %e", task->err);
+			task->flags |= RSPAMD_TASK_FLAG_SKIP;
+		}
+
+		return 0;
+	}
+
+	if (rspamd_worker_handle_request (task, ctx, msg)) {
+		rspamd_worker_load_message (task, ctx, msg, chunk, len);
+	}
+
+	rspamd_worker_task_run (task, ctx);
 
 	return 0;
 }
 
+/*
+ * Called when the whole message is received in streaming mode
+ */
+static void
+rspamd_worker_body_complete (struct rspamd_task *task,
+		struct rspamd_worker_ctx *ctx,
+		struct rspamd_http_message *msg)
+{
+	const gchar *body;
+	gsize len;
+
+	body = rspamd_http_message_get_body (msg, &len);
+
+	if (task->flags & RSPAMD_TASK_FLAG_WAIT_BODY) {
+		if (!RSPAMD_TASK_IS_SKIPPED (task)) {
+			/*
+			 * Headers have been processed on the first portion of body, but
+			 * message is still required to get a descriptor passed with it
+			 */
+			rspamd_worker_load_message (task, ctx, msg, body, len);
+		}
+
+		task->flags &= ~RSPAMD_TASK_FLAG_WAIT_BODY;
+	}
+	else if (rspamd_worker_handle_request (task, ctx, msg)) {
+		/* Request has no body at all */
+		rspamd_worker_load_message (task, ctx, msg, body, len);
+	}
+
+	rspamd_worker_task_run (task, ctx);
+}
+
 static void
 rspamd_worker_error_handler (struct rspamd_http_connection *conn, GError *err)
 {
 	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
+	struct rspamd_worker_ctx *ctx = task->worker->ctx;
 	struct rspamd_http_message *msg;
 	rspamd_fstring_t *reply;
 
@@ -289,6 +566,8 @@ rspamd_worker_error_handler (struct rspamd_http_connection *conn, GError *err)
 		rspamd_session_destroy (task->s);
 	}
 	else {
+		/* The rest of request might be still unread */
+		task->flags &= ~RSPAMD_TASK_FLAG_KEEPALIVE;
 		task->processed_stages |= RSPAMD_TASK_STAGE_REPLIED;
 		msg = rspamd_http_new_message (HTTP_RESPONSE);
 
@@ -325,20 +604,259 @@ rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
 {
 	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
+	struct rspamd_worker_ctx *ctx = task->worker->ctx;
+	gdouble latency;
 
 	if (task->processed_stages & RSPAMD_TASK_STAGE_REPLIED) {
-		/* We are done here */
-		msg_debug_task ("normally closing connection from: %s",
-			rspamd_inet_address_to_string (task->client_addr));
-		rspamd_session_destroy (task->s);
+		if (!(task->flags & (RSPAMD_TASK_FLAG_OVERLOADED|RSPAMD_TASK_FLAG_SKIP))) {
+			latency = rspamd_get_ticks () - task->time_real;
+			ctx->task_latency = ctx->task_latency * (1.0 - OVERLOAD_EWMA_ALPHA) +
+					latency * OVERLOAD_EWMA_ALPHA;
+			ctx->latency_updated = TRUE;
+		}
+
+		if ((task->flags & RSPAMD_TASK_FLAG_KEEPALIVE) &&
+				!task->worker->wanna_die) {
+			rspamd_worker_keepalive (task, ctx);
+		}
+		else {
+			/* We are done here */
+			msg_debug_task ("normally closing connection from: %s",
+					rspamd_inet_address_to_string (task->client_addr));
+			rspamd_session_destroy (task->s);
+		}
 	}
-	else if (task->processed_stages & RSPAMD_TASK_STAGE_DONE) {
-		rspamd_session_pending (task->s);
+	else {
+		if (conn->opts & RSPAMD_HTTP_BODY_PARTIAL) {
+			rspamd_worker_body_complete (task, ctx, msg);
+		}
+
+		if (task->processed_stages & RSPAMD_TASK_STAGE_DONE) {
+			rspamd_session_pending (task->s);
+		}
 	}
 
 	return 0;
 }
 
+/*
+ * Create a task for a connection, a new HTTP connection is created if
+ * `http_conn` is NULL, task takes ownership of `pool` if it is not NULL
+ */
+static struct rspamd_task *
+rspamd_worker_new_task (struct rspamd_worker *worker,
+		struct rspamd_worker_ctx *ctx,
+		gint nfd,
+		rspamd_inet_addr_t *addr,
+		struct rspamd_http_connection *http_conn,
+		rspamd_mempool_t *pool)
+{
+	struct rspamd_task *task;
+	unsigned http_opts = 0;
+
+	task = rspamd_task_new (worker, ctx->cfg, pool);
+
+	if (pool) {
+		task->flags |= RSPAMD_TASK_FLAG_OWN_POOL;
+	}
+
+	/* Copy some variables */
+	if (ctx->is_mime) {
+		task->flags |= RSPAMD_TASK_FLAG_MIME;
+	}
+	else {
+		task->flags &= ~RSPAMD_TASK_FLAG_MIME;
+	}
+
+	task->sock = nfd;
+	task->client_addr = addr;
+
+	task->resolver = ctx->resolver;
+	/* TODO: allow to disable autolearn in protocol */
+	task->flags |= RSPAMD_TASK_FLAG_LEARN_AUTO;
+
+	if (http_conn == NULL) {
+		if (addr && rspamd_inet_address_get_af (addr) == AF_UNIX) {
+			/* Local peers (e.g. proxy) can pass message segments directly */
+			http_opts |= RSPAMD_HTTP_ACCEPT_FD;
+		}
+
+		if (ctx->streaming && ctx->key == NULL) {
+			/* Encrypted bodies can be processed only when fully received */
+			http_opts |= RSPAMD_HTTP_BODY_PARTIAL;
+		}
+
+		http_conn = rspamd_http_connection_new (rspamd_worker_body_handler,
+				rspamd_worker_error_handler,
+				rspamd_worker_finish_handler,
+				http_opts,
+				RSPAMD_HTTP_SERVER,
+				ctx->keys_cache,
+				NULL);
+		rspamd_http_connection_set_max_size (http_conn, task->cfg->max_message);
+
+		if (ctx->key) {
+			rspamd_http_connection_set_key (http_conn, ctx->key);
+		}
+	}
+
+	task->http_conn = http_conn;
+	task->ev_base = ctx->ev_base;
+
+	/* Set up async session */
+	task->s = rspamd_session_create (task->task_pool, rspamd_task_fin,
+			rspamd_task_restore, (event_finalizer_t )rspamd_task_free, task);
+
+	return task;
+}
+
+/*
+ * Account task as active
+ */
+static void
+rspamd_worker_task_start (struct rspamd_worker *worker,
+		struct rspamd_task *task)
+{
+	/* Do not count idle time of persistent connections */
+	task->time_real = rspamd_get_ticks ();
+	task->time_virtual = rspamd_get_virtual_ticks ();
+	worker->nconns++;
+	rspamd_mempool_add_destructor (task->task_pool,
+		(rspamd_mempool_destruct_t)reduce_tasks_count, worker);
+}
+
+static void
+rspamd_worker_idle_conn_free (struct rspamd_worker_idle_conn *idle)
+{
+	if (idle->http_conn) {
+		rspamd_http_connection_reset (idle->http_conn);
+		rspamd_http_connection_unref (idle->http_conn);
+	}
+
+	if (idle->pool) {
+		rspamd_mempool_delete (idle->pool);
+	}
+
+	if (idle->addr) {
+		rspamd_inet_address_free (idle->addr);
+	}
+
+	if (idle->sock != -1) {
+		close (idle->sock);
+	}
+
+	g_slice_free1 (sizeof (*idle), idle);
+}
+
+/*
+ * Create a task for the next request on a persistent connection
+ */
+static struct rspamd_task *
+rspamd_worker_idle_conn_wakeup (struct rspamd_http_connection *conn)
+{
+	struct rspamd_worker_idle_conn *idle = conn->ud;
+	struct rspamd_worker *worker = idle->worker;
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+	struct rspamd_task *task;
+
+	g_hash_table_remove (ctx->idle_conns, idle);
+	task = rspamd_worker_new_task (worker, ctx, idle->sock, idle->addr,
+			conn, idle->pool);
+	g_slice_free1 (sizeof (*idle), idle);
+
+	conn->body_handler = rspamd_worker_body_handler;
+	conn->error_handler = rspamd_worker_error_handler;
+	conn->finish_handler = rspamd_worker_finish_handler;
+	conn->ud = task;
+	rspamd_worker_task_start (worker, task);
+
+	return task;
+}
+
+static gint
+rspamd_worker_idle_body_handler (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg,
+		const gchar *chunk, gsize len)
+{
+	rspamd_worker_idle_conn_wakeup (conn);
+
+	return rspamd_worker_body_handler (conn, msg, chunk, len);
+}
+
+static void
+rspamd_worker_idle_error_handler (struct rspamd_http_connection *conn,
+		GError *err)
+{
+	struct rspamd_worker_idle_conn *idle = conn->ud;
+	struct rspamd_worker_ctx *ctx;
+
+	if (rspamd_http_connection_is_idle (conn)) {
+		ctx = idle->worker->ctx;
+		msg_debug_ctx ("closing persistent connection from: %s: %e",
+				rspamd_inet_address_to_string (idle->addr), err);
+		g_hash_table_remove (ctx->idle_conns, idle);
+		rspamd_worker_idle_conn_free (idle);
+
+		return;
+	}
+
+	rspamd_worker_idle_conn_wakeup (conn);
+	rspamd_worker_error_handler (conn, err);
+}
+
+static gint
+rspamd_worker_idle_finish_handler (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg)
+{
+	rspamd_worker_idle_conn_wakeup (conn);
+
+	return rspamd_worker_finish_handler (conn, msg);
+}
+
+/*
+ * Keep connection of a finished task waiting for the next request: task
+ * is destroyed and its pool is reset to be reused by the next task, idle
+ * connections are not counted as active ones
+ */
+static void
+rspamd_worker_keepalive (struct rspamd_task *task,
+		struct rspamd_worker_ctx *ctx)
+{
+	struct rspamd_worker_idle_conn *idle;
+	struct rspamd_http_connection *http_conn = task->http_conn;
+
+	idle = g_slice_alloc0 (sizeof (*idle));
+	idle->worker = task->worker;
+	idle->http_conn = http_conn;
+	idle->addr = task->client_addr;
+	idle->sock = task->sock;
+	idle->pool = task->task_pool;
+
+	msg_debug_task ("keep connection from %s for the next request",
+			rspamd_inet_address_to_string (task->client_addr));
+
+	task->http_conn = NULL;
+	task->client_addr = NULL;
+	task->sock = -1;
+	task->flags &= ~RSPAMD_TASK_FLAG_OWN_POOL;
+	rspamd_session_destroy (task->s);
+	/* Destructors of the finished task are called here */
+	rspamd_mempool_reset (idle->pool);
+
+	g_hash_table_insert (ctx->idle_conns, idle, idle);
+	http_conn->body_handler = rspamd_worker_idle_body_handler;
+	http_conn->error_handler = rspamd_worker_idle_error_handler;
+	http_conn->finish_handler = rspamd_worker_idle_finish_handler;
+
+	rspamd_http_connection_reset (http_conn);
+	rspamd_http_connection_read_message (http_conn,
+			idle,
+			idle->sock,
+			&ctx->io_tv,
+			ctx->ev_base);
+	rspamd_http_connection_set_idle_timeout (http_conn, &ctx->keepalive_tv);
+}
+
 /*
  * Accept new connection and construct task
  */
@@ -353,7 +871,9 @@ accept_socket (gint fd, short what, void *arg)
 
 	ctx = worker->ctx;
 
-	if (ctx->max_tasks != 0 && worker->nconns > ctx->max_tasks) {
+	/* When load shedding is enabled we accept and reply to every connection */
+	if (!ctx->shed_enabled && ctx->max_tasks != 0 &&
+			worker->nconns > ctx->max_tasks) {
 		msg_info_ctx ("current tasks is now: %uD while maximum is: %uD",
 				worker->nconns,
 			ctx->max_tasks);
@@ -370,49 +890,15 @@ accept_socket (gint fd, short what, void *arg)
 		return;
 	}
 
-	task = rspamd_task_new (worker, ctx->cfg, NULL);
+	task = rspamd_worker_new_task (worker, ctx, nfd, addr, NULL, NULL);
 
 	msg_info_task ("accepted connection from %s port %d, task ptr: %p",
 		rspamd_inet_address_to_string (addr),
 		rspamd_inet_address_get_port (addr),
 		task);
 
-	/* Copy some variables */
-	if (ctx->is_mime) {
-		task->flags |= RSPAMD_TASK_FLAG_MIME;
-	}
-	else {
-		task->flags &= ~RSPAMD_TASK_FLAG_MIME;
-	}
-
-	task->sock = nfd;
-	task->client_addr = addr;
-
 	worker->srv->stat->connections_count++;
-	task->resolver = ctx->resolver;
-	/* TODO: allow to disable autolearn in protocol */
-	task->flags |= RSPAMD_TASK_FLAG_LEARN_AUTO;
-
-	task->http_conn = rspamd_http_connection_new (rspamd_worker_body_handler,
-			rspamd_worker_error_handler,
-			rspamd_worker_finish_handler,
-			0,
-			RSPAMD_HTTP_SERVER,
-			ctx->keys_cache,
-			NULL);
-	rspamd_http_connection_set_max_size (task->http_conn, task->cfg->max_message);
-	task->ev_base = ctx->ev_base;
-	worker->nconns++;
-	rspamd_mempool_add_destructor (task->task_pool,
-		(rspamd_mempool_destruct_t)reduce_tasks_count, worker);
-
-	/* Set up async session */
-	task->s = rspamd_session_create (task->task_pool, rspamd_task_fin,
-			rspamd_task_restore, (event_finalizer_t )rspamd_task_free, task);
-
-	if (ctx->key) {
-		rspamd_http_connection_set_key (task->http_conn, ctx->key);
-	}
+	rspamd_worker_task_start (worker, task);
 
 	rspamd_http_connection_read_message (task->http_conn,
 			task,
@@ -444,6 +930,9 @@ rspamd_worker_hyperscan_ready (struct rspamd_main *rspamd_main,
 				worker->srv->cfg->re_cache, cmd->cmd.hs_loaded.cache_dir);
 	}
 
+	/* Regexp maps compiled by hs_helper */
+	rspamd_regexp_map_load_hyperscan (worker->srv->cfg);
+
 	if (write (fd, &rep, sizeof (rep)) != sizeof (rep)) {
 		msg_err ("cannot write reply to the control socket: %s",
 				strerror (errno));
@@ -543,6 +1032,9 @@ init_worker (struct rspamd_config *cfg)
 	ctx->timeout = DEFAULT_WORKER_IO_TIMEOUT;
 	ctx->cfg = cfg;
 	ctx->task_timeout = DEFAULT_TASK_TIMEOUT;
+	ctx->overload_action_str = DEFAULT_OVERLOAD_ACTION;
+	ctx->keepalive = FALSE;
+	ctx->keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -612,6 +1104,69 @@ init_worker (struct rspamd_config *cfg)
 			RSPAMD_CL_FLAG_INT_32,
 			"Maximum count of parallel tasks processed by a single worker process");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"max_loop_lag",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						max_loop_lag),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Treat worker as overloaded if event loop lag exceeds this value");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"max_task_latency",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						max_task_latency),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Treat worker as overloaded if average task latency exceeds this value");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"overload_action",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						overload_action_str),
+			0,
+			"Action for tasks received when worker is overloaded: an action name "
+			"(e.g. `soft reject`), `skip` to reply without scanning or `none` "
+			"to disable load shedding, default: " DEFAULT_OVERLOAD_ACTION);
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, keepalive),
+			0,
+			"Allow persistent (and pipelined) HTTP connections, default: false");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive_timeout",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						keepalive_timeout),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Idle timeout for persistent connections, default: "
+					G_STRINGIFY(DEFAULT_KEEPALIVE_TIMEOUT)
+					" seconds");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"streaming",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, streaming),
+			0,
+			"Run connection filters while message body is being received "
+			"(not used for encrypted connections), default: false");
+
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"keypair",
@@ -625,6 +1180,25 @@ init_worker (struct rspamd_config *cfg)
 	return ctx;
 }
 
+static gboolean
+rspamd_worker_close_idle (struct rspamd_worker *worker)
+{
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+	GList *conns, *cur;
+
+	/* Idle persistent connections should not wait for termination */
+	conns = g_hash_table_get_keys (ctx->idle_conns);
+	g_hash_table_remove_all (ctx->idle_conns);
+
+	for (cur = conns; cur != NULL; cur = g_list_next (cur)) {
+		rspamd_worker_idle_conn_free (cur->data);
+	}
+
+	g_list_free (conns);
+
+	return FALSE;
+}
+
 static gboolean
 rspamd_worker_on_terminate (struct rspamd_worker *worker)
 {
@@ -638,6 +1212,32 @@ rspamd_worker_on_terminate (struct rspamd_worker *worker)
 	return FALSE;
 }
 
+#ifdef WITH_HYPERSCAN
+/*
+ * hs_helper is started even if it is not defined in the config, so it is
+ * missing only when it is explicitly disabled
+ */
+static gboolean
+rspamd_worker_has_hs_helper (struct rspamd_config *cfg)
+{
+	struct rspamd_worker_conf *cf;
+	GQuark type;
+	GList *cur;
+
+	type = g_quark_try_string ("hs_helper");
+
+	for (cur = cfg->workers; cur != NULL; cur = g_list_next (cur)) {
+		cf = cur->data;
+
+		if (cf->type == type) {
+			return cf->enabled && cf->count > 0;
+		}
+	}
+
+	return TRUE;
+}
+#endif
+
 void
 rspamd_worker_init_scanner (struct rspamd_worker *worker,
 		struct event_base *ev_base,
@@ -651,6 +1251,9 @@ rspamd_worker_init_scanner (struct rspamd_worker *worker,
 			RSPAMD_CONTROL_HYPERSCAN_LOADED,
 			rspamd_worker_hyperscan_ready,
 			NULL);
+	/* Regexp maps are compiled by hs_helper if it is running */
+	rspamd_regexp_map_defer_hyperscan (
+			rspamd_worker_has_hs_helper (worker->srv->cfg));
 #endif
 	rspamd_control_worker_add_cmd_handler (worker,
 			RSPAMD_CONTROL_LOG_PIPE,
@@ -669,10 +1272,35 @@ void
 start_worker (struct rspamd_worker *worker)
 {
 	struct rspamd_worker_ctx *ctx = worker->ctx;
+	struct timeval tv;
 
 	ctx->cfg = worker->srv->cfg;
 	ctx->ev_base = rspamd_prepare_worker (worker, "normal", accept_socket);
 	msec_to_tv (ctx->timeout, &ctx->io_tv);
+
+	ctx->shed_enabled = TRUE;
+
+	if (g_ascii_strcasecmp (ctx->overload_action_str, "none") == 0) {
+		ctx->shed_enabled = FALSE;
+	}
+	else if (g_ascii_strcasecmp (ctx->overload_action_str, "skip") == 0) {
+		ctx->overload_action = OVERLOAD_ACTION_SKIP;
+	}
+	else if (!rspamd_action_from_str (ctx->overload_action_str,
+			&ctx->overload_action)) {
+		msg_err_ctx ("invalid overload action: %s, disable load shedding",
+				ctx->overload_action_str);
+		ctx->shed_enabled = FALSE;
+	}
+
+	if (ctx->shed_enabled) {
+		ctx->lag_probe_ts = rspamd_get_ticks ();
+		event_set (&ctx->lag_ev, -1, EV_TIMEOUT, rspamd_worker_lag_probe,
+				worker);
+		event_base_set (ctx->ev_base, &ctx->lag_ev);
+		double_to_tv (LOOP_LAG_PROBE_INTERVAL, &tv);
+		event_add (&ctx->lag_ev, &tv);
+	}
 	rspamd_symbols_cache_start_refresh (worker->srv->cfg->cache, ctx->ev_base,
 			worker);
 
@@ -685,6 +1313,11 @@ start_worker (struct rspamd_worker *worker)
 
 	/* XXX: stupid default */
 	ctx->keys_cache = rspamd_keypair_cache_new (256);
+	ctx->idle_conns = g_hash_table_new (g_direct_hash, g_direct_equal);
+	double_to_tv (ctx->keepalive_timeout, &ctx->keepalive_tv);
+	/* Must be called before finishing scripts */
+	g_ptr_array_add (worker->finish_actions,
+			(gpointer) rspamd_worker_close_idle);
 	rspamd_worker_init_scanner (worker, ctx->ev_base, ctx->resolver);
 	rspamd_lua_run_postloads (ctx->cfg->lua_state, ctx->cfg, ctx->ev_base,
 			worker);
@@ -694,6 +1327,7 @@ start_worker (struct rspamd_worker *worker)
 
 	rspamd_stat_close ();
 	rspamd_log_close (worker->srv->logger);
+	g_hash_table_unref (ctx->idle_conns);
 	rspamd_keypair_cache_destroy (ctx->keys_cache);
 	REF_RELEASE (ctx->cfg);
 
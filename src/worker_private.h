@@ -48,6 +48,28 @@ struct rspamd_worker_ctx {
 	guint32 max_tasks;
 	/* Maximum time for task processing */
 	gdouble task_timeout;
+	/* Overload detection thresholds (0 to disable) */
+	gdouble max_loop_lag;
+	gdouble max_task_latency;
+	/* Action for tasks received while overloaded */
+	const gchar *overload_action_str;
+	gint overload_action;
+	gboolean shed_enabled;
+	gboolean overloaded;
+	/* Smoothed event loop lag and task latency */
+	gdouble loop_lag;
+	gdouble task_latency;
+	gdouble lag_probe_ts;
+	gboolean latency_updated;
+	struct event lag_ev;
+	/* Persistent connections support */
+	gboolean keepalive;
+	gdouble keepalive_timeout;
+	struct timeval keepalive_tv;
+	/* Persistent connections waiting for the next request */
+	GHashTable *idle_conns;
+	/* Start envelope checks before message body is received */
+	gboolean streaming;
 	/* Encryption key */
 	struct rspamd_cryptobox_keypair *key;
 	/* Keys cache */
@@ -0,0 +1,43 @@
+rspamd_config:register_symbol({
+  type = 'connfilter',
+  name = 'TEST_CONN',
+  callback = function(task)
+    local ip = task:get_from_ip()
+    if ip and ip:is_valid() then
+      task:insert_result('TEST_CONN', 1.0, tostring(ip))
+    end
+  end
+})
+rspamd_config:set_metric_symbol({
+  name = 'TEST_CONN',
+  score = 1.0
+})
+
+rspamd_config:register_symbol({
+  type = 'prefilter',
+  name = 'TEST_CONN_PRE',
+  callback = function(task)
+    if task:has_symbol('TEST_CONN') then
+      task:insert_result('TEST_CONN_PRE', 1.0)
+    end
+  end
+})
+rspamd_config:set_metric_symbol({
+  name = 'TEST_CONN_PRE',
+  score = 1.0
+})
+
+rspamd_config:register_symbol({
+  type = 'normal',
+  name = 'TEST_CONN_BODY',
+  callback = function(task)
+    local subject = task:get_header('Subject')
+    if subject and task:has_symbol('TEST_CONN') then
+      task:insert_result('TEST_CONN_BODY', 1.0)
+    end
+  end
+})
+rspamd_config:set_metric_symbol({
+  name = 'TEST_CONN_BODY',
+  score = 1.0
+})
@@ -0,0 +1,137 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libserver/log_record.h"
+#include "libmime/email_addr.h"
+#include "tests.h"
+
+extern struct rspamd_main *rspamd_main;
+
+static struct rspamd_task *
+rspamd_log_record_test_task (guint nrcpts, guint nsymbols)
+{
+	struct rspamd_task *task;
+	struct rspamd_metric_result *mres;
+	struct rspamd_symbol_result *sym;
+	struct rspamd_email_address *addr;
+	gchar buf[128], pad[65];
+	guint i;
+
+	memset (pad, 'x', sizeof (pad) - 1);
+	pad[sizeof (pad) - 1] = '\0';
+
+	task = rspamd_task_new (NULL, rspamd_main->cfg, NULL);
+	task->message_id = "<test@example.com>";
+	task->user = "user";
+	g_assert (rspamd_parse_inet_address (&task->from_addr, "127.0.0.1",
+			sizeof ("127.0.0.1") - 1));
+	task->from_envelope = rspamd_email_address_from_smtp ("<from@example.com>",
+			sizeof ("<from@example.com>") - 1);
+	g_assert (task->from_envelope != NULL);
+	task->rcpt_envelope = g_ptr_array_new ();
+
+	for (i = 0; i < nrcpts; i ++) {
+		rspamd_snprintf (buf, sizeof (buf), "<rcpt%ud-%s@example.com>",
+				i, pad);
+		addr = rspamd_email_address_from_smtp (buf, strlen (buf));
+		g_assert (addr != NULL);
+		g_ptr_array_add (task->rcpt_envelope, addr);
+	}
+
+	mres = rspamd_mempool_alloc0 (task->task_pool, sizeof (*mres));
+	mres->symbols = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)g_hash_table_unref, mres->symbols);
+
+	for (i = 0; i < METRIC_ACTION_MAX; i ++) {
+		mres->actions_limits[i] = NAN;
+	}
+
+	mres->actions_limits[METRIC_ACTION_REJECT] = 15.0;
+	mres->action = METRIC_ACTION_ADD_HEADER;
+	mres->score = 7.5;
+
+	for (i = 0; i < nsymbols; i ++) {
+		sym = rspamd_mempool_alloc0 (task->task_pool, sizeof (*sym));
+		rspamd_snprintf (buf, sizeof (buf), "SYMBOL_%ud", i);
+		sym->name = rspamd_mempool_strdup (task->task_pool, buf);
+		sym->score = i;
+		g_hash_table_insert (mres->symbols, (gpointer)sym->name, sym);
+	}
+
+	task->result = mres;
+	task->msg.len = 1024;
+
+	return task;
+}
+
+void
+rspamd_log_record_test_func (void)
+{
+	struct rspamd_task *task;
+	struct rspamd_log_record rec;
+	struct rspamd_log_record_symbol *sym;
+	GByteArray *buf;
+	guint i, idx;
+
+	rspamd_log_record_init (&rec);
+
+	/* Encode -> parse round trip */
+	task = rspamd_log_record_test_task (2, 3);
+	buf = rspamd_log_record_from_task (task);
+	g_assert (rspamd_log_record_parse (&rec, buf->data, buf->len));
+	g_assert (rec.version == RSPAMD_LOG_RECORD_VERSION);
+	g_assert (rec.flags == 0);
+	g_assert (rspamd_ftok_cstr_equal (&rec.message_id, "<test@example.com>",
+			FALSE));
+	g_assert (rspamd_ftok_cstr_equal (&rec.ip, "127.0.0.1", FALSE));
+	g_assert (rspamd_ftok_cstr_equal (&rec.user, "user", FALSE));
+	g_assert (rspamd_ftok_cstr_equal (&rec.from, "from@example.com", FALSE));
+	g_assert (rspamd_ftok_cstr_equal (&rec.action, "add header", FALSE));
+	g_assert (rec.score == 7.5);
+	g_assert (rec.required_score == 15.0);
+	g_assert (rec.size == 1024);
+	g_assert (rec.rcpts->len == 2);
+	g_assert (rec.urls->len == 0);
+	g_assert (rec.symbols->len == 3);
+
+	for (i = 0; i < rec.symbols->len; i ++) {
+		sym = &g_array_index (rec.symbols, struct rspamd_log_record_symbol, i);
+		g_assert (sym->name.len > sizeof ("SYMBOL_") - 1);
+		idx = strtoul (sym->name.begin + sizeof ("SYMBOL_") - 1, NULL, 10);
+		g_assert (sym->score == idx);
+	}
+
+	g_byte_array_free (buf, TRUE);
+	rspamd_task_free (task);
+
+	/* Huge lists are truncated to fit the reader's buffer */
+	task = rspamd_log_record_test_task (4000, 4000);
+	buf = rspamd_log_record_from_task (task);
+	g_assert (buf->len <= RSPAMD_LOG_RECORD_BUF_SIZE);
+	g_assert (rspamd_log_record_parse (&rec, buf->data, buf->len));
+	g_assert (rec.flags & RSPAMD_LOG_RECORD_FLAG_TRUNCATED);
+	g_assert (rec.rcpts->len > 0 && rec.rcpts->len < 4000);
+	g_assert (rec.symbols->len > 0 && rec.symbols->len < 4000);
+	g_assert (rec.score == 7.5);
+	g_assert (rec.size == 1024);
+
+	g_byte_array_free (buf, TRUE);
+	rspamd_task_free (task);
+	rspamd_log_record_destroy (&rec);
+}
@@ -0,0 +1,93 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "unix-std.h"
+#include "tests.h"
+
+extern struct rspamd_main *rspamd_main;
+
+#define TEST_LINES 100
+
+void
+rspamd_logger_test_func (void)
+{
+	struct rspamd_config *cfg;
+	rspamd_logger_t *logger = NULL;
+	rspamd_mempool_t *pool;
+	gchar fname[] = "/tmp/rspamd_logger_test.XXXXXX", line[64], *content;
+	pid_t pid;
+	gint fd, status, i;
+
+	fd = mkstemp (fname);
+	g_assert (fd != -1);
+	close (fd);
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
+	cfg = rspamd_config_new ();
+	cfg->log_type = RSPAMD_LOG_FILE;
+	cfg->log_file = rspamd_mempool_strdup (cfg->cfg_pool, fname);
+	cfg->log_level = G_LOG_LEVEL_INFO;
+	cfg->log_async_size = 64 * 1024;
+
+	rspamd_set_logger (cfg, g_quark_from_static_string ("main"), &logger,
+			pool);
+	g_assert (rspamd_log_open (logger) == 0);
+	g_assert (rspamd_log_async_start (logger));
+
+	/* Child process queues lines to the ring */
+	pid = fork ();
+	g_assert (pid != -1);
+
+	if (pid == 0) {
+		rspamd_log_update_pid (g_quark_from_static_string ("worker"), logger);
+
+		for (i = 0; i < TEST_LINES; i ++) {
+			rspamd_common_log_function (logger, G_LOG_LEVEL_INFO, "test",
+					NULL, G_STRFUNC, "async line %d end", i);
+		}
+
+		_exit (EXIT_SUCCESS);
+	}
+
+	g_assert (waitpid (pid, &status, 0) == pid);
+	g_assert (WIFEXITED (status) && WEXITSTATUS (status) == EXIT_SUCCESS);
+
+	g_assert (g_file_get_contents (fname, &content, NULL, NULL));
+	g_assert (strstr (content, "async line") == NULL);
+	g_free (content);
+
+	/* Parent process writes them */
+	g_assert (rspamd_log_drain (logger));
+	g_assert (g_file_get_contents (fname, &content, NULL, NULL));
+
+	for (i = 0; i < TEST_LINES; i ++) {
+		rspamd_snprintf (line, sizeof (line), "async line %d end", i);
+		g_assert (strstr (content, line) != NULL);
+	}
+
+	g_free (content);
+	rspamd_log_close (logger);
+	unlink (fname);
+
+	/* Restore the default logger */
+	rspamd_set_logger (rspamd_main->cfg,
+			g_quark_from_static_string ("rspamd-test"),
+			&rspamd_main->logger, rspamd_main->server_pool);
+	REF_RELEASE (cfg);
+	rspamd_mempool_delete (pool);
+}
@@ -0,0 +1,143 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "map_compiled.h"
+#include "unix-std.h"
+#include "tests.h"
+
+#define TEST_KEYS 10000
+
+/* Copies out to an anonymous mapping and tries to load it */
+static struct rspamd_map_compiled *
+rspamd_map_compiled_test_load (GByteArray *out, gsize off, guint8 c)
+{
+	struct rspamd_map_compiled *cm;
+	guchar *data;
+
+	data = mmap (NULL, out->len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANON, -1, 0);
+	g_assert (data != MAP_FAILED);
+	memcpy (data, out->data, out->len);
+
+	if (off < out->len) {
+		data[off] = c;
+	}
+
+	cm = rspamd_map_compiled_load (data, out->len, NULL);
+
+	if (cm == NULL) {
+		munmap (data, out->len);
+	}
+
+	return cm;
+}
+
+void
+rspamd_map_compiled_test_func (void)
+{
+	struct rspamd_map_compiled *cm;
+	GHashTable *htb;
+	GByteArray *out;
+	gchar fname[] = "/tmp/rspamd_map_compiled_test.XXXXXX", key[64],
+			value[64];
+	const gchar *res;
+	guchar *data;
+	gsize len;
+	gint fd, i;
+
+	htb = g_hash_table_new_full (rspamd_strcase_hash, rspamd_strcase_equal,
+			g_free, g_free);
+
+	for (i = 0; i < TEST_KEYS; i ++) {
+		rspamd_snprintf (key, sizeof (key), "host%d.example.com", i);
+		rspamd_snprintf (value, sizeof (value), "value%d", i);
+		g_hash_table_insert (htb, g_strdup (key), g_strdup (value));
+	}
+
+	g_hash_table_insert (htb, g_strdup ("empty.example.com"), g_strdup (""));
+
+	/* Build -> write -> mmap -> lookup */
+	out = g_byte_array_new ();
+	g_assert (rspamd_map_compiled_write_hash (htb, out, NULL));
+
+	fd = mkstemp (fname);
+	g_assert (fd != -1);
+	g_assert (write (fd, out->data, out->len) == (gssize)out->len);
+	close (fd);
+
+	data = rspamd_file_xmap (fname, PROT_READ, &len, TRUE);
+	g_assert (data != NULL);
+	g_assert (len == out->len);
+	g_assert (rspamd_map_compiled_is_compiled (data, len));
+	cm = rspamd_map_compiled_load (data, len, NULL);
+	g_assert (cm != NULL);
+	g_assert (rspamd_map_compiled_type (cm) == RSPAMD_MAP_COMPILED_HASH);
+	g_assert (rspamd_map_compiled_size (cm) == TEST_KEYS + 1);
+
+	for (i = 0; i < TEST_KEYS; i ++) {
+		rspamd_snprintf (key, sizeof (key), "host%d.example.com", i);
+		rspamd_snprintf (value, sizeof (value), "value%d", i);
+		res = rspamd_map_compiled_hash_lookup (cm, key, strlen (key));
+		g_assert (res != NULL);
+		g_assert (strcmp (res, value) == 0);
+	}
+
+	res = rspamd_map_compiled_hash_lookup (cm, "HOST1.Example.COM",
+			sizeof ("HOST1.Example.COM") - 1);
+	g_assert (res != NULL && strcmp (res, "value1") == 0);
+	res = rspamd_map_compiled_hash_lookup (cm, "empty.example.com",
+			sizeof ("empty.example.com") - 1);
+	g_assert (res != NULL && *res == '\0');
+
+	for (i = TEST_KEYS; i < TEST_KEYS * 2; i ++) {
+		rspamd_snprintf (key, sizeof (key), "host%d.example.com", i);
+		g_assert (rspamd_map_compiled_hash_lookup (cm, key,
+				strlen (key)) == NULL);
+	}
+
+	g_assert (rspamd_map_compiled_hash_lookup (cm, "host1.example.co",
+			sizeof ("host1.example.co") - 1) == NULL);
+	g_assert (rspamd_map_compiled_radix_lookup (cm, (const guint8 *)"\1\2\3\4",
+			4) == RADIX_NO_VALUE);
+
+	rspamd_map_compiled_unref (cm);
+	unlink (fname);
+
+	/* Damaged headers are rejected */
+	cm = rspamd_map_compiled_test_load (out, G_MAXSIZE, 0);
+	g_assert (cm != NULL);
+	rspamd_map_compiled_unref (cm);
+	/* Magic */
+	g_assert (rspamd_map_compiled_test_load (out, 0, 'x') == NULL);
+	/* Version */
+	g_assert (rspamd_map_compiled_test_load (out, 8, 0xff) == NULL);
+	/* Type */
+	g_assert (rspamd_map_compiled_test_load (out, 16, 0xff) == NULL);
+	/* Number of groups */
+	g_assert (rspamd_map_compiled_test_load (out, 23, 0xff) == NULL);
+	/* Number of slots */
+	g_assert (rspamd_map_compiled_test_load (out, 27, 0xff) == NULL);
+	/* Total length */
+	g_assert (rspamd_map_compiled_test_load (out, 56, 0xff) == NULL);
+
+	out->len -= 8;
+	g_assert (rspamd_map_compiled_test_load (out, G_MAXSIZE, 0) == NULL);
+
+	g_byte_array_free (out, TRUE);
+	g_hash_table_unref (htb);
+}
@@ -0,0 +1,227 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "map.h"
+#include "map_private.h"
+#include "radix.h"
+#include "tests.h"
+
+extern struct rspamd_main *rspamd_main;
+
+#define TEST_FILL_LINES 32
+
+/* Emulates reading of the map's data by a periodic callback */
+static void
+rspamd_map_test_reload (struct rspamd_map *map, const gchar *fill,
+		const gchar *content)
+{
+	struct map_periodic_cbdata periodic;
+	gchar *in;
+
+	in = g_strconcat (fill, content, NULL);
+	memset (&periodic, 0, sizeof (periodic));
+	periodic.map = map;
+	periodic.cbdata.map = map;
+	periodic.cbdata.prev_data = *map->user_data;
+	rspamd_map_process_data (map, g_ptr_array_index (map->backends, 0),
+			&periodic, in, strlen (in));
+	map->fin_callback (&periodic.cbdata);
+
+	if (periodic.cbdata.cur_data) {
+		*map->user_data = periodic.cbdata.cur_data;
+	}
+
+	g_free (in);
+}
+
+static void
+rspamd_map_test_check_kv (struct rspamd_hash_map_helper *ht,
+		const gchar *key, const gchar *value)
+{
+	const gchar *res;
+
+	res = rspamd_match_hash_map (ht, key);
+
+	if (value == NULL) {
+		g_assert (res == NULL);
+	}
+	else {
+		g_assert (res != NULL);
+		g_assert_cmpstr (res, ==, value);
+	}
+}
+
+static void
+rspamd_map_test_check_ip (radix_compressed_t *tree, const gchar *ip,
+		const gchar *value)
+{
+	struct in_addr ina;
+	uintptr_t res;
+
+	g_assert (inet_pton (AF_INET, ip, &ina) == 1);
+	res = radix_find_compressed (tree, (const guint8 *)&ina, sizeof (ina));
+
+	if (value == NULL) {
+		g_assert (res == RADIX_NO_VALUE);
+	}
+	else {
+		g_assert (res != RADIX_NO_VALUE);
+		g_assert_cmpstr ((const gchar *)res, ==, value);
+	}
+}
+
+static void
+rspamd_map_test_kv (GString *fill)
+{
+	struct rspamd_map *map;
+	struct rspamd_hash_map_helper *ht = NULL;
+	gpointer data;
+
+	map = rspamd_map_add (rspamd_main->cfg,
+			"file:///nonexistent/rspamd-map-test-kv", NULL,
+			rspamd_kv_list_read, rspamd_kv_list_fin, (void **)&ht);
+	g_assert (map != NULL);
+	map->incremental = TRUE;
+
+	rspamd_map_test_reload (map, fill->str, "a 1\nb 2\n# comment\nc 3\n");
+	g_assert (ht != NULL);
+	data = ht;
+	rspamd_map_test_check_kv (ht, "a", "1");
+	rspamd_map_test_check_kv (ht, "fill1", "");
+
+	/* Added key */
+	rspamd_map_test_reload (map, fill->str,
+			"a 1\nb 2\n# comment\nc 3\nd 4\n");
+	g_assert (ht == data);
+	rspamd_map_test_check_kv (ht, "d", "4");
+	rspamd_map_test_check_kv (ht, "c", "3");
+
+	/* Removed key, comments and empty lines are ignored */
+	rspamd_map_test_reload (map, fill->str,
+			"a 1\n\n# another comment\nc 3\nd 4\n");
+	g_assert (ht == data);
+	rspamd_map_test_check_kv (ht, "b", NULL);
+	rspamd_map_test_check_kv (ht, "a", "1");
+
+	/* Changed value */
+	rspamd_map_test_reload (map, fill->str, "a 10\nc 3\nd 4\n");
+	g_assert (ht == data);
+	rspamd_map_test_check_kv (ht, "a", "10");
+	rspamd_map_test_check_kv (ht, "d", "4");
+
+	/* Duplicate key causes full reread, where the last value wins */
+	rspamd_map_test_reload (map, fill->str, "a 10\nc 3\nd 4\nc 30\n");
+	g_assert (ht != data);
+	data = ht;
+	rspamd_map_test_check_kv (ht, "c", "30");
+
+	/* Map with duplicates is always reread */
+	rspamd_map_test_reload (map, fill->str, "a 10\nc 3\nd 4\nc 30\ne 5\n");
+	g_assert (ht != data);
+	data = ht;
+	rspamd_map_test_check_kv (ht, "c", "30");
+	rspamd_map_test_check_kv (ht, "e", "5");
+
+	rspamd_map_test_reload (map, fill->str, "a 10\nd 4\nc 30\ne 5\n");
+	g_assert (ht != data);
+	data = ht;
+
+	/* And is changed incrementally again when duplicates are gone */
+	rspamd_map_test_reload (map, fill->str, "a 10\nd 4\nc 30\n");
+	g_assert (ht == data);
+	rspamd_map_test_check_kv (ht, "e", NULL);
+	rspamd_map_test_check_kv (ht, "c", "30");
+
+	/* Added key that duplicates an unchanged one */
+	rspamd_map_test_reload (map, fill->str, "a 10\nd 4\nc 30\nA 11\n");
+	g_assert (ht != data);
+	data = ht;
+	rspamd_map_test_check_kv (ht, "a", "11");
+
+	/* Large changes are reread */
+	rspamd_map_test_reload (map, fill->str, "a 10\nd 4\nc 30\n");
+	rspamd_map_test_reload (map, "", "a 10\nd 4\nc 30\n");
+	g_assert (ht != data);
+	rspamd_map_test_check_kv (ht, "fill1", NULL);
+	rspamd_map_test_check_kv (ht, "d", "4");
+
+	rspamd_hash_map_destroy (ht);
+}
+
+static void
+rspamd_map_test_radix (GString *fill)
+{
+	struct rspamd_map *map;
+	radix_compressed_t *tree = NULL;
+	gpointer data;
+
+	map = rspamd_map_add (rspamd_main->cfg,
+			"file:///nonexistent/rspamd-map-test-radix", NULL,
+			rspamd_radix_read, rspamd_radix_fin, (void **)&tree);
+	g_assert (map != NULL);
+	map->incremental = TRUE;
+
+	rspamd_map_test_reload (map, fill->str, "10.0.0.0/8 a\n");
+	g_assert (tree != NULL);
+	data = tree;
+	rspamd_map_test_check_ip (tree, "10.1.2.3", "a");
+	rspamd_map_test_check_ip (tree, "172.16.1.1", NULL);
+
+	/* Added prefix */
+	rspamd_map_test_reload (map, fill->str, "10.0.0.0/8 a\n172.16.0.0/12 b\n");
+	g_assert (tree == data);
+	rspamd_map_test_check_ip (tree, "172.16.1.1", "b");
+	rspamd_map_test_check_ip (tree, "10.1.2.3", "a");
+
+	/* Duplicate prefix is reread, so the first value is kept as usual */
+	rspamd_map_test_reload (map, fill->str,
+			"10.0.0.0/8 a\n172.16.0.0/12 b\n10.0.0.0/8 c\n");
+	g_assert (tree != data);
+	data = tree;
+	rspamd_map_test_check_ip (tree, "10.1.2.3", "a");
+
+	/* Removed prefix */
+	rspamd_map_test_reload (map, fill->str, "10.0.0.0/8 a\n");
+	g_assert (tree != data);
+	rspamd_map_test_check_ip (tree, "172.16.1.1", NULL);
+	rspamd_map_test_check_ip (tree, "10.1.2.3", "a");
+
+	radix_destroy_compressed (tree);
+}
+
+void
+rspamd_map_test_func (void)
+{
+	GString *kv_fill, *radix_fill;
+	gint i;
+
+	/* Unchanged lines, so small changes could be applied incrementally */
+	kv_fill = g_string_new (NULL);
+	radix_fill = g_string_new (NULL);
+
+	for (i = 0; i < TEST_FILL_LINES; i ++) {
+		rspamd_printf_gstring (kv_fill, "fill%d\n", i);
+		rspamd_printf_gstring (radix_fill, "192.168.%d.0/24\n", i);
+	}
+
+	rspamd_map_test_kv (kv_fill);
+	rspamd_map_test_radix (radix_fill);
+
+	g_string_free (kv_fill, TRUE);
+	g_string_free (radix_fill, TRUE);
+}
@@ -1,5 +1,6 @@
 #include "config.h"
 #include "mem_pool.h"
+#include "libutil/mempool_vars_internal.h"
 #include "tests.h"
 #include "unix-std.h"
 #include <math.h>
@@ -11,6 +12,25 @@
 #define TEST_BUF "test bufffer"
 #define TEST2_BUF "test bufffertest bufffer"
 
+static void
+rspamd_mem_pool_test_trace_cb (const gchar *name, const gchar *tag,
+		gsize bytes, gsize allocations, gpointer ud)
+{
+	gsize *traced = ud;
+
+	if (strcmp (tag, "trace") == 0) {
+		*traced += bytes;
+	}
+}
+
+static void
+rspamd_mem_pool_test_dtor (gpointer p)
+{
+	int *called = p;
+
+	(*called) ++;
+}
+
 void
 rspamd_mem_pool_test_func ()
 {
@@ -19,6 +39,8 @@ rspamd_mem_pool_test_func ()
 	char *tmp, *tmp2, *tmp3;
 	pid_t pid;
 	int ret;
+	guint recycled;
+	gsize traced = 0;
 
 	pool = rspamd_mempool_new (sizeof (TEST_BUF), NULL);
 	tmp = rspamd_mempool_alloc (pool, sizeof (TEST_BUF));
@@ -33,7 +55,57 @@ rspamd_mem_pool_test_func ()
 	g_assert (strncmp (tmp2, TEST2_BUF, sizeof (TEST2_BUF)) == 0);
 	g_assert (strncmp (tmp3, TEST_BUF, sizeof (TEST_BUF)) == 0);
 	
+	/* Registered variables are shared by string and indexed API */
+	rspamd_mempool_set_variable (pool, RSPAMD_MEMPOOL_PROFILE, tmp, NULL);
+	g_assert (rspamd_mempool_get_variable_idx (pool,
+			RSPAMD_MEMPOOL_VAR_PROFILE) == tmp);
+	rspamd_mempool_set_variable_idx (pool, RSPAMD_MEMPOOL_VAR_PROFILE, tmp2,
+			NULL);
+	g_assert (rspamd_mempool_get_variable (pool, RSPAMD_MEMPOOL_PROFILE) == tmp2);
+	rspamd_mempool_set_variable (pool, "test_var", tmp3, NULL);
+	g_assert (rspamd_mempool_get_variable (pool, "test_var") == tmp3);
+	rspamd_mempool_remove_variable (pool, RSPAMD_MEMPOOL_PROFILE);
+	g_assert (rspamd_mempool_get_variable_idx (pool,
+			RSPAMD_MEMPOOL_VAR_PROFILE) == NULL);
+
+	/* Reset pool runs destructors and forgets variables */
+	rspamd_mempool_add_destructor (pool, rspamd_mem_pool_test_dtor, &ret);
+	ret = 0;
+	rspamd_mempool_reset (pool);
+	g_assert (ret == 1);
+	g_assert (rspamd_mempool_get_variable (pool, "test_var") == NULL);
+	tmp = rspamd_mempool_alloc (pool, sizeof (TEST_BUF));
+	snprintf (tmp, sizeof (TEST_BUF), "%s", TEST_BUF);
+	g_assert (strncmp (tmp, TEST_BUF, sizeof (TEST_BUF)) == 0);
+
 	rspamd_mempool_delete (pool);
 	rspamd_mempool_stat (&st);
-	
+
+	/* Tracing is enabled for this check only, as it slows down other tests */
+	rspamd_mempool_trace_enable (TRUE);
+	g_assert (rspamd_mempool_trace_enabled ());
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "trace");
+	tmp = rspamd_mempool_alloc (pool, sizeof (TEST_BUF));
+	tmp2 = rspamd_mempool_alloc_shared (pool, sizeof (TEST_BUF));
+	rspamd_mempool_trace_foreach (FALSE, rspamd_mem_pool_test_trace_cb, &traced);
+	g_assert (traced == sizeof (TEST_BUF) * 2);
+	rspamd_mempool_delete (pool);
+	rspamd_mempool_trace_enable (FALSE);
+
+	/* Tagged pools are sized by the previous ones and reuse their pages */
+	if (getenv ("VALGRIND") == NULL) {
+		pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "test");
+		tmp = rspamd_mempool_alloc (pool, rspamd_mempool_suggest_size () * 3);
+		rspamd_mempool_delete (pool);
+
+		pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "test");
+		g_assert (pool->elt_len > rspamd_mempool_suggest_size () * 3);
+		rspamd_mempool_stat (&st);
+		recycled = st.chunks_recycled;
+		tmp = rspamd_mempool_alloc (pool, rspamd_mempool_suggest_size () * 3);
+		g_assert (tmp != NULL);
+		rspamd_mempool_stat (&st);
+		g_assert (st.chunks_recycled == recycled + 1);
+		rspamd_mempool_delete (pool);
+	}
 }
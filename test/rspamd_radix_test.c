@@ -18,6 +18,8 @@
 #include "radix.h"
 #include "ottery.h"
 #include "btrie.h"
+#include "map_compiled.h"
+#include "unix-std.h"
 
 const gsize max_elts = 500 * 1024;
 const gint lookup_cycles = 1 * 1024;
@@ -204,6 +206,123 @@ rspamd_btrie_test_vec (void)
 	}
 }
 
+static void
+rspamd_radix_test_compiled (void)
+{
+	radix_compressed_t *tree, *comp_tree;
+	struct _tv *t = &test_vec[0];
+	guint32 addr, mask;
+	gulong i;
+
+	tree = radix_create_compressed ();
+	comp_tree = radix_create_compressed ();
+
+	i = 0;
+	while (t->ip != NULL) {
+		radix_insert_compressed (comp_tree, t->addr, t->len, t->mask, ++i);
+		t ++;
+	}
+
+	g_assert (radix_compile_compressed (comp_tree));
+
+	i = 0;
+	t = &test_vec[0];
+	while (t->ip != NULL) {
+		g_assert (radix_find_compressed (comp_tree, t->addr, t->len) == ++i);
+		t ++;
+	}
+
+	radix_destroy_compressed (comp_tree);
+	comp_tree = radix_create_compressed ();
+
+	/* Compare compiled and plain lookups for random prefixes */
+	for (i = 0; i < 10000; i ++) {
+		addr = ottery_rand_uint32 ();
+		mask = ottery_rand_range (32);
+		radix_insert_compressed (tree, (guint8 *)&addr, sizeof (addr),
+				mask, i + 1);
+		radix_insert_compressed (comp_tree, (guint8 *)&addr, sizeof (addr),
+				mask, i + 1);
+	}
+
+	g_assert (radix_compile_compressed (comp_tree));
+
+	for (i = 0; i < 100000; i ++) {
+		addr = ottery_rand_uint32 ();
+		g_assert (radix_find_compressed (tree, (guint8 *)&addr, sizeof (addr)) ==
+				radix_find_compressed (comp_tree, (guint8 *)&addr,
+						sizeof (addr)));
+	}
+
+	radix_destroy_compressed (tree);
+	radix_destroy_compressed (comp_tree);
+}
+
+static void
+rspamd_radix_check_mapped (uintptr_t v1, uintptr_t v2)
+{
+	if (v1 == RADIX_NO_VALUE || v2 == RADIX_NO_VALUE) {
+		g_assert (v1 == v2);
+	}
+	else {
+		g_assert (strcmp ((const gchar *)v1, (const gchar *)v2) == 0);
+	}
+}
+
+static void
+rspamd_radix_test_mapped (void)
+{
+	static const gchar *values[] = {"a", "b", "c", "d"};
+	radix_compressed_t *tree, *mapped;
+	struct rspamd_map_compiled *cm;
+	GByteArray *out;
+	guint8 addr6[16];
+	guint32 addr, mask;
+	guchar *data;
+	gulong i;
+
+	tree = radix_create_compressed ();
+
+	for (i = 0; i < 10000; i ++) {
+		addr = ottery_rand_uint32 ();
+		mask = ottery_rand_range (32);
+		radix_insert_compressed (tree, (guint8 *)&addr, sizeof (addr),
+				mask, (uintptr_t)values[i % G_N_ELEMENTS (values)]);
+		ottery_rand_bytes (addr6, sizeof (addr6));
+		mask = ottery_rand_range (128);
+		radix_insert_compressed (tree, addr6, sizeof (addr6),
+				mask, (uintptr_t)values[i % G_N_ELEMENTS (values)]);
+	}
+
+	out = g_byte_array_new ();
+	g_assert (rspamd_map_compiled_write_radix (tree, out, NULL));
+
+	/* Compiled map takes ownership of the mapped memory */
+	data = mmap (NULL, out->len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANON, -1, 0);
+	g_assert (data != MAP_FAILED);
+	memcpy (data, out->data, out->len);
+	cm = rspamd_map_compiled_load (data, out->len, NULL);
+	g_assert (cm != NULL);
+	mapped = radix_create_compressed_mapped (cm);
+	rspamd_map_compiled_unref (cm);
+
+	for (i = 0; i < 100000; i ++) {
+		addr = ottery_rand_uint32 ();
+		rspamd_radix_check_mapped (
+				radix_find_compressed (tree, (guint8 *)&addr, sizeof (addr)),
+				radix_find_compressed (mapped, (guint8 *)&addr, sizeof (addr)));
+		ottery_rand_bytes (addr6, sizeof (addr6));
+		rspamd_radix_check_mapped (
+				radix_find_compressed (tree, addr6, sizeof (addr6)),
+				radix_find_compressed (mapped, addr6, sizeof (addr6)));
+	}
+
+	radix_destroy_compressed (mapped);
+	radix_destroy_compressed (tree);
+	g_byte_array_free (out, TRUE);
+}
+
 void
 rspamd_radix_test_func (void)
 {
@@ -226,6 +345,8 @@ rspamd_radix_test_func (void)
 
 	rspamd_btrie_test_vec ();
 	rspamd_radix_test_vec ();
+	rspamd_radix_test_compiled ();
+	rspamd_radix_test_mapped ();
 
 	nelts = max_elts;
 	/* First of all we generate many elements and push them to the array */
@@ -0,0 +1,129 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "unix-std.h"
+#include "tests.h"
+
+extern struct rspamd_main *rspamd_main;
+
+#define TEST_ROWS 64
+#define TEST_WRITERS 4
+#define TEST_WRITES 20000
+
+static void
+rspamd_roll_history_test_fill (struct roll_history_row *row, guint writer,
+		guint n)
+{
+	memset (row, 0, sizeof (*row));
+	rspamd_snprintf (row->message_id, sizeof (row->message_id), "%ud-%ud",
+			writer, n);
+	/* Fill the whole field, so a torn copy is noticed */
+	memset (row->symbols, 'a' + n % 26, sizeof (row->symbols) - 1);
+	row->len = n;
+	row->nsymbols = n;
+	row->score = writer;
+}
+
+static void
+rspamd_roll_history_test_check (struct roll_history_row *row)
+{
+	guint writer, n, i;
+
+	g_assert (sscanf (row->message_id, "%u-%u", &writer, &n) == 2);
+	g_assert (writer < TEST_WRITERS && n < TEST_WRITES);
+	g_assert (row->len == n && row->nsymbols == n);
+	g_assert (row->score == writer);
+
+	for (i = 0; i < sizeof (row->symbols) - 1; i ++) {
+		g_assert (row->symbols[i] == 'a' + n % 26);
+	}
+}
+
+static guint
+rspamd_roll_history_test_read (struct roll_history *history)
+{
+	struct roll_history_iter it;
+	struct roll_history_row row;
+	guint nread = 0;
+
+	rspamd_roll_history_iter_init (history, &it);
+
+	while (rspamd_roll_history_iter_next (&it, &row)) {
+		rspamd_roll_history_test_check (&row);
+		nread ++;
+	}
+
+	return nread;
+}
+
+void
+rspamd_roll_history_test_func (void)
+{
+	rspamd_mempool_t *pool;
+	struct roll_history *history;
+	struct roll_history_row row;
+	pid_t pids[TEST_WRITERS];
+	guint i, j, running, nread = 0;
+	gint status;
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
+	history = rspamd_roll_history_new (pool, TEST_ROWS, rspamd_main->cfg);
+	g_assert (history != NULL && !history->disabled);
+
+	/* Writers in child processes, reader in the parent one */
+	for (i = 0; i < TEST_WRITERS; i ++) {
+		pids[i] = fork ();
+		g_assert (pids[i] != -1);
+
+		if (pids[i] == 0) {
+			for (j = 0; j < TEST_WRITES; j ++) {
+				rspamd_roll_history_test_fill (&row, i, j);
+				rspamd_roll_history_add_row (history, &row);
+			}
+
+			_exit (EXIT_SUCCESS);
+		}
+	}
+
+	running = TEST_WRITERS;
+
+	while (running > 0) {
+		nread += rspamd_roll_history_test_read (history);
+
+		for (i = 0; i < TEST_WRITERS; i ++) {
+			if (pids[i] > 0 && waitpid (pids[i], &status, WNOHANG) == pids[i]) {
+				g_assert (WIFEXITED (status) &&
+						WEXITSTATUS (status) == EXIT_SUCCESS);
+				pids[i] = 0;
+				running --;
+			}
+		}
+	}
+
+	msg_info ("read %ud history rows while writing", nread);
+	g_assert (history->head == TEST_WRITERS * TEST_WRITES);
+
+	/* Rows might be dropped if a slot was busy, but never torn */
+	nread = rspamd_roll_history_test_read (history);
+	g_assert (nread > 0 && nread <= TEST_ROWS);
+
+	rspamd_roll_history_reset (history);
+	g_assert (rspamd_roll_history_test_read (history) == 0);
+
+	rspamd_mempool_delete (pool);
+}
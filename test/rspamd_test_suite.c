@@ -52,6 +52,11 @@ main (int argc, char **argv)
 	g_test_add_func ("/rspamd/lua", rspamd_lua_test_func);
 	g_test_add_func ("/rspamd/cryptobox", rspamd_cryptobox_test_func);
 	g_test_add_func ("/rspamd/heap", rspamd_heap_test_func);
+	g_test_add_func ("/rspamd/roll_history", rspamd_roll_history_test_func);
+	g_test_add_func ("/rspamd/logger", rspamd_logger_test_func);
+	g_test_add_func ("/rspamd/log_record", rspamd_log_record_test_func);
+	g_test_add_func ("/rspamd/map_compiled", rspamd_map_compiled_test_func);
+	g_test_add_func ("/rspamd/map", rspamd_map_test_func);
 
 #if 0
 	g_test_add_func ("/rspamd/url", rspamd_url_test_func);
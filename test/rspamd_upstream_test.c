@@ -159,6 +159,27 @@ rspamd_upstream_test_func (void)
 
 	rspamd_upstreams_destroy (nls);
 
+	/* Test least-loaded rotation: slow and busy upstream is never selected */
+	up = rspamd_upstream_get (ls, RSPAMD_UPSTREAM_MASTER_SLAVE, NULL, 0);
+	rspamd_upstream_request_start (up);
+	rspamd_upstream_request_finish (up, 0.5);
+	rspamd_upstream_request_start (up);
+	g_assert (rspamd_upstream_latency (up) == 0.5);
+
+	for (i = 0; i < 1000; i ++) {
+		upn = rspamd_upstream_get (ls, RSPAMD_UPSTREAM_LEAST_LOADED, NULL, 0);
+		g_assert (upn != NULL && upn != up);
+		g_assert (rspamd_upstream_get_except (ls, upn,
+				RSPAMD_UPSTREAM_LEAST_LOADED, NULL, 0) != upn);
+	}
+
+	rspamd_upstream_request_finish (up, -1);
+
+	/* Cancelled request raises latency but is not a percentile sample */
+	rspamd_upstream_request_start (up);
+	rspamd_upstream_request_cancel (up, 1.0);
+	g_assert (rspamd_upstream_latency (up) > 0.5);
+	g_assert (rspamd_upstreams_latency_percentile (ls, 0.5) == 0);
 
 	/* Upstream fail test */
 	evtimer_set (&ev, rspamd_upstream_timeout_handler, resolver);
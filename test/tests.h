@@ -41,4 +41,14 @@ void rspamd_cryptobox_test_func (void);
 
 void rspamd_heap_test_func (void);
 
+void rspamd_roll_history_test_func (void);
+
+void rspamd_logger_test_func (void);
+
+void rspamd_log_record_test_func (void);
+
+void rspamd_map_compiled_test_func (void);
+
+void rspamd_map_test_func (void);
+
 #endif